@@ -0,0 +1,337 @@
+/*
+ *  flip_scheduler.c - Fair scheduling of flips across outputs
+ *
+ *  xvba-video (C) 2009-2011 Splitted-Desktop Systems
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include "sysdeps.h"
+#include "flip_scheduler.h"
+#include "utils.h"
+
+/*
+ * Clients (outputs) queue a flip with the time it is due at. All the
+ * flips due are handed out at once so that they can be batched on the
+ * same vblank. Clients are visited in round-robin order starting from
+ * a cursor that moves on every batch, so that no client is always the
+ * last one to be flipped, and so that clients left over when a batch
+ * is full are the first ones to be serviced in the next batch.
+ *
+ * All times are plain values supplied by the caller, so that the
+ * scheduling logic can be driven by a fake clock.
+ */
+typedef struct {
+    void               *client;
+    uint64_t            deadline;
+    unsigned int        is_queued;
+} FlipClient;
+
+struct _FlipScheduler {
+    FlipClient         *clients;
+    unsigned int        clients_count;
+    unsigned int        clients_count_max;
+    unsigned int        cursor;
+    unsigned int        seed;
+};
+
+FlipScheduler *flip_scheduler_new(void)
+{
+    return calloc(1, sizeof(FlipScheduler));
+}
+
+void flip_scheduler_free(FlipScheduler *sched)
+{
+    if (!sched)
+        return;
+
+    free(sched->clients);
+    free(sched);
+}
+
+static FlipClient *flip_scheduler_lookup(FlipScheduler *sched, void *client)
+{
+    unsigned int i;
+
+    for (i = 0; i < sched->clients_count; i++) {
+        if (sched->clients[i].client == client)
+            return &sched->clients[i];
+    }
+    return NULL;
+}
+
+// Register a new client
+int flip_scheduler_add(FlipScheduler *sched, void *client)
+{
+    FlipClient *c;
+
+    if (flip_scheduler_lookup(sched, client))
+        return 1;
+
+    c = realloc_buffer(
+        (void **)&sched->clients,
+        &sched->clients_count_max,
+        1 + sched->clients_count,
+        sizeof(*c)
+    );
+    if (!c)
+        return 0;
+
+    c = &sched->clients[sched->clients_count++];
+    c->client    = client;
+    c->deadline  = 0;
+    c->is_queued = 0;
+    return 1;
+}
+
+// Unregister client, dropping any flip it had queued
+void flip_scheduler_remove(FlipScheduler *sched, void *client)
+{
+    FlipClient * const c = flip_scheduler_lookup(sched, client);
+    unsigned int i;
+
+    if (!c)
+        return;
+
+    i = c - sched->clients;
+    memmove(c, c + 1, (--sched->clients_count - i) * sizeof(*c));
+    if (sched->cursor > i)
+        sched->cursor--;
+    if (sched->cursor >= sched->clients_count)
+        sched->cursor = 0;
+}
+
+// Get the number of registered clients
+unsigned int flip_scheduler_get_count(FlipScheduler *sched)
+{
+    return sched->clients_count;
+}
+
+// Queue a flip for client, due at deadline. The earliest one is kept
+void flip_scheduler_queue(FlipScheduler *sched, void *client, uint64_t deadline)
+{
+    FlipClient * const c = flip_scheduler_lookup(sched, client);
+
+    if (!c)
+        return;
+
+    if (!c->is_queued || c->deadline > deadline) {
+        c->deadline  = deadline;
+        c->is_queued = 1;
+    }
+}
+
+// Get the time the next flip is due at, or 0 if none is queued
+uint64_t flip_scheduler_get_next_deadline(FlipScheduler *sched)
+{
+    uint64_t deadline = 0;
+    unsigned int i;
+
+    for (i = 0; i < sched->clients_count; i++) {
+        const FlipClient * const c = &sched->clients[i];
+        if (c->is_queued && (!deadline || c->deadline < deadline))
+            deadline = c->deadline;
+    }
+    return deadline;
+}
+
+// Dequeue up to max_clients clients whose flip is due at time
+unsigned int
+flip_scheduler_get_due(
+    FlipScheduler *sched,
+    uint64_t       time,
+    void         **clients,
+    unsigned int   max_clients
+)
+{
+    const unsigned int n = sched->clients_count;
+    unsigned int i, j, count = 0;
+
+    for (i = 0; i < n && count < max_clients; i++) {
+        j = (sched->cursor + i) % n;
+        FlipClient * const c = &sched->clients[j];
+        if (c->is_queued && c->deadline <= time) {
+            c->is_queued = 0;
+            clients[count++] = c->client;
+        }
+    }
+
+    if (count == 0)
+        return 0;
+
+    /* Simply rotate the starting point if all clients were visited */
+    if (i == n) {
+        sched->cursor = (sched->cursor + 1) % n;
+        return count;
+    }
+
+    /* Otherwise, resume after the last client serviced. Also rotate
+       the order within the batch by a pseudo-random amount, since the
+       batches may always hold the same clients */
+    sched->cursor = (sched->cursor + i) % n;
+    sched->seed   = sched->seed * 1103515245 + 12345;
+    i = (sched->seed >> 16) % count;
+    if (i > 0) {
+        void *tmp[count];
+        memcpy(tmp, clients, count * sizeof(*clients));
+        for (j = 0; j < count; j++)
+            clients[j] = tmp[(i + j) % count];
+    }
+    return count;
+}
+
+#ifdef TEST_FLIP_SCHEDULER
+#define NUM_CLIENTS     16
+#define NUM_VBLANKS     6000
+#define VBLANK_PERIOD   16667
+
+/* Fake output, getting a new frame every period */
+typedef struct {
+    unsigned int        id;
+    uint64_t            period;
+    uint64_t            next_frame;
+    uint64_t            queued_at;
+    unsigned int        is_queued;
+    unsigned int        num_flips;
+    unsigned int        num_first;
+    unsigned int        num_last;
+    uint64_t            max_wait;
+} FakeOutput;
+
+/* Simulate a render thread that can only flip max_flips outputs per
+   vblank, and check all outputs get a fair share */
+static int
+run_test(const char *name, unsigned int max_flips, unsigned int frame_vblanks)
+{
+    FakeOutput outputs[NUM_CLIENTS];
+    void *due[NUM_CLIENTS];
+    FlipScheduler *sched;
+    uint64_t now, vblank, max_wait = 0;
+    unsigned int i, j, n, min_flips = -1, max_flips_seen = 0;
+    unsigned int min_first = -1, max_first = 0;
+    int success = 1;
+
+    sched = flip_scheduler_new();
+    if (!sched)
+        return 0;
+
+    for (i = 0; i < NUM_CLIENTS; i++) {
+        FakeOutput * const o = &outputs[i];
+        memset(o, 0, sizeof(*o));
+        o->id         = i;
+        o->period     = frame_vblanks * VBLANK_PERIOD;
+        o->next_frame = 1000 + i * 977;
+        if (!flip_scheduler_add(sched, o))
+            abort();
+    }
+
+    for (vblank = 1; vblank <= NUM_VBLANKS; vblank++) {
+        now = vblank * VBLANK_PERIOD;
+
+        /* New frames queue a flip on the next vblank */
+        for (i = 0; i < NUM_CLIENTS; i++) {
+            FakeOutput * const o = &outputs[i];
+            while (o->next_frame <= now) {
+                if (!o->is_queued) {
+                    o->is_queued = 1;
+                    o->queued_at = o->next_frame;
+                }
+                flip_scheduler_queue(sched, o, now);
+                o->next_frame += o->period;
+            }
+        }
+
+        n = flip_scheduler_get_due(sched, now, due, max_flips);
+        if (n > max_flips)
+            abort();
+        for (j = 0; j < n; j++) {
+            FakeOutput * const o = due[j];
+            const uint64_t wait = now - o->queued_at;
+            if (!o->is_queued)
+                abort();
+            o->is_queued = 0;
+            o->num_flips++;
+            if (j == 0)
+                o->num_first++;
+            if (j == n - 1 && n > 1)
+                o->num_last++;
+            if (o->max_wait < wait)
+                o->max_wait = wait;
+        }
+    }
+
+    for (i = 0; i < NUM_CLIENTS; i++) {
+        FakeOutput * const o = &outputs[i];
+        min_flips      = MIN(min_flips, o->num_flips);
+        max_flips_seen = MAX(max_flips_seen, o->num_flips);
+        min_first      = MIN(min_first, o->num_first);
+        max_first      = MAX(max_first, o->num_first);
+        max_wait       = MAX(max_wait, o->max_wait);
+    }
+
+    printf("%-28s flips %u..%u, first in batch %u..%u, max wait %.1f vblanks\n",
+           name, min_flips, max_flips_seen, min_first, max_first,
+           (double)max_wait / VBLANK_PERIOD);
+
+    /* Every output gets the same number of flips, within one batch */
+    if (max_flips_seen - min_flips > 1)
+        success = 0;
+
+    /* No output is always serviced first */
+    if (max_first > 2 * min_first + NUM_CLIENTS)
+        success = 0;
+
+    /* Nobody waits for more than a round of batches */
+    if (max_wait > (uint64_t)(NUM_CLIENTS / max_flips + 1) * VBLANK_PERIOD)
+        success = 0;
+
+    /* Removing clients keeps the others scheduled */
+    for (i = 0; i < NUM_CLIENTS; i += 2)
+        flip_scheduler_remove(sched, &outputs[i]);
+    if (flip_scheduler_get_count(sched) != NUM_CLIENTS / 2)
+        success = 0;
+    for (i = 1; i < NUM_CLIENTS; i += 2)
+        flip_scheduler_queue(sched, &outputs[i], 42);
+    if (flip_scheduler_get_next_deadline(sched) != 42)
+        success = 0;
+    if (flip_scheduler_get_due(sched, 41, due, NUM_CLIENTS) != 0)
+        success = 0;
+    if (flip_scheduler_get_due(sched, 42, due, NUM_CLIENTS) != NUM_CLIENTS / 2)
+        success = 0;
+    if (flip_scheduler_get_next_deadline(sched) != 0)
+        success = 0;
+
+    flip_scheduler_free(sched);
+    return success;
+}
+
+int main(void)
+{
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+    /* 16 outputs at 30 fps, all flipped on the same vblank */
+    if (!run_test("16 x 30 fps, unlimited", NUM_CLIENTS, 2))
+        abort();
+
+    /* 16 outputs at 60 fps, only 4 flips per vblank */
+    if (!run_test("16 x 60 fps, 4 per vblank", 4, 1))
+        abort();
+
+    /* 16 outputs at 30 fps, only 3 flips per vblank */
+    if (!run_test("16 x 30 fps, 3 per vblank", 3, 2))
+        abort();
+    return 0;
+}
+#endif
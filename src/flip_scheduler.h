@@ -0,0 +1,55 @@
+/*
+ *  flip_scheduler.h - Fair scheduling of flips across outputs
+ *
+ *  xvba-video (C) 2009-2011 Splitted-Desktop Systems
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#ifndef FLIP_SCHEDULER_H
+#define FLIP_SCHEDULER_H
+
+typedef struct _FlipScheduler FlipScheduler;
+
+FlipScheduler *flip_scheduler_new(void)
+    attribute_hidden;
+
+void flip_scheduler_free(FlipScheduler *sched)
+    attribute_hidden;
+
+int flip_scheduler_add(FlipScheduler *sched, void *client)
+    attribute_hidden;
+
+void flip_scheduler_remove(FlipScheduler *sched, void *client)
+    attribute_hidden;
+
+unsigned int flip_scheduler_get_count(FlipScheduler *sched)
+    attribute_hidden;
+
+void flip_scheduler_queue(FlipScheduler *sched, void *client, uint64_t deadline)
+    attribute_hidden;
+
+uint64_t flip_scheduler_get_next_deadline(FlipScheduler *sched)
+    attribute_hidden;
+
+unsigned int
+flip_scheduler_get_due(
+    FlipScheduler *sched,
+    uint64_t       time,
+    void         **clients,
+    unsigned int   max_clients
+) attribute_hidden;
+
+#endif /* FLIP_SCHEDULER_H */
@@ -0,0 +1,411 @@
+/*
+ *  frame_pacer.c - Frame pacing utilities
+ *
+ *  xvba-video (C) 2009-2011 Splitted-Desktop Systems
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include "sysdeps.h"
+#include "frame_pacer.h"
+#include <math.h>
+
+/* Default amount of time to issue a flip ahead of the vblank (usec) */
+#define DEFAULT_MARGIN 2000
+
+/* Vblank intervals longer than that can't be guessed reliably (usec) */
+#define MAX_VBLANK_INTERVAL 500000
+
+/* Frame intervals longer than that are pauses, not frame rate (usec) */
+#define MAX_FRAME_INTERVAL 1000000
+
+/* Min number of vblanks to measure the period from their counters */
+#define MIN_VBLANK_COUNT 16
+
+/* Inverse weight of new samples for the vblank phase drift */
+#define PHASE_DRIFT 16
+
+/* Inverse weight of new samples for the frame interval */
+#define FRAME_DRIFT 8
+
+/*
+ * The pacer models the display as a train of vertical blanks spaced
+ * by period, starting from a reference vblank (phase). Observations
+ * are timestamps taken *after* a given vblank occurred, so the phase
+ * follows the lower envelope of the observations and only drifts
+ * slowly towards later samples. Vblanks are numbered from the first
+ * observation, from the display counters (msc) if available, or from
+ * the elapsed time otherwise.
+ *
+ * All times are plain microsecond values supplied by the caller, so
+ * that the scheduling logic can be driven by a fake clock.
+ */
+struct _FramePacer {
+    double              period;
+    uint64_t            phase;
+    int64_t             phase_count;
+    uint64_t            vblank_time;
+    int64_t             vblank_msc;
+    int64_t             vblank_count;
+    uint64_t            base_time;
+    int64_t             base_count;
+    uint64_t            flip_vblank;
+    uint64_t            frame_time;
+    double              frame_interval;
+    unsigned int        margin;
+    unsigned int        period_locked   : 1;
+    unsigned int        has_phase       : 1;
+    unsigned int        has_vblank      : 1;
+    unsigned int        has_flip        : 1;
+    unsigned int        has_frame       : 1;
+};
+
+FramePacer *frame_pacer_new(unsigned int refresh)
+{
+    FramePacer *pacer = calloc(1, sizeof(*pacer));
+
+    if (!pacer)
+        return NULL;
+
+    pacer->period     = refresh > 0 ? refresh : 1000000 / 60;
+    pacer->vblank_msc   = FRAME_PACER_NO_MSC;
+    pacer->vblank_count = -1;
+    pacer->margin     = DEFAULT_MARGIN;
+    return pacer;
+}
+
+void frame_pacer_free(FramePacer *pacer)
+{
+    free(pacer);
+}
+
+// Set the exact refresh rate, e.g. from GLX_OML_sync_control
+void frame_pacer_set_refresh_rate(FramePacer *pacer, int num, int den)
+{
+    if (num <= 0 || den <= 0)
+        return;
+
+    pacer->period        = 1000000.0 * den / num;
+    pacer->period_locked = 1;
+}
+
+// Set the amount of time a flip has to be issued ahead of the vblank
+void frame_pacer_set_margin(FramePacer *pacer, unsigned int margin)
+{
+    pacer->margin = margin;
+}
+
+static inline unsigned int get_margin(FramePacer *pacer)
+{
+    return MIN(pacer->margin, (unsigned int)(pacer->period / 2));
+}
+
+// Get the estimated vblank period (usec)
+unsigned int frame_pacer_get_refresh(FramePacer *pacer)
+{
+    return (unsigned int)(pacer->period + 0.5);
+}
+
+// Get the estimated interval between two frames submitted (usec)
+unsigned int frame_pacer_get_frame_interval(FramePacer *pacer)
+{
+    return (unsigned int)(pacer->frame_interval + 0.5);
+}
+
+// Record that the vblank with counter msc happened no later than time
+void frame_pacer_add_vblank(FramePacer *pacer, uint64_t time, int64_t msc)
+{
+    int64_t count = FRAME_PACER_NO_MSC;
+    double n, dt, err, predicted;
+
+    /* Count vblanks since the last observation, either from the
+       counters or by guessing from the current period estimate */
+    if (pacer->has_vblank) {
+        dt = (double)(int64_t)(time - pacer->vblank_time);
+        if (msc >= 0 && pacer->vblank_msc >= 0)
+            n = msc - pacer->vblank_msc;
+        else if (dt > 0 && dt < MAX_VBLANK_INTERVAL) {
+            n = floor(dt / pacer->period + 0.5);
+            /* Discard samples too far away from the current estimate */
+            if (n >= 1 && fabs(dt / n - pacer->period) > pacer->period / 4)
+                n = 0;
+            /* Don't trust the guess until the estimate settled */
+            if (n >= 1 && fabs(dt / n - pacer->period) > pacer->period / 16)
+                pacer->vblank_count = -1;
+        }
+        else
+            n = 0;
+
+        if (n >= 1) {
+            if (!pacer->period_locked)
+                pacer->period += (dt / n - pacer->period) * MIN(n, 8) / 32;
+            if (pacer->vblank_count >= 0)
+                count = pacer->vblank_count + (int64_t)n;
+        }
+    }
+    pacer->vblank_time  = time;
+    pacer->vblank_msc   = msc;
+    pacer->has_vblank   = 1;
+
+    /* Measure the period over a long time span, thus making the
+       observation latency negligible */
+    if (count < 0) {
+        count = 0;
+        pacer->base_time  = time;
+        pacer->base_count = count;
+        pacer->has_phase  = 0;
+    }
+    else if (count - pacer->base_count >= MIN_VBLANK_COUNT &&
+             !pacer->period_locked) {
+        const double period =
+            (double)(int64_t)(time - pacer->base_time) /
+            (count - pacer->base_count);
+        if (fabs(period - pacer->period) < pacer->period / 4)
+            pacer->period = period;
+        else {
+            /* Refresh rate changed, start over */
+            pacer->base_time  = time;
+            pacer->base_count = count;
+        }
+    }
+    pacer->vblank_count = count;
+
+    if (!pacer->has_phase) {
+        pacer->phase       = time;
+        pacer->phase_count = count;
+        pacer->has_phase   = 1;
+        return;
+    }
+
+    n         = count - pacer->phase_count;
+    predicted = (double)pacer->phase + n * pacer->period;
+    err       = (double)time - predicted;
+    if (err < 0.0)
+        pacer->phase = time;
+    else
+        pacer->phase = (uint64_t)(predicted + err / PHASE_DRIFT + 0.5);
+    pacer->phase_count = count;
+}
+
+// Record that a new frame was submitted at time
+void frame_pacer_add_frame(FramePacer *pacer, uint64_t time)
+{
+    if (pacer->has_frame) {
+        const double dt = (double)(int64_t)(time - pacer->frame_time);
+        if (dt > 0 && dt < MAX_FRAME_INTERVAL) {
+            if (pacer->frame_interval > 0.0)
+                pacer->frame_interval += (dt - pacer->frame_interval) / FRAME_DRIFT;
+            else
+                pacer->frame_interval = dt;
+        }
+    }
+    pacer->frame_time = time;
+    pacer->has_frame  = 1;
+}
+
+// Get the time of the first vblank at or after time
+uint64_t frame_pacer_get_next_vblank(FramePacer *pacer, uint64_t time)
+{
+    double n;
+
+    if (!pacer->has_phase)
+        return time;
+
+    n = ceil((double)(int64_t)(time - pacer->phase) / pacer->period);
+    return pacer->phase + (int64_t)ceil(n * pacer->period);
+}
+
+// Get the time a frame ready at time shall be flipped at
+uint64_t frame_pacer_get_deadline(FramePacer *pacer, uint64_t time)
+{
+    const unsigned int margin = pacer->has_phase ? get_margin(pacer) : 0;
+    uint64_t t, vblank;
+
+    /* Allow only one flip per vblank */
+    t = time + margin;
+    if (pacer->has_flip) {
+        const double spacing = pacer->has_phase ? 0.5 : 1.0;
+        const uint64_t min_t = pacer->flip_vblank +
+            (uint64_t)(pacer->period * spacing);
+        if (t < min_t)
+            t = min_t;
+    }
+
+    vblank = frame_pacer_get_next_vblank(pacer, t);
+    return MAX(vblank - margin, time);
+}
+
+// Record that a flip was issued at time
+void frame_pacer_flip(FramePacer *pacer, uint64_t time)
+{
+    pacer->flip_vblank = frame_pacer_get_next_vblank(pacer, time);
+    pacer->has_flip    = 1;
+}
+
+#ifdef TEST_FRAME_PACER
+/* Simulated display, with its own vblank train */
+typedef struct {
+    double   period;
+    uint64_t phase;
+} Display;
+
+static uint64_t display_next_vblank(Display *dpy, uint64_t t)
+{
+    const double n = ceil((double)(int64_t)(t - dpy->phase) / dpy->period);
+    return dpy->phase + (int64_t)ceil(n * dpy->period);
+}
+
+static int64_t display_get_msc(Display *dpy, uint64_t t)
+{
+    return (int64_t)floor((double)(int64_t)(t - dpy->phase) / dpy->period);
+}
+
+static unsigned int fake_latency(unsigned int max_latency)
+{
+    return rand() % (max_latency + 1);
+}
+
+/* Simulate the render thread for num_frames frames of the specified
+   interval, and fill in the number of flips for each number of vblanks
+   between two flips */
+static int
+run_test(
+    const char  *name,
+    double       refresh,
+    double       frame_interval,
+    int          use_msc,
+    int          lock_rate,
+    unsigned int hist[8]
+)
+{
+    Display dpy;
+    FramePacer *pacer;
+    uint64_t start, arrival, ready = 0, deadline = 0, vblank;
+    int64_t msc, prev_msc = -1;
+    unsigned int i, n, num_flips = 0, late = 0, misaligned = 0, dups = 0;
+    int pending = 0;
+    const unsigned int num_frames = 2000, warmup = 200;
+
+    pacer = frame_pacer_new(1000000 / 60);
+    if (!pacer)
+        return 0;
+    if (lock_rate)
+        frame_pacer_set_refresh_rate(pacer, (int)(1000000000.0 / refresh), 1000);
+
+    dpy.period = refresh;
+    dpy.phase  = 1234;
+    start      = 1000000;
+    memset(hist, 0, 8 * sizeof(hist[0]));
+
+    for (i = 0; i <= num_frames; i++) {
+        /* Frames come in with some scheduling jitter */
+        arrival = start + (uint64_t)(i * frame_interval) + fake_latency(3000);
+
+        if (pending && arrival >= deadline) {
+            frame_pacer_flip(pacer, deadline);
+            pending = 0;
+
+            /* The swap is performed on the first vblank after the flip */
+            vblank = display_next_vblank(&dpy, deadline);
+            msc    = display_get_msc(&dpy, vblank + 1);
+
+            /* The vblank is observed with some latency, along with
+               its counter if the display supports it */
+            if (use_msc)
+                frame_pacer_add_vblank(pacer, vblank + fake_latency(500), msc);
+            else
+                frame_pacer_add_vblank(pacer, vblank + fake_latency(1000),
+                                       FRAME_PACER_NO_MSC);
+
+            if (num_flips++ >= warmup) {
+                /* Flips shall be issued within the margin before the vblank */
+                if (vblank - deadline > DEFAULT_MARGIN + 1000)
+                    misaligned++;
+
+                /* Frames shall be displayed on the next possible vblank */
+                if (vblank - ready > dpy.period + DEFAULT_MARGIN + 1000)
+                    late++;
+
+                n = msc - prev_msc;
+                if (n == 0)
+                    dups++;
+                hist[MIN(n, 7)]++;
+            }
+            prev_msc = msc;
+        }
+        if (i == num_frames)
+            break;
+
+        /* Frames received before the deadline replace the pending one */
+        frame_pacer_add_frame(pacer, arrival);
+        if (!pending) {
+            ready    = arrival;
+            deadline = frame_pacer_get_deadline(pacer, arrival);
+            if (deadline < arrival)
+                abort();
+            pending  = 1;
+        }
+    }
+
+    printf("%-24s refresh %u (%.1f), frame %u, %u misaligned, %u late, %u dups\n",
+           name, frame_pacer_get_refresh(pacer), dpy.period,
+           frame_pacer_get_frame_interval(pacer), misaligned, late, dups);
+    printf("%-24s cadence:", "");
+    for (i = 0; i < 8; i++)
+        printf(" %u", hist[i]);
+    printf("\n");
+
+    n = fabs(frame_pacer_get_refresh(pacer) - dpy.period) <= 2.0;
+    frame_pacer_free(pacer);
+    return n && !misaligned && !late && !dups;
+}
+
+int main(void)
+{
+    unsigned int hist[8];
+
+    setvbuf(stdout, NULL, _IONBF, 0);
+    srand(42);
+
+    /* 25 fps on a 50 Hz display, with vblank counters */
+    if (!run_test("25p @ 50 Hz (msc)", 20000.0, 40000.0, 1, 0, hist))
+        abort();
+    if (hist[2] != 1800)
+        abort();
+
+    /* 25 fps on a 50 Hz display, with swap completion times only */
+    if (!run_test("25p @ 50 Hz", 20000.0, 40000.0, 0, 0, hist))
+        abort();
+    if (hist[2] != 1800)
+        abort();
+
+    /* 24 fps on a 60 Hz display shall follow a 3:2 cadence */
+    if (!run_test("24p @ 60 Hz", 1000000.0 / 60, 1000000.0 / 24, 0, 0, hist))
+        abort();
+    if (hist[2] + hist[3] != 1800 || abs((int)hist[2] - (int)hist[3]) > 2)
+        abort();
+
+    /* 23.976 fps on a 59.94 Hz display, with the exact refresh rate */
+    if (!run_test("23.976p @ 59.94 Hz (oml)", 1001000.0 / 60, 1001000.0 / 24, 1, 1, hist))
+        abort();
+    if (hist[2] + hist[3] != 1800)
+        abort();
+
+    /* 60 fps on a 50 Hz display: drop frames, never flip twice a vblank */
+    if (!run_test("60p @ 50 Hz (msc)", 20000.0, 1000000.0 / 60, 1, 0, hist))
+        abort();
+    return 0;
+}
+#endif
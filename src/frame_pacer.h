@@ -0,0 +1,62 @@
+/*
+ *  frame_pacer.h - Frame pacing utilities
+ *
+ *  xvba-video (C) 2009-2011 Splitted-Desktop Systems
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#ifndef FRAME_PACER_H
+#define FRAME_PACER_H
+
+/* Vertical blank counter value to use when it is not known */
+#define FRAME_PACER_NO_MSC (-1)
+
+typedef struct _FramePacer FramePacer;
+
+FramePacer *frame_pacer_new(unsigned int refresh)
+    attribute_hidden;
+
+void frame_pacer_free(FramePacer *pacer)
+    attribute_hidden;
+
+void frame_pacer_set_refresh_rate(FramePacer *pacer, int num, int den)
+    attribute_hidden;
+
+void frame_pacer_set_margin(FramePacer *pacer, unsigned int margin)
+    attribute_hidden;
+
+unsigned int frame_pacer_get_refresh(FramePacer *pacer)
+    attribute_hidden;
+
+unsigned int frame_pacer_get_frame_interval(FramePacer *pacer)
+    attribute_hidden;
+
+void frame_pacer_add_vblank(FramePacer *pacer, uint64_t time, int64_t msc)
+    attribute_hidden;
+
+void frame_pacer_add_frame(FramePacer *pacer, uint64_t time)
+    attribute_hidden;
+
+uint64_t frame_pacer_get_next_vblank(FramePacer *pacer, uint64_t time)
+    attribute_hidden;
+
+uint64_t frame_pacer_get_deadline(FramePacer *pacer, uint64_t time)
+    attribute_hidden;
+
+void frame_pacer_flip(FramePacer *pacer, uint64_t time)
+    attribute_hidden;
+
+#endif /* FRAME_PACER_H */
@@ -0,0 +1,1386 @@
+/*
+ *  image_convert.c - Pixel format conversions
+ *
+ *  xvba-video (C) 2009-2011 Splitted-Desktop Systems
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include "sysdeps.h"
+#include "image_convert.h"
+#include "utils.h"
+#include <va/va.h>
+#include <math.h>
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+# define USE_X86_SIMD 1
+# include <immintrin.h>
+# define TARGET(isa) __attribute__((__target__(isa)))
+#else
+# define USE_X86_SIMD 0
+#endif
+
+#define DEBUG 1
+#include "debug.h"
+
+/* Defined to 1 to use the SSE2, SSSE3 or AVX2 conversion kernels the
+   CPU supports. Otherwise, only the C reference kernels are used */
+#define CONVERT_SIMD 1
+
+static int get_convert_simd_env(void)
+{
+    int convert_simd;
+    if (getenv_int("XVBA_VIDEO_CONVERT_SIMD", &convert_simd) < 0)
+        convert_simd = CONVERT_SIMD;
+    return convert_simd != 0;
+}
+
+static inline int use_convert_simd(void)
+{
+    static int g_convert_simd = -1;
+    if (g_convert_simd < 0)
+        g_convert_simd = get_convert_simd_env();
+    return g_convert_simd;
+}
+
+/* Fractional bits of the fixed point YUV to RGB coefficients */
+#define RGB_COEFF_BITS 13
+
+/* BT.601 YCbCr to RGB conversion, as done by the shaders */
+static const float yuv2rgb[3][3] = {
+    { 1.16438356f,  0.00000000f,  1.59602678f },
+    { 1.16438356f, -0.39176229f, -0.81296764f },
+    { 1.16438356f,  2.01723214f,  0.00000000f },
+};
+
+/* YUV to RGB coefficients of the first three bytes of output pixels,
+   the last one being alpha */
+typedef struct {
+    int16_t             y[3];
+    int16_t             u[3];
+    int16_t             v[3];
+    int32_t             offset[3];
+} RGBCoeffs;
+
+typedef enum {
+    CONVERT_ISA_C = 0,
+    CONVERT_ISA_SSE2,
+    CONVERT_ISA_SSSE3,
+    CONVERT_ISA_AVX2
+} ConvertISA;
+
+/* Line conversion kernels. Unless noted otherwise, all of them process
+   N pixel pairs */
+typedef struct {
+    const char         *name;
+    ConvertISA          isa;
+
+    /* Splits NV12 chroma into U and V lines */
+    void (*split_uv)(uint8_t *u, uint8_t *v, const uint8_t *uv,
+                     unsigned int n);
+
+    /* Interleaves U and V lines into NV12 chroma */
+    void (*merge_uv)(uint8_t *uv, const uint8_t *u, const uint8_t *v,
+                     unsigned int n);
+
+    /* Packs NV12 luma and chroma lines into a YUY2 or UYVY line */
+    void (*pack_yuv422)(uint8_t *dst, const uint8_t *y, const uint8_t *uv,
+                        unsigned int n, int uyvy);
+
+    /* Unpacks two YUY2 or UYVY lines into NV12 luma and chroma lines */
+    void (*unpack_yuv422)(uint8_t *y0, uint8_t *y1, uint8_t *uv,
+                          const uint8_t *src0, const uint8_t *src1,
+                          unsigned int n, int uyvy);
+
+    /* Converts NV12 luma and chroma lines to a 32-bit RGB line */
+    void (*nv12_to_rgb)(uint8_t *dst, const uint8_t *y, const uint8_t *uv,
+                        unsigned int n, const RGBCoeffs *coeffs);
+
+    /* Blends lines A and B of N bytes, B being weighted by F/256 */
+    void (*blend_lines)(uint8_t *dst, const uint8_t *a, const uint8_t *b,
+                        unsigned int n, unsigned int f);
+} ConvertKernels;
+
+static void
+split_uv_c(uint8_t *u, uint8_t *v, const uint8_t *uv, unsigned int n)
+{
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        u[i] = uv[2*i];
+        v[i] = uv[2*i + 1];
+    }
+}
+
+static void
+merge_uv_c(uint8_t *uv, const uint8_t *u, const uint8_t *v, unsigned int n)
+{
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        uv[2*i]     = u[i];
+        uv[2*i + 1] = v[i];
+    }
+}
+
+static void
+pack_yuv422_c(
+    uint8_t            *dst,
+    const uint8_t      *y,
+    const uint8_t      *uv,
+    unsigned int        n,
+    int                 uyvy
+)
+{
+    const unsigned int yo = uyvy ? 1 : 0;
+    const unsigned int co = uyvy ? 0 : 1;
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        dst[4*i + yo]     = y[2*i];
+        dst[4*i + co]     = uv[2*i];
+        dst[4*i + yo + 2] = y[2*i + 1];
+        dst[4*i + co + 2] = uv[2*i + 1];
+    }
+}
+
+static void
+unpack_yuv422_c(
+    uint8_t            *y0,
+    uint8_t            *y1,
+    uint8_t            *uv,
+    const uint8_t      *src0,
+    const uint8_t      *src1,
+    unsigned int        n,
+    int                 uyvy
+)
+{
+    const unsigned int yo = uyvy ? 1 : 0;
+    const unsigned int co = uyvy ? 0 : 1;
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        y0[2*i]     = src0[4*i + yo];
+        y0[2*i + 1] = src0[4*i + yo + 2];
+        y1[2*i]     = src1[4*i + yo];
+        y1[2*i + 1] = src1[4*i + yo + 2];
+        uv[2*i]     = (src0[4*i + co]     + src1[4*i + co]     + 1) >> 1;
+        uv[2*i + 1] = (src0[4*i + co + 2] + src1[4*i + co + 2] + 1) >> 1;
+    }
+}
+
+static inline uint8_t rgb_clamp(int v)
+{
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+static void
+nv12_to_rgb_c(
+    uint8_t            *dst,
+    const uint8_t      *y,
+    const uint8_t      *uv,
+    unsigned int        n,
+    const RGBCoeffs    *k
+)
+{
+    unsigned int i, c;
+
+    for (i = 0; i < 2 * n; i++) {
+        const int Y = y[i] - 16;
+        const int U = uv[i & ~1U] - 128;
+        const int V = uv[i | 1U] - 128;
+        for (c = 0; c < 3; c++)
+            dst[4*i + c] = rgb_clamp((k->y[c] * Y + k->u[c] * U +
+                                      k->v[c] * V + k->offset[c]) >>
+                                     RGB_COEFF_BITS);
+        dst[4*i + 3] = 0xff;
+    }
+}
+
+static void
+blend_lines_c(
+    uint8_t            *dst,
+    const uint8_t      *a,
+    const uint8_t      *b,
+    unsigned int        n,
+    unsigned int        f
+)
+{
+    unsigned int i;
+
+    for (i = 0; i < n; i++)
+        dst[i] = (a[i] * (256 - f) + b[i] * f + 128) >> 8;
+}
+
+#if USE_X86_SIMD
+/* Splits 16-bit words of A and B into their low and high bytes */
+TARGET("sse2")
+static inline void
+deinterleave_sse2(__m128i a, __m128i b, __m128i *even, __m128i *odd)
+{
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+
+    *even = _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask));
+    *odd  = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+}
+
+TARGET("ssse3")
+static inline void
+deinterleave_ssse3(__m128i a, __m128i b, __m128i *even, __m128i *odd)
+{
+    const __m128i shuffle = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14,
+                                          1, 3, 5, 7, 9, 11, 13, 15);
+
+    a = _mm_shuffle_epi8(a, shuffle);
+    b = _mm_shuffle_epi8(b, shuffle);
+    *even = _mm_unpacklo_epi64(a, b);
+    *odd  = _mm_unpackhi_epi64(a, b);
+}
+
+TARGET("avx2")
+static inline void
+deinterleave_avx2(__m256i a, __m256i b, __m256i *even, __m256i *odd)
+{
+    const __m256i mask = _mm256_set1_epi16(0x00ff);
+
+    /* Packing works within 128-bit lanes, hence the final permutes */
+    *even = _mm256_permute4x64_epi64(
+        _mm256_packus_epi16(_mm256_and_si256(a, mask),
+                            _mm256_and_si256(b, mask)), 0xd8);
+    *odd  = _mm256_permute4x64_epi64(
+        _mm256_packus_epi16(_mm256_srli_epi16(a, 8),
+                            _mm256_srli_epi16(b, 8)), 0xd8);
+}
+
+TARGET("sse2")
+static void
+split_uv_sse2(uint8_t *u, uint8_t *v, const uint8_t *uv, unsigned int n)
+{
+    __m128i us, vs;
+    unsigned int i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        deinterleave_sse2(_mm_loadu_si128((const __m128i *)(uv + 2*i)),
+                          _mm_loadu_si128((const __m128i *)(uv + 2*i + 16)),
+                          &us, &vs);
+        _mm_storeu_si128((__m128i *)(u + i), us);
+        _mm_storeu_si128((__m128i *)(v + i), vs);
+    }
+    split_uv_c(u + i, v + i, uv + 2*i, n - i);
+}
+
+TARGET("ssse3")
+static void
+split_uv_ssse3(uint8_t *u, uint8_t *v, const uint8_t *uv, unsigned int n)
+{
+    __m128i us, vs;
+    unsigned int i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        deinterleave_ssse3(_mm_loadu_si128((const __m128i *)(uv + 2*i)),
+                           _mm_loadu_si128((const __m128i *)(uv + 2*i + 16)),
+                           &us, &vs);
+        _mm_storeu_si128((__m128i *)(u + i), us);
+        _mm_storeu_si128((__m128i *)(v + i), vs);
+    }
+    split_uv_c(u + i, v + i, uv + 2*i, n - i);
+}
+
+TARGET("avx2")
+static void
+split_uv_avx2(uint8_t *u, uint8_t *v, const uint8_t *uv, unsigned int n)
+{
+    __m256i us, vs;
+    unsigned int i;
+
+    for (i = 0; i + 32 <= n; i += 32) {
+        deinterleave_avx2(_mm256_loadu_si256((const __m256i *)(uv + 2*i)),
+                          _mm256_loadu_si256((const __m256i *)(uv + 2*i + 32)),
+                          &us, &vs);
+        _mm256_storeu_si256((__m256i *)(u + i), us);
+        _mm256_storeu_si256((__m256i *)(v + i), vs);
+    }
+    split_uv_c(u + i, v + i, uv + 2*i, n - i);
+}
+
+TARGET("sse2")
+static void
+merge_uv_sse2(uint8_t *uv, const uint8_t *u, const uint8_t *v, unsigned int n)
+{
+    unsigned int i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        const __m128i us = _mm_loadu_si128((const __m128i *)(u + i));
+        const __m128i vs = _mm_loadu_si128((const __m128i *)(v + i));
+        _mm_storeu_si128((__m128i *)(uv + 2*i), _mm_unpacklo_epi8(us, vs));
+        _mm_storeu_si128((__m128i *)(uv + 2*i + 16), _mm_unpackhi_epi8(us, vs));
+    }
+    merge_uv_c(uv + 2*i, u + i, v + i, n - i);
+}
+
+TARGET("avx2")
+static void
+merge_uv_avx2(uint8_t *uv, const uint8_t *u, const uint8_t *v, unsigned int n)
+{
+    unsigned int i;
+
+    /* Unpacking works within 128-bit lanes, so the quadwords of the
+       sources are first reordered to 0, 2, 1, 3 */
+    for (i = 0; i + 32 <= n; i += 32) {
+        const __m256i us = _mm256_permute4x64_epi64(
+            _mm256_loadu_si256((const __m256i *)(u + i)), 0xd8);
+        const __m256i vs = _mm256_permute4x64_epi64(
+            _mm256_loadu_si256((const __m256i *)(v + i)), 0xd8);
+        _mm256_storeu_si256((__m256i *)(uv + 2*i),
+                            _mm256_unpacklo_epi8(us, vs));
+        _mm256_storeu_si256((__m256i *)(uv + 2*i + 32),
+                            _mm256_unpackhi_epi8(us, vs));
+    }
+    merge_uv_c(uv + 2*i, u + i, v + i, n - i);
+}
+
+TARGET("sse2")
+static void
+pack_yuv422_sse2(
+    uint8_t            *dst,
+    const uint8_t      *y,
+    const uint8_t      *uv,
+    unsigned int        n,
+    int                 uyvy
+)
+{
+    unsigned int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        const __m128i ys = _mm_loadu_si128((const __m128i *)(y + 2*i));
+        const __m128i cs = _mm_loadu_si128((const __m128i *)(uv + 2*i));
+        const __m128i a  = uyvy ? cs : ys;
+        const __m128i b  = uyvy ? ys : cs;
+        _mm_storeu_si128((__m128i *)(dst + 4*i), _mm_unpacklo_epi8(a, b));
+        _mm_storeu_si128((__m128i *)(dst + 4*i + 16), _mm_unpackhi_epi8(a, b));
+    }
+    pack_yuv422_c(dst + 4*i, y + 2*i, uv + 2*i, n - i, uyvy);
+}
+
+TARGET("avx2")
+static void
+pack_yuv422_avx2(
+    uint8_t            *dst,
+    const uint8_t      *y,
+    const uint8_t      *uv,
+    unsigned int        n,
+    int                 uyvy
+)
+{
+    unsigned int i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        const __m256i ys = _mm256_permute4x64_epi64(
+            _mm256_loadu_si256((const __m256i *)(y + 2*i)), 0xd8);
+        const __m256i cs = _mm256_permute4x64_epi64(
+            _mm256_loadu_si256((const __m256i *)(uv + 2*i)), 0xd8);
+        const __m256i a  = uyvy ? cs : ys;
+        const __m256i b  = uyvy ? ys : cs;
+        _mm256_storeu_si256((__m256i *)(dst + 4*i),
+                            _mm256_unpacklo_epi8(a, b));
+        _mm256_storeu_si256((__m256i *)(dst + 4*i + 32),
+                            _mm256_unpackhi_epi8(a, b));
+    }
+    pack_yuv422_c(dst + 4*i, y + 2*i, uv + 2*i, n - i, uyvy);
+}
+
+TARGET("sse2")
+static void
+unpack_yuv422_sse2(
+    uint8_t            *y0,
+    uint8_t            *y1,
+    uint8_t            *uv,
+    const uint8_t      *src0,
+    const uint8_t      *src1,
+    unsigned int        n,
+    int                 uyvy
+)
+{
+    __m128i e0, o0, e1, o1;
+    unsigned int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        deinterleave_sse2(_mm_loadu_si128((const __m128i *)(src0 + 4*i)),
+                          _mm_loadu_si128((const __m128i *)(src0 + 4*i + 16)),
+                          &e0, &o0);
+        deinterleave_sse2(_mm_loadu_si128((const __m128i *)(src1 + 4*i)),
+                          _mm_loadu_si128((const __m128i *)(src1 + 4*i + 16)),
+                          &e1, &o1);
+        _mm_storeu_si128((__m128i *)(y0 + 2*i), uyvy ? o0 : e0);
+        _mm_storeu_si128((__m128i *)(y1 + 2*i), uyvy ? o1 : e1);
+        _mm_storeu_si128((__m128i *)(uv + 2*i),
+                         uyvy ? _mm_avg_epu8(e0, e1) : _mm_avg_epu8(o0, o1));
+    }
+    unpack_yuv422_c(y0 + 2*i, y1 + 2*i, uv + 2*i, src0 + 4*i, src1 + 4*i,
+                    n - i, uyvy);
+}
+
+TARGET("ssse3")
+static void
+unpack_yuv422_ssse3(
+    uint8_t            *y0,
+    uint8_t            *y1,
+    uint8_t            *uv,
+    const uint8_t      *src0,
+    const uint8_t      *src1,
+    unsigned int        n,
+    int                 uyvy
+)
+{
+    __m128i e0, o0, e1, o1;
+    unsigned int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        deinterleave_ssse3(_mm_loadu_si128((const __m128i *)(src0 + 4*i)),
+                           _mm_loadu_si128((const __m128i *)(src0 + 4*i + 16)),
+                           &e0, &o0);
+        deinterleave_ssse3(_mm_loadu_si128((const __m128i *)(src1 + 4*i)),
+                           _mm_loadu_si128((const __m128i *)(src1 + 4*i + 16)),
+                           &e1, &o1);
+        _mm_storeu_si128((__m128i *)(y0 + 2*i), uyvy ? o0 : e0);
+        _mm_storeu_si128((__m128i *)(y1 + 2*i), uyvy ? o1 : e1);
+        _mm_storeu_si128((__m128i *)(uv + 2*i),
+                         uyvy ? _mm_avg_epu8(e0, e1) : _mm_avg_epu8(o0, o1));
+    }
+    unpack_yuv422_c(y0 + 2*i, y1 + 2*i, uv + 2*i, src0 + 4*i, src1 + 4*i,
+                    n - i, uyvy);
+}
+
+TARGET("avx2")
+static void
+unpack_yuv422_avx2(
+    uint8_t            *y0,
+    uint8_t            *y1,
+    uint8_t            *uv,
+    const uint8_t      *src0,
+    const uint8_t      *src1,
+    unsigned int        n,
+    int                 uyvy
+)
+{
+    __m256i e0, o0, e1, o1;
+    unsigned int i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        deinterleave_avx2(_mm256_loadu_si256((const __m256i *)(src0 + 4*i)),
+                          _mm256_loadu_si256((const __m256i *)(src0 + 4*i + 32)),
+                          &e0, &o0);
+        deinterleave_avx2(_mm256_loadu_si256((const __m256i *)(src1 + 4*i)),
+                          _mm256_loadu_si256((const __m256i *)(src1 + 4*i + 32)),
+                          &e1, &o1);
+        _mm256_storeu_si256((__m256i *)(y0 + 2*i), uyvy ? o0 : e0);
+        _mm256_storeu_si256((__m256i *)(y1 + 2*i), uyvy ? o1 : e1);
+        _mm256_storeu_si256((__m256i *)(uv + 2*i),
+                            uyvy ? _mm256_avg_epu8(e0, e1) :
+                            _mm256_avg_epu8(o0, o1));
+    }
+    unpack_yuv422_c(y0 + 2*i, y1 + 2*i, uv + 2*i, src0 + 4*i, src1 + 4*i,
+                    n - i, uyvy);
+}
+
+/* Words of the coefficients, as pairs for pmaddwd */
+#define RGB_COEFF_PAIR(a, b) \
+    ((uint32_t)(uint16_t)(a) | ((uint32_t)(uint16_t)(b) << 16))
+
+TARGET("sse2")
+static void
+nv12_to_rgb_sse2(
+    uint8_t            *dst,
+    const uint8_t      *y,
+    const uint8_t      *uv,
+    unsigned int        n,
+    const RGBCoeffs    *k
+)
+{
+    const __m128i zero    = _mm_setzero_si128();
+    const __m128i y_bias  = _mm_set1_epi16(16);
+    const __m128i uv_bias = _mm_set1_epi16(128);
+    const __m128i max     = _mm_set1_epi16(255);
+    const __m128i alpha   = _mm_set1_epi16((short)0xff00);
+    __m128i k_yu[3], k_v[3], k_offset[3], rgb[3];
+    unsigned int i, c;
+
+    for (c = 0; c < 3; c++) {
+        k_yu[c]     = _mm_set1_epi32(RGB_COEFF_PAIR(k->y[c], k->u[c]));
+        k_v[c]      = _mm_set1_epi32(RGB_COEFF_PAIR(k->v[c], 0));
+        k_offset[c] = _mm_set1_epi32(k->offset[c]);
+    }
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        const __m128i ys = _mm_sub_epi16(_mm_unpacklo_epi8(
+            _mm_loadl_epi64((const __m128i *)(y + 2*i)), zero), y_bias);
+        const __m128i cs = _mm_sub_epi16(_mm_unpacklo_epi8(
+            _mm_loadl_epi64((const __m128i *)(uv + 2*i)), zero), uv_bias);
+        const __m128i us = _mm_shufflehi_epi16(
+            _mm_shufflelo_epi16(cs, _MM_SHUFFLE(2,2,0,0)), _MM_SHUFFLE(2,2,0,0));
+        const __m128i vs = _mm_shufflehi_epi16(
+            _mm_shufflelo_epi16(cs, _MM_SHUFFLE(3,3,1,1)), _MM_SHUFFLE(3,3,1,1));
+        const __m128i yu_lo = _mm_unpacklo_epi16(ys, us);
+        const __m128i yu_hi = _mm_unpackhi_epi16(ys, us);
+        const __m128i v_lo  = _mm_unpacklo_epi16(vs, zero);
+        const __m128i v_hi  = _mm_unpackhi_epi16(vs, zero);
+
+        for (c = 0; c < 3; c++) {
+            __m128i lo, hi;
+            lo = _mm_add_epi32(_mm_madd_epi16(yu_lo, k_yu[c]),
+                               _mm_madd_epi16(v_lo, k_v[c]));
+            hi = _mm_add_epi32(_mm_madd_epi16(yu_hi, k_yu[c]),
+                               _mm_madd_epi16(v_hi, k_v[c]));
+            lo = _mm_srai_epi32(_mm_add_epi32(lo, k_offset[c]), RGB_COEFF_BITS);
+            hi = _mm_srai_epi32(_mm_add_epi32(hi, k_offset[c]), RGB_COEFF_BITS);
+            rgb[c] = _mm_min_epi16(_mm_max_epi16(_mm_packs_epi32(lo, hi),
+                                                 zero), max);
+        }
+
+        const __m128i c01 = _mm_or_si128(rgb[0], _mm_slli_epi16(rgb[1], 8));
+        const __m128i c23 = _mm_or_si128(rgb[2], alpha);
+        _mm_storeu_si128((__m128i *)(dst + 8*i), _mm_unpacklo_epi16(c01, c23));
+        _mm_storeu_si128((__m128i *)(dst + 8*i + 16), _mm_unpackhi_epi16(c01, c23));
+    }
+    nv12_to_rgb_c(dst + 8*i, y + 2*i, uv + 2*i, n - i, k);
+}
+
+TARGET("avx2")
+static void
+nv12_to_rgb_avx2(
+    uint8_t            *dst,
+    const uint8_t      *y,
+    const uint8_t      *uv,
+    unsigned int        n,
+    const RGBCoeffs    *k
+)
+{
+    const __m256i zero    = _mm256_setzero_si256();
+    const __m256i y_bias  = _mm256_set1_epi16(16);
+    const __m256i uv_bias = _mm256_set1_epi16(128);
+    const __m256i max     = _mm256_set1_epi16(255);
+    const __m256i alpha   = _mm256_set1_epi16((short)0xff00);
+    __m256i k_yu[3], k_v[3], k_offset[3], rgb[3];
+    unsigned int i, c;
+
+    for (c = 0; c < 3; c++) {
+        k_yu[c]     = _mm256_set1_epi32(RGB_COEFF_PAIR(k->y[c], k->u[c]));
+        k_v[c]      = _mm256_set1_epi32(RGB_COEFF_PAIR(k->v[c], 0));
+        k_offset[c] = _mm256_set1_epi32(k->offset[c]);
+    }
+
+    /* Pixels 0-7 are processed in the low lane and 8-15 in the high
+       one, which only the final stores need to account for */
+    for (i = 0; i + 8 <= n; i += 8) {
+        const __m256i ys = _mm256_sub_epi16(_mm256_cvtepu8_epi16(
+            _mm_loadu_si128((const __m128i *)(y + 2*i))), y_bias);
+        const __m256i cs = _mm256_sub_epi16(_mm256_cvtepu8_epi16(
+            _mm_loadu_si128((const __m128i *)(uv + 2*i))), uv_bias);
+        const __m256i us = _mm256_shufflehi_epi16(
+            _mm256_shufflelo_epi16(cs, _MM_SHUFFLE(2,2,0,0)), _MM_SHUFFLE(2,2,0,0));
+        const __m256i vs = _mm256_shufflehi_epi16(
+            _mm256_shufflelo_epi16(cs, _MM_SHUFFLE(3,3,1,1)), _MM_SHUFFLE(3,3,1,1));
+        const __m256i yu_lo = _mm256_unpacklo_epi16(ys, us);
+        const __m256i yu_hi = _mm256_unpackhi_epi16(ys, us);
+        const __m256i v_lo  = _mm256_unpacklo_epi16(vs, zero);
+        const __m256i v_hi  = _mm256_unpackhi_epi16(vs, zero);
+
+        for (c = 0; c < 3; c++) {
+            __m256i lo, hi;
+            lo = _mm256_add_epi32(_mm256_madd_epi16(yu_lo, k_yu[c]),
+                                  _mm256_madd_epi16(v_lo, k_v[c]));
+            hi = _mm256_add_epi32(_mm256_madd_epi16(yu_hi, k_yu[c]),
+                                  _mm256_madd_epi16(v_hi, k_v[c]));
+            lo = _mm256_srai_epi32(_mm256_add_epi32(lo, k_offset[c]),
+                                   RGB_COEFF_BITS);
+            hi = _mm256_srai_epi32(_mm256_add_epi32(hi, k_offset[c]),
+                                   RGB_COEFF_BITS);
+            rgb[c] = _mm256_min_epi16(_mm256_max_epi16(
+                _mm256_packs_epi32(lo, hi), zero), max);
+        }
+
+        const __m256i c01 = _mm256_or_si256(rgb[0], _mm256_slli_epi16(rgb[1], 8));
+        const __m256i c23 = _mm256_or_si256(rgb[2], alpha);
+        const __m256i lo  = _mm256_unpacklo_epi16(c01, c23);
+        const __m256i hi  = _mm256_unpackhi_epi16(c01, c23);
+        _mm256_storeu_si256((__m256i *)(dst + 8*i),
+                            _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)(dst + 8*i + 32),
+                            _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    nv12_to_rgb_c(dst + 8*i, y + 2*i, uv + 2*i, n - i, k);
+}
+
+TARGET("sse2")
+static void
+blend_lines_sse2(
+    uint8_t            *dst,
+    const uint8_t      *a,
+    const uint8_t      *b,
+    unsigned int        n,
+    unsigned int        f
+)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i fa   = _mm_set1_epi16(256 - f);
+    const __m128i fb   = _mm_set1_epi16(f);
+    const __m128i bias = _mm_set1_epi16(128);
+    unsigned int i;
+
+    /* Weights add up to 256, so sums fit in unsigned 16-bit words */
+    for (i = 0; i + 16 <= n; i += 16) {
+        const __m128i as = _mm_loadu_si128((const __m128i *)(a + i));
+        const __m128i bs = _mm_loadu_si128((const __m128i *)(b + i));
+        __m128i lo = _mm_add_epi16(
+            _mm_mullo_epi16(_mm_unpacklo_epi8(as, zero), fa),
+            _mm_mullo_epi16(_mm_unpacklo_epi8(bs, zero), fb));
+        __m128i hi = _mm_add_epi16(
+            _mm_mullo_epi16(_mm_unpackhi_epi8(as, zero), fa),
+            _mm_mullo_epi16(_mm_unpackhi_epi8(bs, zero), fb));
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, bias), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, bias), 8);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+    blend_lines_c(dst + i, a + i, b + i, n - i, f);
+}
+
+TARGET("avx2")
+static void
+blend_lines_avx2(
+    uint8_t            *dst,
+    const uint8_t      *a,
+    const uint8_t      *b,
+    unsigned int        n,
+    unsigned int        f
+)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i fa   = _mm256_set1_epi16(256 - f);
+    const __m256i fb   = _mm256_set1_epi16(f);
+    const __m256i bias = _mm256_set1_epi16(128);
+    unsigned int i;
+
+    /* Unpacking and packing both work within 128-bit lanes, so bytes
+       end up in their original order */
+    for (i = 0; i + 32 <= n; i += 32) {
+        const __m256i as = _mm256_loadu_si256((const __m256i *)(a + i));
+        const __m256i bs = _mm256_loadu_si256((const __m256i *)(b + i));
+        __m256i lo = _mm256_add_epi16(
+            _mm256_mullo_epi16(_mm256_unpacklo_epi8(as, zero), fa),
+            _mm256_mullo_epi16(_mm256_unpacklo_epi8(bs, zero), fb));
+        __m256i hi = _mm256_add_epi16(
+            _mm256_mullo_epi16(_mm256_unpackhi_epi8(as, zero), fa),
+            _mm256_mullo_epi16(_mm256_unpackhi_epi8(bs, zero), fb));
+        lo = _mm256_srli_epi16(_mm256_add_epi16(lo, bias), 8);
+        hi = _mm256_srli_epi16(_mm256_add_epi16(hi, bias), 8);
+        _mm256_storeu_si256((__m256i *)(dst + i),
+                            _mm256_packus_epi16(lo, hi));
+    }
+    blend_lines_c(dst + i, a + i, b + i, n - i, f);
+}
+#endif
+
+/* Kernels by increasing order of preference */
+static const ConvertKernels convert_kernels[] = {
+    { "C", CONVERT_ISA_C,
+      split_uv_c, merge_uv_c,
+      pack_yuv422_c, unpack_yuv422_c,
+      nv12_to_rgb_c, blend_lines_c },
+#if USE_X86_SIMD
+    { "SSE2", CONVERT_ISA_SSE2,
+      split_uv_sse2, merge_uv_sse2,
+      pack_yuv422_sse2, unpack_yuv422_sse2,
+      nv12_to_rgb_sse2, blend_lines_sse2 },
+    { "SSSE3", CONVERT_ISA_SSSE3,
+      split_uv_ssse3, merge_uv_sse2,
+      pack_yuv422_sse2, unpack_yuv422_ssse3,
+      nv12_to_rgb_sse2, blend_lines_sse2 },
+    { "AVX2", CONVERT_ISA_AVX2,
+      split_uv_avx2, merge_uv_avx2,
+      pack_yuv422_avx2, unpack_yuv422_avx2,
+      nv12_to_rgb_avx2, blend_lines_avx2 },
+#endif
+};
+
+// Checks whether the CPU supports the instruction set
+static int is_supported_isa(ConvertISA isa)
+{
+#if USE_X86_SIMD
+    __builtin_cpu_init();
+    switch (isa) {
+    case CONVERT_ISA_SSE2:  return __builtin_cpu_supports("sse2");
+    case CONVERT_ISA_SSSE3: return __builtin_cpu_supports("ssse3");
+    case CONVERT_ISA_AVX2:  return __builtin_cpu_supports("avx2");
+    default:                break;
+    }
+#endif
+    return isa == CONVERT_ISA_C;
+}
+
+// Selects the best kernels the CPU supports
+static const ConvertKernels *get_convert_kernels(void)
+{
+    static const ConvertKernels *g_kernels;
+    int i;
+
+    if (!g_kernels) {
+        i = use_convert_simd() ? ARRAY_ELEMS(convert_kernels) - 1 : 0;
+        while (i > 0 && !is_supported_isa(convert_kernels[i].isa))
+            i--;
+        D(bug("using %s pixel format conversions\n", convert_kernels[i].name));
+        g_kernels = &convert_kernels[i];
+    }
+    return g_kernels;
+}
+
+static inline int is_yuv420_planar_format(uint32_t fourcc)
+{
+    return (fourcc == VA_FOURCC('I','4','2','0') ||
+            fourcc == VA_FOURCC('Y','V','1','2'));
+}
+
+static inline int is_yuv422_packed_format(uint32_t fourcc)
+{
+    return (fourcc == VA_FOURCC('Y','U','Y','2') ||
+            fourcc == VA_FOURCC('U','Y','V','Y'));
+}
+
+static inline int is_rgb32_format(uint32_t fourcc)
+{
+    return (fourcc == VA_FOURCC('B','G','R','A') ||
+            fourcc == VA_FOURCC('R','G','B','A'));
+}
+
+// Checks whether pixels can be converted from SRC_FOURCC to DST_FOURCC
+int image_convert_is_supported(uint32_t dst_fourcc, uint32_t src_fourcc)
+{
+    if (src_fourcc == VA_FOURCC('N','V','1','2'))
+        return (is_yuv420_planar_format(dst_fourcc) ||
+                is_yuv422_packed_format(dst_fourcc) ||
+                is_rgb32_format(dst_fourcc));
+    if (dst_fourcc == VA_FOURCC('N','V','1','2'))
+        return (is_yuv420_planar_format(src_fourcc) ||
+                is_yuv422_packed_format(src_fourcc));
+    return 0;
+}
+
+static inline uint8_t *
+get_line(const ConvertImage *image, unsigned int plane, unsigned int y)
+{
+    return image->planes[plane] + y * image->pitches[plane];
+}
+
+// Gets the planes of U and V samples of a planar YUV 4:2:0 image
+static inline void
+get_chroma_planes(const ConvertImage *image, unsigned int *u, unsigned int *v)
+{
+    const int is_yv12 = image->fourcc == VA_FOURCC('Y','V','1','2');
+
+    *u = is_yv12 ? 2 : 1;
+    *v = is_yv12 ? 1 : 2;
+}
+
+// Copies N bytes of the first H lines of the luma planes
+static void
+copy_luma(ConvertImage *dst, const ConvertImage *src, unsigned int n)
+{
+    unsigned int y;
+
+    for (y = 0; y < src->height; y++)
+        memcpy(get_line(dst, 0, y), get_line(src, 0, y), n);
+}
+
+static void
+nv12_to_yuv420_planar(
+    const ConvertKernels *k,
+    ConvertImage       *dst,
+    const ConvertImage *src,
+    unsigned int        n
+)
+{
+    unsigned int y, u, v;
+
+    copy_luma(dst, src, 2 * n);
+    get_chroma_planes(dst, &u, &v);
+    for (y = 0; y < (src->height + 1) / 2; y++)
+        k->split_uv(get_line(dst, u, y), get_line(dst, v, y),
+                    get_line(src, 1, y), n);
+}
+
+static void
+yuv420_planar_to_nv12(
+    const ConvertKernels *k,
+    ConvertImage       *dst,
+    const ConvertImage *src,
+    unsigned int        n
+)
+{
+    unsigned int y, u, v;
+
+    copy_luma(dst, src, 2 * n);
+    get_chroma_planes(src, &u, &v);
+    for (y = 0; y < (src->height + 1) / 2; y++)
+        k->merge_uv(get_line(dst, 1, y),
+                    get_line(src, u, y), get_line(src, v, y), n);
+}
+
+static void
+nv12_to_yuv422_packed(
+    const ConvertKernels *k,
+    ConvertImage       *dst,
+    const ConvertImage *src,
+    unsigned int        n
+)
+{
+    const int uyvy = dst->fourcc == VA_FOURCC('U','Y','V','Y');
+    unsigned int y;
+
+    for (y = 0; y < src->height; y++)
+        k->pack_yuv422(get_line(dst, 0, y), get_line(src, 0, y),
+                       get_line(src, 1, y / 2), n, uyvy);
+}
+
+static void
+yuv422_packed_to_nv12(
+    const ConvertKernels *k,
+    ConvertImage       *dst,
+    const ConvertImage *src,
+    unsigned int        n
+)
+{
+    const int uyvy = src->fourcc == VA_FOURCC('U','Y','V','Y');
+    unsigned int y;
+
+    /* Chroma of line pairs is averaged. The last line of odd heights
+       is paired with itself */
+    for (y = 0; y < src->height; y += 2) {
+        const unsigned int y1 = y + 1 < src->height ? y + 1 : y;
+        k->unpack_yuv422(get_line(dst, 0, y), get_line(dst, 0, y1),
+                         get_line(dst, 1, y / 2),
+                         get_line(src, 0, y), get_line(src, 0, y1),
+                         n, uyvy);
+    }
+}
+
+// Converts a float coefficient to fixed point
+static inline int16_t get_rgb_coeff(float v)
+{
+    const long q = lrintf(v * (1 << RGB_COEFF_BITS));
+
+    return q < INT16_MIN ? INT16_MIN : (q > INT16_MAX ? INT16_MAX : q);
+}
+
+// Computes the coefficients of YUV to RGB conversion, followed by the
+// transform of color matrix CM, as the ProcAmp shader does
+static void
+get_rgb_coeffs(RGBCoeffs *k, uint32_t fourcc, ColorMatrix cm)
+{
+    static const unsigned int bgra_channels[3] = { 2, 1, 0 };
+    static const unsigned int rgba_channels[3] = { 0, 1, 2 };
+    const unsigned int *channels;
+    unsigned int i, j;
+    float a[3], offset;
+
+    channels = (fourcc == VA_FOURCC('B','G','R','A') ?
+                bgra_channels : rgba_channels);
+
+    for (i = 0; i < 3; i++) {
+        const unsigned int c = channels[i];
+        for (j = 0; j < 3; j++)
+            a[j] = (cm ?
+                    (cm[c][0] * yuv2rgb[0][j] +
+                     cm[c][1] * yuv2rgb[1][j] +
+                     cm[c][2] * yuv2rgb[2][j]) :
+                    yuv2rgb[c][j]);
+        offset = cm ? cm[c][3] * 255.0f : 0.0f;
+        offset = MAX(-256.0f, MIN(offset, 256.0f));
+
+        k->y[i]      = get_rgb_coeff(a[0]);
+        k->u[i]      = get_rgb_coeff(a[1]);
+        k->v[i]      = get_rgb_coeff(a[2]);
+        k->offset[i] = (lrintf(offset * (1 << RGB_COEFF_BITS)) +
+                        (1 << (RGB_COEFF_BITS - 1)));
+    }
+}
+
+static void
+nv12_to_rgb32(
+    const ConvertKernels *k,
+    ConvertImage       *dst,
+    const ConvertImage *src,
+    unsigned int        n,
+    ColorMatrix         cm
+)
+{
+    RGBCoeffs coeffs;
+    unsigned int y;
+
+    get_rgb_coeffs(&coeffs, dst->fourcc, cm);
+    for (y = 0; y < src->height; y++)
+        k->nv12_to_rgb(get_line(dst, 0, y), get_line(src, 0, y),
+                       get_line(src, 1, y / 2), n, &coeffs);
+}
+
+static int
+do_image_convert(
+    const ConvertKernels *k,
+    ConvertImage       *dst,
+    const ConvertImage *src,
+    ColorMatrix         cm
+)
+{
+    const unsigned int n = (src->width + 1) / 2;
+
+    if (dst->width != src->width || dst->height != src->height)
+        return -1;
+
+    if (src->fourcc == VA_FOURCC('N','V','1','2')) {
+        if (is_yuv420_planar_format(dst->fourcc))
+            nv12_to_yuv420_planar(k, dst, src, n);
+        else if (is_yuv422_packed_format(dst->fourcc))
+            nv12_to_yuv422_packed(k, dst, src, n);
+        else if (is_rgb32_format(dst->fourcc))
+            nv12_to_rgb32(k, dst, src, n, cm);
+        else
+            return -1;
+    }
+    else if (dst->fourcc == VA_FOURCC('N','V','1','2')) {
+        if (is_yuv420_planar_format(src->fourcc))
+            yuv420_planar_to_nv12(k, dst, src, n);
+        else if (is_yuv422_packed_format(src->fourcc))
+            yuv422_packed_to_nv12(k, dst, src, n);
+        else
+            return -1;
+    }
+    else
+        return -1;
+    return 0;
+}
+
+// Converts SRC pixels into DST, of the same size. RGB pixels are further
+// transformed with the color matrix CM, if any
+int image_convert(ConvertImage *dst, const ConvertImage *src, ColorMatrix cm)
+{
+    return do_image_convert(get_convert_kernels(), dst, src, cm);
+}
+
+/* Fractional bits of the fixed point sample positions when scaling */
+#define SCALE_FRAC_BITS 16
+
+// Gets the source sample I that sample X of DST_N ones scaled from SRC_N
+// falls after, and the 8-bit weight of the next one
+static inline unsigned int
+get_scale_sample(
+    unsigned int        x,
+    unsigned int        dst_n,
+    unsigned int        src_n,
+    unsigned int       *i
+)
+{
+    /* Sample centers are aligned, hence the half sample offsets */
+    const int64_t max_pos = (int64_t)(src_n - 1) << SCALE_FRAC_BITS;
+    int64_t pos = (((2 * (int64_t)x + 1) * src_n << SCALE_FRAC_BITS) /
+                   (2 * dst_n)) - (1 << (SCALE_FRAC_BITS - 1));
+
+    pos = pos < 0 ? 0 : (pos > max_pos ? max_pos : pos);
+    *i = pos >> SCALE_FRAC_BITS;
+    return (pos >> (SCALE_FRAC_BITS - 8)) & 0xff;
+}
+
+// Scales a line of SRC_N samples of CPP bytes horizontally, with the
+// source samples and weights of DST_N ones from XS
+static void
+scale_line(
+    uint8_t            *dst,
+    const uint8_t      *src,
+    const uint32_t     *xs,
+    unsigned int        dst_n,
+    unsigned int        src_n,
+    unsigned int        cpp
+)
+{
+    unsigned int x, c;
+
+    for (x = 0; x < dst_n; x++) {
+        const unsigned int i = xs[x] >> 8;
+        const unsigned int f = xs[x] & 0xff;
+        const uint8_t * const s0 = src + i * cpp;
+        const uint8_t * const s1 = src + MIN(i + 1, src_n - 1) * cpp;
+        for (c = 0; c < cpp; c++)
+            dst[x * cpp + c] = (s0[c] * (256 - f) + s1[c] * f + 128) >> 8;
+    }
+}
+
+// Scales plane P of SRC into DST, with samples of CPP bytes subsampled by
+// 2^SHIFT in both directions
+static int
+scale_plane(
+    const ConvertKernels *k,
+    ConvertImage       *dst,
+    const ConvertImage *src,
+    unsigned int        p,
+    unsigned int        shift,
+    unsigned int        cpp
+)
+{
+    const unsigned int dst_w = (dst->width  + shift) >> shift;
+    const unsigned int dst_h = (dst->height + shift) >> shift;
+    const unsigned int src_w = (src->width  + shift) >> shift;
+    const unsigned int src_h = (src->height + shift) >> shift;
+    const unsigned int line_size = dst_w * cpp;
+    unsigned int x, y, i;
+
+    uint32_t * const xs = malloc(dst_w * sizeof(*xs) + 2 * line_size);
+    if (!xs)
+        return -1;
+    for (x = 0; x < dst_w; x++) {
+        const unsigned int f = get_scale_sample(x, dst_w, src_w, &i);
+        xs[x] = (i << 8) | f;
+    }
+
+    /* Source lines are scaled horizontally once, into the slot of their
+       parity, since consecutive ones are blended */
+    uint8_t * const lines[2] = {
+        (uint8_t *)(xs + dst_w),
+        (uint8_t *)(xs + dst_w) + line_size
+    };
+    int line_y[2] = { -1, -1 };
+
+    for (y = 0; y < dst_h; y++) {
+        const unsigned int f = get_scale_sample(y, dst_h, src_h, &i);
+        const unsigned int i1 = MIN(i + 1, src_h - 1);
+        const unsigned int ys[2] = { i, i1 };
+        unsigned int j;
+
+        for (j = 0; j < 2; j++) {
+            const unsigned int slot = ys[j] & 1;
+            if (line_y[slot] == (int)ys[j])
+                continue;
+            scale_line(lines[slot], get_line(src, p, ys[j]), xs,
+                       dst_w, src_w, cpp);
+            line_y[slot] = ys[j];
+        }
+        k->blend_lines(get_line(dst, p, y), lines[i & 1], lines[i1 & 1],
+                       line_size, f);
+    }
+    free(xs);
+    return 0;
+}
+
+static int
+do_image_scale(
+    const ConvertKernels *k,
+    ConvertImage       *dst,
+    const ConvertImage *src
+)
+{
+    unsigned int i;
+
+    if (dst->fourcc != src->fourcc)
+        return -1;
+
+    switch (src->fourcc) {
+    case VA_FOURCC('N','V','1','2'):
+        if (scale_plane(k, dst, src, 0, 0, 1) < 0 ||
+            scale_plane(k, dst, src, 1, 1, 2) < 0)
+            return -1;
+        break;
+    case VA_FOURCC('I','4','2','0'):
+    case VA_FOURCC('Y','V','1','2'):
+        for (i = 0; i < 3; i++) {
+            if (scale_plane(k, dst, src, i, i > 0, 1) < 0)
+                return -1;
+        }
+        break;
+    case VA_FOURCC('B','G','R','A'):
+    case VA_FOURCC('R','G','B','A'):
+        if (scale_plane(k, dst, src, 0, 0, 4) < 0)
+            return -1;
+        break;
+    default:
+        return -1;
+    }
+    return 0;
+}
+
+// Scales SRC pixels into DST, of the same format, with bilinear filtering
+int image_scale(ConvertImage *dst, const ConvertImage *src)
+{
+    return do_image_scale(get_convert_kernels(), dst, src);
+}
+
+#ifdef TEST_IMAGE_CONVERT
+/* Image with its planes allocated in a single buffer */
+typedef struct {
+    ConvertImage        image;
+    uint8_t            *data;
+    unsigned int        size;
+} TestImage;
+
+static int test_image_init(TestImage *t, uint32_t fourcc,
+                           unsigned int width, unsigned int height)
+{
+    /* Pitches are deliberately not multiples of the vector sizes */
+    const unsigned int width2  = (width + 1) & -2U;
+    const unsigned int height2 = (height + 1) / 2;
+    unsigned int i, num_planes, heights[3];
+
+    memset(t, 0, sizeof(*t));
+    t->image.fourcc = fourcc;
+    t->image.width  = width;
+    t->image.height = height;
+
+    switch (fourcc) {
+    case VA_FOURCC('N','V','1','2'):
+        num_planes = 2;
+        t->image.pitches[0] = width2 + 5;
+        t->image.pitches[1] = width2 + 7;
+        heights[0] = height;
+        heights[1] = height2;
+        break;
+    case VA_FOURCC('I','4','2','0'):
+    case VA_FOURCC('Y','V','1','2'):
+        num_planes = 3;
+        t->image.pitches[0] = width2 + 3;
+        t->image.pitches[1] = width2 / 2 + 1;
+        t->image.pitches[2] = width2 / 2 + 9;
+        heights[0] = height;
+        heights[1] = height2;
+        heights[2] = height2;
+        break;
+    case VA_FOURCC('Y','U','Y','2'):
+    case VA_FOURCC('U','Y','V','Y'):
+        num_planes = 1;
+        t->image.pitches[0] = 2 * width2 + 6;
+        heights[0] = height;
+        break;
+    default:
+        num_planes = 1;
+        t->image.pitches[0] = 4 * width2 + 4;
+        heights[0] = height;
+        break;
+    }
+
+    for (i = 0; i < num_planes; i++)
+        t->size += t->image.pitches[i] * heights[i];
+    t->data = malloc(t->size);
+    if (!t->data)
+        return 0;
+    for (i = 0; i < t->size; i++)
+        t->data[i] = rand();
+
+    uint8_t *p = t->data;
+    for (i = 0; i < num_planes; i++) {
+        t->image.planes[i] = p;
+        p += t->image.pitches[i] * heights[i];
+    }
+    return 1;
+}
+
+static void test_image_copy(TestImage *dst, const TestImage *src)
+{
+    memcpy(dst->data, src->data, src->size);
+}
+
+static void test_image_fini(TestImage *t)
+{
+    free(t->data);
+}
+
+/* Conversions to test, as destination and source formats */
+static const uint32_t test_formats[][2] = {
+    { VA_FOURCC('I','4','2','0'), VA_FOURCC('N','V','1','2') },
+    { VA_FOURCC('Y','V','1','2'), VA_FOURCC('N','V','1','2') },
+    { VA_FOURCC('Y','U','Y','2'), VA_FOURCC('N','V','1','2') },
+    { VA_FOURCC('U','Y','V','Y'), VA_FOURCC('N','V','1','2') },
+    { VA_FOURCC('B','G','R','A'), VA_FOURCC('N','V','1','2') },
+    { VA_FOURCC('R','G','B','A'), VA_FOURCC('N','V','1','2') },
+    { VA_FOURCC('N','V','1','2'), VA_FOURCC('I','4','2','0') },
+    { VA_FOURCC('N','V','1','2'), VA_FOURCC('Y','V','1','2') },
+    { VA_FOURCC('N','V','1','2'), VA_FOURCC('Y','U','Y','2') },
+    { VA_FOURCC('N','V','1','2'), VA_FOURCC('U','Y','V','Y') },
+};
+
+/* Formats of scalings to test */
+static const uint32_t test_scale_formats[] = {
+    VA_FOURCC('N','V','1','2'),
+    VA_FOURCC('I','4','2','0'),
+    VA_FOURCC('B','G','R','A'),
+};
+
+/* Saturation and brightness boost, with some hue shift */
+static ColorMatrix test_matrix = {
+    {  1.20f, -0.10f, -0.10f,  0.05f },
+    { -0.05f,  1.15f, -0.10f,  0.05f },
+    { -0.10f, -0.05f,  1.25f, -0.02f },
+    {  0.00f,  0.00f,  0.00f,  1.00f },
+};
+
+// Checks kernels K produce the same pixels as the C reference ones
+static int
+test_exactness(const ConvertKernels *k, uint32_t dst_fourcc,
+               uint32_t src_fourcc, int use_matrix)
+{
+    static const unsigned int sizes[][2] = {
+        { 2, 1 }, { 6, 3 }, { 34, 7 }, { 97, 18 }, { 318, 17 }, { 1918, 9 },
+    };
+    ColorMatrix * const cm = use_matrix ? &test_matrix : NULL;
+    TestImage src, ref, out;
+    unsigned int i;
+    int ok = 1;
+
+    for (i = 0; ok && i < ARRAY_ELEMS(sizes); i++) {
+        const unsigned int w = sizes[i][0], h = sizes[i][1];
+        if (!test_image_init(&src, src_fourcc, w, h))
+            return 0;
+        if (!test_image_init(&ref, dst_fourcc, w, h))
+            return 0;
+        if (!test_image_init(&out, dst_fourcc, w, h))
+            return 0;
+        test_image_copy(&out, &ref);
+
+        if (do_image_convert(&convert_kernels[0], &ref.image, &src.image,
+                             cm ? *cm : NULL) < 0 ||
+            do_image_convert(k, &out.image, &src.image,
+                             cm ? *cm : NULL) < 0 ||
+            memcmp(ref.data, out.data, ref.size) != 0) {
+            printf("  %ux%u: mismatch\n", w, h);
+            ok = 0;
+        }
+        test_image_fini(&out);
+        test_image_fini(&ref);
+        test_image_fini(&src);
+    }
+    return ok;
+}
+
+// Checks kernels K scale pixels as the C reference ones do
+static int
+test_scale_exactness(const ConvertKernels *k, uint32_t fourcc)
+{
+    static const unsigned int sizes[][4] = {
+        { 34, 7, 97, 18 }, { 318, 17, 160, 9 }, { 1918, 9, 722, 12 },
+    };
+    TestImage src, ref, out;
+    unsigned int i;
+    int ok = 1;
+
+    for (i = 0; ok && i < ARRAY_ELEMS(sizes); i++) {
+        const unsigned int sw = sizes[i][0], sh = sizes[i][1];
+        const unsigned int dw = sizes[i][2], dh = sizes[i][3];
+        if (!test_image_init(&src, fourcc, sw, sh))
+            return 0;
+        if (!test_image_init(&ref, fourcc, dw, dh))
+            return 0;
+        if (!test_image_init(&out, fourcc, dw, dh))
+            return 0;
+        test_image_copy(&out, &ref);
+
+        if (do_image_scale(&convert_kernels[0], &ref.image, &src.image) < 0 ||
+            do_image_scale(k, &out.image, &src.image) < 0 ||
+            memcmp(ref.data, out.data, ref.size) != 0) {
+            printf("  %ux%u -> %ux%u: mismatch\n", sw, sh, dw, dh);
+            ok = 0;
+        }
+        test_image_fini(&out);
+        test_image_fini(&ref);
+        test_image_fini(&src);
+    }
+    return ok;
+}
+
+// Measures the throughput of kernels K, in frames per second
+static double
+test_throughput(const ConvertKernels *k, uint32_t dst_fourcc,
+                uint32_t src_fourcc, unsigned int w, unsigned int h)
+{
+    TestImage src, dst;
+    uint64_t start, elapsed;
+    unsigned int n = 0;
+
+    if (!test_image_init(&src, src_fourcc, w, h))
+        return 0.0;
+    if (!test_image_init(&dst, dst_fourcc, w, h))
+        return 0.0;
+
+    start = get_ticks_usec();
+    do {
+        do_image_convert(k, &dst.image, &src.image, test_matrix);
+        ++n;
+        elapsed = get_ticks_usec() - start;
+    } while (elapsed < 200000);
+
+    test_image_fini(&dst);
+    test_image_fini(&src);
+    return n * 1000000.0 / elapsed;
+}
+
+int main(void)
+{
+    static const unsigned int resolutions[][2] = {
+        { 720, 576 }, { 1280, 720 }, { 1920, 1080 }, { 3840, 2160 },
+    };
+    unsigned int i, j, r;
+    int failed = 0;
+
+    printf("Bit-exactness against the C kernels\n");
+    for (i = 1; i < ARRAY_ELEMS(convert_kernels); i++) {
+        const ConvertKernels * const k = &convert_kernels[i];
+        if (!is_supported_isa(k->isa)) {
+            printf("%-6s not supported, skipped\n", k->name);
+            continue;
+        }
+        for (j = 0; j < ARRAY_ELEMS(test_formats); j++) {
+            const uint32_t dst_fourcc = test_formats[j][0];
+            const uint32_t src_fourcc = test_formats[j][1];
+            int ok = test_exactness(k, dst_fourcc, src_fourcc, 0);
+            if (ok && is_rgb32_format(dst_fourcc))
+                ok = test_exactness(k, dst_fourcc, src_fourcc, 1);
+            printf("%-6s %.4s -> %.4s: %s\n", k->name,
+                   (const char *)&src_fourcc, (const char *)&dst_fourcc,
+                   ok ? "OK" : "FAILED");
+            failed |= !ok;
+        }
+        for (j = 0; j < ARRAY_ELEMS(test_scale_formats); j++) {
+            const uint32_t fourcc = test_scale_formats[j];
+            const int ok = test_scale_exactness(k, fourcc);
+            printf("%-6s %.4s scaling: %s\n", k->name,
+                   (const char *)&fourcc, ok ? "OK" : "FAILED");
+            failed |= !ok;
+        }
+    }
+
+    printf("\nThroughput (frames per second)\n");
+    for (j = 0; j < ARRAY_ELEMS(test_formats); j++) {
+        const uint32_t dst_fourcc = test_formats[j][0];
+        const uint32_t src_fourcc = test_formats[j][1];
+        for (r = 0; r < ARRAY_ELEMS(resolutions); r++) {
+            const unsigned int w = resolutions[r][0];
+            const unsigned int h = resolutions[r][1];
+            printf("%.4s -> %.4s %4ux%-4u", (const char *)&src_fourcc,
+                   (const char *)&dst_fourcc, w, h);
+            for (i = 0; i < ARRAY_ELEMS(convert_kernels); i++) {
+                const ConvertKernels * const k = &convert_kernels[i];
+                if (!is_supported_isa(k->isa))
+                    continue;
+                printf("  %s %7.1f", k->name,
+                       test_throughput(k, dst_fourcc, src_fourcc, w, h));
+            }
+            printf("\n");
+        }
+    }
+    return failed;
+}
+#endif
@@ -0,0 +1,50 @@
+/*
+ *  image_convert.h - Pixel format conversions
+ *
+ *  xvba-video (C) 2009-2011 Splitted-Desktop Systems
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#ifndef IMAGE_CONVERT_H
+#define IMAGE_CONVERT_H
+
+#include "color_matrix.h"
+
+/* Pixels to convert, with the planes in VA image order, i.e. U then V
+   for I420 and V then U for YV12. Widths are rounded up to a multiple
+   of 2, so planes shall be padded accordingly */
+typedef struct {
+    uint32_t            fourcc;
+    unsigned int        width;
+    unsigned int        height;
+    uint8_t            *planes[3];
+    unsigned int        pitches[3];
+} ConvertImage;
+
+// Checks whether pixels can be converted from SRC_FOURCC to DST_FOURCC
+int image_convert_is_supported(uint32_t dst_fourcc, uint32_t src_fourcc)
+    attribute_hidden;
+
+// Converts SRC pixels into DST, of the same size. RGB pixels are further
+// transformed with the color matrix CM, if any
+int image_convert(ConvertImage *dst, const ConvertImage *src, ColorMatrix cm)
+    attribute_hidden;
+
+// Scales SRC pixels into DST, of the same format, with bilinear filtering
+int image_scale(ConvertImage *dst, const ConvertImage *src)
+    attribute_hidden;
+
+#endif /* IMAGE_CONVERT_H */
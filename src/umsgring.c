@@ -0,0 +1,486 @@
+/*
+ *  umsgring.c - Single-producer/single-consumer message ring
+ *
+ *  xvba-video (C) 2009-2011 Splitted-Desktop Systems
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include "sysdeps.h"
+#include "umsgring.h"
+#include "utils.h"
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+# include <sys/syscall.h>
+# include <linux/futex.h>
+# if defined(SYS_futex)
+#  define USE_FUTEX 1
+# endif
+#endif
+#ifndef USE_FUTEX
+# define USE_FUTEX 0
+#endif
+#if USE_FUTEX && !defined(FUTEX_WAIT_PRIVATE)
+# define FUTEX_WAIT_PRIVATE FUTEX_WAIT
+# define FUTEX_WAKE_PRIVATE FUTEX_WAKE
+#endif
+
+/* Keep producer and consumer indices on separate cache lines */
+#define CACHE_LINE_SIZE 64
+
+/* Number of times to poll the other side before going to sleep, on
+   SMP systems only */
+#define SPIN_COUNT 200
+
+#define memory_barrier() __sync_synchronize()
+
+#if defined(__ATOMIC_ACQUIRE)
+# define read_barrier()  __atomic_thread_fence(__ATOMIC_ACQUIRE)
+# define write_barrier() __atomic_thread_fence(__ATOMIC_RELEASE)
+#else
+# define read_barrier()  memory_barrier()
+# define write_barrier() memory_barrier()
+#endif
+
+#if defined(__i386__) || defined(__x86_64__)
+# define cpu_relax() __asm__ __volatile__("pause" ::: "memory")
+#else
+# define cpu_relax() memory_barrier()
+#endif
+
+/*
+ * Messages are stored in preallocated slots. The producer fills in
+ * the slot returned by msg_ring_alloc() and publishes it with
+ * msg_ring_push(). The consumer gets it from msg_ring_timed_pop() and
+ * hands it back with msg_ring_release(). Both sides only sleep when
+ * the ring is empty (consumer) or full (producer), and the other side
+ * only issues a wakeup if somebody is actually waiting.
+ */
+struct _UMsgRing {
+    uint8_t            *slots;
+    unsigned int        num_slots;
+    unsigned int        slot_size;
+    unsigned int        spin_count;
+#if !USE_FUTEX
+    pthread_mutex_t     mutex;
+    pthread_cond_t      cond;
+#endif
+
+    /* Written by the producer */
+    volatile unsigned int head __attribute__((aligned(CACHE_LINE_SIZE)));
+    volatile unsigned int producer_waiting;
+
+    /* Written by the consumer */
+    volatile unsigned int tail __attribute__((aligned(CACHE_LINE_SIZE)));
+    volatile unsigned int consumer_waiting;
+};
+
+// Wait for *addr to change from val, or until end_time is reached
+static void
+msg_ring_wait(
+    UMsgRing              *ring,
+    volatile unsigned int *addr,
+    unsigned int           val,
+    uint64_t               end_time
+)
+{
+    unsigned int i;
+
+    /* The other side is likely running, give it a chance first */
+    for (i = 0; i < ring->spin_count; i++) {
+        if (*addr != val)
+            return;
+        cpu_relax();
+    }
+
+#if USE_FUTEX
+    struct timespec timeout, *timeout_p = NULL;
+
+    if (end_time) {
+        const uint64_t now = get_ticks_usec();
+        if (now >= end_time)
+            return;
+        timeout.tv_sec  = (end_time - now) / 1000000;
+        timeout.tv_nsec = 1000 * ((end_time - now) % 1000000);
+        timeout_p       = &timeout;
+    }
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout_p, NULL, 0);
+#else
+    pthread_mutex_lock(&ring->mutex);
+    if (*addr == val) {
+        if (!end_time)
+            pthread_cond_wait(&ring->cond, &ring->mutex);
+        else {
+            struct timespec timeout;
+            timeout.tv_sec  = end_time / 1000000;
+            timeout.tv_nsec = 1000 * (end_time % 1000000);
+            pthread_cond_timedwait(&ring->cond, &ring->mutex, &timeout);
+        }
+    }
+    pthread_mutex_unlock(&ring->mutex);
+#endif
+}
+
+// Wake up the consumer, waiting on head, or the producer, waiting on tail
+static void msg_ring_wake(UMsgRing *ring, int consumer)
+{
+    if (!(consumer ? ring->consumer_waiting : ring->producer_waiting))
+        return;
+
+#if USE_FUTEX
+    syscall(SYS_futex, consumer ? &ring->head : &ring->tail,
+            FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+    pthread_mutex_lock(&ring->mutex);
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->mutex);
+#endif
+}
+
+static inline void *msg_ring_get_slot(UMsgRing *ring, unsigned int index)
+{
+    return ring->slots + (index & (ring->num_slots - 1)) * ring->slot_size;
+}
+
+UMsgRing *msg_ring_new(unsigned int num_slots, unsigned int slot_size)
+{
+    UMsgRing *ring;
+    void *ptr;
+
+    if (num_slots == 0 || slot_size == 0)
+        return NULL;
+
+    if (posix_memalign(&ptr, CACHE_LINE_SIZE, sizeof(*ring)) != 0)
+        return NULL;
+    ring = ptr;
+    memset(ring, 0, sizeof(*ring));
+
+    /* Indices wrap around, so the number of slots must divide 2^32 */
+    ring->num_slots = 1;
+    while (ring->num_slots < num_slots)
+        ring->num_slots <<= 1;
+    ring->slot_size = (slot_size + 15) & -16U;
+    ring->spin_count = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPIN_COUNT : 0;
+
+    ring->slots = malloc(ring->num_slots * ring->slot_size);
+    if (!ring->slots) {
+        free(ring);
+        return NULL;
+    }
+
+#if !USE_FUTEX
+    pthread_mutex_init(&ring->mutex, NULL);
+    pthread_cond_init(&ring->cond, NULL);
+#endif
+    return ring;
+}
+
+void msg_ring_free(UMsgRing *ring)
+{
+    if (!ring)
+        return;
+
+#if !USE_FUTEX
+    pthread_cond_destroy(&ring->cond);
+    pthread_mutex_destroy(&ring->mutex);
+#endif
+    free(ring->slots);
+    free(ring);
+}
+
+int msg_ring_is_empty(UMsgRing *ring)
+{
+    return ring && ring->head == ring->tail;
+}
+
+// Get the next free slot, waiting for one if the ring is full
+void *msg_ring_alloc(UMsgRing *ring)
+{
+    const unsigned int head = ring->head;
+    unsigned int tail;
+
+    for (;;) {
+        tail = ring->tail;
+        if (head - tail < ring->num_slots)
+            break;
+        ring->producer_waiting = 1;
+        memory_barrier();
+        if (ring->tail == tail)
+            msg_ring_wait(ring, &ring->tail, tail, 0);
+        ring->producer_waiting = 0;
+    }
+
+    /* Make sure the consumer is done with the slot */
+    read_barrier();
+    return msg_ring_get_slot(ring, head);
+}
+
+// Publish the slot returned by msg_ring_alloc()
+void msg_ring_push(UMsgRing *ring)
+{
+    /* This is a full barrier: the message is visible before the new
+       head, and the new head before the waiting flag is checked */
+    __sync_fetch_and_add(&ring->head, 1);
+    msg_ring_wake(ring, 1);
+}
+
+// Get the oldest message, waiting for one until end_time (0: forever)
+void *msg_ring_timed_pop(UMsgRing *ring, uint64_t end_time)
+{
+    const unsigned int tail = ring->tail;
+    unsigned int head;
+
+    for (;;) {
+        head = ring->head;
+        if (head != tail)
+            break;
+        if (end_time && get_ticks_usec() >= end_time)
+            return NULL;
+        ring->consumer_waiting = 1;
+        memory_barrier();
+        if (ring->head == head)
+            msg_ring_wait(ring, &ring->head, head, end_time);
+        ring->consumer_waiting = 0;
+    }
+
+    /* Make sure the message contents are visible */
+    read_barrier();
+    return msg_ring_get_slot(ring, tail);
+}
+
+// Hand the slot returned by msg_ring_timed_pop() back to the producer
+void msg_ring_release(UMsgRing *ring)
+{
+    __sync_fetch_and_add(&ring->tail, 1);
+    msg_ring_wake(ring, 0);
+}
+
+#ifdef TEST_MSG_RING
+#include "uasyncqueue.h"
+
+/* Same size as a vaPutSurface() request to the render thread */
+typedef struct {
+    unsigned int        seqno;
+    uint64_t            timestamp;
+    unsigned int        payload[8];
+} Message;
+
+typedef struct {
+    UMsgRing           *ring;
+    UAsyncQueue        *queue;
+    unsigned int        num_msgs;
+    uint64_t            latency_sum;
+    uint64_t            latency_max;
+} BenchArgs;
+
+static uint64_t get_ticks_nsec(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static void account_latency(BenchArgs *args, const Message *msg)
+{
+    const uint64_t latency = get_ticks_nsec() - msg->timestamp;
+
+    args->latency_sum += latency;
+    if (args->latency_max < latency)
+        args->latency_max = latency;
+}
+
+static void *ring_consumer(void *arg)
+{
+    BenchArgs * const args = arg;
+    unsigned int i;
+    Message *msg;
+
+    for (i = 0; i < args->num_msgs; i++) {
+        msg = msg_ring_pop(args->ring);
+        if (msg->seqno != i)
+            abort();
+        account_latency(args, msg);
+        msg_ring_release(args->ring);
+    }
+    return NULL;
+}
+
+static void *queue_consumer(void *arg)
+{
+    BenchArgs * const args = arg;
+    unsigned int i;
+    Message *msg;
+
+    for (i = 0; i < args->num_msgs; i++) {
+        msg = async_queue_pop(args->queue);
+        if (msg->seqno != i)
+            abort();
+        account_latency(args, msg);
+        free(msg);
+    }
+    return NULL;
+}
+
+/* Send num_msgs messages, waiting delay usec between each of them so
+   that the consumer has to be woken up (latency) or not (throughput) */
+static void
+run_bench(const char *name, int use_ring, unsigned int num_msgs, unsigned int delay)
+{
+    BenchArgs args;
+    pthread_t consumer_thread;
+    uint64_t start, end;
+    unsigned int i;
+    Message *msg;
+
+    memset(&args, 0, sizeof(args));
+    args.num_msgs = num_msgs;
+    if (use_ring) {
+        args.ring = msg_ring_new(16, sizeof(Message));
+        if (!args.ring)
+            abort();
+    }
+    else {
+        args.queue = async_queue_new();
+        if (!args.queue)
+            abort();
+    }
+
+    if (pthread_create(&consumer_thread, NULL,
+                       use_ring ? ring_consumer : queue_consumer, &args) != 0)
+        abort();
+
+    start = get_ticks_nsec();
+    for (i = 0; i < num_msgs; i++) {
+        if (delay)
+            delay_usec(delay);
+        if (use_ring)
+            msg = msg_ring_alloc(args.ring);
+        else {
+            msg = malloc(sizeof(*msg));
+            if (!msg)
+                abort();
+        }
+        msg->seqno     = i;
+        msg->timestamp = get_ticks_nsec();
+        if (use_ring)
+            msg_ring_push(args.ring);
+        else if (!async_queue_push(args.queue, msg))
+            abort();
+    }
+    pthread_join(consumer_thread, NULL);
+    end = get_ticks_nsec();
+
+    printf("%-12s %-8s %8u msgs: %8.0f msgs/s, latency avg %6.1f usec, max %7.1f usec\n",
+           name, use_ring ? "ring" : "queue", num_msgs,
+           num_msgs * 1e9 / (end - start),
+           args.latency_sum / 1000.0 / num_msgs,
+           args.latency_max / 1000.0);
+
+    msg_ring_free(args.ring);
+    async_queue_free(args.queue);
+}
+
+/* Push and pop num_msgs messages from a single thread, i.e. measure
+   the cost of the operations themselves */
+static void run_bench_uncontended(int use_ring, unsigned int num_msgs)
+{
+    UMsgRing *ring = NULL;
+    UAsyncQueue *queue = NULL;
+    uint64_t start, end;
+    unsigned int i;
+    Message *msg;
+
+    if (use_ring)
+        ring = msg_ring_new(16, sizeof(Message));
+    else
+        queue = async_queue_new();
+    if (!ring && !queue)
+        abort();
+
+    start = get_ticks_nsec();
+    for (i = 0; i < num_msgs; i++) {
+        if (use_ring) {
+            msg = msg_ring_alloc(ring);
+            msg->seqno = i;
+            msg_ring_push(ring);
+            msg = msg_ring_pop(ring);
+            if (msg->seqno != i)
+                abort();
+            msg_ring_release(ring);
+        }
+        else {
+            msg = malloc(sizeof(*msg));
+            if (!msg)
+                abort();
+            msg->seqno = i;
+            async_queue_push(queue, msg);
+            msg = async_queue_pop(queue);
+            if (msg->seqno != i)
+                abort();
+            free(msg);
+        }
+    }
+    end = get_ticks_nsec();
+
+    printf("%-12s %-8s %8u msgs: %8.1f nsec per push/pop\n",
+           "uncontended", use_ring ? "ring" : "queue", num_msgs,
+           (double)(end - start) / num_msgs);
+
+    msg_ring_free(ring);
+    async_queue_free(queue);
+}
+
+int main(void)
+{
+    UMsgRing *ring;
+    uint64_t end_time;
+    unsigned int i;
+
+    /* Timed pop from an empty ring */
+    ring = msg_ring_new(3, 1);
+    if (!ring)
+        abort();
+    end_time = get_ticks_usec() + 20000;
+    if (msg_ring_timed_pop(ring, end_time))
+        abort();
+    if (get_ticks_usec() < end_time)
+        abort();
+
+    /* Fill in the ring, the number of slots is rounded up */
+    for (i = 0; i < 4; i++) {
+        *(unsigned char *)msg_ring_alloc(ring) = i;
+        msg_ring_push(ring);
+    }
+    for (i = 0; i < 4; i++) {
+        if (*(unsigned char *)msg_ring_pop(ring) != i)
+            abort();
+        msg_ring_release(ring);
+    }
+    if (!msg_ring_is_empty(ring))
+        abort();
+    msg_ring_free(ring);
+
+    run_bench_uncontended(0, 1000000);
+    run_bench_uncontended(1, 1000000);
+    run_bench("throughput", 0, 1000000, 0);
+    run_bench("throughput", 1, 1000000, 0);
+    run_bench("latency", 0, 10000, 100);
+    run_bench("latency", 1, 10000, 100);
+    return 0;
+}
+#endif
@@ -0,0 +1,50 @@
+/*
+ *  umsgring.h - Single-producer/single-consumer message ring
+ *
+ *  xvba-video (C) 2009-2011 Splitted-Desktop Systems
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#ifndef UMSGRING_H
+#define UMSGRING_H
+
+typedef struct _UMsgRing UMsgRing;
+
+UMsgRing *msg_ring_new(unsigned int num_slots, unsigned int slot_size)
+    attribute_hidden;
+
+void msg_ring_free(UMsgRing *ring)
+    attribute_hidden;
+
+int msg_ring_is_empty(UMsgRing *ring)
+    attribute_hidden;
+
+void *msg_ring_alloc(UMsgRing *ring)
+    attribute_hidden;
+
+void msg_ring_push(UMsgRing *ring)
+    attribute_hidden;
+
+void *msg_ring_timed_pop(UMsgRing *ring, uint64_t end_time)
+    attribute_hidden;
+
+void msg_ring_release(UMsgRing *ring)
+    attribute_hidden;
+
+#define msg_ring_pop(ring) \
+    msg_ring_timed_pop(ring, 0)
+
+#endif /* UMSGRING_H */
@@ -22,6 +22,7 @@
 #include "sysdeps.h"
 #include <string.h>
 #include <math.h>
+#include <time.h>
 #include <dlfcn.h>
 #include <pthread.h>
 #include "utils.h"
@@ -301,11 +302,26 @@ gl_resize(unsigned int width, unsigned int height)
  * complete!! However, this cannot be used in standard VA/GLX
  * situations because foreign changes (from the user program) can
  * occur without us knowing about.
+ *
+ * Even without the cache, the current context is tracked while a
+ * context pushed with gl_push_context() is current, since no foreign
+ * change can occur until the matching gl_pop_context().
  */
-static int                 gl_current_context_cache = 0;
-static __thread Display   *gl_current_display;
-static __thread Window     gl_current_window;
-static __thread GLXContext gl_current_context;
+#define GL_CONTEXT_STACK_DEPTH 8
+
+typedef struct {
+    Display        *display;
+    Window          window;
+    GLXContext      context;
+    unsigned int    generation;         // gl_context_generation then
+    GLContextState  stack[GL_CONTEXT_STACK_DEPTH];
+    unsigned int    depth;
+} GLThreadState;
+
+static int                   gl_current_context_cache = 0;
+static __thread GLThreadState gl_thread_state;
+static GLContextStats        gl_context_stats;
+static volatile unsigned int gl_context_generation; // contexts destroyed
 
 void
 gl_set_current_context_cache(int is_enabled)
@@ -313,23 +329,43 @@ gl_set_current_context_cache(int is_enabled)
     gl_current_context_cache = is_enabled;
 }
 
+// Check whether the tracked current context can be trusted
+static inline int
+gl_current_context_is_known(void)
+{
+    GLThreadState * const ts = &gl_thread_state;
+
+    /* A context destroyed by any thread since could be the tracked one,
+       or its address could be reused by a new context */
+    if (ts->generation != gl_context_generation)
+        return 0;
+    return gl_current_context_cache || ts->depth > 0;
+}
+
 static Bool
 gl_make_current(Display *dpy, Window win, GLXContext ctx)
 {
+    GLThreadState * const ts = &gl_thread_state;
+    unsigned int generation;
     Bool ret;
 
-    if (gl_current_context_cache  &&
-        gl_current_display == dpy &&
-        gl_current_window  == win &&
-        gl_current_context == ctx)
+    if (gl_current_context_is_known() &&
+        ts->display == dpy &&
+        ts->window  == win &&
+        ts->context == ctx) {
+        __sync_fetch_and_add(&gl_context_stats.num_skipped, 1);
         return True;
+    }
 
+    generation = gl_context_generation;
     ret = glXMakeCurrent(dpy, win, ctx);
+    __sync_fetch_and_add(&gl_context_stats.num_switches, 1);
 
-    if (ret && gl_current_context_cache) {
-        gl_current_display = dpy;
-        gl_current_window  = win;
-        gl_current_context = ctx;
+    if (ret) {
+        ts->display    = dpy;
+        ts->window     = win;
+        ts->context    = ctx;
+        ts->generation = generation;
     }
     return ret;
 }
@@ -451,6 +487,9 @@ gl_destroy_context(GLContextState *cs)
     if (cs->display && cs->context) {
         if (glXGetCurrentContext() == cs->context)
             gl_make_current(cs->display, None, NULL);
+
+        /* Other threads may still track it as their current context */
+        __sync_add_and_fetch(&gl_context_generation, 1);
         glXDestroyContext(cs->display, cs->context);
         cs->display = NULL;
         cs->context = NULL;
@@ -494,16 +533,17 @@ gl_init_context(GLContextState *cs)
 void
 gl_get_current_context(GLContextState *cs)
 {
-    if (gl_current_context_cache) {
-        cs->display = gl_current_display;
-        cs->window  = gl_current_window;
-        cs->context = gl_current_context;
-    }
-    else {
-        cs->display = glXGetCurrentDisplay();
-        cs->window  = glXGetCurrentDrawable();
-        cs->context = glXGetCurrentContext();
+    GLThreadState * const ts = &gl_thread_state;
+
+    if (!gl_current_context_is_known()) {
+        ts->generation = gl_context_generation;
+        ts->display    = glXGetCurrentDisplay();
+        ts->window     = glXGetCurrentDrawable();
+        ts->context    = glXGetCurrentContext();
     }
+    cs->display = ts->display;
+    cs->window  = ts->window;
+    cs->context = ts->context;
 }
 
 /**
@@ -547,6 +587,76 @@ gl_set_current_context(GLContextState *new_cs, GLContextState *old_cs)
     return gl_make_current(new_cs->display, new_cs->window, new_cs->context);
 }
 
+/**
+ * gl_push_context:
+ * @cs: the requested new #GLContextState
+ *
+ * Makes the @cs GLX context current, saving the previously current
+ * context so that it is restored by the matching gl_pop_context().
+ * Nested calls are cheap: the current context is tracked until the
+ * outermost gl_pop_context(), and it is only made current again if
+ * it actually changes.
+ *
+ * Return value: 1 on success
+ */
+int
+gl_push_context(GLContextState *cs)
+{
+    GLThreadState * const ts = &gl_thread_state;
+
+    if (ts->depth >= GL_CONTEXT_STACK_DEPTH)
+        return 0;
+    if (!gl_set_current_context(cs, &ts->stack[ts->depth]))
+        return 0;
+    ts->depth++;
+    return 1;
+}
+
+/**
+ * gl_pop_context:
+ *
+ * Restores the GLX context that was current before the matching
+ * gl_push_context().
+ *
+ * If the context cache is enabled and there was no current context
+ * before, the pushed context is kept current. This saves releasing
+ * it, only to make it current again on the next gl_push_context().
+ * Once any context is destroyed, threads query the current context
+ * again rather than trusting the one they kept.
+ */
+void
+gl_pop_context(void)
+{
+    GLThreadState * const ts = &gl_thread_state;
+    GLContextState *old_cs;
+
+    if (ts->depth == 0)
+        return;
+    old_cs = &ts->stack[ts->depth - 1];
+
+    /* Restore the context while it is still tracked, so that nothing
+       is done if it did not change */
+    if (gl_current_context_cache && !old_cs->context)
+        __sync_fetch_and_add(&gl_context_stats.num_skipped, 1);
+    else
+        gl_set_current_context(old_cs, NULL);
+    ts->depth--;
+}
+
+/**
+ * gl_get_context_stats:
+ * @stats: return location for the #GLContextStats
+ *
+ * Retrieves the number of context switches made so far, by all
+ * threads, and the number of switches that were avoided.
+ */
+void
+gl_get_context_stats(GLContextStats *stats)
+{
+    stats->num_switches = gl_context_stats.num_switches;
+    stats->num_skipped  = gl_context_stats.num_skipped;
+}
+
 /**
  * gl_swap_buffers:
  * @cs: a #GLContextState
@@ -561,6 +671,100 @@ gl_swap_buffers(GLContextState *cs)
     glXSwapBuffers(cs->display, cs->window);
 }
 
+/**
+ * gl_get_refresh_rate:
+ * @cs: a #GLContextState
+ * @pnum: return location for the numerator of the refresh rate
+ * @pden: return location for the denominator of the refresh rate
+ *
+ * Retrieves the exact refresh rate of the display the @cs window is
+ * on, i.e. @pnum / @pden Hz. This requires GLX_OML_sync_control.
+ *
+ * Return value: 1 on success
+ */
+int
+gl_get_refresh_rate(GLContextState *cs, int *pnum, int *pden)
+{
+    GLVTable * const gl_vtable = gl_get_vtable();
+    int32_t num, den;
+
+    if (!gl_vtable || !gl_vtable->has_sync_control)
+        return 0;
+    if (!gl_vtable->glx_get_msc_rate(cs->display, cs->window, &num, &den))
+        return 0;
+    if (num <= 0 || den <= 0)
+        return 0;
+
+    if (pnum)
+        *pnum = num;
+    if (pden)
+        *pden = den;
+    return 1;
+}
+
+/**
+ * gl_get_vblank:
+ * @cs: a #GLContextState
+ * @ptime: return location for the time of the vertical blank
+ * @pmsc: return location for the vertical blank counter
+ *
+ * Retrieves the time, as returned by get_ticks_usec(), and the
+ * counter of the last vertical blank of the display the @cs window
+ * is on. This never waits for a vertical blank. With
+ * GLX_SGI_video_sync, the time is only an upper bound of when the
+ * vertical blank occurred.
+ *
+ * Return value: 1 on success, 0 if no vertical blank info is available
+ */
+int
+gl_get_vblank(GLContextState *cs, uint64_t *ptime, int64_t *pmsc)
+{
+    GLVTable * const gl_vtable = gl_get_vtable();
+    uint64_t time;
+    int64_t msc;
+
+    if (!gl_vtable)
+        return 0;
+
+    if (gl_vtable->has_sync_control) {
+        int64_t ust, sbc;
+
+        if (!gl_vtable->glx_get_sync_values(cs->display, cs->window,
+                                            &ust, &msc, &sbc))
+            return 0;
+
+        /* UST is CLOCK_MONOTONIC based on Linux, translate it to our
+           clock. Otherwise, assume the vblank just occurred */
+        time = get_ticks_usec();
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        const int64_t now = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+        if (ust <= now && now - ust < 1000000)
+            time -= now - ust;
+#endif
+    }
+    else if (gl_vtable->has_video_sync) {
+        unsigned int count;
+
+        /* Waiting for the next vblank would stall the render thread,
+           and every output it serves. The pacer keeps the earliest
+           phase observed, so late samples do no harm */
+        if (gl_vtable->glx_get_video_sync(&count) != 0)
+            return 0;
+        time = get_ticks_usec();
+        msc  = count;
+    }
+    else
+        return 0;
+
+    if (ptime)
+        *ptime = time;
+    if (pmsc)
+        *pmsc = msc;
+    return 1;
+}
+
 /**
  * get_proc_address:
  * @name: the name of the OpenGL extension function to lookup
@@ -726,6 +930,68 @@ gl_init_vtable(void)
         gl_vtable->has_fragment_program = 1;
     }
 
+    /* GL_ARB_shading_language_100 */
+    has_extension = (
+        find_string("GL_ARB_shading_language_100", gl_extensions, " ") &&
+        find_string("GL_ARB_shader_objects", gl_extensions, " ") &&
+        find_string("GL_ARB_fragment_shader", gl_extensions, " ")
+    );
+    if (has_extension) {
+        gl_vtable->gl_create_shader = (PFNGLCREATESHADEROBJECTARBPROC)
+            get_proc_address("glCreateShaderObjectARB");
+        if (!gl_vtable->gl_create_shader)
+            return NULL;
+        gl_vtable->gl_shader_source = (PFNGLSHADERSOURCEARBPROC)
+            get_proc_address("glShaderSourceARB");
+        if (!gl_vtable->gl_shader_source)
+            return NULL;
+        gl_vtable->gl_compile_shader = (PFNGLCOMPILESHADERARBPROC)
+            get_proc_address("glCompileShaderARB");
+        if (!gl_vtable->gl_compile_shader)
+            return NULL;
+        gl_vtable->gl_create_program = (PFNGLCREATEPROGRAMOBJECTARBPROC)
+            get_proc_address("glCreateProgramObjectARB");
+        if (!gl_vtable->gl_create_program)
+            return NULL;
+        gl_vtable->gl_attach_object = (PFNGLATTACHOBJECTARBPROC)
+            get_proc_address("glAttachObjectARB");
+        if (!gl_vtable->gl_attach_object)
+            return NULL;
+        gl_vtable->gl_link_program = (PFNGLLINKPROGRAMARBPROC)
+            get_proc_address("glLinkProgramARB");
+        if (!gl_vtable->gl_link_program)
+            return NULL;
+        gl_vtable->gl_use_program = (PFNGLUSEPROGRAMOBJECTARBPROC)
+            get_proc_address("glUseProgramObjectARB");
+        if (!gl_vtable->gl_use_program)
+            return NULL;
+        gl_vtable->gl_delete_object = (PFNGLDELETEOBJECTARBPROC)
+            get_proc_address("glDeleteObjectARB");
+        if (!gl_vtable->gl_delete_object)
+            return NULL;
+        gl_vtable->gl_get_object_parameter_iv = (PFNGLGETOBJECTPARAMETERIVARBPROC)
+            get_proc_address("glGetObjectParameterivARB");
+        if (!gl_vtable->gl_get_object_parameter_iv)
+            return NULL;
+        gl_vtable->gl_get_info_log = (PFNGLGETINFOLOGARBPROC)
+            get_proc_address("glGetInfoLogARB");
+        if (!gl_vtable->gl_get_info_log)
+            return NULL;
+        gl_vtable->gl_get_uniform_location = (PFNGLGETUNIFORMLOCATIONARBPROC)
+            get_proc_address("glGetUniformLocationARB");
+        if (!gl_vtable->gl_get_uniform_location)
+            return NULL;
+        gl_vtable->gl_uniform_1i = (PFNGLUNIFORM1IARBPROC)
+            get_proc_address("glUniform1iARB");
+        if (!gl_vtable->gl_uniform_1i)
+            return NULL;
+        gl_vtable->gl_uniform_4fv = (PFNGLUNIFORM4FVARBPROC)
+            get_proc_address("glUniform4fvARB");
+        if (!gl_vtable->gl_uniform_4fv)
+            return NULL;
+        gl_vtable->has_shading_language = 1;
+    }
+
     /* GL_ARB_multitexture */
     has_extension = (
         find_string("GL_ARB_multitexture", gl_extensions, " ")
@@ -749,6 +1015,110 @@ gl_init_vtable(void)
     if (has_extension) {
         gl_vtable->has_gpu_shader5 = 1;
     }
+
+    /* GL_ARB_sync */
+    has_extension = (
+        find_string("GL_ARB_sync", gl_extensions, " ")
+    );
+    if (has_extension) {
+        gl_vtable->gl_fence_sync = (PFNGLFENCESYNCPROC)
+            get_proc_address("glFenceSync");
+        gl_vtable->gl_delete_sync = (PFNGLDELETESYNCPROC)
+            get_proc_address("glDeleteSync");
+        gl_vtable->gl_client_wait_sync = (PFNGLCLIENTWAITSYNCPROC)
+            get_proc_address("glClientWaitSync");
+        gl_vtable->has_sync = (
+            gl_vtable->gl_fence_sync &&
+            gl_vtable->gl_delete_sync &&
+            gl_vtable->gl_client_wait_sync
+        );
+    }
+
+    /* GL_NV_fence */
+    has_extension = (
+        find_string("GL_NV_fence", gl_extensions, " ")
+    );
+    if (has_extension) {
+        gl_vtable->gl_gen_fences = (PFNGLGENFENCESNVPROC)
+            get_proc_address("glGenFencesNV");
+        gl_vtable->gl_delete_fences = (PFNGLDELETEFENCESNVPROC)
+            get_proc_address("glDeleteFencesNV");
+        gl_vtable->gl_set_fence = (PFNGLSETFENCENVPROC)
+            get_proc_address("glSetFenceNV");
+        gl_vtable->gl_test_fence = (PFNGLTESTFENCENVPROC)
+            get_proc_address("glTestFenceNV");
+        gl_vtable->has_fence = (
+            gl_vtable->gl_gen_fences &&
+            gl_vtable->gl_delete_fences &&
+            gl_vtable->gl_set_fence &&
+            gl_vtable->gl_test_fence
+        );
+    }
+
+    /* GL_ARB_pixel_buffer_object */
+    has_extension = (
+        find_string("GL_ARB_pixel_buffer_object", gl_extensions, " ")
+    );
+    if (has_extension) {
+        gl_vtable->gl_gen_buffers = (PFNGLGENBUFFERSARBPROC)
+            get_proc_address("glGenBuffersARB");
+        gl_vtable->gl_delete_buffers = (PFNGLDELETEBUFFERSARBPROC)
+            get_proc_address("glDeleteBuffersARB");
+        gl_vtable->gl_bind_buffer = (PFNGLBINDBUFFERARBPROC)
+            get_proc_address("glBindBufferARB");
+        gl_vtable->gl_buffer_data = (PFNGLBUFFERDATAARBPROC)
+            get_proc_address("glBufferDataARB");
+        gl_vtable->gl_map_buffer = (PFNGLMAPBUFFERARBPROC)
+            get_proc_address("glMapBufferARB");
+        gl_vtable->gl_unmap_buffer = (PFNGLUNMAPBUFFERARBPROC)
+            get_proc_address("glUnmapBufferARB");
+        gl_vtable->has_pixel_buffer_object = (
+            gl_vtable->gl_gen_buffers &&
+            gl_vtable->gl_delete_buffers &&
+            gl_vtable->gl_bind_buffer &&
+            gl_vtable->gl_buffer_data &&
+            gl_vtable->gl_map_buffer &&
+            gl_vtable->gl_unmap_buffer
+        );
+    }
+
+    /* GLX extensions are only queried if a GLX context is current */
+    Display * const x11_dpy = glXGetCurrentDisplay();
+    const char *glx_extensions = NULL;
+    if (x11_dpy)
+        glx_extensions = glXQueryExtensionsString(x11_dpy, DefaultScreen(x11_dpy));
+
+    /* GLX_SGI_video_sync */
+    has_extension = (
+        glx_extensions &&
+        find_string("GLX_SGI_video_sync", glx_extensions, " ")
+    );
+    if (has_extension) {
+        gl_vtable->glx_get_video_sync = (PFNGLXGETVIDEOSYNCSGIPROC)
+            get_proc_address("glXGetVideoSyncSGI");
+        gl_vtable->glx_wait_video_sync = (PFNGLXWAITVIDEOSYNCSGIPROC)
+            get_proc_address("glXWaitVideoSyncSGI");
+        gl_vtable->has_video_sync = (
+            gl_vtable->glx_get_video_sync &&
+            gl_vtable->glx_wait_video_sync
+        );
+    }
+
+    /* GLX_OML_sync_control */
+    has_extension = (
+        glx_extensions &&
+        find_string("GLX_OML_sync_control", glx_extensions, " ")
+    );
+    if (has_extension) {
+        gl_vtable->glx_get_sync_values = (PFNGLXGETSYNCVALUESOMLPROC)
+            get_proc_address("glXGetSyncValuesOML");
+        gl_vtable->glx_get_msc_rate = (PFNGLXGETMSCRATEOMLPROC)
+            get_proc_address("glXGetMscRateOML");
+        gl_vtable->has_sync_control = (
+            gl_vtable->glx_get_sync_values &&
+            gl_vtable->glx_get_msc_rate
+        );
+    }
     return gl_vtable;
 }
 
@@ -775,6 +1145,164 @@ gl_get_vtable(void)
     return gl_vtable;
 }
 
+struct _GLSync {
+    GLsync       sync;
+    GLuint       fence;
+    GLXContext   context;
+    volatile unsigned int ref_count;
+};
+
+/**
+ * gl_create_sync:
+ *
+ * Inserts a fence into the command stream of the current GL context.
+ * The fence is signaled once all the commands issued before it have
+ * completed, without stalling the GL pipeline like glFinish() does.
+ *
+ * GL_ARB_sync fences can be checked from any context sharing objects
+ * with the current one. GL_NV_fence fences can only be checked from
+ * the very context they were created in.
+ *
+ * Return value: the newly created #GLSync, or %NULL if fences are not
+ *   supported
+ */
+GLSync *
+gl_create_sync(void)
+{
+    GLVTable * const gl_vtable = gl_get_vtable();
+    GLSync *sync;
+
+    if (!gl_vtable || !(gl_vtable->has_sync || gl_vtable->has_fence))
+        return NULL;
+
+    sync = calloc(1, sizeof(*sync));
+    if (!sync)
+        return NULL;
+
+    sync->ref_count = 1;
+    sync->context   = glXGetCurrentContext();
+    if (gl_vtable->has_sync) {
+        sync->sync = gl_vtable->gl_fence_sync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        if (!sync->sync)
+            goto error;
+    }
+    else {
+        gl_vtable->gl_gen_fences(1, &sync->fence);
+        gl_vtable->gl_set_fence(sync->fence, GL_ALL_COMPLETED_NV);
+    }
+
+    /* Make sure the fence reaches the GPU, so that it can be waited
+       on from another context */
+    glFlush();
+    return sync;
+
+error:
+    free(sync);
+    return NULL;
+}
+
+/**
+ * gl_ref_sync:
+ * @sync: a #GLSync
+ *
+ * Adds a reference to the @sync fence, so that it can be waited on
+ * while its creator goes on and destroys it.
+ *
+ * Return value: the @sync fence
+ */
+GLSync *
+gl_ref_sync(GLSync *sync)
+{
+    if (sync)
+        __sync_add_and_fetch(&sync->ref_count, 1);
+    return sync;
+}
+
+/**
+ * gl_destroy_sync:
+ * @sync: a #GLSync
+ *
+ * Drops a reference to the @sync fence, and destroys it once the last
+ * one is gone.
+ */
+void
+gl_destroy_sync(GLSync *sync)
+{
+    GLVTable * const gl_vtable = gl_get_vtable();
+
+    if (!sync || __sync_sub_and_fetch(&sync->ref_count, 1) > 0)
+        return;
+
+    if (sync->sync)
+        gl_vtable->gl_delete_sync(sync->sync);
+    else if (sync->fence && glXGetCurrentContext() == sync->context) {
+        /* Otherwise, the fence name goes away with its context */
+        gl_vtable->gl_delete_fences(1, &sync->fence);
+    }
+    free(sync);
+}
+
+/**
+ * gl_test_sync:
+ * @sync: a #GLSync
+ *
+ * Checks whether the @sync fence was signaled, without blocking.
+ *
+ * Return value: 1 if the fence was signaled, 0 if it was not yet, -1
+ *   if the fence cannot be checked from the current context
+ */
+int
+gl_test_sync(GLSync *sync)
+{
+    return gl_wait_sync(sync, 0);
+}
+
+/**
+ * gl_wait_sync:
+ * @sync: a #GLSync
+ * @timeout: the max time to wait for, in microseconds
+ *
+ * Waits for the @sync fence to be signaled, or for the @timeout to
+ * expire, whichever happens first.
+ *
+ * Return value: 1 if the fence was signaled, 0 if the timeout expired,
+ *   -1 if the fence cannot be checked from the current context
+ */
+int
+gl_wait_sync(GLSync *sync, unsigned int timeout)
+{
+    GLVTable * const gl_vtable = gl_get_vtable();
+
+    if (!sync)
+        return -1;
+
+    if (sync->sync) {
+        switch (gl_vtable->gl_client_wait_sync(
+                    sync->sync,
+                    timeout > 0 ? GL_SYNC_FLUSH_COMMANDS_BIT : 0,
+                    (GLuint64)timeout * 1000)) {
+        case GL_ALREADY_SIGNALED:
+        case GL_CONDITION_SATISFIED:
+            return 1;
+        case GL_TIMEOUT_EXPIRED:
+            return 0;
+        }
+        return -1;
+    }
+
+    if (glXGetCurrentContext() != sync->context)
+        return -1;
+
+    /* GL_NV_fence has no timeout, poll for the fence status */
+    const uint64_t end = get_ticks_usec() + timeout;
+    while (!gl_vtable->gl_test_fence(sync->fence)) {
+        if (get_ticks_usec() >= end)
+            return 0;
+        delay_usec(100);
+    }
+    return 1;
+}
+
 /**
  * gl_create_texture:
  * @target: the target to which the texture is bound
@@ -944,6 +1472,178 @@ gl_destroy_texture_object(GLTextureObject *to)
     free(to);
 }
 
+/* Shelves are rows of the atlas, filled from left to right with
+   regions of at most their height */
+struct _GLAtlasShelf {
+    unsigned int y;
+    unsigned int height;
+    unsigned int used_width;
+    unsigned int count;                 // regions allocated
+};
+
+/**
+ * gl_create_texture_atlas:
+ * @target: the target to which the texture is bound
+ * @format: the format of the pixel data
+ * @width: the requested width, in pixels
+ * @height: the requested height, in pixels
+ *
+ * Creates a texture whose regions are handed out with a shelf
+ * allocator, so that many small images can be drawn with a single
+ * texture bound.
+ *
+ * Return value: the newly created #GLTextureAtlas, or %NULL if
+ *   an error occurred
+ */
+GLTextureAtlas *
+gl_create_texture_atlas(
+    GLenum       target,
+    GLenum       format,
+    unsigned int width,
+    unsigned int height
+)
+{
+    GLTextureAtlas *atlas;
+
+    atlas = calloc(1, sizeof(*atlas));
+    if (!atlas)
+        return NULL;
+
+    atlas->texture = gl_create_texture(target, format, width, height);
+    if (!atlas->texture) {
+        free(atlas);
+        return NULL;
+    }
+    atlas->target = target;
+    atlas->format = format;
+    atlas->width  = width;
+    atlas->height = height;
+    return atlas;
+}
+
+/**
+ * gl_destroy_texture_atlas:
+ * @atlas: a #GLTextureAtlas
+ *
+ * Destroys the #GLTextureAtlas object.
+ */
+void
+gl_destroy_texture_atlas(GLTextureAtlas *atlas)
+{
+    if (!atlas)
+        return;
+
+    if (atlas->texture) {
+        glDeleteTextures(1, &atlas->texture);
+        atlas->texture = 0;
+    }
+    free(atlas->shelves);
+    free(atlas);
+}
+
+/**
+ * gl_texture_atlas_alloc:
+ * @atlas: a #GLTextureAtlas
+ * @width: the requested width, in pixels
+ * @height: the requested height, in pixels
+ * @px: return location for the X coordinate of the region
+ * @py: return location for the Y coordinate of the region
+ *
+ * Allocates a @width x @height region of @atlas. The shelf wasting
+ * the least height is used, and a new shelf is only opened if none
+ * has room left and tall enough.
+ *
+ * Return value: 1 on success, 0 if @atlas is full
+ */
+int
+gl_texture_atlas_alloc(
+    GLTextureAtlas *atlas,
+    unsigned int    width,
+    unsigned int    height,
+    unsigned int   *px,
+    unsigned int   *py
+)
+{
+    GLAtlasShelf *shelf = NULL;
+    unsigned int i;
+
+    if (width > atlas->width || height > atlas->height)
+        return 0;
+
+    /* Round heights up, so that similar regions share shelves */
+    height = (height + 3) & -4U;
+
+    for (i = 0; i < atlas->shelves_count; i++) {
+        GLAtlasShelf * const s = &atlas->shelves[i];
+        if (s->height < height || s->used_width + width > atlas->width)
+            continue;
+        if (!shelf || shelf->height > s->height)
+            shelf = s;
+    }
+
+    /* Open a new shelf rather than wasting more than half a shelf */
+    if ((!shelf || shelf->height > 2 * height) &&
+        atlas->shelves_height + height <= atlas->height) {
+        GLAtlasShelf * const shelves = realloc_buffer(
+            (void **)&atlas->shelves,
+            &atlas->shelves_count_max,
+            1 + atlas->shelves_count,
+            sizeof(*shelves)
+        );
+        if (shelves) {
+            shelf = &shelves[atlas->shelves_count++];
+            shelf->y          = atlas->shelves_height;
+            shelf->height     = height;
+            shelf->used_width = 0;
+            shelf->count      = 0;
+            atlas->shelves_height += height;
+        }
+    }
+    if (!shelf)
+        return 0;
+
+    *px = shelf->used_width;
+    *py = shelf->y;
+    shelf->used_width += width;
+    shelf->count++;
+    return 1;
+}
+
+/**
+ * gl_texture_atlas_free:
+ * @atlas: a #GLTextureAtlas
+ * @x: the X coordinate of the region
+ * @y: the Y coordinate of the region
+ *
+ * Releases the region of @atlas at (@x, @y). Space is only reclaimed
+ * once all the regions of a shelf are released.
+ */
+void
+gl_texture_atlas_free(GLTextureAtlas *atlas, unsigned int x, unsigned int y)
+{
+    unsigned int i;
+
+    for (i = 0; i < atlas->shelves_count; i++) {
+        GLAtlasShelf * const shelf = &atlas->shelves[i];
+        if (shelf->y != y || x >= shelf->used_width)
+            continue;
+        ASSERT(shelf->count > 0);
+        if (--shelf->count > 0)
+            return;
+        shelf->used_width = 0;
+
+        /* Give back the height of empty shelves at the top */
+        while (atlas->shelves_count > 0) {
+            GLAtlasShelf * const top = &atlas->shelves[atlas->shelves_count - 1];
+            if (top->count > 0)
+                break;
+            atlas->shelves_height -= top->height;
+            atlas->shelves_count--;
+        }
+        return;
+    }
+}
+
 /**
  * gl_create_framebuffer_object:
  * @target: the target to which the texture is bound
@@ -1090,6 +1790,326 @@ gl_unbind_framebuffer_object(GLFramebufferObject *fbo)
     return 1;
 }
 
+/* Pooled texture, with its FBO if one was attached */
+typedef struct _GLResourcePoolEntry GLResourcePoolEntry;
+struct _GLResourcePoolEntry {
+    GLResourcePoolEntry *prev;
+    GLResourcePoolEntry *next;
+    GLenum               target;
+    GLenum               format;
+    GLuint               texture;
+    unsigned int         width;
+    unsigned int         height;
+    unsigned int         size;
+    GLFramebufferObject *fbo;
+};
+
+struct _GLResourcePool {
+    unsigned int         refcount;
+    pthread_mutex_t      mutex;
+    GLResourcePoolEntry *head;          // most recently used
+    GLResourcePoolEntry *tail;          // least recently used
+    unsigned int         size;
+    unsigned int         max_size;
+};
+
+// Computes texture memory size, approximately
+static unsigned int
+get_texture_size(GLenum format, unsigned int width, unsigned int height)
+{
+    unsigned int bytes_per_component;
+
+    switch (format) {
+    case GL_LUMINANCE:
+        bytes_per_component = 1;
+        break;
+    case GL_LUMINANCE_ALPHA:
+        bytes_per_component = 2;
+        break;
+    case GL_RGBA32F_ARB:
+        bytes_per_component = 4 * 4;
+        break;
+    default:
+        bytes_per_component = 4;
+        break;
+    }
+    return width * MAX(height, 1) * bytes_per_component;
+}
+
+// Destroys pool entry, and the GL resources it holds
+static void
+destroy_pool_entry(GLResourcePoolEntry *entry)
+{
+    if (entry->fbo) {
+        gl_destroy_framebuffer_object(entry->fbo);
+        entry->fbo = NULL;
+    }
+    if (entry->texture) {
+        glDeleteTextures(1, &entry->texture);
+        entry->texture = 0;
+    }
+    free(entry);
+}
+
+// Unlinks entry from the pool LRU list
+static void
+unlink_pool_entry(GLResourcePool *pool, GLResourcePoolEntry *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        pool->head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        pool->tail = entry->prev;
+    entry->prev = NULL;
+    entry->next = NULL;
+    pool->size -= entry->size;
+}
+
+/**
+ * gl_resource_pool_new:
+ * @max_size: the maximum amount of memory held by unused textures, in bytes
+ *
+ * Creates a pool of GL textures and FBOs, for contexts of the same
+ * share group. Released textures are kept around for later reuse
+ * with the same target, format and dimensions, and the least
+ * recently used ones are destroyed once @max_size is exceeded.
+ *
+ * Return value: the newly created #GLResourcePool, or %NULL if
+ *   an error occurred
+ */
+GLResourcePool *
+gl_resource_pool_new(unsigned int max_size)
+{
+    GLResourcePool *pool;
+
+    pool = calloc(1, sizeof(*pool));
+    if (!pool)
+        return NULL;
+
+    pool->refcount = 1;
+    pool->max_size = max_size;
+    pthread_mutex_init(&pool->mutex, NULL);
+    return pool;
+}
+
+/**
+ * gl_resource_pool_ref:
+ * @pool: a #GLResourcePool
+ *
+ * Atomically increases the reference count of @pool by one.
+ *
+ * Return value: the same @pool argument
+ */
+GLResourcePool *
+gl_resource_pool_ref(GLResourcePool *pool)
+{
+    if (pool) {
+        pthread_mutex_lock(&pool->mutex);
+        ++pool->refcount;
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    return pool;
+}
+
+/**
+ * gl_resource_pool_unref:
+ * @pool: a #GLResourcePool
+ *
+ * Atomically decreases the reference count of @pool by one. If the
+ * reference count reaches zero, the pool and all the textures it
+ * holds are destroyed. A GL context of the share group shall be
+ * current at this point.
+ */
+void
+gl_resource_pool_unref(GLResourcePool *pool)
+{
+    unsigned int refcount;
+
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->mutex);
+    refcount = --pool->refcount;
+    pthread_mutex_unlock(&pool->mutex);
+    if (refcount > 0)
+        return;
+
+    while (pool->head) {
+        GLResourcePoolEntry * const entry = pool->head;
+        unlink_pool_entry(pool, entry);
+        destroy_pool_entry(entry);
+    }
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+}
+
+/**
+ * gl_resource_pool_get_texture:
+ * @pool: a #GLResourcePool, or %NULL
+ * @target: the target to which the texture is bound
+ * @format: the format of the pixel data
+ * @width: the requested width, in pixels
+ * @height: the requested height, in pixels
+ * @pfbo: return location for the FBO attached to the texture, or %NULL
+ *
+ * Retrieves a texture with the specified target, format and
+ * dimensions from @pool, or creates a new one if none is available.
+ * The texture contents are undefined.
+ *
+ * If @pfbo is not %NULL, it receives the FBO that was attached to
+ * the recycled texture, or %NULL if there is none.
+ *
+ * Return value: the GL texture, or 0 if an error occurred
+ */
+GLuint
+gl_resource_pool_get_texture(
+    GLResourcePool       *pool,
+    GLenum                target,
+    GLenum                format,
+    unsigned int          width,
+    unsigned int          height,
+    GLFramebufferObject **pfbo
+)
+{
+    GLResourcePoolEntry *entry;
+    GLuint texture;
+
+    if (pfbo)
+        *pfbo = NULL;
+
+    if (pool) {
+        pthread_mutex_lock(&pool->mutex);
+        for (entry = pool->head; entry; entry = entry->next) {
+            if (entry->target == target &&
+                entry->format == format &&
+                entry->width  == width  &&
+                entry->height == height) {
+                unlink_pool_entry(pool, entry);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&pool->mutex);
+
+        if (entry) {
+            texture        = entry->texture;
+            entry->texture = 0;
+            if (pfbo) {
+                *pfbo      = entry->fbo;
+                entry->fbo = NULL;
+            }
+            destroy_pool_entry(entry);
+            return texture;
+        }
+    }
+    return gl_create_texture(target, format, width, height);
+}
+
+/**
+ * gl_resource_pool_put_texture:
+ * @pool: a #GLResourcePool, or %NULL
+ * @target: the target to which the texture is bound
+ * @format: the format of the pixel data
+ * @texture: the GL texture to release
+ * @width: the texture width, in pixels
+ * @height: the texture height, in pixels
+ * @fbo: the FBO attached to @texture, or %NULL
+ *
+ * Releases @texture, and its @fbo, to @pool for later reuse. If @pool
+ * is %NULL, or if it would exceed its memory limit, the least
+ * recently used textures are destroyed.
+ */
+void
+gl_resource_pool_put_texture(
+    GLResourcePool       *pool,
+    GLenum                target,
+    GLenum                format,
+    GLuint                texture,
+    unsigned int          width,
+    unsigned int          height,
+    GLFramebufferObject  *fbo
+)
+{
+    GLResourcePoolEntry *entry, *evicted = NULL;
+
+    if (!texture) {
+        if (fbo)
+            gl_destroy_framebuffer_object(fbo);
+        return;
+    }
+
+    entry = calloc(1, sizeof(*entry));
+    if (!entry) {
+        if (fbo)
+            gl_destroy_framebuffer_object(fbo);
+        glDeleteTextures(1, &texture);
+        return;
+    }
+    entry->target  = target;
+    entry->format  = format;
+    entry->texture = texture;
+    entry->width   = width;
+    entry->height  = height;
+    entry->size    = get_texture_size(format, width, height);
+    entry->fbo     = fbo;
+
+    if (!pool || entry->size > pool->max_size) {
+        destroy_pool_entry(entry);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    entry->next = pool->head;
+    if (pool->head)
+        pool->head->prev = entry;
+    else
+        pool->tail = entry;
+    pool->head  = entry;
+    pool->size += entry->size;
+
+    /* Evict least recently used textures */
+    while (pool->size > pool->max_size) {
+        GLResourcePoolEntry * const lru = pool->tail;
+        unlink_pool_entry(pool, lru);
+        lru->next = evicted;
+        evicted   = lru;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    while (evicted) {
+        entry   = evicted;
+        evicted = entry->next;
+        D(bug("Evicted %ux%u texture from GL resource pool\n",
+              entry->width, entry->height));
+        destroy_pool_entry(entry);
+    }
+}
+
+/**
+ * gl_get_shader_language:
+ *
+ * Determines the preferred shading language. GLSL is used when
+ * available, ARB fragment programs otherwise.
+ *
+ * Return value: the preferred #GLShaderLanguage, or
+ *   %GL_SHADER_LANGUAGE_NONE if fragment shaders are not supported
+ */
+GLShaderLanguage
+gl_get_shader_language(void)
+{
+    GLVTable * const gl_vtable = gl_get_vtable();
+
+    if (!gl_vtable)
+        return GL_SHADER_LANGUAGE_NONE;
+    if (gl_vtable->has_shading_language)
+        return GL_SHADER_LANGUAGE_GLSL;
+    if (gl_vtable->has_fragment_program)
+        return GL_SHADER_LANGUAGE_ARB;
+    return GL_SHADER_LANGUAGE_NONE;
+}
+
 /**
  * gl_create_shader_object:
  * @shader_fp: the shader program source
@@ -1118,6 +2138,7 @@ gl_create_shader_object(
     so = calloc(1, sizeof(*so));
     if (!so)
         return NULL;
+    so->language = GL_SHADER_LANGUAGE_ARB;
 
     char *shader = malloc(shader_fp_length + 1);
     if (!shader)
@@ -1161,6 +2182,109 @@ error:
     return NULL;
 }
 
+/**
+ * gl_create_glsl_shader_object:
+ * @shader_fs: the GLSL fragment shader source
+ * @shader_fs_length: the total length of the fragment shader source
+ *
+ * Creates a shader object from the specified GLSL fragment shader
+ * source. Vertex processing is left to the fixed pipeline.
+ *
+ * The "textureN" sampler uniforms are bound to texture unit N, and
+ * the "params" uniform array of vec4 receives the parameters set
+ * with gl_set_shader_param(), so that shaders can be used the same
+ * way as ARB fragment programs.
+ *
+ * Return value: the newly created #GLShaderObject, or %NULL if
+ *   an error occurred
+ */
+GLShaderObject *
+gl_create_glsl_shader_object(
+    const char  **shader_fs,
+    unsigned int  shader_fs_length
+)
+{
+    GLVTable * const gl_vtable = gl_get_vtable();
+    GLShaderObject *so;
+    GLhandleARB fs = 0;
+    GLint status;
+    char name[32];
+    unsigned int i;
+
+    if (!gl_vtable || !gl_vtable->has_shading_language)
+        return NULL;
+
+    if (!shader_fs || !shader_fs_length)
+        return NULL;
+
+    so = calloc(1, sizeof(*so));
+    if (!so)
+        return NULL;
+    so->language = GL_SHADER_LANGUAGE_GLSL;
+
+    char *shader = malloc(shader_fs_length + 1);
+    if (!shader)
+        goto error;
+    string_array_to_char_array(shader, shader_fs);
+
+    const GLcharARB *sources[1] = { shader };
+    fs = gl_vtable->gl_create_shader(GL_FRAGMENT_SHADER_ARB);
+    gl_vtable->gl_shader_source(fs, 1, sources, NULL);
+    gl_vtable->gl_compile_shader(fs);
+    free(shader);
+
+    gl_vtable->gl_get_object_parameter_iv(
+        fs,
+        GL_OBJECT_COMPILE_STATUS_ARB,
+        &status
+    );
+    if (!status) {
+        char log[1024];
+        gl_vtable->gl_get_info_log(fs, sizeof(log), NULL, log);
+        D(bug("Error while compiling fragment shader: %s\n", log));
+        goto error;
+    }
+
+    so->shader = gl_vtable->gl_create_program();
+    gl_vtable->gl_attach_object(so->shader, fs);
+    gl_vtable->gl_link_program(so->shader);
+    gl_vtable->gl_delete_object(fs);
+    fs = 0;
+
+    gl_vtable->gl_get_object_parameter_iv(
+        so->shader,
+        GL_OBJECT_LINK_STATUS_ARB,
+        &status
+    );
+    if (!status) {
+        char log[1024];
+        gl_vtable->gl_get_info_log(so->shader, sizeof(log), NULL, log);
+        D(bug("Error while linking fragment shader: %s\n", log));
+        goto error;
+    }
+
+    /* Inactive uniforms yield -1 and are ignored afterwards */
+    gl_vtable->gl_use_program(so->shader);
+    for (i = 0; i < GL_SHADER_MAX_TEXTURES; i++) {
+        sprintf(name, "texture%u", i);
+        GLint location = gl_vtable->gl_get_uniform_location(so->shader, name);
+        if (location != -1)
+            gl_vtable->gl_uniform_1i(location, i);
+    }
+    for (i = 0; i < GL_SHADER_MAX_PARAMS; i++) {
+        sprintf(name, "params[%u]", i);
+        so->params[i] = gl_vtable->gl_get_uniform_location(so->shader, name);
+    }
+    gl_vtable->gl_use_program(0);
+    return so;
+
+error:
+    if (fs)
+        gl_vtable->gl_delete_object(fs);
+    gl_destroy_shader_object(so);
+    return NULL;
+}
+
 /**
  * gl_destroy_shader_object:
  * @fbo: a #GLShaderObject
@@ -1178,7 +2302,16 @@ gl_destroy_shader_object(GLShaderObject *so)
     gl_unbind_shader_object(so);
 
     if (so->shader) {
-        gl_vtable->gl_delete_programs(1, &so->shader);
+        switch (so->language) {
+        case GL_SHADER_LANGUAGE_ARB:
+            gl_vtable->gl_delete_programs(1, &so->shader);
+            break;
+        case GL_SHADER_LANGUAGE_GLSL:
+            gl_vtable->gl_delete_object(so->shader);
+            break;
+        default:
+            break;
+        }
         so->shader = 0;
     }
     free(so);
@@ -1200,8 +2333,17 @@ gl_bind_shader_object(GLShaderObject *so)
     if (so->is_bound)
         return 1;
 
-    glEnable(GL_FRAGMENT_PROGRAM);
-    gl_vtable->gl_bind_program(GL_FRAGMENT_PROGRAM, so->shader);
+    switch (so->language) {
+    case GL_SHADER_LANGUAGE_ARB:
+        glEnable(GL_FRAGMENT_PROGRAM);
+        gl_vtable->gl_bind_program(GL_FRAGMENT_PROGRAM, so->shader);
+        break;
+    case GL_SHADER_LANGUAGE_GLSL:
+        gl_vtable->gl_use_program(so->shader);
+        break;
+    default:
+        return 0;
+    }
 
     so->is_bound = 1;
     return 1;
@@ -1223,9 +2365,49 @@ gl_unbind_shader_object(GLShaderObject *so)
     if (!so->is_bound)
         return 1;
 
-    gl_vtable->gl_bind_program(GL_FRAGMENT_PROGRAM, 0);
-    glDisable(GL_FRAGMENT_PROGRAM);
+    switch (so->language) {
+    case GL_SHADER_LANGUAGE_ARB:
+        gl_vtable->gl_bind_program(GL_FRAGMENT_PROGRAM, 0);
+        glDisable(GL_FRAGMENT_PROGRAM);
+        break;
+    case GL_SHADER_LANGUAGE_GLSL:
+        gl_vtable->gl_use_program(0);
+        break;
+    default:
+        return 0;
+    }
 
     so->is_bound = 0;
     return 1;
 }
+
+/**
+ * gl_set_shader_param:
+ * @so: a bound #GLShaderObject
+ * @index: the parameter index
+ * @v: the 4 float values to load
+ *
+ * Loads program.local[@index] of ARB fragment programs, or the
+ * params[@index] uniform of GLSL shaders. Parameters that are not
+ * used by the shader are silently ignored.
+ */
+void
+gl_set_shader_param(GLShaderObject *so, unsigned int index, const float *v)
+{
+    GLVTable * const gl_vtable = gl_get_vtable();
+
+    if (index >= GL_SHADER_MAX_PARAMS)
+        return;
+
+    switch (so->language) {
+    case GL_SHADER_LANGUAGE_ARB:
+        gl_vtable->gl_program_local_parameter_4fv(GL_FRAGMENT_PROGRAM, index, v);
+        break;
+    case GL_SHADER_LANGUAGE_GLSL:
+        if (so->params[index] != -1)
+            gl_vtable->gl_uniform_4fv(so->params[index], 1, v);
+        break;
+    default:
+        break;
+    }
+}
@@ -112,10 +112,36 @@ void
 gl_set_current_context_cache(int is_enabled)
     attribute_hidden;
 
+int
+gl_push_context(GLContextState *cs)
+    attribute_hidden;
+
+void
+gl_pop_context(void)
+    attribute_hidden;
+
+typedef struct _GLContextStats GLContextStats;
+struct _GLContextStats {
+    unsigned int num_switches;
+    unsigned int num_skipped;
+};
+
+void
+gl_get_context_stats(GLContextStats *stats)
+    attribute_hidden;
+
 void
 gl_swap_buffers(GLContextState *cs)
     attribute_hidden;
 
+int
+gl_get_refresh_rate(GLContextState *cs, int *pnum, int *pden)
+    attribute_hidden;
+
+int
+gl_get_vblank(GLContextState *cs, uint64_t *ptime, int64_t *pmsc)
+    attribute_hidden;
+
 typedef struct _GLVTable GLVTable;
 struct _GLVTable {
     PFNGLGENFRAMEBUFFERSEXTPROC          gl_gen_framebuffers;
@@ -134,21 +160,79 @@ struct _GLVTable {
     PFNGLPROGRAMSTRINGARBPROC            gl_program_string;
     PFNGLGETPROGRAMIVARBPROC             gl_get_program_iv;
     PFNGLPROGRAMLOCALPARAMETER4FVARBPROC gl_program_local_parameter_4fv;
+    PFNGLCREATESHADEROBJECTARBPROC       gl_create_shader;
+    PFNGLSHADERSOURCEARBPROC             gl_shader_source;
+    PFNGLCOMPILESHADERARBPROC            gl_compile_shader;
+    PFNGLCREATEPROGRAMOBJECTARBPROC      gl_create_program;
+    PFNGLATTACHOBJECTARBPROC             gl_attach_object;
+    PFNGLLINKPROGRAMARBPROC              gl_link_program;
+    PFNGLUSEPROGRAMOBJECTARBPROC         gl_use_program;
+    PFNGLDELETEOBJECTARBPROC             gl_delete_object;
+    PFNGLGETOBJECTPARAMETERIVARBPROC     gl_get_object_parameter_iv;
+    PFNGLGETINFOLOGARBPROC               gl_get_info_log;
+    PFNGLGETUNIFORMLOCATIONARBPROC       gl_get_uniform_location;
+    PFNGLUNIFORM1IARBPROC                gl_uniform_1i;
+    PFNGLUNIFORM4FVARBPROC               gl_uniform_4fv;
     PFNGLACTIVETEXTUREPROC               gl_active_texture;
     PFNGLMULTITEXCOORD2FPROC             gl_multi_tex_coord_2f;
+    PFNGLXGETVIDEOSYNCSGIPROC            glx_get_video_sync;
+    PFNGLXWAITVIDEOSYNCSGIPROC           glx_wait_video_sync;
+    PFNGLXGETSYNCVALUESOMLPROC           glx_get_sync_values;
+    PFNGLXGETMSCRATEOMLPROC              glx_get_msc_rate;
+    PFNGLFENCESYNCPROC                   gl_fence_sync;
+    PFNGLDELETESYNCPROC                  gl_delete_sync;
+    PFNGLCLIENTWAITSYNCPROC              gl_client_wait_sync;
+    PFNGLGENFENCESNVPROC                 gl_gen_fences;
+    PFNGLDELETEFENCESNVPROC              gl_delete_fences;
+    PFNGLSETFENCENVPROC                  gl_set_fence;
+    PFNGLTESTFENCENVPROC                 gl_test_fence;
+    PFNGLGENBUFFERSARBPROC               gl_gen_buffers;
+    PFNGLDELETEBUFFERSARBPROC            gl_delete_buffers;
+    PFNGLBINDBUFFERARBPROC               gl_bind_buffer;
+    PFNGLBUFFERDATAARBPROC               gl_buffer_data;
+    PFNGLMAPBUFFERARBPROC                gl_map_buffer;
+    PFNGLUNMAPBUFFERARBPROC              gl_unmap_buffer;
     unsigned int                         has_texture_non_power_of_two   : 1;
     unsigned int                         has_texture_rectangle          : 1;
     unsigned int                         has_texture_float              : 1;
     unsigned int                         has_framebuffer_object         : 1;
     unsigned int                         has_fragment_program           : 1;
+    unsigned int                         has_shading_language           : 1;
     unsigned int                         has_multitexture               : 1;
     unsigned int                         has_gpu_shader5                : 1;
+    unsigned int                         has_video_sync                 : 1;
+    unsigned int                         has_sync_control               : 1;
+    unsigned int                         has_sync                       : 1;
+    unsigned int                         has_fence                      : 1;
+    unsigned int                         has_pixel_buffer_object        : 1;
 };
 
 GLVTable *
 gl_get_vtable(void)
     attribute_hidden;
 
+typedef struct _GLSync GLSync;
+
+GLSync *
+gl_create_sync(void)
+    attribute_hidden;
+
+GLSync *
+gl_ref_sync(GLSync *sync)
+    attribute_hidden;
+
+void
+gl_destroy_sync(GLSync *sync)
+    attribute_hidden;
+
+int
+gl_test_sync(GLSync *sync)
+    attribute_hidden;
+
+int
+gl_wait_sync(GLSync *sync, unsigned int timeout)
+    attribute_hidden;
+
 typedef struct _GLTextureObject GLTextureObject;
 struct _GLTextureObject {
     GLenum       target;
@@ -178,6 +262,45 @@ void
 gl_destroy_texture_object(GLTextureObject *to)
     attribute_hidden;
 
+typedef struct _GLAtlasShelf GLAtlasShelf;
+typedef struct _GLTextureAtlas GLTextureAtlas;
+struct _GLTextureAtlas {
+    GLenum        target;
+    GLenum        format;
+    GLuint        texture;
+    unsigned int  width;
+    unsigned int  height;
+    GLAtlasShelf *shelves;
+    unsigned int  shelves_count;
+    unsigned int  shelves_count_max;
+    unsigned int  shelves_height;
+};
+
+GLTextureAtlas *
+gl_create_texture_atlas(
+    GLenum       target,
+    GLenum       format,
+    unsigned int width,
+    unsigned int height
+) attribute_hidden;
+
+void
+gl_destroy_texture_atlas(GLTextureAtlas *atlas)
+    attribute_hidden;
+
+int
+gl_texture_atlas_alloc(
+    GLTextureAtlas *atlas,
+    unsigned int    width,
+    unsigned int    height,
+    unsigned int   *px,
+    unsigned int   *py
+) attribute_hidden;
+
+void
+gl_texture_atlas_free(GLTextureAtlas *atlas, unsigned int x, unsigned int y)
+    attribute_hidden;
+
 typedef struct _GLFramebufferObject GLFramebufferObject;
 struct _GLFramebufferObject {
     unsigned int    width;
@@ -206,18 +329,78 @@ int
 gl_unbind_framebuffer_object(GLFramebufferObject *fbo)
     attribute_hidden;
 
+typedef struct _GLResourcePool GLResourcePool;
+
+GLResourcePool *
+gl_resource_pool_new(unsigned int max_size)
+    attribute_hidden;
+
+GLResourcePool *
+gl_resource_pool_ref(GLResourcePool *pool)
+    attribute_hidden;
+
+void
+gl_resource_pool_unref(GLResourcePool *pool)
+    attribute_hidden;
+
+GLuint
+gl_resource_pool_get_texture(
+    GLResourcePool       *pool,
+    GLenum                target,
+    GLenum                format,
+    unsigned int          width,
+    unsigned int          height,
+    GLFramebufferObject **pfbo
+) attribute_hidden;
+
+void
+gl_resource_pool_put_texture(
+    GLResourcePool       *pool,
+    GLenum                target,
+    GLenum                format,
+    GLuint                texture,
+    unsigned int          width,
+    unsigned int          height,
+    GLFramebufferObject  *fbo
+) attribute_hidden;
+
+/* Maximum number of program parameters, i.e. program.local[] for ARB
+   fragment programs or the "params" uniform array for GLSL shaders */
+#define GL_SHADER_MAX_PARAMS 16
+
+/* Maximum number of samplers bound by GLSL shaders */
+#define GL_SHADER_MAX_TEXTURES 4
+
+typedef enum {
+    GL_SHADER_LANGUAGE_NONE = 0,
+    GL_SHADER_LANGUAGE_ARB,
+    GL_SHADER_LANGUAGE_GLSL
+} GLShaderLanguage;
+
 typedef struct _GLShaderObject GLShaderObject;
 struct _GLShaderObject {
+    GLShaderLanguage language;
     GLuint          shader;
+    GLint           params[GL_SHADER_MAX_PARAMS];
     unsigned int    is_bound    : 1;
 };
 
+GLShaderLanguage
+gl_get_shader_language(void)
+    attribute_hidden;
+
 GLShaderObject *
 gl_create_shader_object(
     const char  **shader_fp,
     unsigned int  shader_fp_length
 ) attribute_hidden;
 
+GLShaderObject *
+gl_create_glsl_shader_object(
+    const char  **shader_fs,
+    unsigned int  shader_fs_length
+) attribute_hidden;
+
 void
 gl_destroy_shader_object(GLShaderObject *so)
     attribute_hidden;
@@ -230,4 +413,8 @@ int
 gl_unbind_shader_object(GLShaderObject *so)
     attribute_hidden;
 
+void
+gl_set_shader_param(GLShaderObject *so, unsigned int index, const float *v)
+    attribute_hidden;
+
 #endif /* UTILS_GLX_H */
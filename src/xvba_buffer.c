@@ -24,6 +24,7 @@
 #include "xvba_decode.h"
 #include "xvba_video.h"
 #include "xvba_dump.h"
+#include "xvba_image.h"
 #include "fglrxinfo.h"
 #include <math.h>
 
@@ -209,6 +210,8 @@ create_va_buffer(
     obj_buffer->buffer_size      = size * num_elements;
     obj_buffer->buffer_data      = malloc(obj_buffer->buffer_size);
     obj_buffer->mtime            = 0;
+    obj_buffer->derived_surface  = VA_INVALID_ID;
+    obj_buffer->map_count        = 0;
 
     if (!obj_buffer->buffer_data) {
         destroy_va_buffer(driver_data, obj_buffer);
@@ -892,6 +895,14 @@ xvba_MapBuffer(
     if (!obj_buffer)
         return VA_STATUS_ERROR_INVALID_BUFFER;
 
+    /* Derived images get the surface pixels only once they are mapped */
+    if (obj_buffer->derived_surface != VA_INVALID_ID) {
+        VAStatus status = sync_derived_image(driver_data,
+                                             obj_buffer->derived_surface);
+        if (status != VA_STATUS_SUCCESS)
+            return status;
+    }
+
     if (pbuf)
         *pbuf = obj_buffer->buffer_data;
 
@@ -899,6 +910,7 @@ xvba_MapBuffer(
         return VA_STATUS_ERROR_UNKNOWN;
 
     ++obj_buffer->mtime;
+    ++obj_buffer->map_count;
     return VA_STATUS_SUCCESS;
 }
 
@@ -915,7 +927,13 @@ xvba_UnmapBuffer(
     if (!obj_buffer)
         return VA_STATUS_ERROR_INVALID_BUFFER;
 
+    if (obj_buffer->map_count > 0)
+        --obj_buffer->map_count;
     ++obj_buffer->mtime;
+
+    /* Pixels written into derived images go to their surface */
+    if (obj_buffer->derived_surface != VA_INVALID_ID)
+        return commit_derived_image(driver_data, obj_buffer->derived_surface);
     return VA_STATUS_SUCCESS;
 }
 
@@ -33,6 +33,8 @@ struct object_buffer {
     unsigned int        max_num_elements;
     unsigned int        num_elements;
     uint64_t            mtime;
+    VASurfaceID         derived_surface; /* read back on vaMapBuffer() */
+    unsigned int        map_count;       /* vaMapBuffer() not unmapped yet */
 };
 
 // Create VA buffer object
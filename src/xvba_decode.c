@@ -25,6 +25,7 @@
 #include "xvba_buffer.h"
 #include "xvba_dump.h"
 #include "xvba_image.h"
+#include "xvba_readback.h"
 #include "utils.h"
 
 #define DEBUG 1
@@ -236,6 +237,7 @@ destroy_decoder(xvba_driver_data_t *driver_data, object_context_p obj_context)
 {
     if (!obj_context->xvba_decoder)
         return;
+    readback_cancel_session(driver_data, obj_context->xvba_decoder);
     xvba_destroy_decode_session(obj_context->xvba_decoder);
     if (obj_context->xvba_session == obj_context->xvba_decoder)
         obj_context->xvba_session = NULL;
@@ -420,30 +422,36 @@ decode_picture(
     XVBASession * const xvba_decoder = obj_context->xvba_decoder;
     XVBABufferDescriptor *xvba_buffers[2];
     unsigned int i, n_buffers;
+    VAStatus status = VA_STATUS_ERROR_UNKNOWN;
 
+    /* The readback thread may query surfaces of the same session */
+    pthread_mutex_lock(&driver_data->decode_lock);
     if (xvba_decode_picture_start(xvba_decoder, obj_surface->xvba_surface) < 0)
-        return VA_STATUS_ERROR_UNKNOWN;
+        goto end;
 
     n_buffers = 0;
     xvba_buffers[n_buffers++] = obj_surface->pic_desc_buffer;
     if (obj_surface->iq_matrix_buffer)
         xvba_buffers[n_buffers++] = obj_surface->iq_matrix_buffer;
     if (xvba_decode_picture(xvba_decoder, xvba_buffers, n_buffers) < 0)
-        return VA_STATUS_ERROR_UNKNOWN;
+        goto end;
 
     for (i = 0; i < obj_surface->data_ctrl_buffers_count; i++) {
         n_buffers                 = 0;
         xvba_buffers[n_buffers++] = obj_surface->data_buffer;
         xvba_buffers[n_buffers++] = obj_surface->data_ctrl_buffers[i];
         if (xvba_decode_picture(xvba_decoder, xvba_buffers, n_buffers) < 0)
-            return VA_STATUS_ERROR_UNKNOWN;
+            goto end;
     }
 
     if (xvba_decode_picture_end(xvba_decoder) < 0)
-        return VA_STATUS_ERROR_UNKNOWN;
+        goto end;
 
     obj_surface->va_surface_status = VASurfaceRendering;
-    return 0;
+    status = VA_STATUS_SUCCESS;
+end:
+    pthread_mutex_unlock(&driver_data->decode_lock);
+    return status;
 }
 
 // Translate picture buffers and send it to the HW for decoding
@@ -622,6 +630,7 @@ xvba_BeginPicture(
     obj_context->current_render_target = obj_surface->base.id;
     obj_surface->va_surface_status     = VASurfaceRendering;
     obj_surface->used_for_decoding     = 1;
+    surface_update_mtime(obj_surface);
 
     ASSERT(!obj_context->va_buffers_count);
     destroy_va_buffers(driver_data, obj_context);
@@ -707,6 +716,8 @@ xvba_EndPicture(
 
     /* Send picture bits to the HW and free VA resources (buffers) */
     VAStatus va_status = commit_picture(driver_data, obj_context, obj_surface);
+    if (va_status == VA_STATUS_SUCCESS)
+        readback_queue_surface(driver_data, obj_context, obj_surface);
 
     /* XXX: assume we are done with rendering right away */
     obj_context->current_render_target = VA_INVALID_SURFACE;
@@ -23,6 +23,7 @@
 #include "xvba_buffer.h"
 #include "xvba_decode.h"
 #include "xvba_image.h"
+#include "xvba_readback.h"
 #include "xvba_subpic.h"
 #include "xvba_video.h"
 #include "xvba_video_x11.h"
@@ -111,6 +112,18 @@ static void xvba_common_Terminate(xvba_driver_data_t *driver_data)
         driver_data->xvba_surface_caps_count = 0;
     }
 
+    readback_engine_destroy(driver_data);
+
+#if USE_GLX
+    glx_readback_destroy(driver_data);
+#endif
+
+    if (driver_data->getimage_staging) {
+        free(driver_data->getimage_staging);
+        driver_data->getimage_staging = NULL;
+        driver_data->getimage_staging_size = 0;
+    }
+
     DESTROY_HEAP(buffer,        destroy_buffer_cb);
     DESTROY_HEAP(output,        NULL);
     DESTROY_HEAP(image,         NULL);
@@ -125,6 +138,7 @@ static void xvba_common_Terminate(xvba_driver_data_t *driver_data)
     }
 
     xvba_gate_exit();
+    pthread_mutex_destroy(&driver_data->decode_lock);
 }
 
 // vaInitialize
@@ -134,6 +148,8 @@ static VAStatus xvba_common_Initialize(xvba_driver_data_t *driver_data)
     int fglrx_major_version, fglrx_minor_version, fglrx_micro_version;
     unsigned int device_id;
 
+    pthread_mutex_init(&driver_data->decode_lock, NULL);
+
     driver_data->x11_dpy_local = XOpenDisplay(driver_data->x11_dpy_name);
     if (!driver_data->x11_dpy_local)
         return VA_STATUS_ERROR_UNKNOWN;
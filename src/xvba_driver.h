@@ -26,6 +26,7 @@
 #include "xvba_gate.h"
 #include "object_heap.h"
 #include "color_matrix.h"
+#include <pthread.h>
 
 #define XVBA_DRIVER_DATA_INIT                           \
         struct xvba_driver_data *driver_data =          \
@@ -56,6 +57,7 @@
 #define XVBA_MAX_CONFIG_ATTRIBUTES      10
 #define XVBA_MAX_IMAGE_FORMATS          10
 #define XVBA_MAX_DISPLAY_ATTRIBUTES     6
+#define XVBA_MAX_RENDER_THREADS         8
 #define XVBA_STR_DRIVER_VENDOR          "Splitted-Desktop Systems"
 #define XVBA_STR_DRIVER_NAME            "XvBA backend for VA-API"
 
@@ -73,6 +75,13 @@ struct xvba_driver_data {
     const char                 *x11_dpy_name;
     int                         x11_screen;
     Display                    *x11_dpy_local;
+    struct glx_render_thread   *glx_render_threads[XVBA_MAX_RENDER_THREADS];
+    struct glx_subpicture_atlas *glx_subpicture_atlas;
+    struct glx_readback        *glx_readback;
+    struct ReadbackEngine      *readback_engine;
+    pthread_mutex_t             decode_lock; /* decode sessions calls */
+    uint8_t                    *getimage_staging;
+    unsigned int                getimage_staging_size;
     XVBADecodeCap              *xvba_decode_caps;
     unsigned int                xvba_decode_caps_count;
     XVBASurfaceCap             *xvba_surface_caps;
@@ -30,7 +30,7 @@
 
 #define XVBA_FAKE                       XVBA_FOURCC('F','A','K','E')
 #define XVBA_MAX_SUBPICTURES            16
-#define XVBA_MAX_SUBPICTURE_FORMATS     3
+#define XVBA_MAX_SUBPICTURE_FORMATS     5
 
 typedef struct _XVBAContext {
     void                       *context;
@@ -24,6 +24,11 @@
 #include "xvba_buffer.h"
 #include "xvba_decode.h"
 #include "xvba_dump.h"
+#include "xvba_readback.h"
+#include "image_convert.h"
+#if USE_GLX
+#include "xvba_video_glx.h"
+#endif
 
 #define DEBUG 1
 #include "debug.h"
@@ -39,6 +44,8 @@ static const xvba_image_format_map_t xvba_image_formats_map[] = {
     { XVBA_NV12, { VA_FOURCC('N','V','1','2'), VA_LSB_FIRST, 12 } },
     { XVBA_YV12, { VA_FOURCC('Y','V','1','2'), VA_LSB_FIRST, 12 } },
     { XVBA_YV12, { VA_FOURCC('I','4','2','0'), VA_LSB_FIRST, 12 } },
+    { XVBA_YUY2, { VA_FOURCC('Y','U','Y','2'), VA_LSB_FIRST, 16 } },
+    { XVBA_FAKE, { VA_FOURCC('U','Y','V','Y'), VA_LSB_FIRST, 16 } },
     { XVBA_ARGB, { VA_FOURCC('B','G','R','A'), VA_LSB_FIRST, 32,
                    32, 0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000 } },
     { XVBA_FAKE, { VA_FOURCC('R','G','B','A'), VA_LSB_FIRST, 32,
@@ -115,6 +122,78 @@ is_supported_format(xvba_driver_data_t *driver_data, uint32_t format)
     return 0;
 }
 
+// Gets the format vaPutImage() pixels of FORMAT are kept as
+static void
+get_upload_format(const VAImageFormat *format, VAImageFormat *upload_format)
+{
+    unsigned int i;
+
+    *upload_format = *format;
+
+    /* Packed YUV is not rendered by the shaders, so convert it to NV12 */
+    if (format->fourcc != VA_FOURCC('Y','U','Y','2') &&
+        format->fourcc != VA_FOURCC('U','Y','V','Y'))
+        return;
+
+    for (i = 0; xvba_image_formats_map[i].format != 0; i++) {
+        const VAImageFormat * const f = &xvba_image_formats_map[i].va_format;
+        if (f->fourcc == VA_FOURCC('N','V','1','2')) {
+            *upload_format = *f;
+            break;
+        }
+    }
+}
+
+static VAStatus
+copy_image_convert(
+    xvba_driver_data_t *driver_data,
+    object_image_p      dst_obj_image,
+    object_image_p      src_obj_image
+);
+
+// Fill image with black pixels
+static VAStatus
+clear_image(xvba_driver_data_t *driver_data, object_image_p obj_image)
+{
+    object_buffer_p obj_buffer = XVBA_BUFFER(obj_image->image.buf);
+    if (!obj_buffer)
+        return VA_STATUS_ERROR_INVALID_BUFFER;
+
+    const VAImage * const image = &obj_image->image;
+    uint8_t * const data = obj_buffer->buffer_data;
+    unsigned int i;
+
+    /* Shadow images are never packed YUV, see get_upload_format() */
+    if (is_yuv_format(&image->format)) {
+        ASSERT(image->num_planes > 1);
+        for (i = 0; i < image->num_planes; i++) {
+            const unsigned int end = (i + 1 < image->num_planes ?
+                                      image->offsets[i + 1] :
+                                      image->data_size);
+            memset(data + image->offsets[i], i > 0 ? 128 : 16,
+                   end - image->offsets[i]);
+        }
+    }
+    else if (image->format.alpha_mask) {
+        /* Pixels are blended on rendering, so keep them opaque */
+        uint32_t * const pixels = (uint32_t *)data;
+        ASSERT(image->format.bits_per_pixel == 32);
+        for (i = 0; i < image->data_size / 4; i++)
+            pixels[i] = image->format.alpha_mask;
+    }
+    else
+        memset(data, 0, image->data_size);
+
+    VARectangle rect;
+    rect.x      = 0;
+    rect.y      = 0;
+    rect.width  = image->width;
+    rect.height = image->height;
+    obj_image->damage.src_image = VA_INVALID_ID;
+    image_damage_rect(obj_image, obj_buffer, &rect);
+    return VA_STATUS_SUCCESS;
+}
+
 // Enable "PutImage hacks", this reinitializes the XvBA state
 static VAStatus
 putimage_hacks_enable(
@@ -139,21 +218,45 @@ putimage_hacks_enable(
     }
 
     if (type == PUTIMAGE_HACKS_IMAGE) {
-        if (h->obj_image &&
-            !compare_image_formats(&h->obj_image->image.format, &obj_image->image.format)) {
-            destroy_image(driver_data, h->obj_image);
+        VAImageFormat upload_format;
+        get_upload_format(&obj_image->image.format, &upload_format);
+
+        /* Pixels of other formats get converted into the shadow image
+           when they are put. So, it's only replaced if they can't be */
+        object_image_p old_obj_image = h->obj_image;
+        if (old_obj_image &&
+            !compare_image_formats(&old_obj_image->image.format, &upload_format) &&
+            !image_convert_is_supported(old_obj_image->image.format.fourcc,
+                                        upload_format.fourcc))
             h->obj_image = NULL;
-        }
+        else
+            old_obj_image = NULL;
 
         if (!h->obj_image) {
             h->obj_image = create_image(
                 driver_data,
                 obj_surface->width,
                 obj_surface->height,
-                &obj_image->image.format
+                &upload_format
             );
-            if (!h->obj_image)
+            if (!h->obj_image) {
+                h->obj_image = old_obj_image;
                 return VA_STATUS_ERROR_ALLOCATION_FAILED;
+            }
+
+            /* Keep the pixels put so far, regions may be put next */
+            VAStatus status;
+            if (old_obj_image &&
+                image_convert_is_supported(upload_format.fourcc,
+                                           old_obj_image->image.format.fourcc))
+                status = copy_image_convert(driver_data, h->obj_image,
+                                            old_obj_image);
+            else
+                status = clear_image(driver_data, h->obj_image);
+            if (old_obj_image)
+                destroy_image(driver_data, old_obj_image);
+            if (status != VA_STATUS_SUCCESS)
+                return status;
         }
         ASSERT(h->obj_image->image.width == obj_surface->width);
         ASSERT(h->obj_image->image.height == obj_surface->height);
@@ -302,6 +405,16 @@ create_image(
     VAImage * const image = &obj_image->image;
     image->image_id       = image_id;
     image->buf            = VA_INVALID_ID;
+    memset(&obj_image->damage, 0, sizeof(obj_image->damage));
+    obj_image->damage.src_image = VA_INVALID_ID;
+    obj_image->palette          = NULL;
+    obj_image->palette_serial   = 0;
+    obj_image->derived_surface  = VA_INVALID_ID;
+    obj_image->derived_refs     = 0;
+    obj_image->derived_mtime    = 0;
+    obj_image->derived_serial   = 0;
+    image->num_palette_entries  = 0;
+    image->entry_bytes          = 0;
 
     /* XXX: we align size to 16-pixel boundaries because the image may
        be used to retrieve XvBA surface pixels and this requires exact
@@ -355,6 +468,13 @@ create_image(
         image->offsets[0] = 0;
         image->data_size  = image->pitches[0] * aheight;
         break;
+    case VA_FOURCC('U','Y','V','Y'):
+        xvba_format       = XVBA_NONE;
+        image->num_planes = 1;
+        image->pitches[0] = awidth * 2;
+        image->offsets[0] = 0;
+        image->data_size  = image->pitches[0] * aheight;
+        break;
     case VA_FOURCC('B','G','R','A'):
         if (format->bits_per_pixel != 32)
             goto error;
@@ -373,13 +493,43 @@ create_image(
         image->offsets[0] = 0;
         image->data_size  = image->pitches[0] * aheight;
         break;
+    case VA_FOURCC('I','A','4','4'):
+    case VA_FOURCC('A','I','4','4'):
+        xvba_format       = XVBA_NONE;
+        image->num_planes = 1;
+        image->pitches[0] = awidth;
+        image->offsets[0] = 0;
+        image->data_size  = image->pitches[0] * aheight;
+        image->num_palette_entries = 16;
+        break;
+    case VA_FOURCC('I','A','8','8'):
+        xvba_format       = XVBA_NONE;
+        image->num_planes = 1;
+        image->pitches[0] = awidth * 2;
+        image->offsets[0] = 0;
+        image->data_size  = image->pitches[0] * aheight;
+        image->num_palette_entries = 256;
+        break;
     default:
         goto error;
     }
+
+    /* Palettes are kept as RGBA so that they map to a GL texture */
+    if (image->num_palette_entries > 0) {
+        obj_image->palette = calloc(image->num_palette_entries, 4);
+        if (!obj_image->palette)
+            goto error;
+        image->entry_bytes          = 3;
+        image->component_order[0]   = 'R';
+        image->component_order[1]   = 'G';
+        image->component_order[2]   = 'B';
+        image->component_order[3]   = '\0';
+    }
     obj_image->xvba_format = xvba_format;
     obj_image->xvba_width  = awidth;
     obj_image->xvba_height = aheight;
     obj_image->hw.mtime    = 0;
+    obj_image->hw.serial   = 0;
     obj_image->hw.xvba     = NULL;
     obj_image->hw.glx      = NULL;
 
@@ -398,10 +548,6 @@ create_image(
     image->format		= *format;
     image->width		= width;
     image->height		= height;
-
-    /* XXX: no paletted formats supported yet */
-    image->num_palette_entries	= 0;
-    image->entry_bytes		= 0;
     return obj_image;
 
 error:
@@ -419,9 +565,331 @@ destroy_image(
     obj_image->image.image_id = VA_INVALID_ID;
     destroy_hw_image(driver_data, obj_image);
     destroy_va_buffer(driver_data, XVBA_BUFFER(obj_image->image.buf));
+    free(obj_image->damage.hashes);
+    obj_image->damage.hashes = NULL;
+    free(obj_image->damage.serials);
+    obj_image->damage.serials = NULL;
+    free(obj_image->palette);
+    obj_image->palette = NULL;
     object_heap_free(&driver_data->image_heap, (object_base_p)obj_image);
 }
 
+// Get the layout of image planes
+unsigned int
+get_image_planes(object_image_p obj_image, ImagePlane *planes)
+{
+    const VAImage * const image = &obj_image->image;
+    unsigned int i;
+
+    /* Chroma planes are subsampled in both directions */
+    for (i = 0; i < image->num_planes; i++) {
+        ImagePlane * const plane = &planes[i];
+        plane->offset = image->offsets[i];
+        plane->pitch  = image->pitches[i];
+        plane->shift  = i > 0;
+        plane->cpp    = plane->pitch / (obj_image->xvba_width >> plane->shift);
+    }
+    return image->num_planes;
+}
+
+// Copy RECT between two buffers laid out as IMAGE
+void
+copy_image_rect(
+    object_image_p      obj_image,
+    uint8_t            *dst,
+    const uint8_t      *src,
+    const VARectangle  *rect
+)
+{
+    ImagePlane planes[3];
+    unsigned int i, y, num_planes;
+
+    num_planes = get_image_planes(obj_image, planes);
+    for (i = 0; i < num_planes; i++) {
+        const ImagePlane * const plane = &planes[i];
+        const unsigned int x0 = rect->x >> plane->shift;
+        const unsigned int y0 = rect->y >> plane->shift;
+        const unsigned int x1 = (rect->x + rect->width)  >> plane->shift;
+        const unsigned int y1 = (rect->y + rect->height) >> plane->shift;
+        const unsigned int offset = plane->offset + x0 * plane->cpp;
+        const unsigned int size   = (x1 - x0) * plane->cpp;
+        for (y = y0; y < y1; y++)
+            memcpy(dst + offset + y * plane->pitch,
+                   src + offset + y * plane->pitch,
+                   size);
+    }
+}
+
+#define TILE_HASH_INIT  UINT64_C(0xcbf29ce484222325)
+#define TILE_HASH_PRIME UINT64_C(0x100000001b3)
+
+// Hash N bytes, a word at a time
+static inline uint64_t
+hash_bytes(uint64_t hash, const uint8_t *p, unsigned int n)
+{
+    uint64_t v;
+
+    for (; n >= sizeof(v); n -= sizeof(v), p += sizeof(v)) {
+        memcpy(&v, p, sizeof(v));
+        hash  = (hash ^ v) * TILE_HASH_PRIME;
+        hash ^= hash >> 29;
+    }
+    for (; n > 0; n--)
+        hash = (hash ^ *p++) * TILE_HASH_PRIME;
+    return hash;
+}
+
+// Allocate tiles of image damage
+static int image_damage_ensure(object_image_p obj_image)
+{
+    ImageDamage * const damage = &obj_image->damage;
+    unsigned int num_tiles;
+
+    if (damage->hashes)
+        return 1;
+
+    damage->tiles_x = (obj_image->xvba_width  + IMAGE_TILE_SIZE - 1) / IMAGE_TILE_SIZE;
+    damage->tiles_y = (obj_image->xvba_height + IMAGE_TILE_SIZE - 1) / IMAGE_TILE_SIZE;
+    num_tiles       = damage->tiles_x * damage->tiles_y;
+
+    /* Hashes start as zero, so that all tiles are damaged by the first scan */
+    damage->hashes  = calloc(num_tiles, sizeof(*damage->hashes));
+    damage->serials = calloc(num_tiles, sizeof(*damage->serials));
+    if (!damage->hashes || !damage->serials) {
+        free(damage->hashes);
+        damage->hashes = NULL;
+        free(damage->serials);
+        damage->serials = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+// Rehash rows of tiles [TY0, TY1) and damage the ones that changed
+static void
+image_damage_scan(
+    object_image_p      obj_image,
+    const uint8_t      *data,
+    unsigned int        ty0,
+    unsigned int        ty1
+)
+{
+    ImageDamage * const damage = &obj_image->damage;
+    const unsigned int serial = damage->serial + 1;
+    uint64_t hashes[damage->tiles_x];
+    ImagePlane planes[3];
+    unsigned int i, x, y, tx, ty, num_planes;
+    int is_damaged = 0;
+
+    num_planes = get_image_planes(obj_image, planes);
+    for (ty = ty0; ty < ty1; ty++) {
+        for (tx = 0; tx < damage->tiles_x; tx++)
+            hashes[tx] = TILE_HASH_INIT;
+
+        /* Walk the buffer row by row, so that it is read sequentially */
+        for (i = 0; i < num_planes; i++) {
+            const ImagePlane * const plane = &planes[i];
+            const unsigned int tile_size = (IMAGE_TILE_SIZE >> plane->shift) * plane->cpp;
+            const unsigned int row_size  = (obj_image->xvba_width >> plane->shift) * plane->cpp;
+            const unsigned int y0 = (ty * IMAGE_TILE_SIZE) >> plane->shift;
+            const unsigned int y1 = MIN((ty + 1) * IMAGE_TILE_SIZE,
+                                        obj_image->xvba_height) >> plane->shift;
+            for (y = y0; y < y1; y++) {
+                const uint8_t * const row = data + plane->offset + y * plane->pitch;
+                for (tx = 0, x = 0; tx < damage->tiles_x; tx++, x += tile_size)
+                    hashes[tx] = hash_bytes(hashes[tx], row + x,
+                                            MIN(tile_size, row_size - x));
+            }
+        }
+
+        for (tx = 0; tx < damage->tiles_x; tx++) {
+            const unsigned int n = ty * damage->tiles_x + tx;
+            if (damage->hashes[n] != hashes[tx]) {
+                damage->hashes[n]  = hashes[tx];
+                damage->serials[n] = serial;
+                is_damaged         = 1;
+            }
+        }
+    }
+    if (is_damaged)
+        damage->serial = serial;
+}
+
+// Update damage of image from a tile-hash diff of its buffer
+void
+image_damage_update(
+    object_image_p      obj_image,
+    object_buffer_p     obj_buffer
+)
+{
+    ImageDamage * const damage = &obj_image->damage;
+
+    if (damage->hashes && damage->mtime == obj_buffer->mtime)
+        return;
+
+    /* Without tiles, the whole image is considered damaged */
+    if (!image_damage_ensure(obj_image))
+        return;
+
+    image_damage_scan(obj_image, obj_buffer->buffer_data, 0, damage->tiles_y);
+    damage->mtime = obj_buffer->mtime;
+}
+
+// Update damage of image for RECT written by the driver, and touch buffer
+void
+image_damage_rect(
+    object_image_p      obj_image,
+    object_buffer_p     obj_buffer,
+    const VARectangle  *rect
+)
+{
+    ImageDamage * const damage = &obj_image->damage;
+    unsigned int ty0, ty1;
+
+    /* Other tiles are known to be unchanged only if the hashes were
+       up-to-date. Otherwise, the next update rescans the whole image */
+    const int is_clean = damage->hashes && damage->mtime == obj_buffer->mtime;
+    ++obj_buffer->mtime;
+    if (!is_clean)
+        return;
+
+    ty0 = rect->y / IMAGE_TILE_SIZE;
+    ty1 = (rect->y + rect->height + IMAGE_TILE_SIZE - 1) / IMAGE_TILE_SIZE;
+    image_damage_scan(obj_image, obj_buffer->buffer_data,
+                      ty0, MIN(ty1, damage->tiles_y));
+    damage->mtime = obj_buffer->mtime;
+}
+
+// Mark tiles of DST copied from SRC as damaged
+static void
+image_damage_copy(
+    object_image_p      dst_obj_image,
+    object_buffer_p     dst_obj_buffer,
+    object_image_p      src_obj_image,
+    unsigned int        serial
+)
+{
+    ImageDamage * const dst_damage = &dst_obj_image->damage;
+    const ImageDamage * const src_damage = &src_obj_image->damage;
+    unsigned int i, num_tiles;
+    int is_damaged = 0;
+
+    /* Unchanged tiles can only be recognized if DST hashes were valid */
+    const int is_clean = (
+        dst_damage->hashes &&
+        dst_damage->mtime == dst_obj_buffer->mtime
+    );
+
+    ++dst_obj_buffer->mtime;
+    dst_damage->src_image  = src_obj_image->base.id;
+    dst_damage->src_serial = src_damage->serial;
+
+    if (!src_damage->hashes ||
+        src_obj_image->xvba_width  != dst_obj_image->xvba_width ||
+        src_obj_image->xvba_height != dst_obj_image->xvba_height ||
+        !image_damage_ensure(dst_obj_image))
+        return;
+
+    num_tiles = dst_damage->tiles_x * dst_damage->tiles_y;
+    for (i = 0; i < num_tiles; i++) {
+        if (src_damage->serials[i] <= serial)
+            continue;
+        if (is_clean && dst_damage->hashes[i] == src_damage->hashes[i])
+            continue;
+        dst_damage->hashes[i]  = src_damage->hashes[i];
+        dst_damage->serials[i] = dst_damage->serial + 1;
+        is_damaged             = 1;
+    }
+    if (is_damaged || !is_clean)
+        dst_damage->serial++;
+    if (!is_clean) {
+        for (i = 0; i < num_tiles; i++)
+            dst_damage->serials[i] = dst_damage->serial;
+    }
+    dst_damage->mtime = dst_obj_buffer->mtime;
+}
+
+// Get the rectangles of image that changed since SERIAL
+unsigned int
+image_damage_get_rects(
+    object_image_p      obj_image,
+    unsigned int        serial,
+    VARectangle        *rects,
+    unsigned int        max_rects
+)
+{
+    const ImageDamage * const damage = &obj_image->damage;
+    unsigned int i, tx, ty, x0, x1, y1, n = 0;
+    unsigned int bx0 = -1, by0 = -1, bx1 = 0, by1 = 0;
+    int is_overflow = 0;
+
+    if (max_rects == 0)
+        return 0;
+
+    /* Without tiles, the whole image is considered damaged */
+    if (!damage->hashes) {
+        rects[0].x      = 0;
+        rects[0].y      = 0;
+        rects[0].width  = obj_image->xvba_width;
+        rects[0].height = obj_image->xvba_height;
+        return 1;
+    }
+
+    if (damage->serial <= serial)
+        return 0;
+
+    /* Merge runs of damaged tiles on a row, then runs spanning the
+       same columns on consecutive rows */
+    for (ty = 0; ty < damage->tiles_y; ty++) {
+        const unsigned int * const serials = &damage->serials[ty * damage->tiles_x];
+        for (tx = 0; tx < damage->tiles_x; tx++) {
+            if (serials[tx] <= serial)
+                continue;
+            for (x0 = tx; tx < damage->tiles_x && serials[tx] > serial; tx++)
+                ;
+            x1  = MIN(tx * IMAGE_TILE_SIZE, obj_image->xvba_width);
+            y1  = MIN((ty + 1) * IMAGE_TILE_SIZE, obj_image->xvba_height);
+            x0 *= IMAGE_TILE_SIZE;
+            bx0 = MIN(bx0, x0);
+            by0 = MIN(by0, ty * IMAGE_TILE_SIZE);
+            bx1 = MAX(bx1, x1);
+            by1 = MAX(by1, y1);
+            if (is_overflow)
+                continue;
+
+            for (i = 0; i < n; i++) {
+                VARectangle * const r = &rects[i];
+                if (r->x == x0 && r->x + r->width == x1 &&
+                    r->y + r->height == ty * IMAGE_TILE_SIZE) {
+                    r->height = y1 - r->y;
+                    break;
+                }
+            }
+            if (i < n)
+                continue;
+            if (n == max_rects) {
+                is_overflow = 1;
+                continue;
+            }
+            rects[n].x      = x0;
+            rects[n].y      = ty * IMAGE_TILE_SIZE;
+            rects[n].width  = x1 - x0;
+            rects[n].height = y1 - rects[n].y;
+            n++;
+        }
+    }
+
+    /* Too many rectangles, fallback to their bounding box */
+    if (is_overflow) {
+        rects[0].x      = bx0;
+        rects[0].y      = by0;
+        rects[0].width  = bx1 - bx0;
+        rects[0].height = by1 - by0;
+        n = 1;
+    }
+    return n;
+}
+
 #if USE_GLX
 const HWImageHooks hw_image_hooks_glx attribute_hidden;
 #endif
@@ -447,9 +915,11 @@ commit_hw_image(
        NOTE: this assumes the user really unmaps the buffer when he is
        done with it, as it is actually required */
     if (obj_image->hw.mtime < obj_buffer->mtime) {
+        image_damage_update(obj_image, obj_buffer);
 #if USE_GLX
         if (flags & HWIMAGE_TYPE_GLX) {
             if (!obj_image->hw.glx) {
+                obj_image->hw.serial = 0;
                 ASSERT(hw_image_hooks_glx.create);
                 status = hw_image_hooks_glx.create(
                     driver_data,
@@ -470,7 +940,8 @@ commit_hw_image(
                 return status;
         }
 #endif
-        obj_image->hw.mtime = obj_buffer->mtime;
+        obj_image->hw.mtime  = obj_buffer->mtime;
+        obj_image->hw.serial = obj_image->damage.serial;
     }
     return VA_STATUS_SUCCESS;
 }
@@ -516,12 +987,52 @@ copy_image(
 
     /* XXX: use map/unmap functions */
     ASSERT(dst_obj_image->image.data_size == src_obj_image->image.data_size);
-    memcpy(
-        dst_obj_buffer->buffer_data,
-        src_obj_buffer->buffer_data,
-        dst_obj_image->image.data_size
+    image_damage_update(src_obj_image, src_obj_buffer);
+
+    /* Only copy the tiles that changed since the last copy from the
+       same image, provided DST was not modified in-between */
+    ImageDamage * const dst_damage = &dst_obj_image->damage;
+    const int is_incremental = (
+        dst_damage->src_image == src_obj_image->base.id &&
+        dst_damage->hashes &&
+        dst_damage->mtime == dst_obj_buffer->mtime &&
+        src_obj_image->damage.hashes &&
+        src_obj_image->xvba_width  == dst_obj_image->xvba_width &&
+        src_obj_image->xvba_height == dst_obj_image->xvba_height
+    );
+
+    if (is_incremental) {
+        VARectangle rects[IMAGE_MAX_DAMAGE_RECTS];
+        unsigned int i, num_rects;
+
+        num_rects = image_damage_get_rects(
+            src_obj_image,
+            dst_damage->src_serial,
+            rects, ARRAY_ELEMS(rects)
+        );
+        if (num_rects == 0)
+            return VA_STATUS_SUCCESS;
+        for (i = 0; i < num_rects; i++)
+            copy_image_rect(
+                dst_obj_image,
+                dst_obj_buffer->buffer_data,
+                src_obj_buffer->buffer_data,
+                &rects[i]
+            );
+    }
+    else {
+        memcpy(
+            dst_obj_buffer->buffer_data,
+            src_obj_buffer->buffer_data,
+            dst_obj_image->image.data_size
+        );
+    }
+    image_damage_copy(
+        dst_obj_image,
+        dst_obj_buffer,
+        src_obj_image,
+        is_incremental ? dst_damage->src_serial : 0
     );
-    dst_obj_buffer->mtime = src_obj_buffer->mtime;
     return VA_STATUS_SUCCESS;
 }
 
@@ -565,6 +1076,10 @@ xvba_DestroyImage(
     if (!obj_image)
         return VA_STATUS_ERROR_INVALID_IMAGE;
 
+    /* Derived images are kept for the next vaDeriveImage() */
+    if (obj_image->derived_surface != VA_INVALID_ID)
+        return release_derived_image(driver_data, obj_image);
+
     destroy_image(driver_data, obj_image);
     return VA_STATUS_SUCCESS;
 }
@@ -577,8 +1092,21 @@ xvba_DeriveImage(
     VAImage             *image
 )
 {
-    /* TODO */
-    return VA_STATUS_ERROR_OPERATION_FAILED;
+    XVBA_DRIVER_DATA_INIT;
+
+    if (!image)
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+
+    object_surface_p obj_surface = XVBA_SURFACE(surface);
+    if (!obj_surface)
+        return VA_STATUS_ERROR_INVALID_SURFACE;
+
+    object_image_p obj_image = derive_surface_image(driver_data, obj_surface);
+    if (!obj_image)
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+
+    *image = obj_image->image;
+    return VA_STATUS_SUCCESS;
 }
 
 // vaSetImagePalette
@@ -589,8 +1117,195 @@ xvba_SetImagePalette(
     unsigned char      *palette
 )
 {
-    /* TODO */
-    return VA_STATUS_ERROR_OPERATION_FAILED;
+    XVBA_DRIVER_DATA_INIT;
+
+    object_image_p obj_image = XVBA_IMAGE(image);
+    if (!obj_image)
+        return VA_STATUS_ERROR_INVALID_IMAGE;
+
+    if (!palette)
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+
+    const unsigned int num_entries = obj_image->image.num_palette_entries;
+    if (num_entries == 0 || !obj_image->palette)
+        return VA_STATUS_ERROR_INVALID_IMAGE_FORMAT;
+
+    /* The palette has 3 bytes per entry in R, G, B order */
+    unsigned int i;
+    for (i = 0; i < num_entries; i++) {
+        obj_image->palette[4*i + 0] = palette[3*i + 0];
+        obj_image->palette[4*i + 1] = palette[3*i + 1];
+        obj_image->palette[4*i + 2] = palette[3*i + 2];
+        obj_image->palette[4*i + 3] = 0xff;
+    }
+    ++obj_image->palette_serial;
+    return VA_STATUS_SUCCESS;
+}
+
+// Checks whether vaGetImage() has to convert pixels from NV12 for FORMAT
+static int
+get_image_needs_conversion(
+    xvba_driver_data_t *driver_data,
+    const VAImageFormat *format
+)
+{
+    switch (format->fourcc) {
+    case VA_FOURCC('N','V','1','2'):
+    case VA_FOURCC('Y','V','1','2'):
+    case VA_FOURCC('I','4','2','0'):
+        return 0;
+    case VA_FOURCC('B','G','R','A'):
+        /* XVBAGetSurface() knows nothing of ProcAmp adjustments */
+        return driver_data->cm_composite_ok;
+    }
+    return image_convert_is_supported(format->fourcc,
+                                      VA_FOURCC('N','V','1','2'));
+}
+
+// Describes the pixels of image for conversions
+static void
+get_convert_image(
+    object_image_p      obj_image,
+    object_buffer_p     obj_buffer,
+    ConvertImage       *image
+)
+{
+    const VAImage * const va_image = &obj_image->image;
+    unsigned int i;
+
+    image->fourcc = va_image->format.fourcc;
+    image->width  = va_image->width;
+    image->height = va_image->height;
+    for (i = 0; i < 3; i++) {
+        if (i < va_image->num_planes) {
+            image->planes[i]  = obj_buffer->buffer_data + va_image->offsets[i];
+            image->pitches[i] = va_image->pitches[i];
+        }
+        else {
+            image->planes[i]  = NULL;
+            image->pitches[i] = 0;
+        }
+    }
+}
+
+// Ensures the vaGetImage() staging buffer holds SIZE bytes
+static uint8_t *
+ensure_getimage_staging(xvba_driver_data_t *driver_data, unsigned int size)
+{
+    if (driver_data->getimage_staging_size < size) {
+        uint8_t * const buffer = realloc(driver_data->getimage_staging, size);
+        if (!buffer)
+            return NULL;
+        driver_data->getimage_staging      = buffer;
+        driver_data->getimage_staging_size = size;
+    }
+    return driver_data->getimage_staging;
+}
+
+// Reads a decoded surface back, serialized with decodes to its session
+static int
+get_decoded_surface(
+    xvba_driver_data_t *driver_data,
+    object_context_p    obj_context,
+    object_surface_p    obj_surface,
+    XVBA_SURFACE_FORMAT format,
+    uint8_t            *target,
+    unsigned int        pitch,
+    unsigned int        width,
+    unsigned int        height
+)
+{
+    int status;
+
+    pthread_mutex_lock(&driver_data->decode_lock);
+    status = xvba_get_surface(
+        obj_context->xvba_decoder,
+        obj_surface->xvba_surface,
+        format,
+        target,
+        pitch,
+        width,
+        height
+    );
+    pthread_mutex_unlock(&driver_data->decode_lock);
+    return status;
+}
+
+// Get image from surface, converting the pixels from NV12
+static VAStatus
+get_image_convert(
+    xvba_driver_data_t *driver_data,
+    object_context_p    obj_context,
+    object_surface_p    obj_surface,
+    object_image_p      obj_image,
+    object_buffer_p     obj_buffer,
+    const VARectangle  *rect,
+    const VARectangle  *image_rect
+)
+{
+    const uint32_t fourcc = VA_FOURCC('N','V','1','2');
+    const unsigned int surface_width  = obj_surface->xvba_surface->info.normal.width;
+    const unsigned int surface_height = obj_surface->xvba_surface->info.normal.height;
+    const unsigned int luma_size      = surface_width * surface_height;
+    const unsigned int buffer_size    = luma_size + luma_size / 2;
+
+    /* NV12 is what the decoder produces, so that is the cheapest
+       format to read back, and to prefetch */
+    readback_mark_surface(driver_data, obj_surface, fourcc, XVBA_NV12,
+                          surface_width, buffer_size);
+
+    const uint8_t *frame = readback_lock_frame(driver_data, obj_surface,
+                                               fourcc);
+    const int is_cached = frame != NULL;
+    if (!is_cached) {
+        if (sync_surface(driver_data, obj_context, obj_surface) < 0)
+            return VA_STATUS_ERROR_OPERATION_FAILED;
+
+        uint8_t * const staging = ensure_getimage_staging(driver_data,
+                                                          buffer_size);
+        if (!staging)
+            return VA_STATUS_ERROR_ALLOCATION_FAILED;
+
+        if (get_decoded_surface(driver_data, obj_context, obj_surface,
+                                XVBA_NV12,
+                                staging,
+                                surface_width,
+                                surface_width,
+                                surface_height) < 0)
+            return VA_STATUS_ERROR_OPERATION_FAILED;
+        frame = staging;
+    }
+
+    /* Chroma is taken from the pixel pair the region starts in, luma
+       from the exact pixel */
+    const unsigned int x = rect->x;
+    const unsigned int y = rect->y;
+    ConvertImage src, dst;
+    src.fourcc     = fourcc;
+    src.width      = image_rect->width;
+    src.height     = image_rect->height;
+    src.planes[0]  = (uint8_t *)frame + y * surface_width + x;
+    src.pitches[0] = surface_width;
+    src.planes[1]  = (uint8_t *)frame + luma_size + y / 2 * surface_width +
+        (x & -2U);
+    src.pitches[1] = surface_width;
+    src.planes[2]  = NULL;
+    src.pitches[2] = 0;
+    get_convert_image(obj_image, obj_buffer, &dst);
+    dst.width      = image_rect->width;
+    dst.height     = image_rect->height;
+
+    const int status = image_convert(
+        &dst, &src,
+        driver_data->cm_composite_ok ? driver_data->cm_composite : NULL
+    );
+    if (is_cached)
+        readback_unlock_frame(driver_data);
+    if (status < 0)
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+
+    image_damage_rect(obj_image, obj_buffer, image_rect);
+    return VA_STATUS_SUCCESS;
 }
 
 // Get image from surface
@@ -611,33 +1326,139 @@ get_image(
     if (!obj_buffer)
         return VA_STATUS_ERROR_INVALID_BUFFER;
 
-    /* XXX: only support full surface readback for now */
-    if (rect->x != 0 ||
-        rect->y != 0 ||
-        rect->width != obj_surface->width ||
-        rect->height != obj_surface->height)
-        return VA_STATUS_ERROR_OPERATION_FAILED;
+    if (rect->x < 0 || rect->y < 0 ||
+        rect->x + rect->width  > obj_surface->width ||
+        rect->y + rect->height > obj_surface->height)
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+
+    VARectangle image_rect;
+    image_rect.x      = 0;
+    image_rect.y      = 0;
+    image_rect.width  = MIN(rect->width,  obj_image->image.width);
+    image_rect.height = MIN(rect->height, obj_image->image.height);
 
-    /* Make sure the surface is decoded prior to extracting it */
-    /* XXX: API doc mentions this as implicit in XVBAGetSurface() though... */
-    if (sync_surface(driver_data, obj_context, obj_surface) < 0)
+    /* Images smaller than the region get it downscaled on the GPU, so
+       that only the image bytes are read back */
+    if (rect->width  > obj_image->image.width ||
+        rect->height > obj_image->image.height) {
+#if USE_GLX
+        if (sync_surface(driver_data, obj_context, obj_surface) < 0)
+            return VA_STATUS_ERROR_OPERATION_FAILED;
+        VAStatus status = get_image_glx(driver_data, obj_surface,
+                                        obj_image, rect);
+        if (status == VA_STATUS_SUCCESS)
+            image_damage_rect(obj_image, obj_buffer, &image_rect);
+        return status;
+#else
         return VA_STATUS_ERROR_OPERATION_FAILED;
+#endif
+    }
 
     /* XXX: stupid driver requires 16-pixels alignment */
     ASSERT(obj_surface->xvba_surface->type == XVBA_SURFACETYPE_NORMAL);
-    if (obj_image->xvba_width != obj_surface->xvba_surface->info.normal.width ||
-        obj_image->xvba_height != obj_surface->xvba_surface->info.normal.height)
-        return VA_STATUS_ERROR_OPERATION_FAILED;
+    if (get_image_needs_conversion(driver_data, &obj_image->image.format))
+        return get_image_convert(driver_data, obj_context, obj_surface,
+                                 obj_image, obj_buffer, rect, &image_rect);
+
+    const unsigned int surface_width  = obj_surface->xvba_surface->info.normal.width;
+    const unsigned int surface_height = obj_surface->xvba_surface->info.normal.height;
+    const int is_full_surface = (
+        rect->x == 0 &&
+        rect->y == 0 &&
+        rect->width == obj_surface->width &&
+        rect->height == obj_surface->height &&
+        obj_image->xvba_width == surface_width &&
+        obj_image->xvba_height == surface_height
+    );
 
-    if (xvba_get_surface(obj_context->xvba_decoder,
-                         obj_surface->xvba_surface,
-                         obj_image->xvba_format,
-                         obj_buffer->buffer_data,
-                         obj_image->image.pitches[0],
-                         obj_image->xvba_width,
-                         obj_image->xvba_height) < 0)
-        return VA_STATUS_ERROR_OPERATION_FAILED;
+    /* XXX: XVBAGetSurface() can only read back whole frames. So, frames
+       are read laid out as the image would be at the surface size, and
+       the requested region is copied out */
+    ImagePlane planes[3], staging_planes[3];
+    const unsigned int num_planes = get_image_planes(obj_image, planes);
+    const uint64_t image_size   = obj_image->xvba_width * obj_image->xvba_height;
+    const uint64_t staging_size = surface_width * surface_height;
+    unsigned int i, y;
+
+    /* All plane offsets and pitches scale with the luma size */
+    for (i = 0; i < num_planes; i++) {
+        staging_planes[i] = planes[i];
+        staging_planes[i].offset = planes[i].offset * staging_size / image_size;
+        staging_planes[i].pitch  = planes[i].pitch * surface_width /
+            obj_image->xvba_width;
+    }
+    const unsigned int buffer_size = obj_image->image.data_size *
+        staging_size / image_size;
+
+    /* Next decodes into the surface get read back ahead of time */
+    const uint32_t fourcc = obj_image->image.format.fourcc;
+    readback_mark_surface(driver_data, obj_surface, fourcc,
+                          obj_image->xvba_format, staging_planes[0].pitch,
+                          buffer_size);
+
+    const uint8_t *frame = readback_lock_frame(driver_data, obj_surface,
+                                               fourcc);
+    const int is_cached = frame != NULL;
+    if (!is_cached) {
+        /* Make sure the surface is decoded prior to extracting it */
+        /* XXX: API doc mentions this as implicit in XVBAGetSurface() though... */
+        if (sync_surface(driver_data, obj_context, obj_surface) < 0)
+            return VA_STATUS_ERROR_OPERATION_FAILED;
+
+        /* Full surface readback goes straight into the image */
+        if (is_full_surface) {
+            if (get_decoded_surface(driver_data, obj_context, obj_surface,
+                                    obj_image->xvba_format,
+                                    obj_buffer->buffer_data,
+                                    obj_image->image.pitches[0],
+                                    obj_image->xvba_width,
+                                    obj_image->xvba_height) < 0)
+                return VA_STATUS_ERROR_OPERATION_FAILED;
+            image_damage_rect(obj_image, obj_buffer, &image_rect);
+            return VA_STATUS_SUCCESS;
+        }
+
+        uint8_t * const staging = ensure_getimage_staging(driver_data,
+                                                          buffer_size);
+        if (!staging)
+            return VA_STATUS_ERROR_ALLOCATION_FAILED;
 
+        if (get_decoded_surface(driver_data, obj_context, obj_surface,
+                                obj_image->xvba_format,
+                                staging,
+                                staging_planes[0].pitch,
+                                surface_width,
+                                surface_height) < 0)
+            return VA_STATUS_ERROR_OPERATION_FAILED;
+        frame = staging;
+    }
+
+    if (is_full_surface)
+        memcpy(obj_buffer->buffer_data, frame, obj_image->image.data_size);
+    else {
+        for (i = 0; i < num_planes; i++) {
+            const ImagePlane * const src_plane = &staging_planes[i];
+            const ImagePlane * const dst_plane = &planes[i];
+            const unsigned int x0 = rect->x >> src_plane->shift;
+            const unsigned int y0 = rect->y >> src_plane->shift;
+            const unsigned int x1 = (rect->x + rect->width  + src_plane->shift) >> src_plane->shift;
+            const unsigned int y1 = MIN((rect->y + rect->height + src_plane->shift) >> src_plane->shift,
+                                        y0 + (obj_image->xvba_height >> src_plane->shift));
+            const unsigned int size = (x1 - x0) * src_plane->cpp;
+            const uint8_t *src = (frame + src_plane->offset +
+                                  y0 * src_plane->pitch + x0 * src_plane->cpp);
+            uint8_t *dst = obj_buffer->buffer_data + dst_plane->offset;
+
+            for (y = y0; y < y1; y++) {
+                memcpy(dst, src, MIN(size, dst_plane->pitch));
+                src += src_plane->pitch;
+                dst += dst_plane->pitch;
+            }
+        }
+    }
+    if (is_cached)
+        readback_unlock_frame(driver_data);
+    image_damage_rect(obj_image, obj_buffer, &image_rect);
     return VA_STATUS_SUCCESS;
 }
 
@@ -675,6 +1496,253 @@ xvba_GetImage(
     return get_image(driver_data, obj_context, obj_surface, obj_image, &rect);
 }
 
+// Copy image pixels, converting them to the format of DST image
+static VAStatus
+copy_image_convert(
+    xvba_driver_data_t *driver_data,
+    object_image_p      dst_obj_image,
+    object_image_p      src_obj_image
+)
+{
+    object_buffer_p dst_obj_buffer = XVBA_BUFFER(dst_obj_image->image.buf);
+    if (!dst_obj_buffer)
+        return VA_STATUS_ERROR_INVALID_BUFFER;
+
+    object_buffer_p src_obj_buffer = XVBA_BUFFER(src_obj_image->image.buf);
+    if (!src_obj_buffer)
+        return VA_STATUS_ERROR_INVALID_BUFFER;
+
+    ConvertImage dst, src;
+    get_convert_image(dst_obj_image, dst_obj_buffer, &dst);
+    get_convert_image(src_obj_image, src_obj_buffer, &src);
+    if (image_convert(&dst, &src, NULL) < 0)
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+
+    /* DST pixels no longer match those of the image last copied */
+    VARectangle rect;
+    rect.x      = 0;
+    rect.y      = 0;
+    rect.width  = dst_obj_image->image.width;
+    rect.height = dst_obj_image->image.height;
+    dst_obj_image->damage.src_image = VA_INVALID_ID;
+    image_damage_rect(dst_obj_image, dst_obj_buffer, &rect);
+    return VA_STATUS_SUCCESS;
+}
+
+// Describes the pixels of RECT within image, for conversions
+static void
+get_convert_region(
+    object_image_p      obj_image,
+    object_buffer_p     obj_buffer,
+    const VARectangle  *rect,
+    ConvertImage       *image
+)
+{
+    ImagePlane planes[3];
+    unsigned int i, num_planes;
+
+    get_convert_image(obj_image, obj_buffer, image);
+    image->width  = rect->width;
+    image->height = rect->height;
+
+    num_planes = get_image_planes(obj_image, planes);
+    for (i = 0; i < num_planes; i++)
+        image->planes[i] += ((rect->y >> planes[i].shift) * planes[i].pitch +
+                             (rect->x >> planes[i].shift) * planes[i].cpp);
+}
+
+// Copy SRC pixels into DST, both regions of images laid out as IMAGE
+static void
+copy_convert_region(
+    object_image_p      obj_image,
+    ConvertImage       *dst,
+    const ConvertImage *src
+)
+{
+    ImagePlane planes[3];
+    unsigned int i, y, num_planes;
+
+    num_planes = get_image_planes(obj_image, planes);
+    for (i = 0; i < num_planes; i++) {
+        const unsigned int shift  = planes[i].shift;
+        const unsigned int height = (src->height + shift) >> shift;
+        const unsigned int size   = ((src->width + shift) >> shift) * planes[i].cpp;
+        for (y = 0; y < height; y++)
+            memcpy(dst->planes[i] + y * dst->pitches[i],
+                   src->planes[i] + y * src->pitches[i],
+                   size);
+    }
+}
+
+// Allocates pixels of FOURCC for conversions, at the specified size
+static uint8_t *
+alloc_convert_image(
+    ConvertImage       *image,
+    uint32_t            fourcc,
+    unsigned int        width,
+    unsigned int        height
+)
+{
+    const unsigned int pitch   = (width  + 1) & -2U;
+    const unsigned int height2 = (height + 1) & -2U;
+    unsigned int num_planes, size;
+
+    memset(image, 0, sizeof(*image));
+    image->fourcc = fourcc;
+    image->width  = width;
+    image->height = height;
+
+    switch (fourcc) {
+    case VA_FOURCC('N','V','1','2'):
+        num_planes = 2;
+        image->pitches[0] = pitch;
+        image->pitches[1] = pitch;
+        break;
+    case VA_FOURCC('I','4','2','0'):
+    case VA_FOURCC('Y','V','1','2'):
+        num_planes = 3;
+        image->pitches[0] = pitch;
+        image->pitches[1] = pitch / 2;
+        image->pitches[2] = pitch / 2;
+        break;
+    case VA_FOURCC('B','G','R','A'):
+    case VA_FOURCC('R','G','B','A'):
+        num_planes = 1;
+        image->pitches[0] = 4 * pitch;
+        break;
+    default:
+        return NULL;
+    }
+
+    /* Chroma planes have half as many lines */
+    size = image->pitches[0] * height2;
+    if (num_planes > 1)
+        size += (image->pitches[1] + image->pitches[2]) * height2 / 2;
+    uint8_t * const pixels = malloc(size);
+    if (!pixels)
+        return NULL;
+
+    image->planes[0] = pixels;
+    if (num_planes > 1)
+        image->planes[1] = pixels + image->pitches[0] * height2;
+    if (num_planes > 2)
+        image->planes[2] = image->planes[1] + image->pitches[1] * height2 / 2;
+    return pixels;
+}
+
+// Put SRC_RECT of image pixels into DST_RECT of the surface shadow image,
+// scaling them as needed
+static VAStatus
+put_image_region(
+    xvba_driver_data_t *driver_data,
+    object_image_p      dst_obj_image,
+    const VARectangle  *dst_rect,
+    object_image_p      src_obj_image,
+    const VARectangle  *src_rect
+)
+{
+    object_buffer_p dst_obj_buffer = XVBA_BUFFER(dst_obj_image->image.buf);
+    if (!dst_obj_buffer)
+        return VA_STATUS_ERROR_INVALID_BUFFER;
+
+    object_buffer_p src_obj_buffer = XVBA_BUFFER(src_obj_image->image.buf);
+    if (!src_obj_buffer)
+        return VA_STATUS_ERROR_INVALID_BUFFER;
+
+    /* Chroma samples are shared by pixel pairs, so regions starting
+       within one would shift luma against chroma */
+    if (is_yuv_format(&dst_obj_image->image.format) &&
+        ((dst_rect->x | dst_rect->y) & 1))
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+    if (is_yuv_format(&src_obj_image->image.format) &&
+        ((src_rect->x | src_rect->y) & 1))
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+
+    ConvertImage dst, src;
+    get_convert_region(dst_obj_image, dst_obj_buffer, dst_rect, &dst);
+    get_convert_region(src_obj_image, src_obj_buffer, src_rect, &src);
+
+    const int is_scaled = (src.width  != dst.width ||
+                           src.height != dst.height);
+    if (!is_scaled) {
+        if (dst.fourcc == src.fourcc)
+            copy_convert_region(src_obj_image, &dst, &src);
+        else if (image_convert(&dst, &src, NULL) < 0)
+            return VA_STATUS_ERROR_OPERATION_FAILED;
+    }
+    else {
+        /* Pixels are converted to the shadow image format at the source
+           size first, so that there are fewer to convert when downscaling */
+        uint8_t *pixels = NULL;
+        if (dst.fourcc != src.fourcc) {
+            ConvertImage tmp;
+            pixels = alloc_convert_image(&tmp, dst.fourcc,
+                                         src.width, src.height);
+            if (!pixels)
+                return VA_STATUS_ERROR_ALLOCATION_FAILED;
+            if (image_convert(&tmp, &src, NULL) < 0) {
+                free(pixels);
+                return VA_STATUS_ERROR_OPERATION_FAILED;
+            }
+            src = tmp;
+        }
+        const int error = image_scale(&dst, &src);
+        free(pixels);
+        if (error < 0)
+            return VA_STATUS_ERROR_OPERATION_FAILED;
+    }
+
+    /* DST pixels no longer match those of the image last copied */
+    dst_obj_image->damage.src_image = VA_INVALID_ID;
+    image_damage_rect(dst_obj_image, dst_obj_buffer, dst_rect);
+    return VA_STATUS_SUCCESS;
+}
+
+// Turn a decoded surface into a shadow image holding the decoded pixels,
+// so that regions can be put over them
+static VAStatus
+putimage_hacks_overlay(
+    xvba_driver_data_t *driver_data,
+    object_surface_p    obj_surface,
+    object_image_p      obj_image
+)
+{
+    object_context_p obj_context = XVBA_CONTEXT(obj_surface->va_context);
+    if (!obj_context)
+        return VA_STATUS_ERROR_INVALID_CONTEXT;
+
+    if (obj_surface->putimage_hacks &&
+        obj_surface->putimage_hacks->type != PUTIMAGE_HACKS_IMAGE)
+        putimage_hacks_disable(driver_data, obj_surface);
+
+    VAStatus status = putimage_hacks_enable(
+        driver_data,
+        obj_surface,
+        obj_image,
+        PUTIMAGE_HACKS_IMAGE
+    );
+    if (status != VA_STATUS_SUCCESS)
+        return status;
+
+    /* The surface is still read back from XvBA at this point */
+    VARectangle rect;
+    rect.x      = 0;
+    rect.y      = 0;
+    rect.width  = obj_surface->width;
+    rect.height = obj_surface->height;
+    status = get_image(driver_data, obj_context, obj_surface,
+                       obj_surface->putimage_hacks->obj_image, &rect);
+    if (status != VA_STATUS_SUCCESS) {
+        putimage_hacks_disable(driver_data, obj_surface);
+        return status;
+    }
+
+    /* Next decodes into the surface disable the hacks again */
+    obj_surface->used_for_decoding = 0;
+    obj_surface->va_surface_status = VASurfaceReady;
+    return VA_STATUS_SUCCESS;
+}
+
 // Put image to surface
 static VAStatus
 put_image(
@@ -705,42 +1773,59 @@ put_image(
         obj_surface->va_surface_status = VASurfaceReady;
     }
 
-    /* XXX: XvBA does not have a real PutImage API. It requires
-       image and surface to have the same dimensions... */
-    if (obj_image->image.width != obj_surface->width  ||
-        obj_image->image.height != obj_surface->height)
-        return VA_STATUS_ERROR_OPERATION_FAILED;
+    if (src_rect->x < 0 || src_rect->y < 0 ||
+        src_rect->width  == 0 || src_rect->height == 0 ||
+        src_rect->x + src_rect->width  > obj_image->image.width ||
+        src_rect->y + src_rect->height > obj_image->image.height)
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+    if (dst_rect->x < 0 || dst_rect->y < 0 ||
+        dst_rect->width  == 0 || dst_rect->height == 0 ||
+        dst_rect->x + dst_rect->width  > obj_surface->width ||
+        dst_rect->y + dst_rect->height > obj_surface->height)
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
 
-    /* XXX: XvBA implementation cannot do partial surface uploads, though
-       the API permits it... Neither can it scale the data for us */
-    if (src_rect->x != 0 ||
-        src_rect->y != 0 ||
-        src_rect->width  != obj_image->image.width ||
-        src_rect->height != obj_image->image.height)
-         return VA_STATUS_ERROR_OPERATION_FAILED;
-    if (dst_rect->x != 0 ||
-        dst_rect->y != 0 ||
-        dst_rect->width  != obj_surface->width ||
-        dst_rect->height != obj_surface->height)
-        return VA_STATUS_ERROR_OPERATION_FAILED;
-    if (src_rect->width != dst_rect->width ||
-        src_rect->height != dst_rect->height)
-        return VA_STATUS_ERROR_OPERATION_FAILED;
+    VAStatus status;
+    if (obj_surface->used_for_decoding) {
+        status = putimage_hacks_overlay(driver_data, obj_surface, obj_image);
+        if (status != VA_STATUS_SUCCESS)
+            return status;
+    }
 
-    VAStatus status = putimage_hacks_check(driver_data, obj_surface, obj_image);
+    status = putimage_hacks_check(driver_data, obj_surface, obj_image);
     if (status != VA_STATUS_SUCCESS)
         return status;
 
+    /* XXX: XvBA does not have a real PutImage API. Pixels are kept in
+       an image at the surface size, and only the tiles that changed get
+       uploaded to the GL textures the surface is rendered from */
     PutImageHacks * const h = obj_surface->putimage_hacks;
-    if (h && h->type == PUTIMAGE_HACKS_IMAGE) {
-        status = copy_image(
-            driver_data,
-            obj_surface->putimage_hacks->obj_image,
-            obj_image
-        );
+    if (!h || h->type != PUTIMAGE_HACKS_IMAGE)
+        return VA_STATUS_ERROR_UNIMPLEMENTED;
+
+    const int is_full_image = (
+        obj_image->image.width  == obj_surface->width &&
+        obj_image->image.height == obj_surface->height &&
+        src_rect->x == 0 &&
+        src_rect->y == 0 &&
+        src_rect->width  == obj_image->image.width &&
+        src_rect->height == obj_image->image.height &&
+        dst_rect->x == 0 &&
+        dst_rect->y == 0 &&
+        dst_rect->width  == obj_surface->width &&
+        dst_rect->height == obj_surface->height
+    );
+    if (!is_full_image)
+        status = put_image_region(driver_data, h->obj_image, dst_rect,
+                                  obj_image, src_rect);
+    else if (h->obj_image->image.format.fourcc != obj_image->image.format.fourcc)
+        status = copy_image_convert(driver_data, h->obj_image, obj_image);
+    else
+        status = copy_image(driver_data, h->obj_image, obj_image);
+    if (status != VA_STATUS_SUCCESS)
         return status;
-    }
-    return VA_STATUS_ERROR_UNIMPLEMENTED;
+
+    surface_update_mtime(obj_surface);
+    return VA_STATUS_SUCCESS;
 }
 
 // vaPutImage
@@ -820,3 +1905,188 @@ xvba_PutImage_full(
     dst_rect.height = dest_height;
     return put_image(driver_data, obj_image, obj_surface, &src_rect, &dst_rect);
 }
+
+// Gets the image derived from surface, creating it if needed
+object_image_p
+derive_surface_image(
+    xvba_driver_data_t *driver_data,
+    object_surface_p    obj_surface
+)
+{
+    object_image_p obj_image = XVBA_IMAGE(obj_surface->derived_image);
+
+    if (!obj_image) {
+        /* NV12 is what the decoder produces, so that it is read back
+           without any conversion */
+        VAImageFormat format = xvba_image_formats_map[0].va_format;
+        ASSERT(format.fourcc == VA_FOURCC('N','V','1','2'));
+
+        obj_image = create_image(
+            driver_data,
+            obj_surface->width,
+            obj_surface->height,
+            &format
+        );
+        if (!obj_image)
+            return NULL;
+
+        object_buffer_p obj_buffer = XVBA_BUFFER(obj_image->image.buf);
+        if (!obj_buffer) {
+            destroy_image(driver_data, obj_image);
+            return NULL;
+        }
+        obj_buffer->derived_surface = obj_surface->base.id;
+        obj_image->derived_surface  = obj_surface->base.id;
+        obj_surface->derived_image  = obj_image->image.image_id;
+    }
+    ++obj_image->derived_refs;
+    return obj_image;
+}
+
+// Releases a reference to the image derived from a surface
+VAStatus
+release_derived_image(
+    xvba_driver_data_t *driver_data,
+    object_image_p      obj_image
+)
+{
+    if (obj_image->derived_refs == 0)
+        return VA_STATUS_ERROR_INVALID_IMAGE;
+
+    /* The image and its pixels stay cached until the surface is gone */
+    --obj_image->derived_refs;
+    return VA_STATUS_SUCCESS;
+}
+
+// Reads the surface back into its derived image, if its contents changed
+VAStatus
+sync_derived_image(
+    xvba_driver_data_t *driver_data,
+    VASurfaceID         surface
+)
+{
+    object_surface_p obj_surface = XVBA_SURFACE(surface);
+    if (!obj_surface)
+        return VA_STATUS_ERROR_INVALID_SURFACE;
+
+    object_image_p obj_image = XVBA_IMAGE(obj_surface->derived_image);
+    if (!obj_image)
+        return VA_STATUS_ERROR_INVALID_IMAGE;
+
+    object_buffer_p obj_buffer = XVBA_BUFFER(obj_image->image.buf);
+    if (!obj_buffer)
+        return VA_STATUS_ERROR_INVALID_BUFFER;
+
+    if (obj_image->derived_mtime == obj_surface->mtime)
+        goto end;
+
+    VARectangle rect;
+    rect.x      = 0;
+    rect.y      = 0;
+    rect.width  = obj_surface->width;
+    rect.height = obj_surface->height;
+
+    /* Pixels uploaded with vaPutImage() are still in the driver */
+    VAStatus status;
+    PutImageHacks * const h = obj_surface->putimage_hacks;
+    if (h && h->type == PUTIMAGE_HACKS_IMAGE && h->obj_image) {
+        if (h->obj_image->image.format.fourcc == obj_image->image.format.fourcc)
+            status = copy_image(driver_data, obj_image, h->obj_image);
+        else
+            status = copy_image_convert(driver_data, obj_image, h->obj_image);
+    }
+    else {
+        /* Nothing was decoded into the surface yet, so it is black.
+           Otherwise, a frame read back ahead of time is taken over,
+           rather than copied, unless the application still holds the
+           buffer from a previous vaMapBuffer() or vaLockSurface(). That
+           frame is then copied by get_image() */
+        object_context_p obj_context = XVBA_CONTEXT(obj_surface->va_context);
+        if (!obj_context || !obj_context->xvba_decoder ||
+            !obj_surface->xvba_surface)
+            status = clear_image(driver_data, obj_image);
+        else if (obj_buffer->map_count == 0 &&
+                 obj_surface->lock_count == 0 &&
+                 readback_swap_frame(driver_data, obj_surface,
+                                     obj_image->image.format.fourcc,
+                                     obj_image->image.pitches[0],
+                                     obj_buffer->buffer_size,
+                                     &obj_buffer->buffer_data)) {
+            image_damage_rect(obj_image, obj_buffer, &rect);
+            status = VA_STATUS_SUCCESS;
+        }
+        else
+            status = get_image(driver_data, obj_context, obj_surface,
+                               obj_image, &rect);
+    }
+    if (status != VA_STATUS_SUCCESS)
+        return status;
+    obj_image->derived_mtime = obj_surface->mtime;
+
+end:
+    /* Writes by the application are told apart from the tile hashes,
+       as of when the pixels are first handed out */
+    if (obj_buffer->map_count == 0 && obj_surface->lock_count == 0) {
+        image_damage_update(obj_image, obj_buffer);
+        obj_image->derived_serial = obj_image->damage.serial;
+    }
+    return VA_STATUS_SUCCESS;
+}
+
+// Writes the image derived from surface back, if its pixels were changed
+VAStatus
+commit_derived_image(
+    xvba_driver_data_t *driver_data,
+    VASurfaceID         surface
+)
+{
+    object_surface_p obj_surface = XVBA_SURFACE(surface);
+    if (!obj_surface)
+        return VA_STATUS_ERROR_INVALID_SURFACE;
+
+    object_image_p obj_image = XVBA_IMAGE(obj_surface->derived_image);
+    if (!obj_image)
+        return VA_STATUS_ERROR_INVALID_IMAGE;
+
+    object_buffer_p obj_buffer = XVBA_BUFFER(obj_image->image.buf);
+    if (!obj_buffer)
+        return VA_STATUS_ERROR_INVALID_BUFFER;
+
+    /* The application may still write through another mapping */
+    if (obj_buffer->map_count > 0 || obj_surface->lock_count > 0)
+        return VA_STATUS_SUCCESS;
+
+    /* Without tiles, pixels are assumed to have changed */
+    image_damage_update(obj_image, obj_buffer);
+    if (obj_image->damage.hashes &&
+        obj_image->damage.serial == obj_image->derived_serial)
+        return VA_STATUS_SUCCESS;
+
+    VARectangle rect;
+    rect.x      = 0;
+    rect.y      = 0;
+    rect.width  = obj_surface->width;
+    rect.height = obj_surface->height;
+    if (put_image(driver_data, obj_image, obj_surface,
+                  &rect, &rect) != VA_STATUS_SUCCESS)
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+
+    /* The surface now holds the image pixels */
+    obj_image->derived_serial = obj_image->damage.serial;
+    obj_image->derived_mtime  = obj_surface->mtime;
+    return VA_STATUS_SUCCESS;
+}
+
+// Destroys the image derived from surface
+void
+destroy_derived_image(
+    xvba_driver_data_t *driver_data,
+    object_surface_p    obj_surface
+)
+{
+    object_image_p obj_image = XVBA_IMAGE(obj_surface->derived_image);
+
+    if (obj_image)
+        destroy_image(driver_data, obj_image);
+    obj_surface->derived_image = VA_INVALID_ID;
+}
@@ -60,10 +60,36 @@ struct _HWImageHooks {
 typedef struct _HWImage HWImage;
 struct _HWImage {
     uint64_t            mtime;
+    unsigned int        serial;         /* damage serial last committed */
     object_image_xvba_p xvba;
     object_image_glx_p  glx;
 };
 
+/* Image contents are tracked in tiles of IMAGE_TILE_SIZE pixels, so that
+   only the tiles that changed get uploaded or copied */
+#define IMAGE_TILE_SIZE         64
+#define IMAGE_MAX_DAMAGE_RECTS  16
+
+typedef struct _ImageDamage ImageDamage;
+struct _ImageDamage {
+    uint64_t           *hashes;         /* content hash of each tile */
+    unsigned int       *serials;        /* serial each tile last changed at */
+    unsigned int        tiles_x;
+    unsigned int        tiles_y;
+    unsigned int        serial;         /* last damage serial */
+    uint64_t            mtime;          /* buffer mtime the hashes match */
+    VAImageID           src_image;      /* image last copied from */
+    unsigned int        src_serial;     /* its damage serial at that time */
+};
+
+typedef struct _ImagePlane ImagePlane;
+struct _ImagePlane {
+    unsigned int        offset;
+    unsigned int        pitch;
+    unsigned int        cpp;            /* bytes per (subsampled) pixel */
+    unsigned int        shift;          /* subsampling shift */
+};
+
 typedef struct object_image object_image_t;
 struct object_image {
     struct object_base  base;
@@ -72,6 +98,13 @@ struct object_image {
     unsigned int        xvba_width;
     unsigned int        xvba_height;
     HWImage             hw;
+    ImageDamage         damage;
+    uint8_t            *palette;        /* RGBA, for paletted formats */
+    unsigned int        palette_serial;
+    VASurfaceID         derived_surface; /* surface it was derived from */
+    unsigned int        derived_refs;
+    uint64_t            derived_mtime;  /* surface contents time of pixels */
+    unsigned int        derived_serial; /* damage serial when handed out */
 };
 
 typedef struct GetImageHacks {
@@ -102,6 +135,41 @@ putimage_hacks_disable(
     object_surface_p    obj_surface
 ) attribute_hidden;
 
+// Gets the image derived from surface, creating it if needed
+object_image_p
+derive_surface_image(
+    xvba_driver_data_t *driver_data,
+    object_surface_p    obj_surface
+) attribute_hidden;
+
+// Releases a reference to the image derived from a surface
+VAStatus
+release_derived_image(
+    xvba_driver_data_t *driver_data,
+    object_image_p      obj_image
+) attribute_hidden;
+
+// Reads the surface back into its derived image, if its contents changed
+VAStatus
+sync_derived_image(
+    xvba_driver_data_t *driver_data,
+    VASurfaceID         surface
+) attribute_hidden;
+
+// Writes the image derived from surface back, if its pixels were changed
+VAStatus
+commit_derived_image(
+    xvba_driver_data_t *driver_data,
+    VASurfaceID         surface
+) attribute_hidden;
+
+// Destroys the image derived from surface
+void
+destroy_derived_image(
+    xvba_driver_data_t *driver_data,
+    object_surface_p    obj_surface
+) attribute_hidden;
+
 // Check VA image format represents RGB
 int is_rgb_format(const VAImageFormat *image_format)
     attribute_hidden;
@@ -139,6 +207,44 @@ destroy_hw_image(
     object_image_p      obj_image
 ) attribute_hidden;
 
+// Get the layout of image planes
+unsigned int
+get_image_planes(object_image_p obj_image, ImagePlane *planes)
+    attribute_hidden;
+
+// Copy RECT between two buffers laid out as IMAGE
+void
+copy_image_rect(
+    object_image_p      obj_image,
+    uint8_t            *dst,
+    const uint8_t      *src,
+    const VARectangle  *rect
+) attribute_hidden;
+
+// Update damage of image from a tile-hash diff of its buffer
+void
+image_damage_update(
+    object_image_p      obj_image,
+    object_buffer_p     obj_buffer
+) attribute_hidden;
+
+// Update damage of image for RECT written by the driver, and touch buffer
+void
+image_damage_rect(
+    object_image_p      obj_image,
+    object_buffer_p     obj_buffer,
+    const VARectangle  *rect
+) attribute_hidden;
+
+// Get the rectangles of image that changed since SERIAL
+unsigned int
+image_damage_get_rects(
+    object_image_p      obj_image,
+    unsigned int        serial,
+    VARectangle        *rects,
+    unsigned int        max_rects
+) attribute_hidden;
+
 // Commit image to the HW
 VAStatus
 commit_hw_image(
@@ -0,0 +1,450 @@
+/*
+ *  xvba_readback.c - vaGetImage() readbacks ahead of time
+ *
+ *  xvba-video (C) 2009-2011 Splitted-Desktop Systems
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include "sysdeps.h"
+#include "xvba_readback.h"
+#include "xvba_video.h"
+#include "xvba_decode.h"
+#include "utils.h"
+#include <pthread.h>
+
+#define DEBUG 1
+#include "debug.h"
+
+/* Defined to 1 to read surfaces back as soon as they are decoded, once
+   vaGetImage() was called on them. Frames read back are cached until
+   the surface contents change, so vaGetImage() is then a copy */
+#define READBACK_PREFETCH 1
+
+static int get_readback_prefetch_env(void)
+{
+    int readback_prefetch;
+    if (getenv_int("XVBA_VIDEO_READBACK_PREFETCH", &readback_prefetch) < 0)
+        readback_prefetch = READBACK_PREFETCH;
+    return readback_prefetch != 0;
+}
+
+static inline int use_readback_prefetch(void)
+{
+    static int g_readback_prefetch = -1;
+    if (g_readback_prefetch < 0)
+        g_readback_prefetch = get_readback_prefetch_env();
+    return g_readback_prefetch;
+}
+
+/* Number of decodes after which a surface no longer read back with
+   vaGetImage() stops being read back ahead of time */
+#define READBACK_EXPIRY 16
+
+/* The worker only gets pointers that outlive the job: object heaps
+   may be reallocated by the application thread meanwhile */
+typedef struct {
+    SurfaceReadback    *readback;
+    XVBASession        *session;
+    XVBASurface        *surface;
+    uint64_t            mtime;
+} ReadbackJob;
+
+struct ReadbackEngine {
+    pthread_t           thread;
+    pthread_mutex_t    *decode_lock;    /* driver_data->decode_lock */
+    pthread_mutex_t     lock;
+    pthread_cond_t      job_cond;       /* a job was queued */
+    pthread_cond_t      done_cond;      /* the busy job completed */
+    ReadbackJob        *jobs;
+    unsigned int        jobs_count;
+    unsigned int        jobs_count_max;
+    ReadbackJob         busy;           /* job in progress, if readback */
+    int                 quit;
+};
+
+// Waits for the decode of job surface and reads it back
+static int
+readback_job_run(
+    ReadbackEngine        *engine,
+    const ReadbackJob     *job,
+    const SurfaceReadback *rb
+)
+{
+    int status;
+
+    /* The application thread keeps decoding through the same session */
+    for (;;) {
+        pthread_mutex_lock(engine->decode_lock);
+        status = xvba_sync_surface(job->session, job->surface,
+                                   XVBA_GET_SURFACE_STATUS);
+        if (status == XVBA_COMPLETED)
+            break;
+        pthread_mutex_unlock(engine->decode_lock);
+        if (status < 0)
+            return -1;
+        delay_usec(XVBA_SYNC_DELAY);
+    }
+
+    status = xvba_get_surface(
+        job->session,
+        job->surface,
+        rb->format,
+        rb->back,
+        rb->pitch,
+        rb->width,
+        rb->height
+    );
+    pthread_mutex_unlock(engine->decode_lock);
+    return status;
+}
+
+static void *readback_thread(void *arg)
+{
+    ReadbackEngine * const engine = arg;
+    ReadbackJob job;
+
+    pthread_mutex_lock(&engine->lock);
+    for (;;) {
+        while (!engine->quit && engine->jobs_count == 0)
+            pthread_cond_wait(&engine->job_cond, &engine->lock);
+        if (engine->quit)
+            break;
+
+        job = engine->jobs[0];
+        memmove(&engine->jobs[0], &engine->jobs[1],
+                --engine->jobs_count * sizeof(engine->jobs[0]));
+
+        SurfaceReadback * const rb = job.readback;
+        if (!rb->back) {
+            rb->back = malloc(rb->size);
+            if (!rb->back)
+                continue;
+        }
+
+        /* The layout and buffers of the readback can't change while it
+           is busy, see readback_wait_idle() */
+        engine->busy = job;
+        pthread_mutex_unlock(&engine->lock);
+        const int status = readback_job_run(engine, &job, rb);
+        pthread_mutex_lock(&engine->lock);
+        engine->busy.readback = NULL;
+        engine->busy.session  = NULL;
+
+        if (status == 0) {
+            uint8_t * const data = rb->data;
+            rb->data  = rb->back;
+            rb->back  = data;
+            rb->mtime = job.mtime;
+        }
+        pthread_cond_broadcast(&engine->done_cond);
+    }
+    pthread_mutex_unlock(&engine->lock);
+    return NULL;
+}
+
+// Creates the readback thread
+static ReadbackEngine *readback_engine_create(xvba_driver_data_t *driver_data)
+{
+    ReadbackEngine *engine;
+
+    engine = calloc(1, sizeof(*engine));
+    if (!engine)
+        return NULL;
+
+    engine->decode_lock = &driver_data->decode_lock;
+    pthread_mutex_init(&engine->lock, NULL);
+    pthread_cond_init(&engine->job_cond, NULL);
+    pthread_cond_init(&engine->done_cond, NULL);
+
+    if (pthread_create(&engine->thread, NULL, readback_thread, engine) != 0) {
+        pthread_cond_destroy(&engine->done_cond);
+        pthread_cond_destroy(&engine->job_cond);
+        pthread_mutex_destroy(&engine->lock);
+        free(engine);
+        return NULL;
+    }
+    return engine;
+}
+
+// Stops the readback thread
+void readback_engine_destroy(xvba_driver_data_t *driver_data)
+{
+    ReadbackEngine * const engine = driver_data->readback_engine;
+
+    if (!engine)
+        return;
+
+    pthread_mutex_lock(&engine->lock);
+    engine->quit = 1;
+    pthread_cond_signal(&engine->job_cond);
+    pthread_mutex_unlock(&engine->lock);
+    pthread_join(engine->thread, NULL);
+
+    pthread_cond_destroy(&engine->done_cond);
+    pthread_cond_destroy(&engine->job_cond);
+    pthread_mutex_destroy(&engine->lock);
+    free(engine->jobs);
+    free(engine);
+    driver_data->readback_engine = NULL;
+}
+
+// Drops the queued jobs of readback, or session, and waits for the
+// job in progress if it is one of them. Engine lock is held
+static void
+readback_wait_idle(
+    ReadbackEngine     *engine,
+    SurfaceReadback    *rb,
+    XVBASession        *session
+)
+{
+    unsigned int i, n = 0;
+
+    for (i = 0; i < engine->jobs_count; i++) {
+        const ReadbackJob * const job = &engine->jobs[i];
+        if (job->readback == rb || job->session == session)
+            continue;
+        engine->jobs[n++] = *job;
+    }
+    engine->jobs_count = n;
+
+    while ((rb && engine->busy.readback == rb) ||
+           (session && engine->busy.session == session))
+        pthread_cond_wait(&engine->done_cond, &engine->lock);
+}
+
+// Marks surface for readback of its next decodes, in the specified layout
+void
+readback_mark_surface(
+    xvba_driver_data_t *driver_data,
+    object_surface_p    obj_surface,
+    uint32_t            fourcc,
+    XVBA_SURFACE_FORMAT format,
+    unsigned int        pitch,
+    unsigned int        size
+)
+{
+    SurfaceReadback *rb = obj_surface->readback;
+
+    if (rb)
+        rb->idle_decodes = 0;
+
+    if (rb &&
+        rb->fourcc == fourcc &&
+        rb->width  == obj_surface->xvba_surface_width &&
+        rb->height == obj_surface->xvba_surface_height)
+        return;
+
+    if (!use_readback_prefetch())
+        return;
+
+    ReadbackEngine *engine = driver_data->readback_engine;
+    if (!engine) {
+        engine = readback_engine_create(driver_data);
+        if (!engine)
+            return;
+        driver_data->readback_engine = engine;
+    }
+
+    if (!rb) {
+        rb = calloc(1, sizeof(*rb));
+        if (!rb)
+            return;
+        obj_surface->readback = rb;
+    }
+
+    /* Frames in the previous layout are no longer of any use */
+    pthread_mutex_lock(&engine->lock);
+    readback_wait_idle(engine, rb, NULL);
+    free(rb->data);
+    rb->data   = NULL;
+    free(rb->back);
+    rb->back   = NULL;
+    rb->mtime  = 0;
+    rb->fourcc = fourcc;
+    rb->format = format;
+    rb->pitch  = pitch;
+    rb->width  = obj_surface->xvba_surface_width;
+    rb->height = obj_surface->xvba_surface_height;
+    rb->size   = size;
+    pthread_mutex_unlock(&engine->lock);
+
+    D(bug("surface 0x%08x marked for readback as %.4s\n",
+          obj_surface->base.id, (const char *)&fourcc));
+}
+
+// Queues readback of the picture decoded into surface, if it is marked
+void
+readback_queue_surface(
+    xvba_driver_data_t *driver_data,
+    object_context_p    obj_context,
+    object_surface_p    obj_surface
+)
+{
+    ReadbackEngine * const engine = driver_data->readback_engine;
+    SurfaceReadback * const rb = obj_surface->readback;
+    unsigned int i;
+
+    if (!engine || !rb || !obj_context->xvba_decoder)
+        return;
+
+    /* The application stopped reading the surface back */
+    if (++rb->idle_decodes > READBACK_EXPIRY) {
+        D(bug("surface 0x%08x no longer read back\n", obj_surface->base.id));
+        readback_destroy_surface(driver_data, obj_surface);
+        return;
+    }
+
+    pthread_mutex_lock(&engine->lock);
+    for (i = 0; i < engine->jobs_count; i++) {
+        if (engine->jobs[i].readback == rb)
+            break;
+    }
+    if (i == engine->jobs_count) {
+        /* Keep the queued jobs if the queue can't grow */
+        if (engine->jobs_count >= engine->jobs_count_max) {
+            const unsigned int jobs_count_max = engine->jobs_count_max + 4;
+            ReadbackJob * const jobs = realloc(
+                engine->jobs,
+                jobs_count_max * sizeof(*jobs)
+            );
+            if (!jobs)
+                goto end;
+            engine->jobs           = jobs;
+            engine->jobs_count_max = jobs_count_max;
+        }
+        engine->jobs_count++;
+    }
+
+    /* A picture still queued is superseded by the new one */
+    ReadbackJob * const job = &engine->jobs[i];
+    job->readback = rb;
+    job->session  = obj_context->xvba_decoder;
+    job->surface  = obj_surface->xvba_surface;
+    job->mtime    = obj_surface->mtime;
+    pthread_cond_signal(&engine->job_cond);
+end:
+    pthread_mutex_unlock(&engine->lock);
+}
+
+// Locks the frame read back from the current surface contents, if any
+const uint8_t *
+readback_lock_frame(
+    xvba_driver_data_t *driver_data,
+    object_surface_p    obj_surface,
+    uint32_t            fourcc
+)
+{
+    ReadbackEngine * const engine = driver_data->readback_engine;
+    SurfaceReadback * const rb = obj_surface->readback;
+
+    if (!engine || !rb)
+        return NULL;
+
+    pthread_mutex_lock(&engine->lock);
+
+    /* The readback in progress is what would be done here anyway */
+    while (engine->busy.readback == rb &&
+           engine->busy.mtime == obj_surface->mtime)
+        pthread_cond_wait(&engine->done_cond, &engine->lock);
+
+    if (rb->data &&
+        rb->mtime  == obj_surface->mtime &&
+        rb->fourcc == fourcc &&
+        rb->width  == obj_surface->xvba_surface_width &&
+        rb->height == obj_surface->xvba_surface_height)
+        return rb->data;
+
+    pthread_mutex_unlock(&engine->lock);
+    return NULL;
+}
+
+// Exchanges the frame read back from the current surface contents, if
+// any, with the buffer at *DATA, of SIZE bytes laid out with PITCH
+int
+readback_swap_frame(
+    xvba_driver_data_t *driver_data,
+    object_surface_p    obj_surface,
+    uint32_t            fourcc,
+    unsigned int        pitch,
+    unsigned int        size,
+    void              **data
+)
+{
+    SurfaceReadback * const rb = obj_surface->readback;
+
+    if (!rb || rb->pitch != pitch || rb->size != size)
+        return 0;
+    if (!readback_lock_frame(driver_data, obj_surface, fourcc))
+        return 0;
+
+    /* The buffer given back only holds stale pixels */
+    uint8_t * const frame = rb->data;
+    rb->data  = *data;
+    rb->mtime = 0;
+    *data     = frame;
+    readback_unlock_frame(driver_data);
+    return 1;
+}
+
+// Unlocks the frame returned by readback_lock_frame()
+void
+readback_unlock_frame(xvba_driver_data_t *driver_data)
+{
+    ReadbackEngine * const engine = driver_data->readback_engine;
+
+    pthread_mutex_unlock(&engine->lock);
+}
+
+// Cancels readbacks of surface and releases its frames
+void
+readback_destroy_surface(
+    xvba_driver_data_t *driver_data,
+    object_surface_p    obj_surface
+)
+{
+    ReadbackEngine * const engine = driver_data->readback_engine;
+    SurfaceReadback * const rb = obj_surface->readback;
+
+    if (!rb)
+        return;
+
+    if (engine) {
+        pthread_mutex_lock(&engine->lock);
+        readback_wait_idle(engine, rb, NULL);
+        pthread_mutex_unlock(&engine->lock);
+    }
+    free(rb->data);
+    free(rb->back);
+    free(rb);
+    obj_surface->readback = NULL;
+}
+
+// Cancels readbacks of surfaces decoded through session
+void
+readback_cancel_session(
+    xvba_driver_data_t *driver_data,
+    XVBASession        *session
+)
+{
+    ReadbackEngine * const engine = driver_data->readback_engine;
+
+    if (!engine || !session)
+        return;
+
+    pthread_mutex_lock(&engine->lock);
+    readback_wait_idle(engine, NULL, session);
+    pthread_mutex_unlock(&engine->lock);
+}
@@ -0,0 +1,106 @@
+/*
+ *  xvba_readback.h - vaGetImage() readbacks ahead of time
+ *
+ *  xvba-video (C) 2009-2011 Splitted-Desktop Systems
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#ifndef XVBA_READBACK_H
+#define XVBA_READBACK_H
+
+#include "xvba_driver.h"
+
+typedef struct ReadbackEngine ReadbackEngine;
+
+/* Frames of a surface read back as soon as they are decoded. They are
+   laid out as an image of that format, at the surface size */
+typedef struct SurfaceReadback {
+    uint32_t            fourcc;
+    XVBA_SURFACE_FORMAT format;
+    unsigned int        pitch;
+    unsigned int        width;
+    unsigned int        height;
+    unsigned int        size;
+    uint8_t            *data;           /* last frame read back */
+    uint64_t            mtime;          /* surface contents time of data */
+    uint8_t            *back;           /* frame being read back */
+    unsigned int        idle_decodes;   /* decodes since the last vaGetImage() */
+} SurfaceReadback;
+
+// Marks surface for readback of its next decodes, in the specified layout
+void
+readback_mark_surface(
+    xvba_driver_data_t *driver_data,
+    object_surface_p    obj_surface,
+    uint32_t            fourcc,
+    XVBA_SURFACE_FORMAT format,
+    unsigned int        pitch,
+    unsigned int        size
+) attribute_hidden;
+
+// Queues readback of the picture decoded into surface, if it is marked
+void
+readback_queue_surface(
+    xvba_driver_data_t *driver_data,
+    object_context_p    obj_context,
+    object_surface_p    obj_surface
+) attribute_hidden;
+
+// Locks the frame read back from the current surface contents, if any
+const uint8_t *
+readback_lock_frame(
+    xvba_driver_data_t *driver_data,
+    object_surface_p    obj_surface,
+    uint32_t            fourcc
+) attribute_hidden;
+
+// Exchanges the frame read back from the current surface contents, if
+// any, with the buffer at *DATA, of SIZE bytes laid out with PITCH
+int
+readback_swap_frame(
+    xvba_driver_data_t *driver_data,
+    object_surface_p    obj_surface,
+    uint32_t            fourcc,
+    unsigned int        pitch,
+    unsigned int        size,
+    void              **data
+) attribute_hidden;
+
+// Unlocks the frame returned by readback_lock_frame()
+void
+readback_unlock_frame(xvba_driver_data_t *driver_data)
+    attribute_hidden;
+
+// Cancels readbacks of surface and releases its frames
+void
+readback_destroy_surface(
+    xvba_driver_data_t *driver_data,
+    object_surface_p    obj_surface
+) attribute_hidden;
+
+// Cancels readbacks of surfaces decoded through session
+void
+readback_cancel_session(
+    xvba_driver_data_t *driver_data,
+    XVBASession        *session
+) attribute_hidden;
+
+// Stops the readback thread
+void
+readback_engine_destroy(xvba_driver_data_t *driver_data)
+    attribute_hidden;
+
+#endif /* XVBA_READBACK_H */
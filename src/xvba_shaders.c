@@ -0,0 +1,1173 @@
+/*
+ *  xvba_shaders.c - XvBA backend for VA-API (fragment shader generator)
+ *
+ *  xvba-video (C) 2009-2011 Splitted-Desktop Systems
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include "sysdeps.h"
+#include <stdarg.h>
+#include "utils.h"
+#include "xvba_shaders.h"
+
+#define DEBUG 1
+#include "debug.h"
+
+/* BT.601 YCbCr to RGB conversion (see the former YV12.cg shader) */
+static const float yuv2rgb[3][4] = {
+    { 1.16438356f,  0.00000000f,  1.59602678f, 0.0f },
+    { 1.16438356f, -0.39176229f, -0.81296764f, 0.0f },
+    { 1.16438356f,  2.01723214f,  0.00000000f, 0.0f },
+};
+
+/* BT.601 RGB to YCbCr conversion, with the (16/255, 0.5, 0.5) offsets */
+static const float rgb2yuv[3][4] = {
+    {  0.25678824f,  0.50412941f,  0.09790588f, 0.06274510f },
+    { -0.14822290f, -0.29099279f,  0.43921569f, 0.50196078f },
+    {  0.43921569f, -0.36778831f, -0.07142737f, 0.50196078f },
+};
+
+typedef struct {
+    char               *text;
+    unsigned int        length;
+    unsigned int        max_length;
+    unsigned int        features;
+} ShaderText;
+
+// Append formatted string to program source
+static void
+emit(ShaderText *st, const char *format, ...)
+{
+    va_list args;
+    int n;
+
+    if (!st->text)
+        return;
+
+    va_start(args, format);
+    n = vsnprintf(st->text + st->length, st->max_length - st->length,
+                  format, args);
+    va_end(args);
+    if (n < 0)
+        goto error;
+
+    if (st->length + n >= st->max_length) {
+        unsigned int max_length = st->max_length;
+        while (st->length + n >= max_length)
+            max_length *= 2;
+        char * const text = realloc(st->text, max_length);
+        if (!text)
+            goto error;
+        st->text       = text;
+        st->max_length = max_length;
+
+        va_start(args, format);
+        vsnprintf(st->text + st->length, st->max_length - st->length,
+                  format, args);
+        va_end(args);
+    }
+    st->length += n;
+    return;
+
+error:
+    free(st->text);
+    st->text = NULL;
+}
+
+// Sample texture unit at normalized coordinates
+static void
+emit_tex(
+    ShaderText *st,
+    const char *dst,
+    const char *coord,
+    unsigned int unit,
+    const char *size
+)
+{
+    if (st->features & SHADER_FEATURE_TEXTURE_RECT) {
+        emit(st, "MUL tc, %s, %s.xyxy;\n", coord, size);
+        emit(st, "TEX %s, tc, texture[%u], RECT;\n", dst, unit);
+    }
+    else
+        emit(st, "TEX %s, %s, texture[%u], 2D;\n", dst, coord, unit);
+}
+
+// Sample texture unit with Evergreen swizzle fix-up. Since neighbouring
+// texels are no longer adjacent in memory, bilinear filtering is done
+// manually from the four nearest texel centers
+static void
+emit_evergreen_tap(
+    ShaderText *st,
+    const char *dst,
+    const char *coord,
+    unsigned int unit,
+    const char *size
+)
+{
+    const unsigned int n_params = SHADER_EVERGREEN_PARAMS(st->features);
+    unsigned int i, j;
+
+    emit(st, "MAD ep.xy, %s, %s, -k0.x;\n", coord, size);
+    emit(st, "FLR eb.xy, ep;\n");
+    emit(st, "SUB ef.xy, ep, eb;\n");
+    emit(st, "ADD eb.xy, eb, k0.x;\n");
+    for (j = 0; j < 4; j++) {
+        emit(st, "ADD ec.xy, eb, { %d.0, %d.0, 0.0, 0.0 };\n", j & 1, j >> 1);
+        emit(st, "MAX ec.xy, ec, k0.x;\n");
+        emit(st, "MIN ec.xy, ec, lim;\n");
+        for (i = 0; i < n_params; i++) {
+            /* swap_l(v) + swap_r(v), see the former Evergreen.cg shader */
+            emit(st, "MUL es.xy, ec, mixParams[%u];\n", i);
+            emit(st, "FLR es.xy, es;\n");
+            emit(st, "MUL es.xy, es, mixParams[%u].zwzw;\n", i);
+            emit(st, "ADD er.xy, ec, mixParams[%u].zwzw;\n", i);
+            emit(st, "MUL et.xy, er, mixParams[%u];\n", i);
+            emit(st, "FLR et.xy, et;\n");
+            emit(st, "MUL et.xy, et, mixParams[%u].zwzw;\n", i);
+            emit(st, "MAD er.xy, et, -k1.x, er;\n");
+            emit(st, "MAD ec.xy, es, k1.x, er;\n");
+        }
+        emit(st, "MUL ec.xy, ec, %s.zwzw;\n", size);
+        emit_tex(st, j == 0 ? "e0" : j == 1 ? "e1" : j == 2 ? "e2" : "e3",
+                 "ec", unit, size);
+    }
+    emit(st, "LRP e0, ef.x, e1, e0;\n");
+    emit(st, "LRP e2, ef.x, e3, e2;\n");
+    emit(st, "LRP %s, ef.y, e2, e0;\n", dst);
+}
+
+// Sample texture unit, with the Evergreen fix-up if needed
+static void
+emit_tap(
+    ShaderText *st,
+    const char *dst,
+    const char *coord,
+    unsigned int unit,
+    const char *size
+)
+{
+    if (SHADER_EVERGREEN_PARAMS(st->features) > 0)
+        emit_evergreen_tap(st, dst, coord, unit, size);
+    else
+        emit_tex(st, dst, coord, unit, size);
+}
+
+// Sample a full plane, with the bicubic scaler if needed. This is the
+// fast 4-tap B-spline filter that relies on bilinear filtering (see
+// the former Bicubic.cg shader)
+static void
+emit_plane(
+    ShaderText *st,
+    const char *dst,
+    unsigned int unit,
+    const char *size
+)
+{
+    if (SHADER_EVERGREEN_PARAMS(st->features) > 0)
+        emit(st, "ADD lim.xy, %s, -k0.x;\n", size);
+
+    if (!(st->features & SHADER_FEATURE_BICUBIC)) {
+        emit_tap(st, dst, "coord", unit, size);
+        return;
+    }
+
+    emit(st, "MAD bp.xy, coord, %s, -k0.x;\n", size);
+    emit(st, "FLR bi.xy, bp;\n");
+    if (st->features & SHADER_FEATURE_BICUBIC_LUT) {
+        /* float4 = (h0, h1, g0, g1), see ensure_hqscaler_texture() */
+        emit(st, "TEX t0, bp.xxxx, texture[%d], 1D;\n", SHADER_TEXUNIT_BICUBIC_LUT);
+        emit(st, "TEX t1, bp.yyyy, texture[%d], 1D;\n", SHADER_TEXUNIT_BICUBIC_LUT);
+        emit(st, "MOV hh.xz, t0.xxyy;\n");
+        emit(st, "MOV hh.yw, t1.xxyy;\n");
+        emit(st, "MOV gg.xz, t0.zzww;\n");
+        emit(st, "MOV gg.yw, t1.zzww;\n");
+    }
+    else {
+        emit(st, "SUB bf.xy, bp, bi;\n");
+        emit(st, "MUL t0.xy, bf, bf;\n");               // a^2
+        emit(st, "MUL t1.xy, t0, bf;\n");               // a^3
+        emit(st, "MUL gg.xy, t1, k1.x;\n");             // g0 = (2a^3
+        emit(st, "MAD gg.xy, t0, -k1.y, gg;\n");        //       - 3a^2
+        emit(st, "MAD gg.xy, bf, -k1.y, gg;\n");        //       - 3a
+        emit(st, "ADD gg.xy, gg, k1.w;\n");             //       + 5)
+        emit(st, "MUL gg.xy, gg, k0.w;\n");             //       / 6
+        emit(st, "ADD gg.zw, -gg.xyxy, k0.y;\n");       // g1 = 1 - g0
+        emit(st, "MUL t2.xy, t1, k1.y;\n");             // w1 = (3a^3
+        emit(st, "MAD t2.xy, t0, -k2.x, t2;\n");        //       - 6a^2
+        emit(st, "ADD t2.xy, t2, k1.z;\n");             //       + 4)
+        emit(st, "MUL t2.xy, t2, k0.w;\n");             //       / 6
+        emit(st, "MUL t3.xy, t1, k0.w;\n");             // w3 = a^3 / 6
+        emit(st, "RCP t0.x, gg.x;\n");
+        emit(st, "RCP t0.y, gg.y;\n");
+        emit(st, "RCP t0.z, gg.z;\n");
+        emit(st, "RCP t0.w, gg.w;\n");
+        emit(st, "MUL t2.xy, t2, t0;\n");
+        emit(st, "MUL t3.xy, t3, t0.zwzw;\n");
+        emit(st, "ADD hh.xy, t2, -k0.x;\n");            // h0 = w1 / g0 - 0.5
+        emit(st, "ADD hh.zw, t3.xyxy, k0.z;\n");        // h1 = w3 / g1 + 1.5
+    }
+    emit(st, "ADD hh, hh, bi.xyxy;\n");
+    emit(st, "MUL hh, hh, %s.zwzw;\n", size);
+    emit_tap(st, "t0", "hh.xyxy", unit, size);
+    emit_tap(st, "t1", "hh.zyzy", unit, size);
+    emit_tap(st, "t2", "hh.xwxw", unit, size);
+    emit_tap(st, "t3", "hh.zwzw", unit, size);
+    emit(st, "MUL t0, t0, gg.y;\n");
+    emit(st, "MAD t0, t2, gg.w, t0;\n");
+    emit(st, "MUL t1, t1, gg.y;\n");
+    emit(st, "MAD t1, t3, gg.w, t1;\n");
+    emit(st, "MUL %s, t0, gg.x;\n", dst);
+    emit(st, "MAD %s, t1, gg.z, %s;\n", dst, dst);
+}
+
+// Render the pixel at coord into dst, i.e. sample the source planes,
+// convert to RGB and apply ProcAmp adjustments
+static int
+emit_pixel_arb(ShaderText *st, const char *dst)
+{
+    switch (st->features & SHADER_SOURCE_MASK) {
+    case SHADER_SOURCE_RGBA:
+        emit_plane(st, "color", 0, "texSize");
+        break;
+    case SHADER_SOURCE_NV12:
+        emit_plane(st, "c0", 0, "texSize");
+        emit(st, "MUL csize, texSize, { 0.5, 0.5, 2.0, 2.0 };\n");
+        emit_plane(st, "c1", 1, "csize");
+        emit(st, "MOV yuv.x, c0.x;\n");
+        emit(st, "MOV yuv.yz, c1.xxww;\n");
+        break;
+    case SHADER_SOURCE_YV12:
+        emit_plane(st, "c0", 0, "texSize");
+        emit(st, "MUL csize, texSize, { 0.5, 0.5, 2.0, 2.0 };\n");
+        emit_plane(st, "c1", 1, "csize");
+        emit_plane(st, "c2", 2, "csize");
+        emit(st, "MOV yuv.x, c0.x;\n");
+        emit(st, "MOV yuv.y, c2.x;\n");
+        emit(st, "MOV yuv.z, c1.x;\n");
+        break;
+    case SHADER_SOURCE_INDEXED:
+        /* Split texels into the palette coordinate (c1.x) and alpha
+           (c1.w). Nibbles are offset by half a step, so that FLR and
+           FRC are exact */
+        emit_tex(st, "c0", "coord", 0, "texSize");
+        switch (st->features & SHADER_PALETTE_MASK) {
+        case SHADER_PALETTE_IA44:
+            emit(st, "MAD c1.x, c0.x, ki.x, ki.y;\n");
+            emit(st, "FRC c1.z, c1.x;\n");
+            emit(st, "SUB c1.y, c1.x, c1.z;\n");
+            emit(st, "MAD c1.x, c1.y, ki.z, ki.y;\n");
+            emit(st, "MAD c1.w, c1.z, ki.w, kj.x;\n");
+            break;
+        case SHADER_PALETTE_AI44:
+            emit(st, "MAD c1.y, c0.x, ki.x, ki.y;\n");
+            emit(st, "FRC c1.x, c1.y;\n");
+            emit(st, "SUB c1.y, c1.y, c1.x;\n");
+            emit(st, "MUL c1.w, c1.y, kj.y;\n");
+            break;
+        case SHADER_PALETTE_IA88:
+            emit(st, "MAD c1.x, c0.x, kj.z, kj.w;\n");
+            emit(st, "MOV c1.w, c0.w;\n");
+            break;
+        default:
+            return 0;
+        }
+        emit(st, "TEX color, c1.xxxx, texture[%d], 1D;\n", SHADER_TEXUNIT_PALETTE);
+        emit(st, "MOV color.w, c1.w;\n");
+        emit(st, "MUL color, color, fragment.color;\n");
+        break;
+    default:
+        return 0;
+    }
+
+    if ((st->features & SHADER_SOURCE_MASK) != SHADER_SOURCE_RGBA &&
+        (st->features & SHADER_SOURCE_MASK) != SHADER_SOURCE_INDEXED) {
+        emit(st, "MOV yuv.w, k0.y;\n");
+        emit(st, "DP4 color.x, yuv2rgb0, yuv;\n");
+        emit(st, "DP4 color.y, yuv2rgb1, yuv;\n");
+        emit(st, "DP4 color.z, yuv2rgb2, yuv;\n");
+        emit(st, "MOV color.w, k0.y;\n");
+    }
+
+    if (st->features & SHADER_FEATURE_PROCAMP) {
+        emit(st, "DP4 %s.x, colorMatrix[0], color;\n", dst);
+        emit(st, "DP4 %s.y, colorMatrix[1], color;\n", dst);
+        emit(st, "DP4 %s.z, colorMatrix[2], color;\n", dst);
+        emit(st, "MOV %s.w, color.w;\n", dst);
+    }
+    else
+        emit(st, "MOV %s, color;\n", dst);
+    return 1;
+}
+
+// Render the four bytes of the packed YUV picture held in the output
+// texel. The output texture w x h holds a (4 * w) x (2 * h / 3) picture:
+// the luma rows first, then the interleaved chroma rows (NV12), or the
+// U then V rows with two chroma rows per texture row (I420)
+static int
+emit_packing_arb(ShaderText *st)
+{
+    static const char * const comps = "xyzw";
+    unsigned int k;
+
+    emit(st, "MUL po.xy, fragment.texcoord[0], packing;\n");
+    emit(st, "FLR po.xy, po;\n");
+    emit(st, "RCP pq.x, packing.x;\n");            // size of a picture pixel
+    emit(st, "RCP pq.y, packing.y;\n");            // in source coordinates
+    emit(st, "MUL pq.xy, pq, kp;\n");
+    emit(st, "MUL pq.xy, pq, packing.zwzw;\n");
+    emit(st, "MUL pq.z, packing.y, kp.z;\n");      // picture height
+    emit(st, "MAD px, po.xxxx, k1.z, { 0.5, 1.5, 2.5, 3.5 };\n");
+    emit(st, "ADD py.x, po.y, k0.x;\n");
+    emit(st, "SGE pq.w, py.x, pq.z;\n");           // chroma rows?
+    emit(st, "SUB pv.x, po.y, pq.z;\n");           // chroma row
+    switch (st->features & SHADER_OUTPUT_MASK) {
+    case SHADER_OUTPUT_NV12:
+        emit(st, "MAD pc, po.xxxx, k1.z, { 1.0, 1.0, 3.0, 3.0 };\n");
+        emit(st, "MAD py.y, pv.x, k1.x, k0.y;\n");
+        emit(st, "MOV pv, { 0.0, 1.0, 0.0, 1.0 };\n");
+        break;
+    case SHADER_OUTPUT_I420:
+        emit(st, "MUL pv.y, pq.z, kp.x;\n");
+        emit(st, "ADD pv.z, pv.x, k0.x;\n");
+        emit(st, "SGE pv.z, pv.z, pv.y;\n");       // V plane?
+        emit(st, "MAD pv.x, -pv.z, pv.y, pv.x;\n");
+        emit(st, "MUL pv.y, packing.x, k0.x;\n");
+        emit(st, "SGE pv.w, po.x, pv.y;\n");       // odd chroma row?
+        emit(st, "MAD pv.y, -pv.w, pv.y, po.x;\n");
+        emit(st, "MAD pc, pv.yyyy, kp.w, { 1.0, 3.0, 5.0, 7.0 };\n");
+        emit(st, "MAD pv.x, pv.x, k1.x, pv.w;\n");
+        emit(st, "MAD py.y, pv.x, k1.x, k0.y;\n");
+        emit(st, "MOV pv, pv.zzzz;\n");
+        break;
+    default:
+        return 0;
+    }
+    emit(st, "LRP px, pq.w, pc, px;\n");
+    emit(st, "LRP py.x, pq.w, py.y, py.x;\n");
+
+    for (k = 0; k < 4; k++) {
+        emit(st, "MUL coord.x, px.%c, pq.x;\n", comps[k]);
+        emit(st, "MUL coord.y, py.x, pq.y;\n");
+        if (!emit_pixel_arb(st, "pc"))
+            return 0;
+        emit(st, "MOV pc.w, k0.y;\n");
+        emit(st, "LRP ps, pv.%c, rgb2yuv2, rgb2yuv1;\n", comps[k]);
+        emit(st, "LRP ps, pq.w, ps, rgb2yuv0;\n");
+        emit(st, "DP4 pk.%c, ps, pc;\n", comps[k]);
+    }
+    emit(st, "MOV result.color, pk;\n");
+    return 1;
+}
+
+// Generate ARB fragment program
+static char *
+generate_arb(unsigned int features)
+{
+    const unsigned int source   = features & SHADER_SOURCE_MASK;
+    const unsigned int output   = features & SHADER_OUTPUT_MASK;
+    const unsigned int n_params = SHADER_EVERGREEN_PARAMS(features);
+    ShaderText st;
+    unsigned int i;
+    int success;
+
+    st.length     = 0;
+    st.max_length = 4096;
+    st.text       = malloc(st.max_length);
+    st.features   = features;
+
+    emit(&st, "!!ARBfp1.0\n");
+    emit(&st, "PARAM texSize = program.local[%d];\n", SHADER_PARAM_TEXTURE_SIZE);
+    if (n_params > 0)
+        emit(&st, "PARAM mixParams[%u] = { program.local[%d..%d] };\n",
+             n_params, SHADER_PARAM_EVERGREEN,
+             SHADER_PARAM_EVERGREEN + n_params - 1);
+    if (features & SHADER_FEATURE_PROCAMP)
+        emit(&st, "PARAM colorMatrix[4] = { program.local[%d..%d] };\n",
+             SHADER_PARAM_PROCAMP, SHADER_PARAM_PROCAMP + 3);
+    emit(&st, "PARAM k0 = { 0.5, 1.0, 1.5, 0.16666667 };\n");
+    emit(&st, "PARAM k1 = { 2.0, 3.0, 4.0, 5.0 };\n");
+    emit(&st, "PARAM k2 = { 6.0, 0.0, 0.0, 0.0 };\n");
+    if (source == SHADER_SOURCE_INDEXED) {
+        /* 255/16, 0.5/16, 1/16, 16/15 and -0.5/15, 1/15, 255/256, 0.5/256 */
+        emit(&st, "PARAM ki = { 15.9375, 0.03125, 0.0625, 1.06666667 };\n");
+        emit(&st, "PARAM kj = { -0.03333333, 0.06666667, 0.99609375, 0.001953125 };\n");
+    }
+    else if (source != SHADER_SOURCE_RGBA) {
+        for (i = 0; i < 3; i++) {
+            /* Fold the (-16/255, -0.5, -0.5) offsets into the matrix */
+            const float * const m = yuv2rgb[i];
+            emit(&st, "PARAM yuv2rgb%u = { %.8f, %.8f, %.8f, %.8f };\n",
+                 i, m[0], m[1], m[2],
+                 m[3] - m[0] * 0.0625f - (m[1] + m[2]) * 0.5f);
+        }
+    }
+    if (output != SHADER_OUTPUT_RGBA) {
+        emit(&st, "PARAM packing = program.local[%d];\n", SHADER_PARAM_PACKING);
+        emit(&st, "PARAM kp = { 0.25, 1.5, 0.66666667, 8.0 };\n");
+        for (i = 0; i < 3; i++) {
+            const float * const m = rgb2yuv[i];
+            emit(&st, "PARAM rgb2yuv%u = { %.8f, %.8f, %.8f, %.8f };\n",
+                 i, m[0], m[1], m[2], m[3]);
+        }
+    }
+    emit(&st, "TEMP coord, csize, tc, lim, color, yuv, c0, c1, c2;\n");
+    emit(&st, "TEMP bp, bi, bf, hh, gg, t0, t1, t2, t3;\n");
+    emit(&st, "TEMP ep, eb, ef, ec, es, er, et, e0, e1, e2, e3;\n");
+    if (output != SHADER_OUTPUT_RGBA)
+        emit(&st, "TEMP po, pq, px, py, pc, pv, ps, pk;\n");
+
+    if (output != SHADER_OUTPUT_RGBA)
+        success = emit_packing_arb(&st);
+    else {
+        /* Texture coordinates are normalized internally */
+        if (features & SHADER_FEATURE_TEXTURE_RECT)
+            emit(&st, "MUL coord, fragment.texcoord[0], texSize.zwzw;\n");
+        else
+            emit(&st, "MOV coord, fragment.texcoord[0];\n");
+        success = emit_pixel_arb(&st, "result.color");
+    }
+    if (!success) {
+        free(st.text);
+        return NULL;
+    }
+    emit(&st, "END\n");
+    return st.text;
+}
+
+// Generate GLSL fragment shader, this mirrors generate_arb()
+static char *
+generate_glsl(unsigned int features)
+{
+    const unsigned int source   = features & SHADER_SOURCE_MASK;
+    const unsigned int output   = features & SHADER_OUTPUT_MASK;
+    const unsigned int n_params = SHADER_EVERGREEN_PARAMS(features);
+    const char *sampler, *tex;
+    ShaderText st;
+    unsigned int i;
+
+    st.length     = 0;
+    st.max_length = 4096;
+    st.text       = malloc(st.max_length);
+    st.features   = features;
+
+    if (features & SHADER_FEATURE_TEXTURE_RECT) {
+        sampler = "sampler2DRect";
+        tex     = "texture2DRect(t, c * size.xy)";
+    }
+    else {
+        sampler = "sampler2D";
+        tex     = "texture2D(t, c)";
+    }
+
+    emit(&st, "#version 110\n");
+    if (features & SHADER_FEATURE_TEXTURE_RECT)
+        emit(&st, "#extension GL_ARB_texture_rectangle : enable\n");
+    emit(&st, "uniform vec4 params[%d];\n",
+         output != SHADER_OUTPUT_RGBA ?
+         SHADER_PARAM_PACKING + 1 : SHADER_PARAM_PROCAMP + 4);
+    switch (source) {
+    case SHADER_SOURCE_INDEXED:
+        emit(&st, "uniform sampler1D texture%d;\n", SHADER_TEXUNIT_PALETTE);
+        emit(&st, "uniform %s texture0;\n", sampler);
+        break;
+    case SHADER_SOURCE_YV12:
+        emit(&st, "uniform %s texture2;\n", sampler);
+        /* fall-through */
+    case SHADER_SOURCE_NV12:
+        emit(&st, "uniform %s texture1;\n", sampler);
+        /* fall-through */
+    default:
+        emit(&st, "uniform %s texture0;\n", sampler);
+        break;
+    }
+    if (features & SHADER_FEATURE_BICUBIC_LUT)
+        emit(&st, "uniform sampler1D texture%d;\n", SHADER_TEXUNIT_BICUBIC_LUT);
+
+    /* Sample texture at normalized coordinates */
+    emit(&st, "vec4 tex(%s t, vec2 c, vec4 size) {\n", sampler);
+    emit(&st, "  return %s;\n", tex);
+    emit(&st, "}\n");
+
+    /* Sample texture, with the Evergreen fix-up if needed */
+    emit(&st, "vec4 tap(%s t, vec2 c, vec4 size) {\n", sampler);
+    if (n_params > 0) {
+        emit(&st, "  vec2 p = c * size.xy - 0.5;\n");
+        emit(&st, "  vec2 b = floor(p), f = p - b;\n");
+        emit(&st, "  vec4 e[4];\n");
+        emit(&st, "  for (int j = 0; j < 4; j++) {\n");
+        emit(&st, "    vec2 o = vec2(mod(float(j), 2.0), floor(float(j) / 2.0));\n");
+        emit(&st, "    vec2 ec = clamp(b + 0.5 + o, vec2(0.5), size.xy - 0.5);\n");
+        for (i = 0; i < n_params; i++) {
+            /* swap_l(v) + swap_r(v), see the former Evergreen.cg shader */
+            emit(&st, "    {\n");
+            emit(&st, "      vec4 m = params[%d];\n", SHADER_PARAM_EVERGREEN + i);
+            emit(&st, "      vec2 es = floor(ec * m.xy) * m.zw;\n");
+            emit(&st, "      vec2 er = ec + m.zw;\n");
+            emit(&st, "      er -= 2.0 * floor(er * m.xy) * m.zw;\n");
+            emit(&st, "      ec = 2.0 * es + er;\n");
+            emit(&st, "    }\n");
+        }
+        emit(&st, "    e[j] = tex(t, ec * size.zw, size);\n");
+        emit(&st, "  }\n");
+        emit(&st, "  return mix(mix(e[0], e[1], f.x), mix(e[2], e[3], f.x), f.y);\n");
+    }
+    else
+        emit(&st, "  return tex(t, c, size);\n");
+    emit(&st, "}\n");
+
+    /* Sample a full plane, with the bicubic scaler if needed */
+    emit(&st, "vec4 plane(%s t, vec2 c, vec4 size) {\n", sampler);
+    if (features & SHADER_FEATURE_BICUBIC) {
+        emit(&st, "  vec2 p = c * size.xy - 0.5;\n");
+        emit(&st, "  vec2 i = floor(p);\n");
+        emit(&st, "  vec4 h, g;\n");
+        if (features & SHADER_FEATURE_BICUBIC_LUT) {
+            /* vec4 = (h0, h1, g0, g1), see ensure_hqscaler_texture() */
+            emit(&st, "  vec4 hx = texture1D(texture%d, p.x);\n",
+                 SHADER_TEXUNIT_BICUBIC_LUT);
+            emit(&st, "  vec4 hy = texture1D(texture%d, p.y);\n",
+                 SHADER_TEXUNIT_BICUBIC_LUT);
+            emit(&st, "  h = vec4(hx.x, hy.x, hx.y, hy.y);\n");
+            emit(&st, "  g = vec4(hx.z, hy.z, hx.w, hy.w);\n");
+        }
+        else {
+            emit(&st, "  vec2 a = p - i, a2 = a * a, a3 = a2 * a;\n");
+            emit(&st, "  vec2 g0 = (2.0 * a3 - 3.0 * a2 - 3.0 * a + 5.0) / 6.0;\n");
+            emit(&st, "  vec2 w1 = (3.0 * a3 - 6.0 * a2 + 4.0) / 6.0;\n");
+            emit(&st, "  vec2 w3 = a3 / 6.0;\n");
+            emit(&st, "  g = vec4(g0, 1.0 - g0);\n");
+            emit(&st, "  h = vec4(w1 / g.xy - 0.5, w3 / g.zw + 1.5);\n");
+        }
+        emit(&st, "  h = (h + i.xyxy) * size.zwzw;\n");
+        emit(&st, "  vec4 t0 = tap(t, h.xy, size) * g.y + tap(t, h.xw, size) * g.w;\n");
+        emit(&st, "  vec4 t1 = tap(t, h.zy, size) * g.y + tap(t, h.zw, size) * g.w;\n");
+        emit(&st, "  return t0 * g.x + t1 * g.z;\n");
+    }
+    else
+        emit(&st, "  return tap(t, c, size);\n");
+    emit(&st, "}\n");
+
+    /* Render the pixel at normalized coordinates */
+    emit(&st, "vec4 pixel(vec2 coord) {\n");
+    emit(&st, "  vec4 size = params[%d];\n", SHADER_PARAM_TEXTURE_SIZE);
+    emit(&st, "  vec4 csize = size * vec4(0.5, 0.5, 2.0, 2.0);\n");
+
+    switch (source) {
+    case SHADER_SOURCE_RGBA:
+        emit(&st, "  vec4 color = plane(texture0, coord, size);\n");
+        break;
+    case SHADER_SOURCE_NV12:
+        emit(&st, "  vec4 uv = plane(texture1, coord, csize);\n");
+        emit(&st, "  vec4 yuv = vec4(plane(texture0, coord, size).x, uv.x, uv.w, 1.0);\n");
+        break;
+    case SHADER_SOURCE_YV12:
+        emit(&st, "  vec4 yuv = vec4(plane(texture0, coord, size).x,\n");
+        emit(&st, "                  plane(texture2, coord, csize).x,\n");
+        emit(&st, "                  plane(texture1, coord, csize).x, 1.0);\n");
+        break;
+    case SHADER_SOURCE_INDEXED:
+        emit(&st, "  vec4 c = tex(texture0, coord, size);\n");
+        switch (features & SHADER_PALETTE_MASK) {
+        case SHADER_PALETTE_IA44:
+            emit(&st, "  float v = c.x * 15.9375 + 0.03125;\n");
+            emit(&st, "  float p = (floor(v) + 0.5) / 16.0;\n");
+            emit(&st, "  float a = (fract(v) * 16.0 - 0.5) / 15.0;\n");
+            break;
+        case SHADER_PALETTE_AI44:
+            emit(&st, "  float v = c.x * 15.9375 + 0.03125;\n");
+            emit(&st, "  float p = fract(v);\n");
+            emit(&st, "  float a = floor(v) / 15.0;\n");
+            break;
+        case SHADER_PALETTE_IA88:
+            emit(&st, "  float p = c.x * 0.99609375 + 0.001953125;\n");
+            emit(&st, "  float a = c.a;\n");
+            break;
+        default:
+            free(st.text);
+            return NULL;
+        }
+        emit(&st, "  vec4 color = vec4(texture1D(texture%d, p).rgb, a) * gl_Color;\n",
+             SHADER_TEXUNIT_PALETTE);
+        break;
+    default:
+        free(st.text);
+        return NULL;
+    }
+
+    if (source != SHADER_SOURCE_RGBA && source != SHADER_SOURCE_INDEXED) {
+        emit(&st, "  vec4 color = vec4(1.0);\n");
+        for (i = 0; i < 3; i++) {
+            /* Fold the (-16/255, -0.5, -0.5) offsets into the matrix */
+            const float * const m = yuv2rgb[i];
+            emit(&st, "  color[%u] = dot(vec4(%.8f, %.8f, %.8f, %.8f), yuv);\n",
+                 i, m[0], m[1], m[2],
+                 m[3] - m[0] * 0.0625f - (m[1] + m[2]) * 0.5f);
+        }
+    }
+
+    if (features & SHADER_FEATURE_PROCAMP) {
+        emit(&st, "  return vec4(dot(params[%d], color),\n",
+             SHADER_PARAM_PROCAMP);
+        emit(&st, "              dot(params[%d], color),\n",
+             SHADER_PARAM_PROCAMP + 1);
+        emit(&st, "              dot(params[%d], color), color.a);\n",
+             SHADER_PARAM_PROCAMP + 2);
+    }
+    else
+        emit(&st, "  return color;\n");
+    emit(&st, "}\n");
+
+    emit(&st, "void main() {\n");
+    switch (output) {
+    case SHADER_OUTPUT_RGBA:
+        if (features & SHADER_FEATURE_TEXTURE_RECT)
+            emit(&st, "  vec2 coord = gl_TexCoord[0].xy * params[%d].zw;\n",
+                 SHADER_PARAM_TEXTURE_SIZE);
+        else
+            emit(&st, "  vec2 coord = gl_TexCoord[0].xy;\n");
+        emit(&st, "  gl_FragColor = pixel(coord);\n");
+        break;
+    case SHADER_OUTPUT_NV12:
+    case SHADER_OUTPUT_I420:
+        /* See emit_packing_arb() */
+        emit(&st, "  vec4 packing = params[%d];\n", SHADER_PARAM_PACKING);
+        emit(&st, "  vec2 o = floor(gl_TexCoord[0].xy * packing.xy);\n");
+        emit(&st, "  vec2 q = vec2(0.25, 1.5) / packing.xy * packing.zw;\n");
+        emit(&st, "  float ph = packing.y * 0.66666667;\n");
+        emit(&st, "  float chroma = step(ph, o.y + 0.5);\n");
+        emit(&st, "  float r = o.y - ph;\n");
+        if (output == SHADER_OUTPUT_NV12) {
+            emit(&st, "  vec4 cx = 4.0 * o.x + vec4(1.0, 1.0, 3.0, 3.0);\n");
+            emit(&st, "  float cy = 2.0 * r + 1.0;\n");
+            emit(&st, "  vec4 cv = vec4(0.0, 1.0, 0.0, 1.0);\n");
+        }
+        else {
+            emit(&st, "  float v = step(0.25 * ph, r + 0.5);\n");
+            emit(&st, "  float h = step(0.5 * packing.x, o.x);\n");
+            emit(&st, "  vec4 cx = 8.0 * (o.x - h * 0.5 * packing.x) + vec4(1.0, 3.0, 5.0, 7.0);\n");
+            emit(&st, "  float cy = 2.0 * (2.0 * (r - v * 0.25 * ph) + h) + 1.0;\n");
+            emit(&st, "  vec4 cv = vec4(v);\n");
+        }
+        emit(&st, "  vec4 px = mix(4.0 * o.x + vec4(0.5, 1.5, 2.5, 3.5), cx, chroma);\n");
+        emit(&st, "  float py = mix(o.y + 0.5, cy, chroma);\n");
+        for (i = 0; i < 3; i++) {
+            const float * const m = rgb2yuv[i];
+            emit(&st, "  vec4 rgb2yuv%u = vec4(%.8f, %.8f, %.8f, %.8f);\n",
+                 i, m[0], m[1], m[2], m[3]);
+        }
+        for (i = 0; i < 4; i++) {
+            emit(&st, "  gl_FragColor[%u] = dot(mix(rgb2yuv0, mix(rgb2yuv1, rgb2yuv2, cv[%u]), chroma),\n", i, i);
+            emit(&st, "                        vec4(pixel(vec2(px[%u], py) * q).rgb, 1.0));\n", i);
+        }
+        break;
+    default:
+        free(st.text);
+        return NULL;
+    }
+    emit(&st, "}\n");
+    return st.text;
+}
+
+/**
+ * shader_generate:
+ * @features: the shader feature set
+ * @language: the shading language
+ *
+ * Generates a fragment shader that renders the source texture planes
+ * with all the requested features in a single pass: color space
+ * conversion, Evergreen swizzle fix-up, bicubic scaling, ProcAmp
+ * adjustments and packing to YUV bytes. Both languages yield the same
+ * output and use the same texture units and parameters.
+ *
+ * Return value: the newly allocated shader source, or %NULL if the
+ *   feature set is not supported or an error occurred
+ */
+char *
+shader_generate(unsigned int features, GLShaderLanguage language)
+{
+    const unsigned int source   = features & SHADER_SOURCE_MASK;
+    const unsigned int n_params = SHADER_EVERGREEN_PARAMS(features);
+
+    /* XXX: the Evergreen workaround only applies to XvBA surfaces */
+    if (n_params > SHADER_MAX_EVERGREEN_PARAMS)
+        return NULL;
+    if (n_params > 0 && source != SHADER_SOURCE_RGBA)
+        return NULL;
+
+    /* Indices cannot be filtered, nor packed */
+    if (source == SHADER_SOURCE_INDEXED &&
+        (features & (SHADER_FEATURE_BICUBIC|SHADER_OUTPUT_MASK)))
+        return NULL;
+
+    switch (language) {
+    case GL_SHADER_LANGUAGE_ARB:
+        return generate_arb(features);
+    case GL_SHADER_LANGUAGE_GLSL:
+        return generate_glsl(features);
+    default:
+        break;
+    }
+    return NULL;
+}
+
+// Create shader object for the specified feature set and language
+static GLShaderObject *
+create_shader(unsigned int features, GLShaderLanguage language)
+{
+    GLShaderObject *shader = NULL;
+    char *shader_text;
+
+    shader_text = shader_generate(features, language);
+    if (!shader_text)
+        return NULL;
+
+    const char *shader_text_array[2] = { shader_text, NULL };
+    switch (language) {
+    case GL_SHADER_LANGUAGE_ARB:
+        shader = gl_create_shader_object(
+            shader_text_array,
+            strlen(shader_text)
+        );
+        break;
+    case GL_SHADER_LANGUAGE_GLSL:
+        shader = gl_create_glsl_shader_object(
+            shader_text_array,
+            strlen(shader_text)
+        );
+        break;
+    default:
+        break;
+    }
+    free(shader_text);
+    return shader;
+}
+
+// Determine the preferred shading language
+static GLShaderLanguage get_shader_language(void)
+{
+    static int glsl = -1;
+    GLShaderLanguage language = gl_get_shader_language();
+
+    if (glsl < 0) {
+        if (getenv_yesno("XVBA_VIDEO_GLSL", &glsl) < 0)
+            glsl = 1;
+    }
+    if (!glsl && language == GL_SHADER_LANGUAGE_GLSL) {
+        GLVTable * const gl_vtable = gl_get_vtable();
+        if (gl_vtable->has_fragment_program)
+            language = GL_SHADER_LANGUAGE_ARB;
+    }
+    return language;
+}
+
+// Create fragment program for the specified feature set
+GLShaderObject *shader_create(unsigned int features)
+{
+    GLShaderObject *shader;
+
+    /* GLSL falls back to ARB fragment programs */
+    const GLShaderLanguage language = get_shader_language();
+    shader = create_shader(features, language);
+    if (!shader && language == GL_SHADER_LANGUAGE_GLSL &&
+        gl_get_vtable()->has_fragment_program)
+        shader = create_shader(features, GL_SHADER_LANGUAGE_ARB);
+    if (!shader) {
+        D(bug("ERROR: unsupported shader features 0x%x\n", features));
+        return NULL;
+    }
+    D(bug("Created %s shader for features 0x%x\n",
+          shader->language == GL_SHADER_LANGUAGE_GLSL ? "GLSL" : "ARB",
+          features));
+    return shader;
+}
+
+typedef struct {
+    unsigned int        features;
+    GLShaderObject     *shader;
+} ShaderCacheEntry;
+
+struct _ShaderCache {
+    ShaderCacheEntry   *entries;
+    unsigned int        entries_count;
+    unsigned int        entries_count_max;
+};
+
+// Create a shader cache
+ShaderCache *shader_cache_new(void)
+{
+    return calloc(1, sizeof(ShaderCache));
+}
+
+// Destroy shader cache, and all its programs
+void shader_cache_destroy(ShaderCache *cache)
+{
+    unsigned int i;
+
+    if (!cache)
+        return;
+
+    for (i = 0; i < cache->entries_count; i++) {
+        ShaderCacheEntry * const entry = &cache->entries[i];
+        if (entry->shader) {
+            gl_destroy_shader_object(entry->shader);
+            entry->shader = NULL;
+        }
+    }
+    free(cache->entries);
+    free(cache);
+}
+
+// Lookup fragment program for the specified feature set, creating it if needed
+GLShaderObject *shader_cache_lookup(ShaderCache *cache, unsigned int features)
+{
+    ShaderCacheEntry *entry;
+    unsigned int i;
+
+    if (!cache)
+        return NULL;
+
+    for (i = 0; i < cache->entries_count; i++) {
+        entry = &cache->entries[i];
+        if (entry->features == features)
+            return entry->shader;
+    }
+
+    /* Grow into a temporary, so that the shaders already cached are
+       kept if that fails */
+    if (cache->entries_count >= cache->entries_count_max) {
+        const unsigned int entries_count_max = cache->entries_count_max + 4;
+        entry = realloc(cache->entries, entries_count_max * sizeof(*entry));
+        if (!entry)
+            return NULL;
+        cache->entries           = entry;
+        cache->entries_count_max = entries_count_max;
+    }
+    entry = &cache->entries[cache->entries_count++];
+    entry->features = features;
+    entry->shader   = NULL;
+
+    /* Failed feature sets are remembered too, so that they are not
+       rebuilt on every frame */
+    entry->shader = shader_create(features);
+    return entry->shader;
+}
+
+#ifdef TEST_SHADERS
+#include "utils_x11.h"
+
+/* Render all feature sets with both ARB fragment programs and GLSL
+   shaders into an offscreen FBO, and check the outputs match. This
+   can run on llvmpipe, e.g. with LIBGL_ALWAYS_SOFTWARE=1 */
+
+#define TEST_WIDTH      64
+#define TEST_HEIGHT     48
+#define TEST_TOLERANCE  2
+
+static GLuint
+create_test_texture(GLenum target, GLenum format, unsigned int width,
+                    unsigned int height, unsigned int bpp, unsigned int seed)
+{
+    unsigned char *data;
+    unsigned int i;
+    GLuint texture;
+
+    texture = gl_create_texture(target, format, width, height);
+    if (!texture)
+        abort();
+
+    data = malloc(width * height * bpp);
+    if (!data)
+        abort();
+    for (i = 0; i < width * height * bpp; i++) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = seed >> 16;
+    }
+
+    glBindTexture(target, texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    gl_set_texture_scaling(target, GL_LINEAR);
+    glTexSubImage2D(target, 0, 0, 0, width, height, format,
+                    GL_UNSIGNED_BYTE, data);
+    glBindTexture(target, 0);
+    free(data);
+    return texture;
+}
+
+static GLuint create_test_lut(void)
+{
+    const int N = 128;
+    float data[N * 4];
+    GLuint texture;
+    int i;
+
+    texture = gl_create_texture(GL_TEXTURE_1D, GL_RGBA32F_ARB, N, 0);
+    if (!texture)
+        abort();
+
+    /* Same as ensure_hqscaler_texture() */
+    for (i = 0; i < N; i++) {
+        const float x  = (1.0f*i) / N;
+        const float x2 = x*x;
+        const float x3 = x2*x;
+        const float w0 = (1.0f/6.0f) * (     -x3 + 3.0f*x2 - 3.0f*x + 1.0f);
+        const float w1 = (1.0f/6.0f) * ( 3.0f*x3 - 6.0f*x2          + 4.0f);
+        const float w2 = (1.0f/6.0f) * (-3.0f*x3 + 3.0f*x2 + 3.0f*x + 1.0f);
+        const float w3 = (1.0f/6.0f) * (      x3);
+        data[i*4 + 0] = -1.0f + w1 / (w0 + w1) + 0.5f;
+        data[i*4 + 1] =  1.0f + w3 / (w2 + w3) + 0.5f;
+        data[i*4 + 2] = w0 + w1;
+        data[i*4 + 3] = w2 + w3;
+    }
+
+    glBindTexture(GL_TEXTURE_1D, texture);
+    gl_set_texture_scaling(GL_TEXTURE_1D, GL_NEAREST);
+    gl_set_texture_wrapping(GL_TEXTURE_1D, GL_REPEAT);
+    glTexSubImage1D(GL_TEXTURE_1D, 0, 0, N, GL_RGBA, GL_FLOAT, data);
+    glBindTexture(GL_TEXTURE_1D, 0);
+    return texture;
+}
+
+static GLuint create_test_palette(void)
+{
+    unsigned char data[256 * 4];
+    unsigned int i, seed = 7;
+    GLuint texture;
+
+    texture = gl_create_texture(GL_TEXTURE_1D, GL_RGBA, 256, 0);
+    if (!texture)
+        abort();
+
+    for (i = 0; i < sizeof(data); i++) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = seed >> 16;
+    }
+
+    glBindTexture(GL_TEXTURE_1D, texture);
+    gl_set_texture_scaling(GL_TEXTURE_1D, GL_NEAREST);
+    glTexSubImage1D(GL_TEXTURE_1D, 0, 0, 256, GL_RGBA, GL_UNSIGNED_BYTE, data);
+    glBindTexture(GL_TEXTURE_1D, 0);
+    return texture;
+}
+
+static int
+render_test(GLFramebufferObject *fbo, unsigned int features,
+            GLShaderLanguage language, unsigned char *pixels)
+{
+    static const float params[SHADER_PARAM_PACKING + 1][4] = {
+        { TEST_WIDTH, TEST_HEIGHT, 1.0f/TEST_WIDTH, 1.0f/TEST_HEIGHT },
+        { 1.0f/16, 1.0f/32,  8.0f, 16.0f },
+        { 1.0f/32, 1.0f/16, 16.0f,  8.0f },
+        { 1.0f,    1.0f,     0.0f,  0.0f },
+        { 1.0f/64, 1.0f/64, 32.0f, 32.0f },
+        { 1.10f,  0.10f, 0.00f,  0.05f },
+        { 0.00f,  0.90f, 0.10f, -0.02f },
+        { 0.05f,  0.00f, 1.00f,  0.01f },
+        { 0.00f,  0.00f, 0.00f,  1.00f },
+        { TEST_WIDTH, TEST_HEIGHT, 0.9f, 0.8f },
+    };
+    GLShaderObject *shader;
+    float tw = 1.0f, th = 1.0f;
+    unsigned int i;
+    char *text;
+
+    text = shader_generate(features, language);
+    if (!text)
+        return 0;
+    const char *text_array[2] = { text, NULL };
+    if (language == GL_SHADER_LANGUAGE_GLSL)
+        shader = gl_create_glsl_shader_object(text_array, strlen(text));
+    else
+        shader = gl_create_shader_object(text_array, strlen(text));
+    free(text);
+    if (!shader)
+        return 0;
+
+    /* Packed outputs take normalized output coordinates */
+    if ((features & SHADER_FEATURE_TEXTURE_RECT) &&
+        !(features & SHADER_OUTPUT_MASK)) {
+        tw = TEST_WIDTH;
+        th = TEST_HEIGHT;
+    }
+
+    gl_bind_framebuffer_object(fbo);
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+    gl_bind_shader_object(shader);
+    for (i = 0; i < SHADER_PARAM_PACKING + 1; i++)
+        gl_set_shader_param(shader, i, params[i]);
+    glBegin(GL_QUADS);
+    glTexCoord2f(0.1f*tw, 0.1f*th); glVertex2i(0, 0);
+    glTexCoord2f(0.1f*tw, 0.9f*th); glVertex2i(0, TEST_HEIGHT);
+    glTexCoord2f(0.8f*tw, 0.9f*th); glVertex2i(TEST_WIDTH, TEST_HEIGHT);
+    glTexCoord2f(0.8f*tw, 0.1f*th); glVertex2i(TEST_WIDTH, 0);
+    glEnd();
+    gl_unbind_shader_object(shader);
+    glReadPixels(0, 0, TEST_WIDTH, TEST_HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE,
+                 pixels);
+    gl_unbind_framebuffer_object(fbo);
+    gl_destroy_shader_object(shader);
+    return 1;
+}
+
+int main(void)
+{
+    static unsigned char arb_pixels[TEST_WIDTH * TEST_HEIGHT * 4];
+    static unsigned char glsl_pixels[TEST_WIDTH * TEST_HEIGHT * 4];
+    Display *dpy;
+    GLContextState *cs;
+    GLVTable *gl_vtable;
+    GLFramebufferObject *fbo;
+    GLuint fbo_texture, lut_texture, palette_texture, textures[3];
+    unsigned int i, source, palette, flags, n_params, output, features;
+    int rect, n_tests = 0, n_errors = 0;
+
+    dpy = XOpenDisplay(NULL);
+    if (!dpy)
+        abort();
+
+    cs = gl_create_context(dpy, DefaultScreen(dpy), NULL);
+    if (!cs)
+        abort();
+    cs->window = x11_create_window(
+        dpy, TEST_WIDTH, TEST_HEIGHT,
+        cs->visual->visual,
+        XCreateColormap(dpy, RootWindow(dpy, DefaultScreen(dpy)),
+                        cs->visual->visual, AllocNone)
+    );
+    if (!gl_set_current_context(cs, NULL))
+        abort();
+
+    gl_vtable = gl_get_vtable();
+    if (!gl_vtable || !gl_vtable->has_shading_language ||
+        !gl_vtable->has_fragment_program)
+        abort();
+
+    fbo_texture = gl_create_texture(GL_TEXTURE_2D, GL_RGBA,
+                                    TEST_WIDTH, TEST_HEIGHT);
+    fbo = gl_create_framebuffer_object(GL_TEXTURE_2D, fbo_texture,
+                                       TEST_WIDTH, TEST_HEIGHT);
+    if (!fbo)
+        abort();
+
+    lut_texture = create_test_lut();
+    gl_vtable->gl_active_texture(GL_TEXTURE0 + SHADER_TEXUNIT_BICUBIC_LUT);
+    glBindTexture(GL_TEXTURE_1D, lut_texture);
+    palette_texture = create_test_palette();
+    gl_vtable->gl_active_texture(GL_TEXTURE0 + SHADER_TEXUNIT_PALETTE);
+    glBindTexture(GL_TEXTURE_1D, palette_texture);
+
+    for (rect = 0; rect < 2; rect++) {
+        const GLenum target = rect ? GL_TEXTURE_RECTANGLE_ARB : GL_TEXTURE_2D;
+        for (source = 0; source <= SHADER_SOURCE_INDEXED; source++) {
+            memset(textures, 0, sizeof(textures));
+            switch (source) {
+            case SHADER_SOURCE_RGBA:
+                textures[0] = create_test_texture(target, GL_BGRA,
+                    TEST_WIDTH, TEST_HEIGHT, 4, 1);
+                break;
+            case SHADER_SOURCE_NV12:
+                textures[0] = create_test_texture(target, GL_LUMINANCE,
+                    TEST_WIDTH, TEST_HEIGHT, 1, 2);
+                textures[1] = create_test_texture(target, GL_LUMINANCE_ALPHA,
+                    TEST_WIDTH/2, TEST_HEIGHT/2, 2, 3);
+                break;
+            case SHADER_SOURCE_YV12:
+                textures[0] = create_test_texture(target, GL_LUMINANCE,
+                    TEST_WIDTH, TEST_HEIGHT, 1, 4);
+                textures[1] = create_test_texture(target, GL_LUMINANCE,
+                    TEST_WIDTH/2, TEST_HEIGHT/2, 1, 5);
+                textures[2] = create_test_texture(target, GL_LUMINANCE,
+                    TEST_WIDTH/2, TEST_HEIGHT/2, 1, 6);
+                break;
+            case SHADER_SOURCE_INDEXED:
+                /* [0] = IA44/AI44 indices, [2] = IA88 indices */
+                textures[0] = create_test_texture(target, GL_LUMINANCE,
+                    TEST_WIDTH, TEST_HEIGHT, 1, 8);
+                textures[2] = create_test_texture(target, GL_LUMINANCE_ALPHA,
+                    TEST_WIDTH, TEST_HEIGHT, 2, 9);
+                for (i = 0; i < 3; i += 2) {
+                    glBindTexture(target, textures[i]);
+                    gl_set_texture_scaling(target, GL_NEAREST);
+                }
+                glBindTexture(target, 0);
+                break;
+            }
+            for (i = 3; i-- > 0;) {
+                gl_vtable->gl_active_texture(GL_TEXTURE0 + i);
+                glBindTexture(target, textures[i]);
+            }
+
+            for (palette = 0;
+                 palette <= (source == SHADER_SOURCE_INDEXED ?
+                             SHADER_PALETTE_IA88 : 0);
+                 palette += SHADER_PALETTE_AI44) {
+                if (source == SHADER_SOURCE_INDEXED)
+                    glBindTexture(target, textures[
+                        palette == SHADER_PALETTE_IA88 ? 2 : 0]);
+                for (flags = 0; flags < 8 * 3; flags++) {
+                    for (n_params = 0; n_params <= SHADER_MAX_EVERGREEN_PARAMS; n_params++) {
+                        output    = (flags / 8) * SHADER_OUTPUT_NV12;
+                        features  = source | palette;
+                        features |= (flags % 8) * SHADER_FEATURE_PROCAMP;
+                        features |= SHADER_FEATURE_EVERGREEN(n_params) | output;
+                        if (rect)
+                            features |= SHADER_FEATURE_TEXTURE_RECT;
+                        if ((features & SHADER_FEATURE_BICUBIC_LUT) &&
+                            !(features & SHADER_FEATURE_BICUBIC))
+                            continue;
+                        if (n_params > 0 && source != SHADER_SOURCE_RGBA)
+                            continue;
+                        if (source == SHADER_SOURCE_INDEXED &&
+                            (features & (SHADER_FEATURE_BICUBIC|SHADER_OUTPUT_MASK)))
+                            continue;
+
+                        n_tests++;
+                        if (!render_test(fbo, features, GL_SHADER_LANGUAGE_ARB,
+                                         arb_pixels) ||
+                            !render_test(fbo, features, GL_SHADER_LANGUAGE_GLSL,
+                                         glsl_pixels)) {
+                            printf("features 0x%04x: compile error\n", features);
+                            n_errors++;
+                            continue;
+                        }
+
+                        int max_diff = 0;
+                        for (i = 0; i < sizeof(arb_pixels); i++) {
+                            const int diff = abs(arb_pixels[i] - glsl_pixels[i]);
+                            if (max_diff < diff)
+                                max_diff = diff;
+                        }
+                        printf("features 0x%04x: max diff %d\n", features, max_diff);
+                        if (max_diff > TEST_TOLERANCE)
+                            n_errors++;
+                    }
+                }
+            }
+            glDeleteTextures(3, textures);
+        }
+    }
+    printf("%d/%d feature sets match\n", n_tests - n_errors, n_tests);
+
+    glDeleteTextures(1, &palette_texture);
+    glDeleteTextures(1, &lut_texture);
+    gl_destroy_framebuffer_object(fbo);
+    glDeleteTextures(1, &fbo_texture);
+    gl_set_current_context(cs, NULL);
+    gl_destroy_context(cs);
+    XCloseDisplay(dpy);
+    return n_errors != 0;
+}
+#endif
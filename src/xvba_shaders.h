@@ -0,0 +1,97 @@
+/*
+ *  xvba_shaders.h - XvBA backend for VA-API (fragment shader generator)
+ *
+ *  xvba-video (C) 2009-2011 Splitted-Desktop Systems
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#ifndef XVBA_SHADERS_H
+#define XVBA_SHADERS_H
+
+#include "utils_glx.h"
+
+/* Shader features. A feature set is the source format ORed with any
+   combination of the feature flags and the number of Evergreen mix
+   params. Each feature set maps to exactly one fragment program */
+enum {
+    SHADER_SOURCE_RGBA          = 0,            // texture[0] = RGBA
+    SHADER_SOURCE_NV12          = 1,            // texture[0] = Y, [1] = UV
+    SHADER_SOURCE_YV12          = 2,            // texture[0] = Y, [1] = V, [2] = U
+    SHADER_SOURCE_INDEXED       = 3,            // texture[0] = index/alpha, [1] = palette
+    SHADER_SOURCE_MASK          = 0x03,
+
+    SHADER_FEATURE_TEXTURE_RECT = 1 << 2,       // GL_TEXTURE_RECTANGLE_ARB source
+    SHADER_FEATURE_PROCAMP      = 1 << 3,       // ProcAmp color matrix
+    SHADER_FEATURE_BICUBIC      = 1 << 4,       // Bicubic scaler
+    SHADER_FEATURE_BICUBIC_LUT  = 1 << 5,       // Bicubic weights from 1D texture
+
+    /* Output packing, bits 6..8 hold the number of Evergreen params */
+    SHADER_OUTPUT_RGBA          = 0,            // RGBA pixels
+    SHADER_OUTPUT_NV12          = 1 << 9,       // Y, then UV bytes in RGBA texels
+    SHADER_OUTPUT_I420          = 2 << 9,       // Y, U, then V bytes in RGBA texels
+    SHADER_OUTPUT_MASK          = 3 << 9,
+
+    /* Layout of the indexed source texels */
+    SHADER_PALETTE_IA44         = 0,            // index in the high nibble
+    SHADER_PALETTE_AI44         = 1 << 11,      // alpha in the high nibble
+    SHADER_PALETTE_IA88         = 2 << 11,      // luminance = index, alpha
+    SHADER_PALETTE_MASK         = 3 << 11,
+};
+
+#define SHADER_EVERGREEN_SHIFT          6
+#define SHADER_EVERGREEN_MASK           (7 << SHADER_EVERGREEN_SHIFT)
+#define SHADER_FEATURE_EVERGREEN(n)     ((n) << SHADER_EVERGREEN_SHIFT)
+#define SHADER_EVERGREEN_PARAMS(f)      (((f) & SHADER_EVERGREEN_MASK) >> SHADER_EVERGREEN_SHIFT)
+#define SHADER_MAX_EVERGREEN_PARAMS     4
+
+/* Program parameters, shared by all feature sets. This maps to
+   program.local[] for ARB fragment programs or params[] for GLSL */
+enum {
+    SHADER_PARAM_TEXTURE_SIZE   = 0,            // (w, h, 1/w, 1/h) of texture[0]
+    SHADER_PARAM_EVERGREEN      = 1,            // mix_params[0..3]
+    SHADER_PARAM_PROCAMP        = 5,            // color_matrix[0..3]
+    SHADER_PARAM_PACKING        = 9,            // (w, h) of output, (sx, sy) of source
+};
+
+/* Texture unit holding the bicubic weights (GL_TEXTURE_1D) */
+#define SHADER_TEXUNIT_BICUBIC_LUT      3
+
+/* Texture unit holding the palette of indexed sources (GL_TEXTURE_1D) */
+#define SHADER_TEXUNIT_PALETTE          1
+
+typedef struct _ShaderCache ShaderCache;
+
+// Generate fragment shader source for the specified feature set
+char *shader_generate(unsigned int features, GLShaderLanguage language)
+    attribute_hidden;
+
+// Create fragment program for the specified feature set
+GLShaderObject *shader_create(unsigned int features)
+    attribute_hidden;
+
+// Create a shader cache
+ShaderCache *shader_cache_new(void)
+    attribute_hidden;
+
+// Destroy shader cache, and all its programs
+void shader_cache_destroy(ShaderCache *cache)
+    attribute_hidden;
+
+// Lookup fragment program for the specified feature set, creating it if needed
+GLShaderObject *shader_cache_lookup(ShaderCache *cache, unsigned int features)
+    attribute_hidden;
+
+#endif /* XVBA_SHADERS_H */
@@ -43,6 +43,12 @@ static const xvba_subpic_format_map_t xvba_subpic_formats_map[] = {
     { XVBA_FAKE, { VA_FOURCC('R','G','B','A'), VA_LSB_FIRST, 32,
                    32, 0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000 },
       VA_SUBPICTURE_GLOBAL_ALPHA },
+    { XVBA_FAKE, { VA_FOURCC('I','A','4','4'), VA_MSB_FIRST, 8, },
+      VA_SUBPICTURE_GLOBAL_ALPHA },
+    { XVBA_FAKE, { VA_FOURCC('A','I','4','4'), VA_MSB_FIRST, 8, },
+      VA_SUBPICTURE_GLOBAL_ALPHA },
+    { XVBA_FAKE, { VA_FOURCC('I','A','8','8'), VA_MSB_FIRST, 16, },
+      VA_SUBPICTURE_GLOBAL_ALPHA },
     { 0, }
 };
 
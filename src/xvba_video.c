@@ -24,6 +24,7 @@
 #include "xvba_buffer.h"
 #include "xvba_decode.h"
 #include "xvba_image.h"
+#include "xvba_readback.h"
 #include "xvba_subpic.h"
 #include "xvba_video_x11.h"
 #if USE_GLX
@@ -99,6 +100,7 @@ ensure_surface_size(
         return VA_STATUS_SUCCESS;
 
     if (obj_surface->xvba_surface) {
+        readback_destroy_surface(driver_data, obj_surface);
         xvba_destroy_surface(obj_surface->xvba_surface);
         obj_surface->xvba_surface = NULL;
     }
@@ -127,6 +129,7 @@ destroy_surface(xvba_driver_data_t *driver_data, object_surface_p obj_surface)
 {
     destroy_subpictures(driver_data, obj_surface);
     destroy_surface_buffers(driver_data, obj_surface);
+    readback_destroy_surface(driver_data, obj_surface);
 
     if (obj_surface->xvba_surface) {
         xvba_destroy_surface(obj_surface->xvba_surface);
@@ -134,6 +137,17 @@ destroy_surface(xvba_driver_data_t *driver_data, object_surface_p obj_surface)
     }
 }
 
+// Mark surface contents as changed
+void
+surface_update_mtime(object_surface_p obj_surface)
+{
+    /* Surfaces are recycled, so the time is global to tell a new
+       surface from a previous one at the same location. Surfaces may
+       be updated from several threads at once */
+    static uint64_t mtime;
+    obj_surface->mtime = __sync_add_and_fetch(&mtime, 1);
+}
+
 // Query surface status
 int
 query_surface_status(
@@ -158,11 +172,13 @@ query_surface_status(
             return 0;
         if (!obj_surface->xvba_surface)
             return 0;
+        pthread_mutex_lock(&driver_data->decode_lock);
         status = xvba_sync_surface(
             obj_context->xvba_decoder,
             obj_surface->xvba_surface,
             XVBA_GET_SURFACE_STATUS
         );
+        pthread_mutex_unlock(&driver_data->decode_lock);
         if (status < 0)
             return -1;
         if (status == XVBA_COMPLETED)
@@ -194,8 +210,13 @@ sync_surface(
     int status;
 
     while ((status = query_surface_status(driver_data, obj_context, obj_surface, &surface_status)) == 0 &&
-           surface_status != VASurfaceReady)
+           surface_status != VASurfaceReady) {
+        /* Block on the GL fences of the flips, if any */
+        if (surface_status == VASurfaceDisplaying &&
+            sync_surface_glx(driver_data, obj_surface, XVBA_SYNC_TIMEOUT) == XVBA_COMPLETED)
+            continue;
         delay_usec(XVBA_SYNC_DELAY);
+    }
     return status;
 }
 
@@ -221,9 +242,11 @@ int surface_add_association(
         }
     }
 
-    /* Check that we have not reached the maximum subpictures capacity yet */
-    if (obj_surface->assocs_count >= XVBA_MAX_SUBPICTURES)
-        return -1;
+    /* XVBA_MAX_SUBPICTURES is only a soft limit: subpictures are drawn
+       in batches from the GLX atlas, so more of them are still fine */
+    if (obj_surface->assocs_count == XVBA_MAX_SUBPICTURES)
+        D(bug("surface 0x%08x has more than %d subpictures\n",
+              obj_surface->base.id, XVBA_MAX_SUBPICTURES));
 
     /* Append this subpicture association */
     SubpictureAssociationP *assocs;
@@ -489,6 +512,8 @@ xvba_CreateSurfaces(
         obj_surface->output_surfaces             = NULL;
         obj_surface->output_surfaces_count       = 0;
         obj_surface->output_surfaces_count_max   = 0;
+        obj_surface->glx_output                  = NULL;
+        obj_surface->glx_seqno                   = 0;
         obj_surface->width                       = width;
         obj_surface->height                      = height;
         obj_surface->gl_surface                  = NULL;
@@ -502,6 +527,10 @@ xvba_CreateSurfaces(
         obj_surface->assocs_count                = 0;
         obj_surface->assocs_count_max            = 0;
         obj_surface->putimage_hacks              = NULL;
+        obj_surface->readback                    = NULL;
+        obj_surface->derived_image               = VA_INVALID_ID;
+        obj_surface->lock_count                  = 0;
+        surface_update_mtime(obj_surface);
         surfaces[i] = va_surface;
     }
 
@@ -534,13 +563,16 @@ xvba_DestroySurfaces(
         destroy_surface(driver_data, obj_surface);
 
 #if USE_GLX
-        if (obj_surface->gl_surface) {
-            glx_surface_unref(driver_data, obj_surface->gl_surface);
-            obj_surface->gl_surface = NULL;
-        }
+        glx_surface_release(driver_data, obj_surface);
 #endif
 
         for (j = 0; j < obj_surface->output_surfaces_count; j++) {
+#if USE_GLX
+            object_output_p const obj_output = obj_surface->output_surfaces[j];
+            if (obj_output && obj_output->glx)
+                glx_output_surface_forget(driver_data, obj_output->glx,
+                                          obj_surface);
+#endif
             output_surface_unref(driver_data, obj_surface->output_surfaces[j]);
             obj_surface->output_surfaces[j] = NULL;
         }
@@ -575,6 +607,7 @@ xvba_DestroySurfaces(
         obj_surface->assocs_count_max = 0;
 
         putimage_hacks_disable(driver_data, obj_surface);
+        destroy_derived_image(driver_data, obj_surface);
 
         object_heap_free(&driver_data->surface_heap, (object_base_p)obj_surface);
     }
@@ -1024,7 +1057,8 @@ xvba_SetDisplayAttributes(
             static uint64_t mtime;
             const int dst_attr_index = dst_attr - driver_data->va_display_attrs;
             ASSERT(dst_attr_index < XVBA_MAX_DISPLAY_ATTRIBUTES);
-            driver_data->va_display_attrs_mtime[dst_attr_index] = ++mtime;
+            driver_data->va_display_attrs_mtime[dst_attr_index] =
+                __sync_add_and_fetch(&mtime, 1);
         }
     }
     return VA_STATUS_SUCCESS;
@@ -1107,15 +1141,41 @@ xvba_LockSurface(
     void              **buffer
 )
 {
-    if (fourcc)          *fourcc          = VA_FOURCC('N','V','1','2');
-    if (luma_stride)     *luma_stride     = 0;
-    if (chroma_u_stride) *chroma_u_stride = 0;
-    if (chroma_v_stride) *chroma_v_stride = 0;
-    if (luma_offset)     *luma_offset     = 0;
-    if (chroma_u_offset) *chroma_u_offset = 0;
-    if (chroma_v_offset) *chroma_v_offset = 0;
-    if (buffer_name)     *buffer_name     = 0;
-    if (buffer)          *buffer          = NULL;
+    XVBA_DRIVER_DATA_INIT;
+
+    object_surface_p obj_surface = XVBA_SURFACE(surface);
+    if (!obj_surface)
+        return VA_STATUS_ERROR_INVALID_SURFACE;
+
+    /* The surface is locked through its derived image */
+    object_image_p obj_image = derive_surface_image(driver_data, obj_surface);
+    if (!obj_image)
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+
+    VAStatus status = sync_derived_image(driver_data, surface);
+    if (status != VA_STATUS_SUCCESS) {
+        release_derived_image(driver_data, obj_image);
+        return status;
+    }
+
+    object_buffer_p obj_buffer = XVBA_BUFFER(obj_image->image.buf);
+    if (!obj_buffer) {
+        release_derived_image(driver_data, obj_image);
+        return VA_STATUS_ERROR_INVALID_BUFFER;
+    }
+
+    /* NV12: U and V samples are interleaved in the same plane */
+    const VAImage * const image = &obj_image->image;
+    if (fourcc)          *fourcc          = image->format.fourcc;
+    if (luma_stride)     *luma_stride     = image->pitches[0];
+    if (chroma_u_stride) *chroma_u_stride = image->pitches[1];
+    if (chroma_v_stride) *chroma_v_stride = image->pitches[1];
+    if (luma_offset)     *luma_offset     = image->offsets[0];
+    if (chroma_u_offset) *chroma_u_offset = image->offsets[1];
+    if (chroma_v_offset) *chroma_v_offset = image->offsets[1] + 1;
+    if (buffer_name)     *buffer_name     = image->buf;
+    if (buffer)          *buffer          = obj_buffer->buffer_data;
+    ++obj_surface->lock_count;
     return VA_STATUS_SUCCESS;
 }
 
@@ -1126,6 +1186,23 @@ xvba_UnlockSurface(
     VASurfaceID         surface
 )
 {
-    return VA_STATUS_SUCCESS;
+    XVBA_DRIVER_DATA_INIT;
+
+    object_surface_p obj_surface = XVBA_SURFACE(surface);
+    if (!obj_surface)
+        return VA_STATUS_ERROR_INVALID_SURFACE;
+
+    /* Only the references taken by vaLockSurface() are dropped here */
+    if (obj_surface->lock_count == 0)
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+
+    object_image_p obj_image = XVBA_IMAGE(obj_surface->derived_image);
+    if (!obj_image)
+        return VA_STATUS_ERROR_INVALID_SURFACE;
+
+    --obj_surface->lock_count;
+    VAStatus status = commit_derived_image(driver_data, surface);
+    release_derived_image(driver_data, obj_image);
+    return status;
 }
 #endif
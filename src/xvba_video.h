@@ -26,6 +26,9 @@
 /* Define wait delay (in microseconds) between two XVBASyncSurface() calls */
 #define XVBA_SYNC_DELAY 10
 
+/* Define max time (in microseconds) to block on a GL fence in vaSyncSurface() */
+#define XVBA_SYNC_TIMEOUT 20000
+
 typedef enum {
     XVBA_CODEC_MPEG1 = 1,
     XVBA_CODEC_MPEG2,
@@ -98,6 +101,12 @@ struct object_surface {
     unsigned int                assocs_count;
     unsigned int                assocs_count_max;
     struct PutImageHacks       *putimage_hacks; /* vaPutImage() hacks */
+    struct SurfaceReadback     *readback;       /* vaGetImage() prefetch */
+    VAImageID                   derived_image;  /* vaDeriveImage() cache */
+    unsigned int                lock_count;     /* vaLockSurface() calls */
+    uint64_t                    mtime;          /* contents change time */
+    struct object_glx_output   *glx_output;     /* GLX output last put to */
+    unsigned int                glx_seqno;      /* seqno of that put */
     unsigned int                used_for_decoding : 1;
 };
 
@@ -115,6 +124,11 @@ int surface_remove_association(
     SubpictureAssociationP      assoc
 ) attribute_hidden;
 
+// Mark surface contents as changed
+void
+surface_update_mtime(object_surface_p obj_surface)
+    attribute_hidden;
+
 // Query surface status
 int
 query_surface_status(
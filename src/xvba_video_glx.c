@@ -31,18 +31,13 @@
 #include "utils.h"
 #include "utils_x11.h"
 #include "utils_glx.h"
+#include "xvba_shaders.h"
+#include "frame_pacer.h"
+#include "flip_scheduler.h"
+#include "umsgring.h"
 #include <dlfcn.h>
 #include <GL/glext.h>
 #include <GL/glxext.h>
-#include "shaders/Evergreen_mix_1.h"
-#include "shaders/Evergreen_mix_2.h"
-#include "shaders/Evergreen_mix_3.h"
-#include "shaders/Evergreen_mix_4.h"
-#include "shaders/YV12.h"
-#include "shaders/NV12.h"
-#include "shaders/ProcAmp.h"
-#include "shaders/Bicubic.h"
-#include "shaders/Bicubic_FLOAT.h"
 
 #define DEBUG 1
 #include "debug.h"
@@ -83,6 +78,26 @@ static inline int use_putsurface_fast(void)
     return g_use_putsurface_fast;
 }
 
+/* Defined to 1 to only display the latest surface at each flip */
+#define USE_PUTSURFACE_MAILBOX 0
+
+static int get_use_putsurface_mailbox_env(void)
+{
+    int use_putsurface_mailbox;
+    if (getenv_yesno("XVBA_VIDEO_PUTSURFACE_MAILBOX",
+                     &use_putsurface_mailbox) < 0)
+        use_putsurface_mailbox = USE_PUTSURFACE_MAILBOX;
+    return use_putsurface_mailbox;
+}
+
+static inline int use_putsurface_mailbox(void)
+{
+    static int g_use_putsurface_mailbox = -1;
+    if (g_use_putsurface_mailbox < 0)
+        g_use_putsurface_mailbox = get_use_putsurface_mailbox_env();
+    return g_use_putsurface_mailbox;
+}
+
 static int get_evergreen_workaround_env(void)
 {
     int evergreen_workaround;
@@ -107,6 +122,112 @@ static inline int get_evergreen_workaround(void)
     return g_evergreen_workaround;
 }
 
+/* Defined to the max amount of unused GL textures to keep around (MB) */
+#define GL_POOL_SIZE 64
+
+/* Largest pool size whose byte count fits into an unsigned int (MB) */
+#define GL_POOL_SIZE_MAX 4095
+
+static int get_gl_pool_size_env(void)
+{
+    int gl_pool_size;
+    if (getenv_int("XVBA_VIDEO_GL_POOL_SIZE", &gl_pool_size) < 0 ||
+        gl_pool_size < 0)
+        gl_pool_size = GL_POOL_SIZE;
+    return MIN(gl_pool_size, GL_POOL_SIZE_MAX);
+}
+
+static inline unsigned int get_gl_pool_size(void)
+{
+    static int g_gl_pool_size = -1;
+    if (g_gl_pool_size < 0)
+        g_gl_pool_size = get_gl_pool_size_env();
+    return (unsigned int)((uint64_t)g_gl_pool_size * 1024 * 1024);
+}
+
+/* Defined to the number of buffers each output composes into */
+#define OUTPUT_BUFFERS 3
+
+static int get_output_buffers_env(void)
+{
+    int output_buffers;
+    if (getenv_int("XVBA_VIDEO_OUTPUT_BUFFERS", &output_buffers) < 0 ||
+        output_buffers < 1)
+        output_buffers = OUTPUT_BUFFERS;
+    return MIN(output_buffers, XVBA_MAX_OUTPUT_BUFFERS);
+}
+
+static inline unsigned int get_output_buffers(void)
+{
+    static int g_output_buffers = -1;
+    if (g_output_buffers < 0)
+        g_output_buffers = get_output_buffers_env();
+    return g_output_buffers;
+}
+
+/* Defined to the number of PBOs image uploads are streamed through, or
+   0 to upload images synchronously from client memory */
+#define IMAGE_PBOS 2
+
+static int get_image_pbos_env(void)
+{
+    int image_pbos;
+    if (getenv_int("XVBA_VIDEO_IMAGE_PBOS", &image_pbos) < 0 ||
+        image_pbos < 0)
+        image_pbos = IMAGE_PBOS;
+    return MIN(image_pbos, XVBA_MAX_IMAGE_PBOS);
+}
+
+static inline unsigned int get_image_pbos(void)
+{
+    static int g_image_pbos = -1;
+    if (g_image_pbos < 0)
+        g_image_pbos = get_image_pbos_env();
+    return g_image_pbos;
+}
+
+/* Defined to the size of the texture subpictures are packed into, or
+   0 to draw each subpicture from its own texture */
+#define SUBPICTURE_ATLAS_SIZE 2048
+
+static int get_subpicture_atlas_size_env(void)
+{
+    int atlas_size;
+    if (getenv_int("XVBA_VIDEO_SUBPICTURE_ATLAS_SIZE", &atlas_size) < 0 ||
+        atlas_size < 0)
+        atlas_size = SUBPICTURE_ATLAS_SIZE;
+    return atlas_size;
+}
+
+static inline unsigned int get_subpicture_atlas_size(void)
+{
+    static int g_subpicture_atlas_size = -1;
+    if (g_subpicture_atlas_size < 0)
+        g_subpicture_atlas_size = get_subpicture_atlas_size_env();
+    return g_subpicture_atlas_size;
+}
+
+/* Defined to the number of render threads shared by all outputs, or 0
+   to have a render thread per output */
+#define RENDER_THREADS 0
+
+static int get_render_threads_env(void)
+{
+    int render_threads;
+    if (getenv_int("XVBA_VIDEO_RENDER_THREADS", &render_threads) < 0 ||
+        render_threads < 0)
+        render_threads = RENDER_THREADS;
+    return MIN(render_threads, XVBA_MAX_RENDER_THREADS);
+}
+
+static inline unsigned int get_render_threads(void)
+{
+    static int g_render_threads = -1;
+    if (g_render_threads < 0)
+        g_render_threads = get_render_threads_env();
+    return g_render_threads;
+}
+
 // Prototypes
 static VAStatus
 do_put_surface_glx(
@@ -120,6 +241,12 @@ do_put_surface_glx(
     unsigned int         flags
 );
 
+static VAStatus
+do_put_mosaic_glx(
+    xvba_driver_data_t  *driver_data,
+    object_glx_output_p  obj_output
+);
+
 static VAStatus
 flip_surface(
     xvba_driver_data_t *driver_data,
@@ -132,40 +259,238 @@ glx_output_surface_lock(object_glx_output_p obj_output);
 static void
 glx_output_surface_unlock(object_glx_output_p obj_output);
 
+static inline void
+glx_output_surface_set_seqno(
+    object_glx_output_p obj_output,
+    object_surface_p    obj_surface,
+    unsigned int        seqno
+);
+
 // Renderer thread messenger
-#define MSG2PTR(v) ((void *)(uintptr_t)(v))
-#define PTR2MSG(v) ((uintptr_t)(void *)(v))
+#define RENDER_QUEUE_SIZE 16
 enum {
     MSG_TYPE_QUIT = 1,
-    MSG_TYPE_FLIP
+    MSG_TYPE_FLIP,
+    MSG_TYPE_PUT_SURFACE,
+    MSG_TYPE_PUT_MOSAIC,
+    MSG_TYPE_ATTACH,
+    MSG_TYPE_DETACH,
+    MSG_TYPE_FORGET_SURFACE
 };
 
-typedef struct {
+typedef struct put_surface_msg PutSurfaceMsg;
+struct put_surface_msg {
+    unsigned int        type;
+    object_glx_output_p obj_output;
     object_surface_p    obj_surface;
     VARectangle         src_rect;
     VARectangle         dst_rect;
+    VARectangle         cliprects[XVBA_MAX_CLIPRECTS];
+    unsigned int        num_cliprects;
     unsigned int        flags;
-}  PutSurfaceMsg;
+    unsigned int        seqno;
+};
 
-// Renderer thread
-typedef struct {
+/* Max number of outputs flipped on the same vblank */
+#define RENDER_MAX_FLIPS 16
+
+// Renderer thread, servicing one or more outputs
+struct glx_render_thread {
     xvba_driver_data_t *driver_data;
-    object_glx_output_p obj_output;
-} RenderThreadArgs;
+    unsigned int        refcount;
+    pthread_t           thread;
+    UMsgRing           *comm;
+    pthread_mutex_t     comm_lock;
+    pthread_mutex_t     ack_lock;
+    pthread_cond_t      ack_cond;
+    unsigned int        ack_seqno;
+    unsigned int        sync_seqno;     // messages waiting for an ack
+    GLContextState     *gl_context;     // context shared by the outputs
+    GLResourcePool     *gl_pool;        // share group of gl_context
+    FramePacer         *pacer;
+    FlipScheduler      *scheduler;
+};
+
+static pthread_mutex_t g_render_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Vertex of the subpicture quads drawn at once, see GL_T2F_C4UB_V3F */
+typedef struct {
+    GLfloat             s, t;
+    GLubyte             r, g, b, a;
+    GLfloat             x, y, z;
+} GLXSubpictureVertex;
+
+/* Texture the subpicture images are packed into, shared by all outputs */
+typedef struct glx_subpicture_atlas GLXSubpictureAtlas;
+struct glx_subpicture_atlas {
+    GLTextureAtlas      *atlas;
+    object_image_glx_p  *images;        // images with a region
+    unsigned int         images_count;
+    unsigned int         images_count_max;
+    unsigned int         pass;          // render_subpictures() calls
+    GLXSubpictureVertex *vertices;
+    unsigned int         vertices_count;
+    unsigned int         vertices_count_max;
+};
+
+static pthread_mutex_t g_subpicture_atlas_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Guards the VA/GLX surfaces shared by VA surfaces of the same size */
+static pthread_mutex_t g_glx_surfaces_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static const unsigned int VIDEO_REFRESH = 1000000 / 60;
 
-static void *render_thread(void *arg)
+/* Max time to wait for a flip to complete (usec) */
+#define GL_SYNC_TIMEOUT 100000
+
+// Sends a copy of the message to the render thread, returning its seqno
+static unsigned int
+render_thread_send_msg(GLXRenderThread *rt, const PutSurfaceMsg *msg)
+{
+    object_glx_output_p const obj_output = msg->obj_output;
+    PutSurfaceMsg *ring_msg;
+    unsigned int seqno = 0;
+
+    /* Several outputs may send messages from different threads, but
+       the ring only supports a single producer. Messages are filled in
+       beforehand so that the lock only covers the copy */
+    pthread_mutex_lock(&rt->comm_lock);
+    ring_msg  = msg_ring_alloc(rt->comm);
+    *ring_msg = *msg;
+    switch (msg->type) {
+    case MSG_TYPE_PUT_SURFACE:
+    case MSG_TYPE_PUT_MOSAIC:
+        /* Puts are numbered in the order the render thread gets them */
+        seqno = ring_msg->seqno = ++obj_output->put_seqno;
+        if (msg->obj_surface) {
+            glx_output_surface_lock(obj_output);
+            glx_output_surface_set_seqno(obj_output, msg->obj_surface, seqno);
+            glx_output_surface_unlock(obj_output);
+        }
+        break;
+    case MSG_TYPE_DETACH:
+    case MSG_TYPE_FORGET_SURFACE:
+        seqno = ++rt->sync_seqno;
+        break;
+    }
+    msg_ring_push(rt->comm);
+    pthread_mutex_unlock(&rt->comm_lock);
+    return seqno;
+}
+
+// Find the pending surface to be displayed at the same location
+static unsigned int
+find_pending_surface(
+    const PutSurfaceMsg *pending,
+    unsigned int         num_pending,
+    const VARectangle   *dst_rect
+)
+{
+    unsigned int i;
+
+    for (i = 0; i < num_pending; i++) {
+        const VARectangle * const r = &pending[i].dst_rect;
+        if (r->x == dst_rect->x && r->y == dst_rect->y &&
+            r->width == dst_rect->width && r->height == dst_rect->height)
+            break;
+    }
+    return i;
+}
+
+// Render video surface from render thread message
+static inline void
+render_surface_msg(
+    xvba_driver_data_t  *driver_data,
+    object_glx_output_p  obj_output,
+    const PutSurfaceMsg *msg
+)
+{
+    glx_output_surface_lock(obj_output);
+    do_put_surface_glx(
+        driver_data,
+        obj_output,
+        msg->obj_surface,
+        &msg->src_rect,
+        &msg->dst_rect,
+        msg->cliprects, msg->num_cliprects,
+        msg->flags
+    );
+    glx_output_surface_unlock(obj_output);
+}
+
+// Record the vertical blank the last flip was displayed on
+static void pace_vblank(FramePacer *pacer, object_glx_output_p obj_output)
+{
+    uint64_t time;
+    int64_t msc;
+
+    if (gl_get_vblank(obj_output->render_context, &time, &msc)) {
+        frame_pacer_add_vblank(pacer, time, msc);
+        return;
+    }
+
+    /* Fallback to the swap completion time, i.e. assume vsync */
+    if (gl_wait_sync(obj_output->gl_sync, GL_SYNC_TIMEOUT) <= 0)
+        glFinish();
+    frame_pacer_add_vblank(pacer, get_ticks_usec(), FRAME_PACER_NO_MSC);
+}
+
+// Check whether the output context is the one shared by the thread outputs
+static inline int
+render_thread_is_shared_context(GLXRenderThread *rt, GLContextState *cs)
+{
+    return rt->gl_context && cs->context == rt->gl_context->context;
+}
+
+// Releases an output view of the shared context (render thread)
+static void
+render_thread_release_context(GLXRenderThread *rt, GLContextState *cs)
+{
+    GLContextState none_cs;
+
+    /* The output window is about to be destroyed */
+    if (glXGetCurrentContext() == cs->context &&
+        glXGetCurrentDrawable() == cs->window) {
+        none_cs.display = cs->display;
+        none_cs.window  = None;
+        none_cs.visual  = NULL;
+        none_cs.context = NULL;
+        gl_set_current_context(&none_cs, NULL);
+    }
+    free(cs);
+}
+
+// Makes the output context current (render thread)
+static int
+render_thread_use_context(
+    GLXRenderThread    *rt,
+    object_glx_output_p obj_output,
+    int                 need_drawable
+)
 {
-    RenderThreadArgs * const   args        = arg;
-    xvba_driver_data_t * const driver_data = args->driver_data;
-    object_glx_output_p const  obj_output  = args->obj_output;
-    unsigned int stop = 0, num_surfaces = 0;
-    uint64_t next;
+    GLContextState * const cs = obj_output->render_context;
 
-    /* RenderThreadArgs were allocated in the main thread and the
-       render thread is responsible for deallocating them */
-    free(args);
+    if (!cs)
+        return 0;
+
+    /* Puts only render to the output FBOs, so the shared context can
+       stay current on whatever output drawable it was last flipped to */
+    if (need_drawable ||
+        !render_thread_is_shared_context(rt, cs) ||
+        glXGetCurrentContext() != cs->context) {
+        if (!gl_set_current_context(cs, NULL))
+            return 0;
+    }
+    gl_set_bgcolor(obj_output->bgcolor);
+    return 1;
+}
+
+// Attach output to the render thread (render thread)
+static void
+render_thread_do_attach(GLXRenderThread *rt, object_glx_output_p obj_output)
+{
+    xvba_driver_data_t * const driver_data = rt->driver_data;
+    int num, den;
 
 #if 0
     /* Create a new X connection so that glXSwapBuffers() doesn't get
@@ -177,177 +502,717 @@ static void *render_thread(void *arg)
        same underlying X11 display (XDisplayString() shall match). */
     Display *x11_dpy;
     x11_dpy = XOpenDisplay(driver_data->x11_dpy_name);
-    if (!x11_dpy) {
-        obj_output->render_thread_ok = 0;
-        return NULL;
-    }
+    if (!x11_dpy)
+        goto error;
 #else
     /* Use the xvba-video global X11 display */
     Display * const x11_dpy = driver_data->x11_dpy_local;
 #endif
 
-    GLContextState old_cs;
-    obj_output->render_context = gl_create_context(
-        x11_dpy,
-        driver_data->x11_screen,
-        obj_output->gl_context
-    );
-    if (!obj_output->render_context) {
-        obj_output->render_thread_ok = 0;
-        return NULL;
+    /* Outputs sharing GL objects are all rendered from the same
+       context, only the drawable they are flipped to differs */
+    if (!rt->gl_context) {
+        rt->gl_context = gl_create_context(
+            x11_dpy,
+            driver_data->x11_screen,
+            obj_output->gl_context
+        );
+        if (!rt->gl_context)
+            goto error;
+        gl_init_context(rt->gl_context);
+        rt->gl_pool = gl_resource_pool_ref(obj_output->gl_pool);
     }
-    gl_set_current_context(obj_output->render_context, &old_cs);
-    gl_init_context(obj_output->render_context);
 
-    while (!stop) {
-        PutSurfaceMsg *msg;
+    if (rt->gl_pool == obj_output->gl_pool) {
+        obj_output->render_context = malloc(sizeof(*rt->gl_context));
+        if (!obj_output->render_context)
+            goto error;
+        *obj_output->render_context = *rt->gl_context;
+        obj_output->render_context->window = obj_output->gl_context->window;
+        obj_output->render_context->visual = NULL;
+    }
+    else {
+        obj_output->render_context = gl_create_context(
+            x11_dpy,
+            driver_data->x11_screen,
+            obj_output->gl_context
+        );
+        if (!obj_output->render_context)
+            goto error;
+        gl_init_context(obj_output->render_context);
+    }
+    if (!gl_set_current_context(obj_output->render_context, NULL))
+        goto error;
 
-        // Handle message
-        next = get_ticks_usec() + VIDEO_REFRESH;
-        msg = async_queue_timed_pop(obj_output->render_comm, next);
-        if (!msg) {
-            /* No new surface received during this video time slice,
-               make an explicit flip with what was received so far */
-            goto do_flip;
-        }
+    obj_output->render_pending = calloc(
+        RENDER_QUEUE_SIZE,
+        sizeof(*obj_output->render_pending)
+    );
+    if (!obj_output->render_pending)
+        goto error;
+    obj_output->render_num_pending  = 0;
+    obj_output->render_num_surfaces = 0;
 
-        switch (PTR2MSG(msg)) {
-        case MSG_TYPE_QUIT:
-            stop = 1;
-            break;
-        case MSG_TYPE_FLIP:
-        do_flip:
-            if (num_surfaces > 0) {
-                glx_output_surface_lock(obj_output);
-                gl_resize(obj_output->window.width, obj_output->window.height);
-                flip_surface(driver_data, obj_output);
-                gl_bind_framebuffer_object(obj_output->gl_surface->fbo);
-                glClear(GL_COLOR_BUFFER_BIT);
-                gl_unbind_framebuffer_object(obj_output->gl_surface->fbo);
-                glClear(GL_COLOR_BUFFER_BIT);
-                glx_output_surface_unlock(obj_output);
-                num_surfaces = 0;
-            }
-            break;
-        default:
-            glx_output_surface_lock(obj_output);
-            do_put_surface_glx(
-                driver_data,
-                obj_output,
-                msg->obj_surface,
-                &msg->src_rect,
-                &msg->dst_rect,
-                NULL, 0,
-                msg->flags
-            );
-            glx_output_surface_unlock(obj_output);
-            free(msg);
-            num_surfaces++;
-            break;
+    if (!flip_scheduler_add(rt->scheduler, obj_output))
+        goto error;
+
+    /* Flips are scheduled on the vertical blanks of the display the
+       first output is on */
+    if (flip_scheduler_get_count(rt->scheduler) == 1 &&
+        gl_get_refresh_rate(obj_output->render_context, &num, &den))
+        frame_pacer_set_refresh_rate(rt->pacer, num, den);
+    return;
+
+error:
+    obj_output->render_thread_ok = 0;
+}
+
+// Acknowledge the message a producer is waiting on (render thread)
+static void render_thread_ack(GLXRenderThread *rt)
+{
+    pthread_mutex_lock(&rt->ack_lock);
+    rt->ack_seqno++;
+    pthread_cond_broadcast(&rt->ack_cond);
+    pthread_mutex_unlock(&rt->ack_lock);
+}
+
+// Detach output from the render thread (render thread)
+static void
+render_thread_do_detach(GLXRenderThread *rt, object_glx_output_p obj_output)
+{
+    flip_scheduler_remove(rt->scheduler, obj_output);
+
+    /* Pending puts were already rendered, unless in mailbox mode */
+    if (obj_output->use_mailbox)
+        obj_output->render_dropped += obj_output->render_num_pending;
+    obj_output->render_num_pending  = 0;
+    obj_output->render_num_surfaces = 0;
+    free(obj_output->render_pending);
+    obj_output->render_pending = NULL;
+
+    if (obj_output->render_context) {
+        if (render_thread_is_shared_context(rt, obj_output->render_context))
+            render_thread_release_context(rt, obj_output->render_context);
+        else
+            gl_destroy_context(obj_output->render_context);
+        obj_output->render_context = NULL;
+    }
+    render_thread_ack(rt);
+}
+
+// Drop the pending puts of a surface about to be destroyed (render thread)
+static void
+render_thread_do_forget_surface(GLXRenderThread *rt, const PutSurfaceMsg *msg)
+{
+    object_glx_output_p const obj_output = msg->obj_output;
+    PutSurfaceMsg * const     pending    = obj_output->render_pending;
+    unsigned int i, n;
+
+    for (i = 0, n = 0; i < obj_output->render_num_pending; i++) {
+        if (pending[i].obj_surface == msg->obj_surface) {
+            if (obj_output->use_mailbox)
+                obj_output->render_dropped++;
+            continue;
         }
+        if (n != i)
+            pending[n] = pending[i];
+        n++;
     }
-    gl_set_current_context(&old_cs, NULL);
-    return NULL;
+    obj_output->render_num_pending = n;
+    render_thread_ack(rt);
 }
 
-// Ensure FBO and shader extensions are available
-static inline int ensure_extensions(void)
+// Flip output surface (render thread)
+static void
+render_thread_do_flip(GLXRenderThread *rt, object_glx_output_p obj_output)
 {
-    GLVTable * const gl_vtable = gl_get_vtable();
+    xvba_driver_data_t * const driver_data = rt->driver_data;
+    unsigned int i;
 
-    return (gl_vtable &&
-            gl_vtable->has_framebuffer_object &&
-            gl_vtable->has_fragment_program &&
-            gl_vtable->has_multitexture);
+    if (obj_output->render_num_surfaces == 0)
+        return;
+
+    if (!render_thread_use_context(rt, obj_output, 1))
+        return;
+
+    if (obj_output->use_mailbox) {
+        for (i = 0; i < obj_output->render_num_pending; i++)
+            render_surface_msg(driver_data, obj_output,
+                               &obj_output->render_pending[i]);
+    }
+    obj_output->render_presented += obj_output->render_num_pending;
+    obj_output->render_num_pending = 0;
+
+    glx_output_surface_lock(obj_output);
+    gl_resize(obj_output->window.width, obj_output->window.height);
+    flip_surface(driver_data, obj_output);
+    pthread_cond_broadcast(&obj_output->flip_cond);
+    gl_bind_framebuffer_object(obj_output->gl_surface->fbo);
+    glClear(GL_COLOR_BUFFER_BIT);
+    gl_unbind_framebuffer_object(obj_output->gl_surface->fbo);
+    glClear(GL_COLOR_BUFFER_BIT);
+    obj_output->gl_surface_stale = 0;
+    obj_output->gl_surfaces_valid = 0;
+    if (obj_output->gl_surfaces_count < 2)
+        obj_output->damage.is_valid = 0;
+    glx_output_surface_unlock(obj_output);
+    obj_output->render_num_surfaces = 0;
 }
 
-// Ensure FBO surface is create
-static int fbo_ensure(object_glx_surface_p obj_glx_surface)
+// Schedule a flip of the surfaces rendered so far (render thread)
+static void
+render_thread_queue_flip(GLXRenderThread *rt, object_glx_output_p obj_output)
 {
-    if (!obj_glx_surface->fbo) {
-        obj_glx_surface->fbo = gl_create_framebuffer_object(
-            obj_glx_surface->target,
-            obj_glx_surface->texture,
-            obj_glx_surface->width,
-            obj_glx_surface->height
+    /* The surfaces received so far are due for the next vblank */
+    if (obj_output->render_num_surfaces++ == 0) {
+        const uint64_t now = get_ticks_usec();
+        frame_pacer_add_frame(rt->pacer, now);
+        flip_scheduler_queue(
+            rt->scheduler,
+            obj_output,
+            frame_pacer_get_deadline(rt->pacer, now)
         );
-        if (!obj_glx_surface->fbo)
-            return 0;
     }
-    ASSERT(obj_glx_surface->fbo);
-    return 1;
 }
 
-// Destroy HW image
-static void destroy_hw_image_glx(
-    xvba_driver_data_t *driver_data,
-    object_image_p      obj_image
+// Drop a pending put superseded before it was rendered (render thread)
+static void
+render_thread_drop_surface(
+    object_glx_output_p  obj_output,
+    const PutSurfaceMsg *msg
 )
 {
+    object_surface_p const obj_surface = msg->obj_surface;
+
+    obj_output->render_dropped++;
+
+    /* The surface won't be displayed, unless it was put again since */
+    glx_output_surface_lock(obj_output);
+    if (obj_surface->glx_output == obj_output &&
+        obj_surface->glx_seqno  == msg->seqno) {
+        obj_surface->glx_seqno = obj_output->flip_seqno;
+        pthread_cond_broadcast(&obj_output->flip_cond);
+    }
+    glx_output_surface_unlock(obj_output);
+}
+
+// Queue video surface for display (render thread)
+static void
+render_thread_do_put_surface(GLXRenderThread *rt, const PutSurfaceMsg *msg)
+{
+    xvba_driver_data_t * const driver_data = rt->driver_data;
+    object_glx_output_p const  obj_output  = msg->obj_output;
+    PutSurfaceMsg * const      pending     = obj_output->render_pending;
     unsigned int i;
 
-    if (!obj_image || !obj_image->hw.glx)
+    if (!obj_output->render_context)
         return;
 
-    object_image_glx_p const hwi = obj_image->hw.glx;
+    if (!obj_output->use_mailbox &&
+        !render_thread_use_context(rt, obj_output, 0))
+        return;
 
-    if (hwi->num_textures > 0) {
-        glDeleteTextures(hwi->num_textures, hwi->textures);
-        for (i = 0; i < hwi->num_textures; i++) {
-            hwi->formats[i]  = GL_NONE;
-            hwi->textures[i] = 0;
-        }
-        hwi->num_textures = 0;
+    /* A surface displayed at the same location as a pending one
+       supersedes it. In mailbox mode, surfaces are only rendered at
+       flip time so that the superseded ones are never rendered */
+    i = find_pending_surface(
+        pending,
+        obj_output->render_num_pending,
+        &msg->dst_rect
+    );
+    if (i < obj_output->render_num_pending) {
+        if (obj_output->use_mailbox)
+            render_thread_drop_surface(obj_output, &pending[i]);
     }
-
-    if (hwi->shader) {
-        gl_destroy_shader_object(hwi->shader);
-        hwi->shader = NULL;
+    else if (obj_output->render_num_pending < RENDER_QUEUE_SIZE)
+        obj_output->render_num_pending++;
+    if (i < obj_output->render_num_pending) {
+        pending[i] = *msg;
+        if (!obj_output->use_mailbox)
+            render_surface_msg(driver_data, obj_output, msg);
+    }
+    else {
+        /* Too many locations, render it right away */
+        if (render_thread_use_context(rt, obj_output, 0))
+            render_surface_msg(driver_data, obj_output, msg);
+        obj_output->render_presented++;
     }
 
-    free(hwi);
-    obj_image->hw.glx = NULL;
+    obj_output->render_seqno = msg->seqno;
+    render_thread_queue_flip(rt, obj_output);
 }
 
-// Create HW image
-static VAStatus
-create_hw_image_glx(
-    xvba_driver_data_t *driver_data,
-    object_image_p      obj_image,
-    XVBASession        *session
-)
+// Render all the tiles of the output mosaic (render thread)
+static void
+render_thread_do_put_mosaic(GLXRenderThread *rt, const PutSurfaceMsg *msg)
 {
-    object_image_glx_p hwi = calloc(1, sizeof(*hwi));
-    if (!hwi)
-        return VA_STATUS_ERROR_ALLOCATION_FAILED;
-    obj_image->hw.glx = hwi;
+    xvba_driver_data_t * const driver_data = rt->driver_data;
+    object_glx_output_p const  obj_output  = msg->obj_output;
 
-    const char **shader_fp = NULL;
-    unsigned int shader_fp_length = 0;
-    switch (obj_image->image.format.fourcc) {
-    case VA_FOURCC('B','G','R','A'):
-        hwi->num_textures = 1;
-        hwi->formats[0]   = GL_BGRA;
-        break;
-    case VA_FOURCC('R','G','B','A'):
-        hwi->num_textures = 1;
-        hwi->formats[0]   = GL_RGBA;
-        break;
-    case VA_FOURCC('Y','V','1','2'):
+    if (!render_thread_use_context(rt, obj_output, 0))
+        return;
+
+    glx_output_surface_lock(obj_output);
+    obj_output->mosaic.refresh_pending = 0;
+    do_put_mosaic_glx(driver_data, obj_output);
+    glx_output_surface_unlock(obj_output);
+    obj_output->render_presented++;
+
+    obj_output->render_seqno = msg->seqno;
+    render_thread_queue_flip(rt, obj_output);
+}
+
+static void *render_thread(void *arg)
+{
+    GLXRenderThread * const    rt          = arg;
+    xvba_driver_data_t * const driver_data = rt->driver_data;
+    object_glx_output_p obj_output;
+    void *due[RENDER_MAX_FLIPS];
+    unsigned int i, n, stop = 0;
+    GLContextState old_cs;
+
+    /* Make sure gl_set_current_context(&old_cs, NULL); releases the
+       last output context on exit */
+    gl_get_current_context(&old_cs);
+    if (!old_cs.display)
+        old_cs.display = driver_data->x11_dpy_local;
+
+    while (!stop) {
+        PutSurfaceMsg *msg;
+        uint64_t deadline;
+
+        /* Flip all outputs due for this vblank at once, and only then
+           wait for the vblank */
+        n = flip_scheduler_get_due(
+            rt->scheduler,
+            get_ticks_usec(),
+            due,
+            ARRAY_ELEMS(due)
+        );
+        if (n > 0) {
+            frame_pacer_flip(rt->pacer, get_ticks_usec());
+            for (i = 0; i < n; i++)
+                render_thread_do_flip(rt, due[i]);
+            obj_output = due[n - 1];
+            pace_vblank(rt->pacer, obj_output);
+            continue;
+        }
+
+        // Handle message
+        deadline = flip_scheduler_get_next_deadline(rt->scheduler);
+        if (deadline)
+            msg = msg_ring_timed_pop(rt->comm, deadline);
+        else
+            msg = msg_ring_pop(rt->comm);
+        if (!msg)
+            continue;
+
+        switch (msg->type) {
+        case MSG_TYPE_QUIT:
+            stop = 1;
+            break;
+        case MSG_TYPE_FLIP:
+            render_thread_do_flip(rt, msg->obj_output);
+            break;
+        case MSG_TYPE_PUT_SURFACE:
+            render_thread_do_put_surface(rt, msg);
+            break;
+        case MSG_TYPE_PUT_MOSAIC:
+            render_thread_do_put_mosaic(rt, msg);
+            break;
+        case MSG_TYPE_ATTACH:
+            render_thread_do_attach(rt, msg->obj_output);
+            break;
+        case MSG_TYPE_DETACH:
+            render_thread_do_detach(rt, msg->obj_output);
+            break;
+        case MSG_TYPE_FORGET_SURFACE:
+            render_thread_do_forget_surface(rt, msg);
+            break;
+        }
+        msg_ring_release(rt->comm);
+    }
+    D(bug("display refresh %u usec, frame interval %u usec\n",
+          frame_pacer_get_refresh(rt->pacer),
+          frame_pacer_get_frame_interval(rt->pacer)));
+    gl_set_current_context(&old_cs, NULL);
+
+    if (rt->gl_context) {
+        gl_destroy_context(rt->gl_context);
+        rt->gl_context = NULL;
+    }
+    if (rt->gl_pool) {
+        gl_resource_pool_unref(rt->gl_pool);
+        rt->gl_pool = NULL;
+    }
+    return NULL;
+}
+
+// Destroys render thread
+static void render_thread_destroy(GLXRenderThread *rt)
+{
+    if (!rt)
+        return;
+
+    if (rt->thread) {
+        PutSurfaceMsg msg;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.type = MSG_TYPE_QUIT;
+        render_thread_send_msg(rt, &msg);
+        pthread_join(rt->thread, NULL);
+        rt->thread = 0;
+    }
+
+    if (rt->comm) {
+        msg_ring_free(rt->comm);
+        rt->comm = NULL;
+    }
+
+    if (rt->scheduler) {
+        flip_scheduler_free(rt->scheduler);
+        rt->scheduler = NULL;
+    }
+
+    if (rt->pacer) {
+        frame_pacer_free(rt->pacer);
+        rt->pacer = NULL;
+    }
+
+    pthread_cond_destroy(&rt->ack_cond);
+    pthread_mutex_destroy(&rt->ack_lock);
+    pthread_mutex_destroy(&rt->comm_lock);
+    free(rt);
+}
+
+// Creates render thread
+static GLXRenderThread *render_thread_create(xvba_driver_data_t *driver_data)
+{
+    GLXRenderThread *rt;
+
+    rt = calloc(1, sizeof(*rt));
+    if (!rt)
+        return NULL;
+
+    rt->driver_data = driver_data;
+    rt->refcount    = 1;
+    pthread_mutex_init(&rt->comm_lock, NULL);
+    pthread_mutex_init(&rt->ack_lock, NULL);
+    pthread_cond_init(&rt->ack_cond, NULL);
+
+    rt->comm = msg_ring_new(RENDER_QUEUE_SIZE, sizeof(PutSurfaceMsg));
+    if (!rt->comm)
+        goto error;
+
+    rt->scheduler = flip_scheduler_new();
+    if (!rt->scheduler)
+        goto error;
+
+    rt->pacer = frame_pacer_new(VIDEO_REFRESH);
+    if (!rt->pacer)
+        goto error;
+
+    if (pthread_create(&rt->thread, NULL, render_thread, rt) != 0) {
+        rt->thread = 0;
+        goto error;
+    }
+    return rt;
+
+error:
+    render_thread_destroy(rt);
+    return NULL;
+}
+
+// Gets a render thread for a new output
+static GLXRenderThread *render_thread_get(xvba_driver_data_t *driver_data)
+{
+    GLXRenderThread **threads = driver_data->glx_render_threads;
+    const unsigned int num_threads = get_render_threads();
+    GLXRenderThread *rt = NULL;
+    unsigned int i;
+
+    /* Each output has its own render thread */
+    if (num_threads == 0)
+        return render_thread_create(driver_data);
+
+    /* Otherwise, pick the thread with the fewest outputs, spawning
+       a new one if the pool is not full yet */
+    pthread_mutex_lock(&g_render_threads_lock);
+    for (i = 0; i < num_threads; i++) {
+        if (!threads[i]) {
+            rt = threads[i] = render_thread_create(driver_data);
+            break;
+        }
+        if (!rt || rt->refcount > threads[i]->refcount)
+            rt = threads[i];
+    }
+    if (rt && i == num_threads)
+        rt->refcount++;
+    pthread_mutex_unlock(&g_render_threads_lock);
+    return rt;
+}
+
+// Releases a render thread, destroying it with the last output
+static void render_thread_put(GLXRenderThread *rt)
+{
+    xvba_driver_data_t * const driver_data = rt->driver_data;
+    GLXRenderThread **threads = driver_data->glx_render_threads;
+    unsigned int i, refcount;
+
+    pthread_mutex_lock(&g_render_threads_lock);
+    refcount = --rt->refcount;
+    if (refcount == 0) {
+        for (i = 0; i < XVBA_MAX_RENDER_THREADS; i++) {
+            if (threads[i] == rt)
+                threads[i] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&g_render_threads_lock);
+
+    if (refcount == 0)
+        render_thread_destroy(rt);
+}
+
+// Attaches output to a render thread
+static int
+render_thread_attach(
+    xvba_driver_data_t *driver_data,
+    object_glx_output_p obj_output
+)
+{
+    GLXRenderThread *rt;
+    PutSurfaceMsg msg;
+
+    rt = render_thread_get(driver_data);
+    if (!rt)
+        return 0;
+
+    obj_output->render_thread    = rt;
+    obj_output->render_thread_ok = 1;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type       = MSG_TYPE_ATTACH;
+    msg.obj_output = obj_output;
+    render_thread_send_msg(rt, &msg);
+    return 1;
+}
+
+// Waits for the render thread to acknowledge message SEQNO
+static void
+render_thread_wait_ack(GLXRenderThread *rt, unsigned int seqno)
+{
+    /* Acks come in the order the messages were sent */
+    pthread_mutex_lock(&rt->ack_lock);
+    while ((int)(rt->ack_seqno - seqno) < 0)
+        pthread_cond_wait(&rt->ack_cond, &rt->ack_lock);
+    pthread_mutex_unlock(&rt->ack_lock);
+}
+
+// Detaches output from its render thread, waiting for it to be done
+static void
+render_thread_detach(object_glx_output_p obj_output)
+{
+    GLXRenderThread * const rt = obj_output->render_thread;
+    PutSurfaceMsg msg;
+
+    if (!rt)
+        return;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type       = MSG_TYPE_DETACH;
+    msg.obj_output = obj_output;
+    render_thread_wait_ack(rt, render_thread_send_msg(rt, &msg));
+
+    obj_output->render_thread    = NULL;
+    obj_output->render_thread_ok = 0;
+    render_thread_put(rt);
+}
+
+// Makes the render thread drop the puts of surface it has yet to render
+static void
+render_thread_forget_surface(
+    object_glx_output_p obj_output,
+    object_surface_p    obj_surface
+)
+{
+    GLXRenderThread * const rt = obj_output->render_thread;
+    PutSurfaceMsg msg;
+
+    if (!rt || !obj_output->render_thread_ok)
+        return;
+
+    /* Puts still in the ring are handled first, the surface is alive */
+    memset(&msg, 0, sizeof(msg));
+    msg.type        = MSG_TYPE_FORGET_SURFACE;
+    msg.obj_output  = obj_output;
+    msg.obj_surface = obj_surface;
+    render_thread_wait_ack(rt, render_thread_send_msg(rt, &msg));
+}
+
+// Ensure FBO and shader extensions are available
+static inline int ensure_extensions(void)
+{
+    GLVTable * const gl_vtable = gl_get_vtable();
+
+    return (gl_vtable &&
+            gl_vtable->has_framebuffer_object &&
+            (gl_vtable->has_fragment_program ||
+             gl_vtable->has_shading_language) &&
+            gl_vtable->has_multitexture);
+}
+
+// Ensure FBO surface is create
+static int fbo_ensure(object_glx_surface_p obj_glx_surface)
+{
+    if (!obj_glx_surface->fbo) {
+        obj_glx_surface->fbo = gl_create_framebuffer_object(
+            obj_glx_surface->target,
+            obj_glx_surface->texture,
+            obj_glx_surface->width,
+            obj_glx_surface->height
+        );
+        if (!obj_glx_surface->fbo)
+            return 0;
+    }
+    ASSERT(obj_glx_surface->fbo);
+    return 1;
+}
+
+// Destroys the subpicture atlas
+static void
+subpicture_atlas_destroy(
+    xvba_driver_data_t *driver_data,
+    GLXSubpictureAtlas *atlas
+)
+{
+    gl_destroy_texture_atlas(atlas->atlas);
+    free(atlas->images);
+    free(atlas->vertices);
+    free(atlas);
+    driver_data->glx_subpicture_atlas = NULL;
+}
+
+// Releases the atlas region of image, destroying the atlas with the last one
+static void
+subpicture_atlas_remove(
+    xvba_driver_data_t *driver_data,
+    object_image_glx_p  hwi
+)
+{
+    GLXSubpictureAtlas *atlas;
+    unsigned int i;
+
+    pthread_mutex_lock(&g_subpicture_atlas_lock);
+    atlas = driver_data->glx_subpicture_atlas;
+    if (atlas && hwi->in_atlas) {
+        for (i = 0; i < atlas->images_count; i++) {
+            if (atlas->images[i] == hwi) {
+                atlas->images[i] = atlas->images[--atlas->images_count];
+                break;
+            }
+        }
+        gl_texture_atlas_free(atlas->atlas, hwi->atlas_x, hwi->atlas_y);
+        hwi->in_atlas = 0;
+
+        if (atlas->images_count == 0)
+            subpicture_atlas_destroy(driver_data, atlas);
+    }
+    pthread_mutex_unlock(&g_subpicture_atlas_lock);
+}
+
+// Destroy HW image
+static void destroy_hw_image_glx(
+    xvba_driver_data_t *driver_data,
+    object_image_p      obj_image
+)
+{
+    unsigned int i;
+
+    if (!obj_image || !obj_image->hw.glx)
+        return;
+
+    object_image_glx_p const hwi = obj_image->hw.glx;
+
+    if (hwi->in_atlas)
+        subpicture_atlas_remove(driver_data, hwi);
+
+    if (hwi->num_textures > 0) {
+        glDeleteTextures(hwi->num_textures, hwi->textures);
+        for (i = 0; i < hwi->num_textures; i++) {
+            hwi->formats[i]  = GL_NONE;
+            hwi->textures[i] = 0;
+        }
+        hwi->num_textures = 0;
+    }
+
+    if (hwi->num_pbos > 0) {
+        GLVTable * const gl_vtable = gl_get_vtable();
+        gl_vtable->gl_delete_buffers(hwi->num_pbos, hwi->pbos);
+        hwi->num_pbos = 0;
+    }
+
+    if (hwi->palette_shader) {
+        gl_destroy_shader_object(hwi->palette_shader);
+        hwi->palette_shader = NULL;
+    }
+
+    if (hwi->palette_texture) {
+        glDeleteTextures(1, &hwi->palette_texture);
+        hwi->palette_texture = 0;
+    }
+
+    free(hwi);
+    obj_image->hw.glx = NULL;
+}
+
+// Create HW image
+static VAStatus
+create_hw_image_glx(
+    xvba_driver_data_t *driver_data,
+    object_image_p      obj_image,
+    XVBASession        *session
+)
+{
+    object_image_glx_p hwi = calloc(1, sizeof(*hwi));
+    if (!hwi)
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    obj_image->hw.glx = hwi;
+
+    switch (obj_image->image.format.fourcc) {
+    case VA_FOURCC('B','G','R','A'):
+        hwi->num_textures = 1;
+        hwi->formats[0]   = GL_BGRA;
+        break;
+    case VA_FOURCC('R','G','B','A'):
+        hwi->num_textures = 1;
+        hwi->formats[0]   = GL_RGBA;
+        break;
+    case VA_FOURCC('Y','V','1','2'):
     case VA_FOURCC('I','4','2','0'):
         hwi->num_textures = 3;
         hwi->formats[0]   = GL_LUMINANCE;
         hwi->formats[1]   = GL_LUMINANCE;
         hwi->formats[2]   = GL_LUMINANCE;
-        shader_fp         = YV12_fp;
-        shader_fp_length  = YV12_FP_SZ;
         break;
     case VA_FOURCC('N','V','1','2'):
         hwi->num_textures = 2;
         hwi->formats[0]   = GL_LUMINANCE;
         hwi->formats[1]   = GL_LUMINANCE_ALPHA;
-        shader_fp         = NV12_fp;
-        shader_fp_length  = NV12_FP_SZ;
+        break;
+    case VA_FOURCC('I','A','4','4'):
+        hwi->num_textures = 1;
+        hwi->formats[0]   = GL_LUMINANCE;
+        hwi->palette_features = SHADER_SOURCE_INDEXED | SHADER_PALETTE_IA44;
+        break;
+    case VA_FOURCC('A','I','4','4'):
+        hwi->num_textures = 1;
+        hwi->formats[0]   = GL_LUMINANCE;
+        hwi->palette_features = SHADER_SOURCE_INDEXED | SHADER_PALETTE_AI44;
+        break;
+    case VA_FOURCC('I','A','8','8'):
+        hwi->num_textures = 1;
+        hwi->formats[0]   = GL_LUMINANCE_ALPHA;
+        hwi->palette_features = SHADER_SOURCE_INDEXED | SHADER_PALETTE_IA88;
         break;
     default:
         hwi->num_textures = 0;
@@ -359,33 +1224,140 @@ create_hw_image_glx(
         return VA_STATUS_ERROR_INVALID_IMAGE;
     }
 
-    unsigned int i;
+    /* Textures are created on first commit, as subpictures drawn from
+       the atlas never need them */
     hwi->target = GL_TEXTURE_2D;
+
+    GLVTable * const gl_vtable = gl_get_vtable();
+    if (gl_vtable && gl_vtable->has_pixel_buffer_object) {
+        hwi->num_pbos = get_image_pbos();
+        if (hwi->num_pbos > 0)
+            gl_vtable->gl_gen_buffers(hwi->num_pbos, hwi->pbos);
+    }
+
+    hwi->width  = obj_image->xvba_width;
+    hwi->height = obj_image->xvba_height;
+    return VA_STATUS_SUCCESS;
+}
+
+// Returns shader features matching the texture target
+static inline unsigned int get_shader_target(GLenum target)
+{
+    return target == GL_TEXTURE_RECTANGLE_ARB ? SHADER_FEATURE_TEXTURE_RECT : 0;
+}
+
+// Create HW image textures
+static int ensure_hw_image_textures(object_image_glx_p hwi)
+{
+    unsigned int i;
+
+    if (hwi->textures[0])
+        return 1;
+
     for (i = 0; i < hwi->num_textures; i++) {
         hwi->textures[i] = gl_create_texture(
             hwi->target,
             hwi->formats[i],
-            obj_image->xvba_width  >> (i > 0),
-            obj_image->xvba_height >> (i > 0)
+            hwi->width  >> (i > 0),
+            hwi->height >> (i > 0)
         );
-        if (!hwi->textures[i]) {
-            destroy_hw_image_glx(driver_data, obj_image);
-            return VA_STATUS_ERROR_ALLOCATION_FAILED;
+        if (!hwi->textures[i])
+            return 0;
+
+        /* Indices must not be interpolated */
+        if (hwi->palette_features) {
+            glBindTexture(hwi->target, hwi->textures[i]);
+            gl_set_texture_scaling(hwi->target, GL_NEAREST);
+            glBindTexture(hwi->target, 0);
         }
     }
+    return 1;
+}
 
-    if (hwi->num_textures > 1) {
-        ASSERT(shader_fp);
-        ASSERT(shader_fp_length > 0);
+// Upload the image palette to a 1D texture, if it changed
+static int ensure_hw_image_palette(object_image_p obj_image)
+{
+    object_image_glx_p const hwi = obj_image->hw.glx;
+    const unsigned int num_entries = obj_image->image.num_palette_entries;
+
+    if (!hwi->palette_texture) {
+        hwi->palette_texture = gl_create_texture(
+            GL_TEXTURE_1D,
+            GL_RGBA,
+            num_entries,
+            0
+        );
+        if (!hwi->palette_texture)
+            return 0;
+        glBindTexture(GL_TEXTURE_1D, hwi->palette_texture);
+        gl_set_texture_scaling(GL_TEXTURE_1D, GL_NEAREST);
+        glBindTexture(GL_TEXTURE_1D, 0);
+        hwi->palette_serial = obj_image->palette_serial - 1;
+    }
 
-        hwi->shader = gl_create_shader_object(shader_fp, shader_fp_length);
-        if (!hwi->shader)
-            return VA_STATUS_ERROR_OPERATION_FAILED;
+    if (hwi->palette_serial != obj_image->palette_serial) {
+        glBindTexture(GL_TEXTURE_1D, hwi->palette_texture);
+        glTexSubImage1D(
+            GL_TEXTURE_1D,
+            0,
+            0,
+            num_entries,
+            GL_RGBA,
+            GL_UNSIGNED_BYTE,
+            obj_image->palette
+        );
+        glBindTexture(GL_TEXTURE_1D, 0);
+        hwi->palette_serial = obj_image->palette_serial;
     }
+    return 1;
+}
 
-    hwi->width  = obj_image->xvba_width;
-    hwi->height = obj_image->xvba_height;
-    return VA_STATUS_SUCCESS;
+// Stream damaged image data through the next PBO, left bound for the upload
+static int
+stream_hw_image_glx(
+    object_image_p      obj_image,
+    object_buffer_p     obj_buffer,
+    const VARectangle  *rects,
+    unsigned int        num_rects
+)
+{
+    object_image_glx_p const hwi = obj_image->hw.glx;
+    GLVTable * const gl_vtable = gl_get_vtable();
+    uint8_t *pixels;
+    unsigned int i;
+
+    if (hwi->num_pbos == 0)
+        return 0;
+
+    /* Orphan the previous storage so that mapping does not wait for
+       the pending upload from it to complete */
+    gl_vtable->gl_bind_buffer(
+        GL_PIXEL_UNPACK_BUFFER_ARB,
+        hwi->pbos[hwi->pbo_index]
+    );
+    gl_vtable->gl_buffer_data(
+        GL_PIXEL_UNPACK_BUFFER_ARB,
+        obj_buffer->buffer_size,
+        NULL,
+        GL_STREAM_DRAW_ARB
+    );
+    pixels = gl_vtable->gl_map_buffer(
+        GL_PIXEL_UNPACK_BUFFER_ARB,
+        GL_WRITE_ONLY_ARB
+    );
+    if (pixels) {
+        /* Only the damaged rectangles are uploaded from the PBO, the
+           rest of its storage can be left undefined */
+        for (i = 0; i < num_rects; i++)
+            copy_image_rect(obj_image, pixels, obj_buffer->buffer_data,
+                            &rects[i]);
+        if (gl_vtable->gl_unmap_buffer(GL_PIXEL_UNPACK_BUFFER_ARB)) {
+            hwi->pbo_index = (hwi->pbo_index + 1) % hwi->num_pbos;
+            return 1;
+        }
+    }
+    gl_vtable->gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+    return 0;
 }
 
 // Commit HW image
@@ -399,33 +1371,72 @@ commit_hw_image_glx(
 {
     object_image_glx_p const hwi = obj_image->hw.glx;
 
+    /* New textures get the whole image */
+    unsigned int serial = obj_image->hw.serial;
+    if (!hwi->textures[0]) {
+        if (!ensure_hw_image_textures(hwi))
+            return VA_STATUS_ERROR_ALLOCATION_FAILED;
+        serial = 0;
+    }
+
+    /* Only upload the tiles that changed since the last commit */
+    VARectangle rects[IMAGE_MAX_DAMAGE_RECTS];
+    const unsigned int num_rects = image_damage_get_rects(
+        obj_image,
+        serial,
+        rects, ARRAY_ELEMS(rects)
+    );
+    if (num_rects == 0)
+        return VA_STATUS_SUCCESS;
+
+    ImagePlane image_planes[3], planes[3];
     const int is_I420 = obj_image->image.format.fourcc == VA_FOURCC('I','4','2','0');
-    unsigned int offsets[3];
-    switch (obj_image->image.num_planes) {
+    switch (get_image_planes(obj_image, image_planes)) {
     case 3:
-        offsets[2] = obj_image->image.offsets[is_I420 ? 1 : 2];
+        planes[2] = image_planes[is_I420 ? 1 : 2];
     case 2:
-        offsets[1] = obj_image->image.offsets[is_I420 ? 2 : 1];
+        planes[1] = image_planes[is_I420 ? 2 : 1];
     case 1:
-        offsets[0] = obj_image->image.offsets[0];
+        planes[0] = image_planes[0];
     }
 
-    unsigned int i;
+    /* Offsets are relative to the bound PBO, if any */
+    const uint8_t *pixels = obj_buffer->buffer_data;
+    const int use_pbo = stream_hw_image_glx(obj_image, obj_buffer,
+                                            rects, num_rects);
+    if (use_pbo)
+        pixels = NULL;
+
+    unsigned int i, j;
     for (i = 0; i < hwi->num_textures; i++) {
+        const ImagePlane * const plane = &planes[i];
         glBindTexture(hwi->target, hwi->textures[i]);
         glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
-        glTexSubImage2D(
-            hwi->target,
-            0,
-            0,
-            0,
-            hwi->width  >> (i > 0),
-            hwi->height >> (i > 0),
-            hwi->formats[i], GL_UNSIGNED_BYTE,
-            (uint8_t *)obj_buffer->buffer_data + offsets[i]
-        );
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, plane->pitch / plane->cpp);
+        for (j = 0; j < num_rects; j++) {
+            const unsigned int x0 = rects[j].x >> plane->shift;
+            const unsigned int y0 = rects[j].y >> plane->shift;
+            const unsigned int x1 = (rects[j].x + rects[j].width)  >> plane->shift;
+            const unsigned int y1 = (rects[j].y + rects[j].height) >> plane->shift;
+            glTexSubImage2D(
+                hwi->target,
+                0,
+                x0,
+                y0,
+                x1 - x0,
+                y1 - y0,
+                hwi->formats[i], GL_UNSIGNED_BYTE,
+                pixels + plane->offset + y0 * plane->pitch + x0 * plane->cpp
+            );
+        }
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
         glBindTexture(hwi->target, 0);
     }
+
+    if (use_pbo) {
+        GLVTable * const gl_vtable = gl_get_vtable();
+        gl_vtable->gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+    }
     return VA_STATUS_SUCCESS;
 }
 
@@ -435,6 +1446,91 @@ const HWImageHooks hw_image_hooks_glx = {
     commit_hw_image_glx
 };
 
+/* Quad of a subpicture, with texture coordinates normalized to the
+   subpicture image */
+typedef struct {
+    float               tx1, ty1, tx2, ty2;
+    int                 x1, y1, x2, y2;
+} SubpictureQuad;
+
+// Compute the quad of a subpicture association, clipped to the visible area
+static void
+get_subpicture_quad(
+    object_surface_p             obj_surface,
+    const VARectangle           *surface_rect,
+    const SubpictureAssociationP assoc,
+    unsigned int                 subpic_width,
+    unsigned int                 subpic_height,
+    SubpictureQuad              *quad
+)
+{
+    VARectangle const * src_rect = &assoc->src_rect;
+    VARectangle const * dst_rect = &assoc->dst_rect;
+    int x1, x2, y1, y2;
+    float tx1, tx2, ty1, ty2;
+
+    /* Clip source area by visible area */
+    tx1 = src_rect->x / (float)subpic_width;
+    ty1 = src_rect->y / (float)subpic_height;
+    tx2 = (src_rect->x + src_rect->width) / (float)subpic_width;
+    ty2 = (src_rect->y + src_rect->height) / (float)subpic_height;
+
+    const float spx = src_rect->width / ((float)subpic_width * (float)obj_surface->width);
+    const float spy = src_rect->height / ((float)subpic_height * (float)obj_surface->height);
+    const float srx1 = tx1 + surface_rect->x * spx;
+    const float srx2 = srx1 + surface_rect->width * spx;
+    const float sry1 = ty1 + surface_rect->y * spy;
+    const float sry2 = sry1 + surface_rect->height * spy;
+
+    if (tx1 < srx1)
+        tx1 = srx1;
+    if (ty1 < sry1)
+        ty1 = sry1;
+    if (tx2 > srx2)
+        tx2 = srx2;
+    if (ty2 > sry2)
+        ty2 = sry2;
+
+    /* Clip dest area by visible area */
+    x1 = dst_rect->x;
+    y1 = dst_rect->y;
+    x2 = dst_rect->x + dst_rect->width;
+    y2 = dst_rect->y + dst_rect->height;
+
+    if (x1 < surface_rect->x)
+        x1 = surface_rect->x;
+    if (y1 < surface_rect->y)
+        y1 = surface_rect->y;
+    if (x2 > surface_rect->x + surface_rect->width)
+        x2 = surface_rect->x + surface_rect->width;
+    if (y2 > surface_rect->y + surface_rect->height)
+        y2 = surface_rect->y + surface_rect->height;
+
+    /* Translate and scale to fit surface size */
+    const float sx = obj_surface->width / (float)surface_rect->width;
+    const float sy = obj_surface->height / (float)surface_rect->height;
+    quad->x1  = (float)(x1 - surface_rect->x) * sx;
+    quad->x2  = (float)(x2 - surface_rect->x) * sx;
+    quad->y1  = (float)(y1 - surface_rect->y) * sy;
+    quad->y2  = (float)(y2 - surface_rect->y) * sy;
+    quad->tx1 = tx1;
+    quad->ty1 = ty1;
+    quad->tx2 = tx2;
+    quad->ty2 = ty2;
+}
+
+// Get the alpha a subpicture association is blended with
+static inline float
+get_subpicture_alpha(
+    object_subpicture_p          obj_subpicture,
+    const SubpictureAssociationP assoc
+)
+{
+    if (assoc->flags & VA_SUBPICTURE_GLOBAL_ALPHA)
+        return obj_subpicture->alpha;
+    return 1.0f;
+}
+
 // Render subpictures
 static VAStatus
 render_subpicture(
@@ -462,90 +1558,288 @@ render_subpicture(
     if (!hwi)
         return VA_STATUS_ERROR_INVALID_IMAGE;
 
-    float alpha = 1.0;
-    if (assoc->flags & VA_SUBPICTURE_GLOBAL_ALPHA)
-        alpha = obj_subpicture->alpha;
-
-    /* XXX: we only support RGBA and BGRA subpictures */
-    if (hwi->num_textures != 1 &&
-        hwi->formats[0] != GL_RGBA && hwi->formats[0] != GL_BGRA)
+    /* XXX: we only support RGBA, BGRA and paletted subpictures */
+    if (hwi->num_textures != 1 ||
+        (!hwi->palette_features &&
+         hwi->formats[0] != GL_RGBA && hwi->formats[0] != GL_BGRA))
         return VA_STATUS_ERROR_INVALID_IMAGE;
 
+    /* Paletted subpictures are looked up by a fragment program */
+    GLShaderObject *shader = NULL;
+    if (hwi->palette_features) {
+        if (!ensure_hw_image_palette(obj_image))
+            return VA_STATUS_ERROR_ALLOCATION_FAILED;
+        if (!hwi->palette_shader) {
+            hwi->palette_shader = shader_create(
+                hwi->palette_features | get_shader_target(hwi->target)
+            );
+            if (!hwi->palette_shader)
+                return VA_STATUS_ERROR_OPERATION_FAILED;
+        }
+        shader = hwi->palette_shader;
+    }
+
+    SubpictureQuad q;
+    get_subpicture_quad(obj_surface, surface_rect, assoc,
+                        hwi->width, hwi->height, &q);
+
+    switch (hwi->target) {
+    case GL_TEXTURE_RECTANGLE_ARB:
+        q.tx1 *= hwi->width;
+        q.tx2 *= hwi->width;
+        q.ty1 *= hwi->height;
+        q.ty2 *= hwi->height;
+        break;
+    }
+
+    GLVTable * const gl_vtable = gl_get_vtable();
+    if (shader) {
+        gl_vtable->gl_active_texture(GL_TEXTURE0 + SHADER_TEXUNIT_PALETTE);
+        glBindTexture(GL_TEXTURE_1D, hwi->palette_texture);
+        gl_vtable->gl_active_texture(GL_TEXTURE0);
+        gl_bind_shader_object(shader);
+    }
+
     glBindTexture(hwi->target, hwi->textures[0]);
-    glColor4f(1.0f, 1.0f, 1.0f, alpha);
+    glColor4f(1.0f, 1.0f, 1.0f, get_subpicture_alpha(obj_subpicture, assoc));
     glBegin(GL_QUADS);
     {
-        VARectangle const * src_rect = &assoc->src_rect;
-        VARectangle const * dst_rect = &assoc->dst_rect;
-        int x1, x2, y1, y2;
-        float tx1, tx2, ty1, ty2;
-
-        /* Clip source area by visible area */
-        const unsigned int subpic_width  = hwi->width;
-        const unsigned int subpic_height = hwi->height;
-        tx1 = src_rect->x / (float)subpic_width;
-        ty1 = src_rect->y / (float)subpic_height;
-        tx2 = (src_rect->x + src_rect->width) / (float)subpic_width;
-        ty2 = (src_rect->y + src_rect->height) / (float)subpic_height;
-
-        const float spx = src_rect->width / ((float)subpic_width * (float)obj_surface->width);
-        const float spy = src_rect->height / ((float)subpic_height * (float)obj_surface->height);
-        const float srx1 = tx1 + surface_rect->x * spx;
-        const float srx2 = srx1 + surface_rect->width * spx;
-        const float sry1 = ty1 + surface_rect->y * spy;
-        const float sry2 = sry1 + surface_rect->height * spy;
-
-        if (tx1 < srx1)
-            tx1 = srx1;
-        if (ty1 < sry1)
-            ty1 = sry1;
-        if (tx2 > srx2)
-            tx2 = srx2;
-        if (ty2 > sry2)
-            ty2 = sry2;
-
-        /* Clip dest area by visible area */
-        x1 = dst_rect->x;
-        y1 = dst_rect->y;
-        x2 = dst_rect->x + dst_rect->width;
-        y2 = dst_rect->y + dst_rect->height;
-
-        if (x1 < surface_rect->x)
-            x1 = surface_rect->x;
-        if (y1 < surface_rect->y)
-            y1 = surface_rect->y;
-        if (x2 > surface_rect->x + surface_rect->width)
-            x2 = surface_rect->x + surface_rect->width;
-        if (y2 > surface_rect->y + surface_rect->height)
-            y2 = surface_rect->y + surface_rect->height;
-
-        /* Translate and scale to fit surface size */
-        const float sx = obj_surface->width / (float)surface_rect->width;
-        const float sy = obj_surface->height / (float)surface_rect->height;
-        x1 = (float)(x1 - surface_rect->x) * sx;
-        x2 = (float)(x2 - surface_rect->x) * sx;
-        y1 = (float)(y1 - surface_rect->y) * sy;
-        y2 = (float)(y2 - surface_rect->y) * sy;
-
-        switch (hwi->target) {
-        case GL_TEXTURE_RECTANGLE_ARB:
-            tx1 *= subpic_width;
-            tx2 *= subpic_width;
-            ty1 *= subpic_height;
-            ty2 *= subpic_height;
-            break;
-        }
-
-        glTexCoord2f(tx1, ty1); glVertex2i(x1, y1);
-        glTexCoord2f(tx1, ty2); glVertex2i(x1, y2);
-        glTexCoord2f(tx2, ty2); glVertex2i(x2, y2);
-        glTexCoord2f(tx2, ty1); glVertex2i(x2, y1);
+        glTexCoord2f(q.tx1, q.ty1); glVertex2i(q.x1, q.y1);
+        glTexCoord2f(q.tx1, q.ty2); glVertex2i(q.x1, q.y2);
+        glTexCoord2f(q.tx2, q.ty2); glVertex2i(q.x2, q.y2);
+        glTexCoord2f(q.tx2, q.ty1); glVertex2i(q.x2, q.y1);
     }
     glEnd();
     glBindTexture(hwi->target, 0);
+
+    if (shader) {
+        gl_unbind_shader_object(shader);
+        gl_vtable->gl_active_texture(GL_TEXTURE0 + SHADER_TEXUNIT_PALETTE);
+        glBindTexture(GL_TEXTURE_1D, 0);
+        gl_vtable->gl_active_texture(GL_TEXTURE0);
+    }
     return VA_STATUS_SUCCESS;
 }
 
+// Gets the subpicture atlas, creating it if needed
+static GLXSubpictureAtlas *
+subpicture_atlas_get(xvba_driver_data_t *driver_data)
+{
+    GLXSubpictureAtlas *atlas = driver_data->glx_subpicture_atlas;
+    GLint max_size = 0;
+    unsigned int size;
+
+    if (atlas)
+        return atlas;
+
+    size = get_subpicture_atlas_size();
+    if (size == 0)
+        return NULL;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+    if (max_size > 0)
+        size = MIN(size, (unsigned int)max_size);
+
+    atlas = calloc(1, sizeof(*atlas));
+    if (!atlas)
+        return NULL;
+
+    /* Regions get a 1-pixel border replicating their edges, so that
+       linear filtering matches the GL_CLAMP_TO_EDGE textures */
+    atlas->atlas = gl_create_texture_atlas(GL_TEXTURE_2D, GL_BGRA, size, size);
+    if (!atlas->atlas) {
+        free(atlas);
+        return NULL;
+    }
+    driver_data->glx_subpicture_atlas = atlas;
+    return atlas;
+}
+
+// Releases the atlas regions of images not drawn in the current pass
+static void subpicture_atlas_evict(GLXSubpictureAtlas *atlas)
+{
+    unsigned int i = 0;
+
+    while (i < atlas->images_count) {
+        object_image_glx_p const hwi = atlas->images[i];
+        if (hwi->atlas_pass == atlas->pass) {
+            i++;
+            continue;
+        }
+        gl_texture_atlas_free(atlas->atlas, hwi->atlas_x, hwi->atlas_y);
+        hwi->in_atlas = 0;
+        atlas->images[i] = atlas->images[--atlas->images_count];
+    }
+}
+
+// Uploads a rectangle of image to its atlas region, with the borders it touches
+static void
+subpicture_atlas_upload(
+    object_image_p      obj_image,
+    const uint8_t      *data,
+    const VARectangle  *rect
+)
+{
+    object_image_glx_p const hwi = obj_image->hw.glx;
+    const unsigned int pitch = obj_image->image.pitches[0];
+    const unsigned int x = hwi->atlas_x + 1 + rect->x;
+    const unsigned int y = hwi->atlas_y + 1 + rect->y;
+    const uint8_t * const p = data + rect->y * pitch + rect->x * 4;
+    const GLenum format = hwi->formats[0];
+
+    glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, rect->width, rect->height,
+                    format, GL_UNSIGNED_BYTE, p);
+
+    if (rect->x == 0)
+        glTexSubImage2D(GL_TEXTURE_2D, 0, x - 1, y, 1, rect->height,
+                        format, GL_UNSIGNED_BYTE, p);
+    if (rect->x + rect->width == hwi->width)
+        glTexSubImage2D(GL_TEXTURE_2D, 0, x + rect->width, y, 1, rect->height,
+                        format, GL_UNSIGNED_BYTE, p + (rect->width - 1) * 4);
+    if (rect->y == 0)
+        glTexSubImage2D(GL_TEXTURE_2D, 0, x, y - 1, rect->width, 1,
+                        format, GL_UNSIGNED_BYTE, p);
+    if (rect->y + rect->height == hwi->height)
+        glTexSubImage2D(GL_TEXTURE_2D, 0, x, y + rect->height, rect->width, 1,
+                        format, GL_UNSIGNED_BYTE,
+                        p + (rect->height - 1) * pitch);
+}
+
+// Makes sure the subpicture image is up-to-date in the atlas
+static int
+subpicture_atlas_update(
+    xvba_driver_data_t *driver_data,
+    GLXSubpictureAtlas *atlas,
+    object_image_p      obj_image
+)
+{
+    object_buffer_p const obj_buffer = XVBA_BUFFER(obj_image->image.buf);
+    if (!obj_buffer)
+        return 0;
+
+    if (!obj_image->hw.glx) {
+        if (create_hw_image_glx(driver_data, obj_image, NULL) != VA_STATUS_SUCCESS)
+            return 0;
+    }
+
+    object_image_glx_p const hwi = obj_image->hw.glx;
+    if (hwi->num_textures != 1 ||
+        (hwi->formats[0] != GL_RGBA && hwi->formats[0] != GL_BGRA))
+        return 0;
+
+    if (!hwi->in_atlas) {
+        object_image_glx_p *images;
+        const unsigned int w = hwi->width  + 2;
+        const unsigned int h = hwi->height + 2;
+        images = realloc_buffer(
+            (void **)&atlas->images,
+            &atlas->images_count_max,
+            1 + atlas->images_count,
+            sizeof(*images)
+        );
+        if (!images)
+            return 0;
+        if (!gl_texture_atlas_alloc(atlas->atlas, w, h,
+                                    &hwi->atlas_x, &hwi->atlas_y)) {
+            subpicture_atlas_evict(atlas);
+            if (!gl_texture_atlas_alloc(atlas->atlas, w, h,
+                                        &hwi->atlas_x, &hwi->atlas_y))
+                return 0;
+        }
+        atlas->images[atlas->images_count++] = hwi;
+        hwi->in_atlas     = 1;
+        hwi->atlas_serial = 0;
+    }
+    hwi->atlas_pass = atlas->pass;
+
+    /* Only upload the tiles that changed since the last upload */
+    VARectangle rects[IMAGE_MAX_DAMAGE_RECTS];
+    unsigned int i, num_rects;
+    image_damage_update(obj_image, obj_buffer);
+    num_rects = image_damage_get_rects(
+        obj_image,
+        hwi->atlas_serial,
+        rects, ARRAY_ELEMS(rects)
+    );
+    if (num_rects > 0) {
+        glBindTexture(GL_TEXTURE_2D, atlas->atlas->texture);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, obj_image->image.pitches[0] / 4);
+        for (i = 0; i < num_rects; i++)
+            subpicture_atlas_upload(obj_image, obj_buffer->buffer_data,
+                                    &rects[i]);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+    hwi->atlas_serial = obj_image->damage.serial;
+    return 1;
+}
+
+// Appends the quad of a subpicture association to the atlas batch
+static int
+subpicture_atlas_add_quad(
+    GLXSubpictureAtlas          *atlas,
+    object_subpicture_p          obj_subpicture,
+    object_surface_p             obj_surface,
+    const VARectangle           *surface_rect,
+    const SubpictureAssociationP assoc,
+    object_image_glx_p           hwi
+)
+{
+    GLXSubpictureVertex *v;
+    SubpictureQuad q;
+
+    v = realloc_buffer(
+        (void **)&atlas->vertices,
+        &atlas->vertices_count_max,
+        4 + atlas->vertices_count,
+        sizeof(*v)
+    );
+    if (!v)
+        return 0;
+
+    get_subpicture_quad(obj_surface, surface_rect, assoc,
+                        hwi->width, hwi->height, &q);
+
+    /* Map texture coordinates into the atlas region */
+    const float sx = hwi->width  / (float)atlas->atlas->width;
+    const float sy = hwi->height / (float)atlas->atlas->height;
+    const float ox = (hwi->atlas_x + 1) / (float)atlas->atlas->width;
+    const float oy = (hwi->atlas_y + 1) / (float)atlas->atlas->height;
+    const float tx1 = ox + q.tx1 * sx, tx2 = ox + q.tx2 * sx;
+    const float ty1 = oy + q.ty1 * sy, ty2 = oy + q.ty2 * sy;
+    const GLubyte alpha = 255.0f * get_subpicture_alpha(obj_subpicture, assoc);
+    unsigned int i;
+
+    v = &atlas->vertices[atlas->vertices_count];
+    atlas->vertices_count += 4;
+    v[0].s = tx1; v[0].t = ty1; v[0].x = q.x1; v[0].y = q.y1;
+    v[1].s = tx1; v[1].t = ty2; v[1].x = q.x1; v[1].y = q.y2;
+    v[2].s = tx2; v[2].t = ty2; v[2].x = q.x2; v[2].y = q.y2;
+    v[3].s = tx2; v[3].t = ty1; v[3].x = q.x2; v[3].y = q.y1;
+    for (i = 0; i < 4; i++) {
+        v[i].r = v[i].g = v[i].b = 255;
+        v[i].a = alpha;
+        v[i].z = 0.0f;
+    }
+    return 1;
+}
+
+// Draws the quads batched so far from the atlas, in a single call
+static void subpicture_atlas_flush(GLXSubpictureAtlas *atlas)
+{
+    if (!atlas || atlas->vertices_count == 0)
+        return;
+
+    glBindTexture(GL_TEXTURE_2D, atlas->atlas->texture);
+    glInterleavedArrays(GL_T2F_C4UB_V3F, 0, atlas->vertices);
+    glDrawArrays(GL_QUADS, 0, atlas->vertices_count);
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    atlas->vertices_count = 0;
+}
+
 static VAStatus
 render_subpictures(
     xvba_driver_data_t *driver_data,
@@ -553,7 +1847,22 @@ render_subpictures(
     const VARectangle  *surface_rect
 )
 {
+    GLXSubpictureAtlas *atlas;
+    VAStatus status = VA_STATUS_SUCCESS;
     unsigned int i;
+
+    if (obj_surface->assocs_count == 0)
+        return VA_STATUS_SUCCESS;
+
+    /* Subpictures packed into the atlas are drawn at once. The others
+       are drawn from their own texture, flushing the batch first so
+       that they stack in the association order */
+    pthread_mutex_lock(&g_subpicture_atlas_lock);
+    atlas = subpicture_atlas_get(driver_data);
+    if (atlas) {
+        atlas->pass++;
+        atlas->vertices_count = 0;
+    }
     for (i = 0; i < obj_surface->assocs_count; i++) {
         SubpictureAssociationP const assoc = obj_surface->assocs[i];
         ASSERT(assoc);
@@ -565,7 +1874,15 @@ render_subpictures(
         if (!obj_subpicture)
             continue;
 
-        VAStatus status = render_subpicture(
+        object_image_p const obj_image = XVBA_IMAGE(obj_subpicture->image_id);
+        if (atlas && obj_image &&
+            subpicture_atlas_update(driver_data, atlas, obj_image) &&
+            subpicture_atlas_add_quad(atlas, obj_subpicture, obj_surface,
+                                      surface_rect, assoc, obj_image->hw.glx))
+            continue;
+
+        subpicture_atlas_flush(atlas);
+        status = render_subpicture(
             driver_data,
             obj_subpicture,
             obj_surface,
@@ -573,9 +1890,15 @@ render_subpictures(
             assoc
         );
         if (status != VA_STATUS_SUCCESS)
-            return status;
+            break;
     }
-    return VA_STATUS_SUCCESS;
+    subpicture_atlas_flush(atlas);
+
+    /* Nothing made it into a newly created atlas */
+    if (atlas && atlas->images_count == 0)
+        subpicture_atlas_destroy(driver_data, atlas);
+    pthread_mutex_unlock(&g_subpicture_atlas_lock);
+    return status;
 }
 
 // Destroy VA/GLX surface
@@ -588,9 +1911,9 @@ destroy_glx_surface(
     if (!obj_glx_surface)
         return;
 
-    if (obj_glx_surface->fbo) {
-        gl_destroy_framebuffer_object(obj_glx_surface->fbo);
-        obj_glx_surface->fbo = NULL;
+    if (obj_glx_surface->copy_surface) {
+        destroy_glx_surface(driver_data, obj_glx_surface->copy_surface);
+        obj_glx_surface->copy_surface = NULL;
     }
 
     if (obj_glx_surface->tx_xvba_surface) {
@@ -599,7 +1922,15 @@ destroy_glx_surface(
     }
 
     if (obj_glx_surface->tx_texture) {
-        glDeleteTextures(1, &obj_glx_surface->tx_texture);
+        gl_resource_pool_put_texture(
+            obj_glx_surface->pool,
+            GL_TEXTURE_2D,
+            GL_BGRA,
+            obj_glx_surface->tx_texture,
+            obj_glx_surface->tx_width,
+            obj_glx_surface->tx_height,
+            NULL
+        );
         obj_glx_surface->tx_texture = 0;
     }
 
@@ -608,59 +1939,71 @@ destroy_glx_surface(
         obj_glx_surface->xvba_surface = NULL;
     }
 
-    if (obj_glx_surface->procamp_shader) {
-        gl_destroy_shader_object(obj_glx_surface->procamp_shader);
-        obj_glx_surface->procamp_shader = NULL;
-    }
-
-    if (obj_glx_surface->evergreen_fbo) {
-        gl_destroy_framebuffer_object(obj_glx_surface->evergreen_fbo);
-        obj_glx_surface->evergreen_fbo = NULL;
-    }
-
-    if (obj_glx_surface->evergreen_texture) {
-        glDeleteTextures(1, &obj_glx_surface->evergreen_texture);
-        obj_glx_surface->evergreen_texture = 0;
+    /* Recycle the texture and its FBO, unless it belongs to the user */
+    if (obj_glx_surface->own_texture) {
+        gl_resource_pool_put_texture(
+            obj_glx_surface->pool,
+            obj_glx_surface->target,
+            obj_glx_surface->format,
+            obj_glx_surface->texture,
+            obj_glx_surface->width,
+            obj_glx_surface->height,
+            obj_glx_surface->fbo
+        );
+        obj_glx_surface->texture = 0;
+        obj_glx_surface->fbo     = NULL;
     }
 
-    if (obj_glx_surface->evergreen_shader) {
-        gl_destroy_shader_object(obj_glx_surface->evergreen_shader);
-        obj_glx_surface->evergreen_shader = NULL;
+    if (obj_glx_surface->fbo) {
+        gl_destroy_framebuffer_object(obj_glx_surface->fbo);
+        obj_glx_surface->fbo = NULL;
     }
 
-    if (obj_glx_surface->hqscaler) {
-        gl_destroy_shader_object(obj_glx_surface->hqscaler);
-        obj_glx_surface->hqscaler = NULL;
+    if (obj_glx_surface->shaders) {
+        shader_cache_destroy(obj_glx_surface->shaders);
+        obj_glx_surface->shaders = NULL;
     }
 
     if (obj_glx_surface->hqscaler_texture) {
         glDeleteTextures(1, &obj_glx_surface->hqscaler_texture);
         obj_glx_surface->hqscaler_texture = 0;
     }
+
+    if (obj_glx_surface->pool) {
+        gl_resource_pool_unref(obj_glx_surface->pool);
+        obj_glx_surface->pool = NULL;
+    }
+    pthread_mutex_destroy(&obj_glx_surface->lock);
     free(obj_glx_surface);
 }
 
-// Create VA/GLX surface
+// Create VA/GLX surface, with GL resources recycled from pool
 static object_glx_surface_p
 create_glx_surface(
     xvba_driver_data_t *driver_data,
     unsigned int        width,
-    unsigned int        height
+    unsigned int        height,
+    GLResourcePool     *pool
 )
 {
     object_glx_surface_p obj_glx_surface = calloc(1, sizeof(*obj_glx_surface));
     if (!obj_glx_surface)
         return NULL;
 
+    pthread_mutex_init(&obj_glx_surface->lock, NULL);
     obj_glx_surface->refcount             = 1;
+    obj_glx_surface->pool                 = gl_resource_pool_ref(pool);
     obj_glx_surface->target               = GL_TEXTURE_2D;
     obj_glx_surface->format               = GL_BGRA;
-    obj_glx_surface->texture              = gl_create_texture(
+    obj_glx_surface->texture              = gl_resource_pool_get_texture(
+        pool,
         obj_glx_surface->target,
         obj_glx_surface->format,
         width,
-        height
+        height,
+        &obj_glx_surface->fbo
     );
+    obj_glx_surface->own_texture          = 1;
     obj_glx_surface->width                = width;
     obj_glx_surface->height               = height;
     obj_glx_surface->evergreen_workaround = -1;
@@ -701,6 +2044,7 @@ create_glx_surface_from_texture(
     if (!obj_glx_surface)
         goto end;
 
+    pthread_mutex_init(&obj_glx_surface->lock, NULL);
     obj_glx_surface->refcount             = 1;
     obj_glx_surface->target               = target;
     obj_glx_surface->format               = GL_NONE;
@@ -750,7 +2094,15 @@ glx_surface_unref(
     object_glx_surface_p obj_glx_surface
 )
 {
-    if (obj_glx_surface && --obj_glx_surface->refcount == 0)
+    unsigned int refcount;
+
+    if (!obj_glx_surface)
+        return;
+
+    pthread_mutex_lock(&g_glx_surfaces_lock);
+    refcount = --obj_glx_surface->refcount;
+    pthread_mutex_unlock(&g_glx_surfaces_lock);
+    if (refcount == 0)
         destroy_glx_surface(driver_data, obj_glx_surface);
 }
 
@@ -763,10 +2115,29 @@ glx_surface_ref(
 {
     if (!obj_glx_surface)
         return NULL;
+    pthread_mutex_lock(&g_glx_surfaces_lock);
     ++obj_glx_surface->refcount;
+    pthread_mutex_unlock(&g_glx_surfaces_lock);
     return obj_glx_surface;
 }
 
+// Releases the GLX surface of a VA surface
+void
+glx_surface_release(
+    xvba_driver_data_t *driver_data,
+    object_surface_p    obj_surface
+)
+{
+    object_glx_surface_p obj_glx_surface;
+
+    /* Render threads may be looking it up for another VA surface */
+    pthread_mutex_lock(&g_glx_surfaces_lock);
+    obj_glx_surface = obj_surface->gl_surface;
+    obj_surface->gl_surface = NULL;
+    pthread_mutex_unlock(&g_glx_surfaces_lock);
+    glx_surface_unref(driver_data, obj_glx_surface);
+}
+
 static object_glx_surface_p
 glx_surface_lookup(
     xvba_driver_data_t *driver_data,
@@ -795,7 +2166,12 @@ glx_surface_ensure(
     object_glx_output_p obj_output
 )
 {
-    object_glx_surface_p gl_surface = obj_surface->gl_surface;
+    object_glx_surface_p gl_surface;
+
+    /* Outputs rendered from other threads may share the same VA/GLX
+       surfaces, see glx_output_surface_lookup_shared() */
+    pthread_mutex_lock(&g_glx_surfaces_lock);
+    gl_surface = obj_surface->gl_surface;
 
     /* Try to find a VA/GLX surface with the same dimensions */
     if (!gl_surface) {
@@ -804,8 +2180,10 @@ glx_surface_ensure(
             obj_surface->xvba_surface_width,
             obj_surface->xvba_surface_height
         );
-        if (gl_surface)
-            obj_surface->gl_surface = glx_surface_ref(driver_data, gl_surface);
+        if (gl_surface) {
+            ++gl_surface->refcount;
+            obj_surface->gl_surface = gl_surface;
+        }
     }
 
     /* Allocate a new VA/GLX surface */
@@ -813,13 +2191,15 @@ glx_surface_ensure(
         gl_surface = create_glx_surface(
             driver_data,
             obj_surface->xvba_surface_width,
-            obj_surface->xvba_surface_height
+            obj_surface->xvba_surface_height,
+            obj_output->gl_pool
         );
         if (gl_surface) {
             gl_surface->gl_context  = obj_output->gl_context;
             obj_surface->gl_surface = gl_surface;
         }
     }
+    pthread_mutex_unlock(&g_glx_surfaces_lock);
     return gl_surface;
 }
 
@@ -839,6 +2219,12 @@ static inline int is_empty_surface(object_surface_p obj_surface)
     return !obj_surface->used_for_decoding && !obj_surface->putimage_hacks;
 }
 
+// Translates VA_FILTER_SCALING_* to GL texture filter
+static inline GLenum get_texture_scaling(unsigned int va_scale)
+{
+    return va_scale == VA_FILTER_SCALING_FAST ? GL_NEAREST : GL_LINEAR;
+}
+
 static inline void
 fill_evergreen_params(float **pparams, int n)
 {
@@ -848,17 +2234,79 @@ fill_evergreen_params(float **pparams, int n)
     *pparams += 4;
 }
 
-// Transfer XvBA surface to GLX surface
+// Bind fragment program for the specified features and load its parameters
+static VAStatus
+bind_shader(
+    xvba_driver_data_t  *driver_data,
+    object_glx_surface_p obj_glx_surface,
+    unsigned int         features,
+    unsigned int         width,
+    unsigned int         height,
+    GLShaderObject     **pshader
+)
+{
+    GLShaderObject *shader;
+    float params[4];
+    unsigned int i, n_params;
+
+    *pshader = NULL;
+
+    /* Plain RGBA textures are rendered through the fixed pipeline */
+    if ((features & ~SHADER_FEATURE_TEXTURE_RECT) == SHADER_SOURCE_RGBA)
+        return VA_STATUS_SUCCESS;
+
+    if (!obj_glx_surface->shaders) {
+        obj_glx_surface->shaders = shader_cache_new();
+        if (!obj_glx_surface->shaders)
+            return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
+
+    shader = shader_cache_lookup(obj_glx_surface->shaders, features);
+    if (!shader)
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+    gl_bind_shader_object(shader);
+
+    // params[0] = textureSize
+    params[0] = (float)width;
+    params[1] = (float)height;
+    params[2] = 1.0f / width;
+    params[3] = 1.0f / height;
+    gl_set_shader_param(shader, SHADER_PARAM_TEXTURE_SIZE, params);
+
+    // params[1..4] = mix_params[0..3]
+    n_params = SHADER_EVERGREEN_PARAMS(features);
+    for (i = 0; i < n_params; i++)
+        gl_set_shader_param(
+            shader,
+            SHADER_PARAM_EVERGREEN + i,
+            obj_glx_surface->evergreen_params[i]
+        );
+
+    // params[5..8] = color_matrix
+    if (features & SHADER_FEATURE_PROCAMP) {
+        for (i = 0; i < 4; i++)
+            gl_set_shader_param(
+                shader,
+                SHADER_PARAM_PROCAMP + i,
+                driver_data->cm_composite[i]
+            );
+    }
+
+    *pshader = shader;
+    return VA_STATUS_SUCCESS;
+}
+
+// Transfer XvBA surface to GLX surface. If direct is set, the picture
+// may be left in the TX texture for the presentation pass to sample
 static VAStatus
 transfer_surface_native(
     xvba_driver_data_t  *driver_data,
     object_glx_surface_p obj_glx_surface,
     object_surface_p     obj_surface,
-    unsigned int         flags
+    unsigned int         flags,
+    int                  direct
 )
 {
-    GLVTable * const gl_vtable = gl_get_vtable();
-
     object_context_p obj_context = XVBA_CONTEXT(obj_surface->va_context);
     if (!obj_context || !obj_context->xvba_session)
         return VA_STATUS_ERROR_INVALID_CONTEXT;
@@ -888,7 +2336,7 @@ transfer_surface_native(
                         obj_surface->xvba_surface);
 
     /* Check for Evergreen workaround */
-    int needs_evergreen_texture = 0;
+    int needs_evergreen_fixup = 0;
     int evergreen_workaround = obj_glx_surface->evergreen_workaround;
     if (evergreen_workaround < 0) {
         evergreen_workaround = get_evergreen_workaround();
@@ -939,51 +2387,15 @@ transfer_surface_native(
     }
 
     if (evergreen_workaround) {
-        needs_evergreen_texture = 1;
-
-        if (!obj_glx_surface->evergreen_texture) {
-            obj_glx_surface->evergreen_texture = gl_create_texture(
-                GL_TEXTURE_2D,
-                GL_BGRA,
-                src_xvba_surface->info.normal.width,
-                src_xvba_surface->info.normal.height
-                );
-            if (!obj_glx_surface->evergreen_texture)
-                return VA_STATUS_ERROR_ALLOCATION_FAILED;
-
-            /* XXX: some algorithms work modulo the texture size */
-            glBindTexture(GL_TEXTURE_2D, obj_glx_surface->evergreen_texture);
-            gl_set_texture_wrapping(GL_TEXTURE_2D, GL_REPEAT);
-            glBindTexture(GL_TEXTURE_2D, 0);
-        }
-
-        if (!obj_glx_surface->evergreen_fbo) {
-            obj_glx_surface->evergreen_fbo = gl_create_framebuffer_object(
-                GL_TEXTURE_2D,
-                obj_glx_surface->evergreen_texture,
-                src_xvba_surface->info.normal.width,
-                src_xvba_surface->info.normal.height
-            );
-            if (!obj_glx_surface->evergreen_fbo)
-                return VA_STATUS_ERROR_ALLOCATION_FAILED;
-        }
+        needs_evergreen_fixup = 1;
 
         if (evergreen_workaround != EVERGREEN_WORKAROUND_COPY &&
-            !obj_glx_surface->evergreen_shader) {
-            const char **shader_fp = NULL;
-            unsigned int shader_fp_length = 0;
+            obj_glx_surface->evergreen_params_count == 0) {
             float *params;
             int i, n_params, n_x_params, n_y_params;
 
-            // program.local[0] = textureSize
-            params = obj_glx_surface->evergreen_params[0];
-            params[0] = (float)src_xvba_surface->info.normal.width;
-            params[1] = (float)src_xvba_surface->info.normal.height;
-            params[2] = 1.0f / src_xvba_surface->info.normal.width;
-            params[3] = 1.0f / src_xvba_surface->info.normal.height;
-
-            // program.local[1..4] = mix_params[0..3]
-            for (i = 1; i <= XVBA_MAX_EVERGREEN_PARAMS; i++) {
+            // mix_params[0..3]
+            for (i = 0; i < XVBA_MAX_EVERGREEN_PARAMS; i++) {
                 params = obj_glx_surface->evergreen_params[i];
                 params[0] = 1.0f;
                 params[1] = 1.0f;
@@ -992,7 +2404,7 @@ transfer_surface_native(
             }
 
             // fill in X params
-            params = &obj_glx_surface->evergreen_params[1][0];
+            params = &obj_glx_surface->evergreen_params[0][0];
             if (evergreen_workaround & EVERGREEN_WORKAROUND_SWAP8_X)
                 fill_evergreen_params(&params, 8);
             if (evergreen_workaround & EVERGREEN_WORKAROUND_SWAP16_X)
@@ -1001,10 +2413,10 @@ transfer_surface_native(
                 fill_evergreen_params(&params, 32);
             if (evergreen_workaround & EVERGREEN_WORKAROUND_SWAP64_X)
                 fill_evergreen_params(&params, 64);
-            n_x_params = (params - &obj_glx_surface->evergreen_params[1][0])/4;
+            n_x_params = (params - &obj_glx_surface->evergreen_params[0][0])/4;
 
             // fill in Y params
-            params = &obj_glx_surface->evergreen_params[1][1];
+            params = &obj_glx_surface->evergreen_params[0][1];
             if (evergreen_workaround & EVERGREEN_WORKAROUND_SWAP8_Y)
                 fill_evergreen_params(&params, 8);
             if (evergreen_workaround & EVERGREEN_WORKAROUND_SWAP16_Y)
@@ -1013,50 +2425,22 @@ transfer_surface_native(
                 fill_evergreen_params(&params, 32);
             if (evergreen_workaround & EVERGREEN_WORKAROUND_SWAP64_Y)
                 fill_evergreen_params(&params, 64);
-            n_y_params = (params - &obj_glx_surface->evergreen_params[1][1])/4;
+            n_y_params = (params - &obj_glx_surface->evergreen_params[0][1])/4;
 
-            // load shader
             n_params = MAX(n_x_params, n_y_params);
-            switch (n_params) {
-            case 1:
-                shader_fp = Evergreen_mix_1_fp;
-                shader_fp_length = EVERGREEN_MIX_1_FP_SZ;
-                break;
-            case 2:
-                shader_fp = Evergreen_mix_2_fp;
-                shader_fp_length = EVERGREEN_MIX_2_FP_SZ;
-                break;
-            case 3:
-                shader_fp = Evergreen_mix_3_fp;
-                shader_fp_length = EVERGREEN_MIX_3_FP_SZ;
-                break;
-            case 4:
-                shader_fp = Evergreen_mix_4_fp;
-                shader_fp_length = EVERGREEN_MIX_4_FP_SZ;
-                break;
-            default:
+            if (n_params == 0) {
                 /* XXX: unsupported combination, disable Evergreen workaround */
                 D(bug("ERROR: unsupported Evergreen workaround 0x%x, disabling\n",
                       evergreen_workaround));
                 obj_glx_surface->evergreen_workaround = 0;
-                break;
             }
             obj_glx_surface->evergreen_params_count = n_params;
-
-            if (shader_fp && shader_fp_length) {
-                obj_glx_surface->evergreen_shader = gl_create_shader_object(
-                    shader_fp,
-                    shader_fp_length
-                );
-                if (!obj_glx_surface->evergreen_shader)
-                    return VA_STATUS_ERROR_OPERATION_FAILED;
-            }
         }
     }
 
     /* Make sure GLX texture has the same dimensions as the surface */
     int needs_tx_texture = 0;
-    if (needs_evergreen_texture ||
+    if (needs_evergreen_fixup ||
         obj_glx_surface->format == GL_RGBA || // XXX: XvBA bug, no RGBA support
         (/*!fglrx_check_version(8,76,7) &&*/  // XXX: #70011.64 supposedly fixed
          (obj_glx_surface->width  != src_xvba_surface->info.normal.width ||
@@ -1065,14 +2449,25 @@ transfer_surface_native(
         needs_tx_texture = 1;
 
         if (!obj_glx_surface->tx_texture) {
-            obj_glx_surface->tx_texture = gl_create_texture(
+            obj_glx_surface->tx_texture = gl_resource_pool_get_texture(
+                obj_glx_surface->pool,
                 GL_TEXTURE_2D,
                 GL_BGRA,
                 src_xvba_surface->info.normal.width,
-                src_xvba_surface->info.normal.height
+                src_xvba_surface->info.normal.height,
+                NULL
             );
             if (!obj_glx_surface->tx_texture)
                 return VA_STATUS_ERROR_ALLOCATION_FAILED;
+            obj_glx_surface->tx_width  = src_xvba_surface->info.normal.width;
+            obj_glx_surface->tx_height = src_xvba_surface->info.normal.height;
+
+            glBindTexture(GL_TEXTURE_2D, obj_glx_surface->tx_texture);
+            gl_set_texture_scaling(
+                GL_TEXTURE_2D,
+                get_texture_scaling(obj_glx_surface->va_scale)
+            );
+            glBindTexture(GL_TEXTURE_2D, 0);
         }
 
         if (!obj_glx_surface->tx_xvba_surface) {
@@ -1085,9 +2480,6 @@ transfer_surface_native(
                 return VA_STATUS_ERROR_ALLOCATION_FAILED;
         }
 
-        if (!fbo_ensure(obj_glx_surface))
-            return VA_STATUS_ERROR_OPERATION_FAILED;
-
         dst_xvba_surface = obj_glx_surface->tx_xvba_surface;
     }
 
@@ -1106,74 +2498,66 @@ transfer_surface_native(
     if (!needs_tx_texture && obj_glx_surface->format == GL_NONE)
         obj_glx_surface->format = GL_BGRA;
 
-    GLuint alternate_texture;
-    int needs_alternate_texture = 0;
-    if (needs_evergreen_texture) {
-        needs_alternate_texture = 1;
-        alternate_texture = obj_glx_surface->evergreen_texture;
+    /* Let the presentation pass sample the TX texture directly */
+    obj_glx_surface->use_tx_texture = needs_tx_texture && direct;
+    if (obj_glx_surface->use_tx_texture)
+        return VA_STATUS_SUCCESS;
 
-        gl_bind_framebuffer_object(obj_glx_surface->evergreen_fbo);
-        glBindTexture(GL_TEXTURE_2D, obj_glx_surface->tx_texture);
-        if (obj_glx_surface->evergreen_shader) {
-            gl_bind_shader_object(obj_glx_surface->evergreen_shader);
-
-            int i;
-            for (i = 0; i <= obj_glx_surface->evergreen_params_count; i++)
-                gl_vtable->gl_program_local_parameter_4fv(
-                    GL_FRAGMENT_PROGRAM,
-                    i,
-                    obj_glx_surface->evergreen_params[i]
-                );
-        }
-        glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
-        glBegin(GL_QUADS);
-        {
-            const unsigned int w = src_xvba_surface->info.normal.width;
-            const unsigned int h = src_xvba_surface->info.normal.height;
-            glTexCoord2f(0.0f, 0.0f); glVertex2i(0, 0);
-            glTexCoord2f(1.0f, 0.0f); glVertex2i(w, 0);
-            glTexCoord2f(1.0f, 1.0f); glVertex2i(w, h);
-            glTexCoord2f(0.0f, 1.0f); glVertex2i(0, h);
-        }
-        glEnd();
-        if (obj_glx_surface->evergreen_shader)
-            gl_unbind_shader_object(obj_glx_surface->evergreen_shader);
-        gl_unbind_framebuffer_object(obj_glx_surface->evergreen_fbo);
-    }
-    else if (needs_tx_texture) {
-        needs_alternate_texture = 1;
-        alternate_texture = obj_glx_surface->tx_texture;
-    }
+    /* Copy TX texture to GLX surface, with the Evergreen fix-up folded
+       into the very same pass */
+    if (needs_tx_texture) {
+        const unsigned int src_w = src_xvba_surface->info.normal.width;
+        const unsigned int src_h = src_xvba_surface->info.normal.height;
+        GLShaderObject *shader;
+        VAStatus status;
+
+        if (!fbo_ensure(obj_glx_surface))
+            return VA_STATUS_ERROR_OPERATION_FAILED;
 
-    if (needs_alternate_texture) {
         gl_bind_framebuffer_object(obj_glx_surface->fbo);
-        glBindTexture(GL_TEXTURE_2D, alternate_texture);
-        glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
-        glBegin(GL_QUADS);
-        {
-            /* Both TX and Evergreen textures are GL_TEXTURE_2D */
-            const unsigned int w = obj_glx_surface->width;
-            const unsigned int h = obj_glx_surface->height;
-            const float tw = obj_surface->width / (float)src_xvba_surface->info.normal.width;
-            const float th = obj_surface->height / (float)src_xvba_surface->info.normal.height;
-            glTexCoord2f(0.0f, 0.0f); glVertex2i(0, 0);
-            glTexCoord2f(tw,   0.0f); glVertex2i(w, 0);
-            glTexCoord2f(tw,   th  ); glVertex2i(w, h);
-            glTexCoord2f(0.0f, th  ); glVertex2i(0, h);
+        glBindTexture(GL_TEXTURE_2D, obj_glx_surface->tx_texture);
+        status = bind_shader(
+            driver_data,
+            obj_glx_surface,
+            (SHADER_SOURCE_RGBA |
+             SHADER_FEATURE_EVERGREEN(obj_glx_surface->evergreen_params_count)),
+            src_w, src_h,
+            &shader
+        );
+        if (status == VA_STATUS_SUCCESS) {
+            glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+            glBegin(GL_QUADS);
+            {
+                /* TX texture is GL_TEXTURE_2D */
+                const unsigned int w = obj_glx_surface->width;
+                const unsigned int h = obj_glx_surface->height;
+                const float tw = obj_surface->width / (float)src_w;
+                const float th = obj_surface->height / (float)src_h;
+                glTexCoord2f(0.0f, 0.0f); glVertex2i(0, 0);
+                glTexCoord2f(tw,   0.0f); glVertex2i(w, 0);
+                glTexCoord2f(tw,   th  ); glVertex2i(w, h);
+                glTexCoord2f(0.0f, th  ); glVertex2i(0, h);
+            }
+            glEnd();
+            if (shader)
+                gl_unbind_shader_object(shader);
         }
-        glEnd();
+        glBindTexture(GL_TEXTURE_2D, 0);
         gl_unbind_framebuffer_object(obj_glx_surface->fbo);
+        if (status != VA_STATUS_SUCCESS)
+            return status;
     }
     return VA_STATUS_SUCCESS;
 }
 
-// Transfer VA surface to GLX surface
+// Transfer VA surface to GLX surface, converting the picture to RGB
 static VAStatus
-transfer_surface(
+do_transfer_surface(
     xvba_driver_data_t  *driver_data,
     object_glx_surface_p obj_glx_surface,
     object_surface_p     obj_surface,
-    unsigned int         flags
+    unsigned int         flags,
+    int                  direct
 )
 {
     PutImageHacks * const h = obj_surface->putimage_hacks;
@@ -1182,7 +2566,10 @@ transfer_surface(
         return transfer_surface_native(driver_data,
                                        obj_glx_surface,
                                        obj_surface,
-                                       flags);
+                                       flags,
+                                       direct);
+
+    obj_glx_surface->use_tx_texture = 0;
 
     object_image_p obj_image = h->obj_image;
     if (!obj_image)
@@ -1204,17 +2591,27 @@ transfer_surface(
     if (!obj_buffer)
         return VA_STATUS_ERROR_INVALID_BUFFER;
 
+    unsigned int features = get_shader_target(hwi->target);
+    switch (hwi->num_textures) {
+    case 3:  features |= SHADER_SOURCE_YV12; break;
+    case 2:  features |= SHADER_SOURCE_NV12; break;
+    default: features |= SHADER_SOURCE_RGBA; break;
+    }
+
     GLVTable * const gl_vtable = gl_get_vtable();
     unsigned int i;
     for (i = 0; i < hwi->num_textures; i++) {
-        if (hwi->shader)
+        if (hwi->num_textures > 1)
             gl_vtable->gl_active_texture(GL_TEXTURE0 + i);
         glBindTexture(hwi->target, hwi->textures[i]);
     }
 
+    GLShaderObject *shader;
     gl_bind_framebuffer_object(obj_glx_surface->fbo);
-    if (hwi->shader)
-        gl_bind_shader_object(hwi->shader);
+    status = bind_shader(driver_data, obj_glx_surface, features,
+                         hwi->width, hwi->height, &shader);
+    if (status != VA_STATUS_SUCCESS)
+        goto end;
     glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
     glClear(GL_COLOR_BUFFER_BIT);
     glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
@@ -1250,20 +2647,56 @@ transfer_surface(
         glTexCoord2f(tw  , 0.0f); glVertex2i(w, 0);
     }
     glEnd();
-    if (hwi->shader)
-        gl_unbind_shader_object(hwi->shader);
+    if (shader)
+        gl_unbind_shader_object(shader);
+end:
     gl_unbind_framebuffer_object(obj_glx_surface->fbo);
 
     i = hwi->num_textures;
     do {
         --i;
-        if (hwi->shader)
+        if (hwi->num_textures > 1)
             gl_vtable->gl_active_texture(GL_TEXTURE0 + i);
         glBindTexture(hwi->target, 0);
     } while (i > 0);
+    return status;
+}
+
+// Transfer VA surface to GLX surface, unless that picture generation
+// was already converted, e.g. when it is presented to several windows
+static VAStatus
+transfer_surface(
+    xvba_driver_data_t  *driver_data,
+    object_glx_surface_p obj_glx_surface,
+    object_surface_p     obj_surface,
+    unsigned int         flags,
+    int                  direct
+)
+{
+    const unsigned int content_flags = flags & (VA_TOP_FIELD|VA_BOTTOM_FIELD);
+
+    /* The picture left in the TX texture is only usable by the
+       presentation pass, not by other consumers of the texture */
+    if (obj_glx_surface->content_surface == obj_surface &&
+        obj_glx_surface->content_mtime   == obj_surface->mtime &&
+        obj_glx_surface->content_flags   == content_flags &&
+        (direct || !obj_glx_surface->use_tx_texture))
+        return VA_STATUS_SUCCESS;
+
+    VAStatus status;
+    status = do_transfer_surface(driver_data, obj_glx_surface, obj_surface,
+                                 flags, direct);
+    if (status != VA_STATUS_SUCCESS) {
+        obj_glx_surface->content_surface = NULL;
+        return status;
+    }
+    obj_glx_surface->content_surface = obj_surface;
+    obj_glx_surface->content_mtime   = obj_surface->mtime;
+    obj_glx_surface->content_flags   = content_flags;
     return VA_STATUS_SUCCESS;
 }
 
+// Check whether ProcAmp adjustments need to be applied
 static VAStatus
 ensure_procamp_shader(
     xvba_driver_data_t  *driver_data,
@@ -1296,24 +2729,7 @@ ensure_procamp_shader(
         return VA_STATUS_SUCCESS;
 
     /* Check that we really need a shader (ProcAmp with non-default values) */
-    if (n_procamp_zeros == 4) {
-        obj_glx_surface->use_procamp_shader = 0;
-        obj_glx_surface->procamp_mtime      = new_mtime;
-        return VA_STATUS_SUCCESS;
-    }
-
-    if (obj_glx_surface->procamp_shader) {
-        gl_destroy_shader_object(obj_glx_surface->procamp_shader);
-        obj_glx_surface->procamp_shader = NULL;
-    }
-    obj_glx_surface->procamp_shader = gl_create_shader_object(
-        ProcAmp_fp,
-        PROCAMP_FP_SZ
-    );
-    if (!obj_glx_surface->procamp_shader)
-        return VA_STATUS_ERROR_OPERATION_FAILED;
-
-    obj_glx_surface->use_procamp_shader = 1;
+    obj_glx_surface->use_procamp_shader = n_procamp_zeros != 4;
     obj_glx_surface->procamp_mtime      = new_mtime;
     return VA_STATUS_SUCCESS;
 }
@@ -1392,55 +2808,26 @@ ensure_scaler(
     if (obj_glx_surface->va_scale == va_scale)
         return VA_STATUS_SUCCESS;
 
-    if (obj_glx_surface->hqscaler) {
-        gl_destroy_shader_object(obj_glx_surface->hqscaler);
-        obj_glx_surface->hqscaler = NULL;
-    }
-
     if (obj_glx_surface->hqscaler_texture) {
         glDeleteTextures(1, &obj_glx_surface->hqscaler_texture);
         obj_glx_surface->hqscaler_texture = 0;
     }
 
     const GLenum target = obj_glx_surface->target;
-    switch (va_scale) {
-    case VA_FILTER_SCALING_DEFAULT:
-        glBindTexture(target, obj_glx_surface->texture);
-        gl_set_texture_scaling(target, GL_LINEAR);
-        glBindTexture(target, 0);
-        break;
-    case VA_FILTER_SCALING_FAST:
-        glBindTexture(target, obj_glx_surface->texture);
-        gl_set_texture_scaling(target, GL_NEAREST);
-        glBindTexture(target, 0);
-        break;
-    case VA_FILTER_SCALING_HQ: {
-        const char **shader_fp = NULL;
-        unsigned int shader_fp_length = 0;
+    glBindTexture(target, obj_glx_surface->texture);
+    gl_set_texture_scaling(target, get_texture_scaling(va_scale));
+    glBindTexture(target, 0);
 
-        glBindTexture(target, obj_glx_surface->texture);
-        gl_set_texture_scaling(target, GL_LINEAR);
-        glBindTexture(target, 0);
+    if (obj_glx_surface->tx_texture) {
+        glBindTexture(GL_TEXTURE_2D, obj_glx_surface->tx_texture);
+        gl_set_texture_scaling(GL_TEXTURE_2D, get_texture_scaling(va_scale));
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
 
+    /* The bicubic weights are computed in the fragment program
+       if the lookup texture could not be created */
+    if (va_scale == VA_FILTER_SCALING_HQ)
         obj_glx_surface->hqscaler_texture = ensure_hqscaler_texture();
-        if (obj_glx_surface->hqscaler_texture) {
-            shader_fp = Bicubic_FLOAT_fp;
-            shader_fp_length = BICUBIC_FLOAT_FP_SZ;
-        }
-        else {
-            shader_fp = Bicubic_fp;
-            shader_fp_length = BICUBIC_FP_SZ;
-        }
-
-        obj_glx_surface->hqscaler = gl_create_shader_object(
-            shader_fp,
-            shader_fp_length
-        );
-        if (!obj_glx_surface->hqscaler)
-            return VA_STATUS_ERROR_ALLOCATION_FAILED;
-        break;
-    }
-    }
 
     obj_glx_surface->va_scale = va_scale;
     return VA_STATUS_SUCCESS;
@@ -1482,50 +2869,242 @@ xvba_CreateSurfaceGLX(
 
     gl_init_context(new_cs);
 
-    object_glx_surface_p obj_glx_surface;
-    obj_glx_surface = create_glx_surface_from_texture(
+    object_glx_surface_p obj_glx_surface;
+    obj_glx_surface = create_glx_surface_from_texture(
+        driver_data,
+        target,
+        texture
+    );
+    if (!obj_glx_surface)
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+
+    *gl_surface = obj_glx_surface;
+    obj_glx_surface->gl_context = new_cs;
+
+    gl_set_current_context(&old_cs, NULL);
+    return VA_STATUS_SUCCESS;
+}
+
+// vaDestroySurfaceGLX
+VAStatus
+xvba_DestroySurfaceGLX(
+    VADriverContextP    ctx,
+    void               *gl_surface
+)
+{
+    XVBA_DRIVER_DATA_INIT;
+
+    xvba_set_display_type(driver_data, VA_DISPLAY_GLX);
+
+    /* Make sure we have the necessary GLX extensions */
+    if (!ensure_extensions())
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+
+    object_glx_surface_p obj_glx_surface = gl_surface;
+    if (!obj_glx_surface)
+        return VA_STATUS_ERROR_INVALID_SURFACE;
+
+    GLContextState old_cs, *new_cs = obj_glx_surface->gl_context;
+    if (!gl_set_current_context(new_cs, &old_cs))
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+
+    destroy_glx_surface(driver_data, obj_glx_surface);
+
+    gl_destroy_context(new_cs);
+    gl_set_current_context(&old_cs, NULL);
+    return VA_STATUS_SUCCESS;
+}
+
+// Check whether vaCopySurfaceGLX() needs a render pass, rather than
+// transferring the surface to the user texture as is
+static int
+needs_copy_pass(
+    object_glx_surface_p obj_glx_surface,
+    object_surface_p     obj_surface,
+    unsigned int         flags
+)
+{
+    if (flags & XVBA_COPYSURFACE_PACKING)
+        return 1;
+
+    /* ProcAmp adjustments can't be rendered over the source texture */
+    if (obj_glx_surface->use_procamp_shader)
+        return 1;
+
+    /* XvBA transfers only scale with its default filter */
+    switch (flags & VA_FILTER_SCALING_MASK) {
+    case VA_FILTER_SCALING_FAST:
+    case VA_FILTER_SCALING_HQ:
+        return (obj_glx_surface->width  != obj_surface->width ||
+                obj_glx_surface->height != obj_surface->height);
+    }
+    return 0;
+}
+
+// Ensure the source surface of vaCopySurfaceGLX() passes exists
+static object_glx_surface_p
+copy_surface_ensure(
+    xvba_driver_data_t  *driver_data,
+    object_glx_surface_p obj_glx_surface,
+    object_surface_p     obj_surface
+)
+{
+    object_glx_surface_p src = obj_glx_surface->copy_surface;
+
+    if (src &&
+        src->width  == obj_surface->xvba_surface_width &&
+        src->height == obj_surface->xvba_surface_height)
+        return src;
+
+    destroy_glx_surface(driver_data, src);
+    src = create_glx_surface(
+        driver_data,
+        obj_surface->xvba_surface_width,
+        obj_surface->xvba_surface_height,
+        obj_glx_surface->pool
+    );
+    if (src)
+        src->gl_context = obj_glx_surface->gl_context;
+    obj_glx_surface->copy_surface = src;
+    return src;
+}
+
+// vaCopySurfaceGLX, through a render pass that scales the picture,
+// applies ProcAmp adjustments and packs it as YUV all at once
+static VAStatus
+do_copy_surface_pass(
+    xvba_driver_data_t  *driver_data,
+    object_glx_surface_p obj_glx_surface,
+    object_surface_p     obj_surface,
+    unsigned int         flags
+)
+{
+    const unsigned int packing = flags & XVBA_COPYSURFACE_PACKING;
+    unsigned int features;
+    VAStatus status;
+
+    /* Pictures are made of whole 2x2 chroma blocks, and I420 chroma
+       rows are packed by pairs into texture rows */
+    switch (packing) {
+    case 0:
+        features = SHADER_OUTPUT_RGBA;
+        break;
+    case XVBA_COPYSURFACE_NV12:
+        if (obj_glx_surface->height % 3)
+            return VA_STATUS_ERROR_INVALID_PARAMETER;
+        features = SHADER_OUTPUT_NV12;
+        break;
+    case XVBA_COPYSURFACE_I420:
+        if (obj_glx_surface->height % 6 || obj_glx_surface->width % 2)
+            return VA_STATUS_ERROR_INVALID_PARAMETER;
+        features = SHADER_OUTPUT_I420;
+        break;
+    default:
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+    }
+
+    object_glx_surface_p const src = copy_surface_ensure(
         driver_data,
-        target,
-        texture
+        obj_glx_surface,
+        obj_surface
     );
-    if (!obj_glx_surface)
+    if (!src)
         return VA_STATUS_ERROR_ALLOCATION_FAILED;
 
-    *gl_surface = obj_glx_surface;
-    obj_glx_surface->gl_context = new_cs;
+    /* Transfer surface to the source texture */
+    if (!is_empty_surface(obj_surface)) {
+        status = transfer_surface(driver_data, src, obj_surface, flags, 0);
+        if (status != VA_STATUS_SUCCESS)
+            return status;
+    }
 
-    gl_set_current_context(&old_cs, NULL);
-    return VA_STATUS_SUCCESS;
-}
+    /* Render subpictures to the source texture, so that they are
+       scaled and packed along */
+    VARectangle surface_rect;
+    surface_rect.x      = 0;
+    surface_rect.y      = 0;
+    surface_rect.width  = obj_surface->width;
+    surface_rect.height = obj_surface->height;
+    if (obj_surface->assocs_count > 0) {
+        if (!fbo_ensure(src))
+            return VA_STATUS_ERROR_ALLOCATION_FAILED;
+        src->content_surface = NULL;
+        gl_bind_framebuffer_object(src->fbo);
+        status = render_subpictures(driver_data, obj_surface, &surface_rect);
+        gl_unbind_framebuffer_object(src->fbo);
+        if (status != VA_STATUS_SUCCESS)
+            return status;
+    }
 
-// vaDestroySurfaceGLX
-VAStatus
-xvba_DestroySurfaceGLX(
-    VADriverContextP    ctx,
-    void               *gl_surface
-)
-{
-    XVBA_DRIVER_DATA_INIT;
+    /* Setup scaling algorithm */
+    status = ensure_scaler(driver_data, src, flags);
+    if (status != VA_STATUS_SUCCESS)
+        return status;
 
-    xvba_set_display_type(driver_data, VA_DISPLAY_GLX);
+    features |= SHADER_SOURCE_RGBA | get_shader_target(src->target);
+    if (obj_glx_surface->use_procamp_shader)
+        features |= SHADER_FEATURE_PROCAMP;
+    if (src->va_scale == VA_FILTER_SCALING_HQ) {
+        features |= SHADER_FEATURE_BICUBIC;
+        if (src->hqscaler_texture)
+            features |= SHADER_FEATURE_BICUBIC_LUT;
+    }
 
-    /* Make sure we have the necessary GLX extensions */
-    if (!ensure_extensions())
-        return VA_STATUS_ERROR_OPERATION_FAILED;
+    /* Render the picture into the user texture */
+    if (!fbo_ensure(obj_glx_surface))
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    obj_glx_surface->content_surface = NULL;
 
-    object_glx_surface_p obj_glx_surface = gl_surface;
-    if (!obj_glx_surface)
-        return VA_STATUS_ERROR_INVALID_SURFACE;
+    GLVTable * const gl_vtable = gl_get_vtable();
+    GLShaderObject *shader;
 
-    GLContextState old_cs, *new_cs = obj_glx_surface->gl_context;
-    if (!gl_set_current_context(new_cs, &old_cs))
-        return VA_STATUS_ERROR_OPERATION_FAILED;
+    gl_bind_framebuffer_object(obj_glx_surface->fbo);
+    if (features & SHADER_FEATURE_BICUBIC_LUT) {
+        gl_vtable->gl_active_texture(GL_TEXTURE0 + SHADER_TEXUNIT_BICUBIC_LUT);
+        glBindTexture(GL_TEXTURE_1D, src->hqscaler_texture);
+        gl_vtable->gl_active_texture(GL_TEXTURE0);
+    }
+    glBindTexture(src->target, src->texture);
+    status = bind_shader(driver_data, src, features,
+                         src->width, src->height, &shader);
+    if (status != VA_STATUS_SUCCESS)
+        goto end;
 
-    destroy_glx_surface(driver_data, obj_glx_surface);
+    /* Picture extent within the source texture */
+    const float sx = (float)obj_surface->width / src->width;
+    const float sy = (float)obj_surface->height / src->height;
+    float tw = sx, th = sy;
+    if (packing) {
+        float params[4];
+        params[0] = (float)obj_glx_surface->width;
+        params[1] = (float)obj_glx_surface->height;
+        params[2] = sx;
+        params[3] = sy;
+        gl_set_shader_param(shader, SHADER_PARAM_PACKING, params);
+        tw = 1.0f;
+        th = 1.0f;
+    }
 
-    gl_destroy_context(new_cs);
-    gl_set_current_context(&old_cs, NULL);
-    return VA_STATUS_SUCCESS;
+    const unsigned int w = obj_glx_surface->width;
+    const unsigned int h = obj_glx_surface->height;
+    glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+    glBegin(GL_QUADS);
+    glTexCoord2f(0.0f, 0.0f); glVertex2i(0, 0);
+    glTexCoord2f(tw  , 0.0f); glVertex2i(w, 0);
+    glTexCoord2f(tw  , th  ); glVertex2i(w, h);
+    glTexCoord2f(0.0f, th  ); glVertex2i(0, h);
+    glEnd();
+    if (shader)
+        gl_unbind_shader_object(shader);
+end:
+    glBindTexture(src->target, 0);
+    if (features & SHADER_FEATURE_BICUBIC_LUT) {
+        gl_vtable->gl_active_texture(GL_TEXTURE0 + SHADER_TEXUNIT_BICUBIC_LUT);
+        glBindTexture(GL_TEXTURE_1D, 0);
+        gl_vtable->gl_active_texture(GL_TEXTURE0);
+    }
+    gl_unbind_framebuffer_object(obj_glx_surface->fbo);
+    return status;
 }
 
 // vaCopySurfaceGLX
@@ -1539,78 +3118,35 @@ do_copy_surface_glx(
 {
     VAStatus status;
 
+    /* Make sure color matrix for ProcAmp adjustments is setup */
+    status = ensure_procamp_shader(driver_data, obj_glx_surface);
+    if (status != VA_STATUS_SUCCESS)
+        return status;
+
+    if (needs_copy_pass(obj_glx_surface, obj_surface, flags))
+        return do_copy_surface_pass(driver_data, obj_glx_surface,
+                                    obj_surface, flags);
+
     /* Transfer surface to texture */
     if (!is_empty_surface(obj_surface)) {
-        status = transfer_surface(driver_data, obj_glx_surface, obj_surface, flags);
+        status = transfer_surface(driver_data, obj_glx_surface, obj_surface,
+                                  flags, 0);
         if (status != VA_STATUS_SUCCESS)
             return status;
     }
 
-    /* Make sure color matrix for ProcAmp adjustments is setup */
-    status = ensure_procamp_shader(driver_data, obj_glx_surface);
-    if (status != VA_STATUS_SUCCESS)
-        return status;
-
     /* Check if FBO is needed. e.g. for subpictures */
-    const int needs_fbo = (obj_surface->assocs_count > 0 ||
-                           obj_glx_surface->use_procamp_shader);
-    if (!needs_fbo)
+    if (obj_surface->assocs_count == 0)
         return VA_STATUS_SUCCESS;
 
+    /* The texture no longer holds the plain converted picture */
+    obj_glx_surface->content_surface = NULL;
+
     /* Create framebuffer surface */
     if (!fbo_ensure(obj_glx_surface))
         return VA_STATUS_ERROR_ALLOCATION_FAILED;
     gl_bind_framebuffer_object(obj_glx_surface->fbo);
 
-    /* Re-render the video frame with ProcAmp adjustments */
-    if (obj_glx_surface->use_procamp_shader) {
-        GLVTable * const gl_vtable = gl_get_vtable();
-        int i;
-
-        gl_bind_shader_object(obj_glx_surface->procamp_shader);
-
-        /* Commit the new ProcAmp color matrix */
-        for (i = 0; i < 4; i++)
-            gl_vtable->gl_program_local_parameter_4fv(
-                GL_FRAGMENT_PROGRAM, i,
-                driver_data->cm_composite[i]
-            );
-
-        /* Render the picture frame */
-        glBindTexture(obj_glx_surface->target, obj_glx_surface->texture);
-        glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
-        glBegin(GL_QUADS);
-        {
-            float tw, th;
-            switch (obj_glx_surface->target) {
-            case GL_TEXTURE_2D:
-                tw = 1.0f;
-                th = 1.0f;
-                break;
-            case GL_TEXTURE_RECTANGLE_ARB:
-                tw = (float)obj_glx_surface->width;
-                th = (float)obj_glx_surface->height;
-                break;
-            default:
-                tw = 0.0f;
-                th = 0.0f;
-                ASSERT(obj_glx_surface->target == GL_TEXTURE_2D ||
-                       obj_glx_surface->target == GL_TEXTURE_RECTANGLE_ARB);
-                break;
-            }
-
-            const unsigned int w = obj_glx_surface->width;
-            const unsigned int h = obj_glx_surface->height;
-            glTexCoord2f(0.0f, 0.0f); glVertex2i(0, 0);
-            glTexCoord2f(tw  , 0.0f); glVertex2i(w, 0);
-            glTexCoord2f(tw  , th  ); glVertex2i(w, h);
-            glTexCoord2f(0.0f, th  ); glVertex2i(0, h);
-        }
-        glEnd();
-        glBindTexture(obj_glx_surface->target, 0);
-        gl_unbind_shader_object(obj_glx_surface->procamp_shader);
-    }
-
     /* Render subpictures to FBO */
     VARectangle surface_rect;
     surface_rect.x      = 0;
@@ -1647,19 +3183,423 @@ xvba_CopySurfaceGLX(
     if (!ensure_extensions())
         return VA_STATUS_ERROR_OPERATION_FAILED;
 
-    GLContextState old_cs, *new_cs = obj_glx_surface->gl_context;
-    if (!gl_set_current_context(new_cs, &old_cs))
-        return VA_STATUS_ERROR_OPERATION_FAILED;
+    if (!gl_push_context(obj_glx_surface->gl_context))
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+
+    VAStatus status;
+    status = do_copy_surface_glx(
+        driver_data,
+        obj_glx_surface,
+        obj_surface,
+        flags
+    );
+
+    gl_pop_context();
+    return status;
+}
+
+/* Private GL context and surfaces of GPU-scaled vaGetImage() readbacks */
+struct glx_readback {
+    GLContextState      *gl_context;
+    Colormap             cmap;
+    GLResourcePool      *pool;
+    object_glx_surface_p src;           // surface, as transferred by XvBA
+    object_glx_surface_p scaled;        // region of interest, at image size
+    object_glx_surface_p packed;        // image bytes, for YUV images
+    GLuint               pbo;
+};
+
+static pthread_mutex_t g_readback_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Destroys the GL resources of scaled vaGetImage() readbacks
+void glx_readback_destroy(xvba_driver_data_t *driver_data)
+{
+    GLXReadback * const rb = driver_data->glx_readback;
+    GLContextState old_cs;
+
+    if (!rb)
+        return;
+
+    if (rb->gl_context && rb->gl_context->window &&
+        gl_set_current_context(rb->gl_context, &old_cs)) {
+        destroy_glx_surface(driver_data, rb->src);
+        destroy_glx_surface(driver_data, rb->scaled);
+        destroy_glx_surface(driver_data, rb->packed);
+        if (rb->pbo) {
+            GLVTable * const gl_vtable = gl_get_vtable();
+            gl_vtable->gl_delete_buffers(1, &rb->pbo);
+        }
+        gl_resource_pool_unref(rb->pool);
+        gl_set_current_context(&old_cs, NULL);
+    }
+
+    if (rb->gl_context) {
+        const Window window = rb->gl_context->window;
+        gl_destroy_context(rb->gl_context);
+        if (window)
+            XDestroyWindow(driver_data->x11_dpy, window);
+    }
+    if (rb->cmap)
+        XFreeColormap(driver_data->x11_dpy, rb->cmap);
+    free(rb);
+    driver_data->glx_readback = NULL;
+}
+
+// Gets the readback context, creating it if needed
+static GLXReadback *
+readback_ensure(xvba_driver_data_t *driver_data)
+{
+    GLXReadback *rb = driver_data->glx_readback;
+
+    if (rb)
+        return rb;
+
+    rb = calloc(1, sizeof(*rb));
+    if (!rb)
+        return NULL;
+    driver_data->glx_readback = rb;
+
+    /* The context draws into FBOs only, an unmapped window will do */
+    rb->gl_context = gl_create_context(
+        driver_data->x11_dpy,
+        driver_data->x11_screen,
+        NULL
+    );
+    if (!rb->gl_context)
+        goto error;
+    rb->cmap = XCreateColormap(
+        driver_data->x11_dpy,
+        RootWindow(driver_data->x11_dpy, driver_data->x11_screen),
+        rb->gl_context->visual->visual,
+        AllocNone
+    );
+    rb->gl_context->window = x11_create_window(
+        driver_data->x11_dpy,
+        1, 1,
+        rb->gl_context->visual->visual,
+        rb->cmap
+    );
+    if (!rb->gl_context->window)
+        goto error;
+    gl_init_context(rb->gl_context);
+
+    rb->pool = gl_resource_pool_new(get_gl_pool_size());
+    if (!rb->pool)
+        goto error;
+    return rb;
+
+error:
+    glx_readback_destroy(driver_data);
+    return NULL;
+}
+
+// Ensures a readback surface of the specified size exists
+static object_glx_surface_p
+readback_surface_ensure(
+    xvba_driver_data_t   *driver_data,
+    GLXReadback          *rb,
+    object_glx_surface_p *pobj_glx_surface,
+    unsigned int          width,
+    unsigned int          height
+)
+{
+    object_glx_surface_p obj_glx_surface = *pobj_glx_surface;
+
+    if (obj_glx_surface &&
+        obj_glx_surface->width  == width &&
+        obj_glx_surface->height == height)
+        return obj_glx_surface;
+
+    destroy_glx_surface(driver_data, obj_glx_surface);
+    obj_glx_surface = create_glx_surface(driver_data, width, height, rb->pool);
+    if (obj_glx_surface) {
+        obj_glx_surface->gl_context = rb->gl_context;
+        if (!fbo_ensure(obj_glx_surface)) {
+            destroy_glx_surface(driver_data, obj_glx_surface);
+            obj_glx_surface = NULL;
+        }
+    }
+    *pobj_glx_surface = obj_glx_surface;
+    return obj_glx_surface;
+}
+
+// Reads the rendered image bytes back into the image buffer
+static VAStatus
+readback_image(
+    GLXReadback         *rb,
+    object_glx_surface_p obj_glx_surface,
+    object_image_p       obj_image,
+    object_buffer_p      obj_buffer,
+    unsigned int         packing,
+    GLenum               format
+)
+{
+    const VAImage * const image = &obj_image->image;
+    GLVTable * const gl_vtable = gl_get_vtable();
+    uint8_t *pixels = obj_buffer->buffer_data;
+    VAStatus status = VA_STATUS_SUCCESS;
+
+    /* Read into a PBO, so that the driver can DMA at its own pace */
+    const int use_pbo = gl_vtable->has_pixel_buffer_object;
+    if (use_pbo) {
+        if (!rb->pbo)
+            gl_vtable->gl_gen_buffers(1, &rb->pbo);
+        gl_vtable->gl_bind_buffer(GL_PIXEL_PACK_BUFFER_ARB, rb->pbo);
+        gl_vtable->gl_buffer_data(
+            GL_PIXEL_PACK_BUFFER_ARB,
+            image->data_size,
+            NULL,
+            GL_STREAM_READ_ARB
+        );
+        pixels = NULL;
+    }
+
+    /* Offsets are relative to the bound PBO, if any */
+    gl_bind_framebuffer_object(obj_glx_surface->fbo);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    switch (packing) {
+    case SHADER_OUTPUT_RGBA:
+        glPixelStorei(GL_PACK_ROW_LENGTH, obj_image->xvba_width);
+        glReadPixels(0, 0, image->width, image->height,
+                     format, GL_UNSIGNED_BYTE, pixels);
+        glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+        break;
+    case SHADER_OUTPUT_NV12:
+        glReadPixels(0, 0, obj_glx_surface->width, obj_glx_surface->height,
+                     GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+        break;
+    case SHADER_OUTPUT_I420: {
+        /* Y rows, then U and V rows by pairs. Images keep V before U
+           in memory, whatever plane order their format has */
+        const unsigned int height = obj_image->xvba_height;
+        const unsigned int rows   = height / 4;
+        const int is_I420 = image->format.fourcc == VA_FOURCC('I','4','2','0');
+        glReadPixels(0, 0, obj_glx_surface->width, height,
+                     GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+        glReadPixels(0, height, obj_glx_surface->width, rows,
+                     GL_RGBA, GL_UNSIGNED_BYTE,
+                     pixels + image->offsets[is_I420 ? 1 : 2]);
+        glReadPixels(0, height + rows, obj_glx_surface->width, rows,
+                     GL_RGBA, GL_UNSIGNED_BYTE,
+                     pixels + image->offsets[is_I420 ? 2 : 1]);
+        break;
+    }
+    }
+    gl_unbind_framebuffer_object(obj_glx_surface->fbo);
+
+    if (use_pbo) {
+        const uint8_t * const data = gl_vtable->gl_map_buffer(
+            GL_PIXEL_PACK_BUFFER_ARB,
+            GL_READ_ONLY_ARB
+        );
+        if (data) {
+            memcpy(obj_buffer->buffer_data, data, image->data_size);
+            gl_vtable->gl_unmap_buffer(GL_PIXEL_PACK_BUFFER_ARB);
+        }
+        else
+            status = VA_STATUS_ERROR_OPERATION_FAILED;
+        gl_vtable->gl_bind_buffer(GL_PIXEL_PACK_BUFFER_ARB, 0);
+    }
+    return status;
+}
+
+// vaGetImage, scaling RECT to the image size on the GPU
+static VAStatus
+do_get_image_glx(
+    xvba_driver_data_t *driver_data,
+    GLXReadback        *rb,
+    object_surface_p    obj_surface,
+    object_image_p      obj_image,
+    object_buffer_p     obj_buffer,
+    const VARectangle  *rect,
+    unsigned int        packing,
+    GLenum              format
+)
+{
+    const unsigned int width  = obj_image->xvba_width;
+    const unsigned int height = obj_image->xvba_height;
+    VAStatus status;
+
+    object_glx_surface_p const src = readback_surface_ensure(
+        driver_data,
+        rb,
+        &rb->src,
+        obj_surface->xvba_surface_width,
+        obj_surface->xvba_surface_height
+    );
+    if (!src)
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+
+    /* Surface objects are recycled, don't trust the content cache */
+    src->content_surface = NULL;
+    if (!is_empty_surface(obj_surface)) {
+        status = transfer_surface(driver_data, src, obj_surface, 0, 0);
+        if (status != VA_STATUS_SUCCESS)
+            return status;
+    }
+    else {
+        gl_bind_framebuffer_object(src->fbo);
+        glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+        gl_unbind_framebuffer_object(src->fbo);
+    }
+
+    /* Packed bytes are read from the picture at the image size, unless
+       the whole surface is wanted, which can be packed from directly */
+    object_glx_surface_p pic = src;
+    float sx, sy;
+    if (packing == SHADER_OUTPUT_RGBA ||
+        rect->x != 0 || rect->y != 0 ||
+        rect->width  != obj_surface->width ||
+        rect->height != obj_surface->height) {
+        pic = readback_surface_ensure(driver_data, rb, &rb->scaled,
+                                      width, height);
+        if (!pic)
+            return VA_STATUS_ERROR_ALLOCATION_FAILED;
+
+        const float tx1 = (float)rect->x / src->width;
+        const float ty1 = (float)rect->y / src->height;
+        const float tx2 = (float)(rect->x + rect->width)  / src->width;
+        const float ty2 = (float)(rect->y + rect->height) / src->height;
+        const unsigned int w = obj_image->image.width;
+        const unsigned int h = obj_image->image.height;
+
+        gl_bind_framebuffer_object(pic->fbo);
+        glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+        glBindTexture(src->target, src->texture);
+        gl_set_texture_scaling(src->target, GL_LINEAR);
+        glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+        glBegin(GL_QUADS);
+        glTexCoord2f(tx1, ty1); glVertex2i(0, 0);
+        glTexCoord2f(tx2, ty1); glVertex2i(w, 0);
+        glTexCoord2f(tx2, ty2); glVertex2i(w, h);
+        glTexCoord2f(tx1, ty2); glVertex2i(0, h);
+        glEnd();
+        glBindTexture(src->target, 0);
+        gl_unbind_framebuffer_object(pic->fbo);
+        sx = 1.0f;
+        sy = 1.0f;
+    }
+    else {
+        /* Picture extent within the source texture, stretched so that
+           the image alignment padding is left out */
+        sx = (float)obj_surface->width / src->width *
+            width / obj_image->image.width;
+        sy = (float)obj_surface->height / src->height *
+            height / obj_image->image.height;
+    }
+
+    if (packing == SHADER_OUTPUT_RGBA)
+        return readback_image(rb, pic, obj_image, obj_buffer, packing, format);
+
+    /* A w x h texture holds a (4 * w) x (2 * h / 3) picture */
+    object_glx_surface_p const packed = readback_surface_ensure(
+        driver_data,
+        rb,
+        &rb->packed,
+        width / 4,
+        height * 3 / 2
+    );
+    if (!packed)
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+
+    GLShaderObject *shader;
+    gl_bind_framebuffer_object(packed->fbo);
+    glBindTexture(pic->target, pic->texture);
+    gl_set_texture_scaling(pic->target, GL_LINEAR);
+    status = bind_shader(driver_data, pic,
+                         packing | SHADER_SOURCE_RGBA |
+                         get_shader_target(pic->target),
+                         pic->width, pic->height, &shader);
+    if (status == VA_STATUS_SUCCESS) {
+        float params[4];
+        params[0] = (float)packed->width;
+        params[1] = (float)packed->height;
+        params[2] = sx;
+        params[3] = sy;
+        gl_set_shader_param(shader, SHADER_PARAM_PACKING, params);
+
+        const unsigned int w = packed->width;
+        const unsigned int h = packed->height;
+        glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+        glBegin(GL_QUADS);
+        glTexCoord2f(0.0f, 0.0f); glVertex2i(0, 0);
+        glTexCoord2f(1.0f, 0.0f); glVertex2i(w, 0);
+        glTexCoord2f(1.0f, 1.0f); glVertex2i(w, h);
+        glTexCoord2f(0.0f, 1.0f); glVertex2i(0, h);
+        glEnd();
+        gl_unbind_shader_object(shader);
+    }
+    glBindTexture(pic->target, 0);
+    gl_unbind_framebuffer_object(packed->fbo);
+    if (status != VA_STATUS_SUCCESS)
+        return status;
+
+    return readback_image(rb, packed, obj_image, obj_buffer, packing, format);
+}
+
+// Reads RECT of the surface back into the image, scaled to the image size
+VAStatus
+get_image_glx(
+    xvba_driver_data_t *driver_data,
+    object_surface_p    obj_surface,
+    object_image_p      obj_image,
+    const VARectangle  *rect
+)
+{
+    unsigned int packing = SHADER_OUTPUT_RGBA;
+    GLenum format = GL_NONE;
+
+    switch (obj_image->image.format.fourcc) {
+    case VA_FOURCC('B','G','R','A'):
+        format  = GL_BGRA;
+        break;
+    case VA_FOURCC('R','G','B','A'):
+        format  = GL_RGBA;
+        break;
+    case VA_FOURCC('N','V','1','2'):
+        packing = SHADER_OUTPUT_NV12;
+        break;
+    case VA_FOURCC('Y','V','1','2'):
+    case VA_FOURCC('I','4','2','0'):
+        packing = SHADER_OUTPUT_I420;
+        break;
+    default:
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+    }
+
+    object_buffer_p obj_buffer = XVBA_BUFFER(obj_image->image.buf);
+    if (!obj_buffer)
+        return VA_STATUS_ERROR_INVALID_BUFFER;
 
+    GLXReadback *rb;
+    GLContextState old_cs;
     VAStatus status;
-    status = do_copy_surface_glx(
-        driver_data,
-        obj_glx_surface,
-        obj_surface,
-        flags
-    );
 
+    pthread_mutex_lock(&g_readback_lock);
+    rb = readback_ensure(driver_data);
+    if (!rb) {
+        status = VA_STATUS_ERROR_ALLOCATION_FAILED;
+        goto end;
+    }
+
+    /* The context is released afterwards, other threads may need it */
+    if (!gl_set_current_context(rb->gl_context, &old_cs)) {
+        status = VA_STATUS_ERROR_OPERATION_FAILED;
+        goto end;
+    }
+    if (ensure_extensions()) {
+        /* Packed bytes must not be blended */
+        glDisable(GL_BLEND);
+        status = do_get_image_glx(driver_data, rb, obj_surface, obj_image,
+                                  obj_buffer, rect, packing, format);
+    }
+    else
+        status = VA_STATUS_ERROR_OPERATION_FAILED;
     gl_set_current_context(&old_cs, NULL);
+end:
+    pthread_mutex_unlock(&g_readback_lock);
     return status;
 }
 
@@ -1681,6 +3621,89 @@ glx_output_surface_unlock(object_glx_output_p obj_output)
     pthread_mutex_unlock(&obj_output->lock);
 }
 
+// Ensures output buffers are created with the specified dimensions
+static int
+glx_output_surface_ensure_buffers(
+    xvba_driver_data_t *driver_data,
+    object_glx_output_p obj_output,
+    unsigned int        width,
+    unsigned int        height
+)
+{
+    object_glx_surface_p obj_glx_surface;
+    unsigned int i;
+
+    for (i = 0; i < obj_output->gl_surfaces_count; i++) {
+        if (obj_output->gl_surfaces[i])
+            continue;
+        obj_glx_surface = create_glx_surface(
+            driver_data,
+            width,
+            height,
+            obj_output->gl_pool
+        );
+        if (!obj_glx_surface)
+            return -1;
+        obj_glx_surface->gl_context = obj_output->gl_context;
+        obj_output->gl_surfaces[i]  = obj_glx_surface;
+
+        /* Make sure the FBO is created */
+        if (!fbo_ensure(obj_glx_surface))
+            return -1;
+        gl_bind_framebuffer_object(obj_glx_surface->fbo);
+        glClear(GL_COLOR_BUFFER_BIT);
+        gl_unbind_framebuffer_object(obj_glx_surface->fbo);
+    }
+    obj_output->gl_surface = obj_output->gl_surfaces[obj_output->gl_surface_index];
+    return 0;
+}
+
+// Destroys output buffers
+static void
+glx_output_surface_destroy_buffers(
+    xvba_driver_data_t *driver_data,
+    object_glx_output_p obj_output
+)
+{
+    unsigned int i;
+
+    for (i = 0; i < obj_output->gl_surfaces_count; i++) {
+        if (!obj_output->gl_surfaces[i])
+            continue;
+        destroy_glx_surface(driver_data, obj_output->gl_surfaces[i]);
+        obj_output->gl_surfaces[i] = NULL;
+    }
+    obj_output->gl_surface       = NULL;
+    obj_output->gl_surface_index = 0;
+    obj_output->gl_surface_stale = 0;
+    obj_output->gl_surface_puts  = 0;
+    obj_output->gl_surfaces_valid = 0;
+    obj_output->damage.is_valid  = 0;
+}
+
+// Gets the output buffer that was flipped last
+static inline object_glx_surface_p
+glx_output_surface_get_front(object_glx_output_p obj_output)
+{
+    const unsigned int n = obj_output->gl_surfaces_count;
+
+    return obj_output->gl_surfaces[(obj_output->gl_surface_index + n - 1) % n];
+}
+
+// Composes the next picture into another buffer, once the current one
+// was flipped, so that it does not wait for the flip to complete
+static void
+glx_output_surface_swap_buffers(object_glx_output_p obj_output)
+{
+    if (obj_output->gl_surfaces_count < 2)
+        return;
+
+    obj_output->gl_surface_index++;
+    obj_output->gl_surface_index %= obj_output->gl_surfaces_count;
+    obj_output->gl_surface = obj_output->gl_surfaces[obj_output->gl_surface_index];
+    obj_output->gl_surface_stale = 1;
+}
+
 // Destroys output surface
 void
 glx_output_surface_destroy(
@@ -1691,6 +3714,12 @@ glx_output_surface_destroy(
     if (!obj_output)
         return;
 
+    render_thread_detach(obj_output);
+
+    free(obj_output->mosaic.tiles);
+    obj_output->mosaic.tiles       = NULL;
+    obj_output->mosaic.tiles_count = 0;
+
     if (1) {
         const uint64_t end   = get_ticks_usec();
         const uint64_t start = obj_output->render_start;
@@ -1699,36 +3728,36 @@ glx_output_surface_destroy(
         D(bug("%llu refreshes in %llu usec (%.1f fps)\n",
               ticks, end - start,
               ticks * 1000000.0 / (end - start)));
-    }
-
-    if (obj_output->render_thread_ok) {
-        async_queue_push(obj_output->render_comm, MSG2PTR(MSG_TYPE_QUIT));
-        pthread_join(obj_output->render_thread, NULL);
-        obj_output->render_thread    = 0;
-        obj_output->render_thread_ok = 0;
-    }
-
-    if (obj_output->render_comm) {
-        async_queue_free(obj_output->render_comm);
-        obj_output->render_comm = NULL;
-    }
-
-    if (obj_output->render_context) {
-        gl_destroy_context(obj_output->render_context);
-        obj_output->render_context = NULL;
+        D(bug("%llu surfaces presented, %llu dropped\n",
+              obj_output->render_presented,
+              obj_output->render_dropped));
+
+        GLContextStats gl_stats;
+        gl_get_context_stats(&gl_stats);
+        D(bug("%u GL context switches, %u avoided\n",
+              gl_stats.num_switches,
+              gl_stats.num_skipped));
     }
 
     if (obj_output->parent)
         --obj_output->parent->children_count;
 
-    if (obj_output->gl_surface) {
-        if (!obj_output->parent)
-            destroy_glx_surface(driver_data, obj_output->gl_surface);
-        obj_output->gl_surface = NULL;
+    if (!obj_output->parent)
+        glx_output_surface_destroy_buffers(driver_data, obj_output);
+    obj_output->gl_surface = NULL;
+
+    if (obj_output->gl_pool) {
+        gl_resource_pool_unref(obj_output->gl_pool);
+        obj_output->gl_pool = NULL;
     }
 
     if (obj_output->gl_context) {
-        glFinish();
+        /* Make sure the last flip completed before the GL resources
+           are released */
+        if (gl_wait_sync(obj_output->gl_sync, GL_SYNC_TIMEOUT) <= 0)
+            glFinish();
+        gl_destroy_sync(obj_output->gl_sync);
+        obj_output->gl_sync = NULL;
         GLContextState dummy_cs;
         dummy_cs.display = driver_data->x11_dpy;
         dummy_cs.window  = None;
@@ -1763,9 +3792,26 @@ glx_output_surface_destroy(
             XFree(obj_output->gl_window.vi);
         obj_output->gl_window.vi = NULL;
     }
+    pthread_cond_destroy(&obj_output->flip_cond);
     free(obj_output);
 }
 
+// Looks up any output surface whose GL context can be shared with
+static object_glx_output_p
+glx_output_surface_lookup_shared(xvba_driver_data_t *driver_data)
+{
+    object_heap_iterator iter;
+    object_base_p obj = object_heap_first(&driver_data->output_heap, &iter);
+    while (obj) {
+        object_output_p const obj_output = (object_output_p)obj;
+        if (obj_output->glx && obj_output->glx->gl_context &&
+            obj_output->glx->gl_pool)
+            return obj_output->glx;
+        obj = object_heap_next(&driver_data->output_heap, &iter);
+    }
+    return NULL;
+}
+
 // Creates output surface
 static object_glx_output_p
 glx_output_surface_create(
@@ -1780,11 +3826,13 @@ glx_output_surface_create(
         return NULL;
 
     obj_output->va_surface_status = VASurfaceReady;
+    obj_output->gl_surfaces_count = get_output_buffers();
     obj_output->window.xid        = window;
     obj_output->window.width      = width;
     obj_output->window.height     = height;
 
     pthread_mutex_init(&obj_output->lock, NULL);
+    pthread_cond_init(&obj_output->flip_cond, NULL);
 
     /* XXX: recurse through parents until we find an output surface */
     Window root_window, parent_window, *child_windows = NULL;
@@ -1812,6 +3860,15 @@ glx_output_surface_create(
         }
     }
 
+    /* Otherwise, join the share group of any other output so that the
+       pictures converted for one window can be presented to the others */
+    object_glx_output_p share_output = obj_output->parent;
+    if (!share_output) {
+        share_output = glx_output_surface_lookup_shared(driver_data);
+        if (share_output)
+            parent_cs = share_output->gl_context;
+    }
+
     static GLint gl_visual_attr[] = {
         GLX_RGBA,
         GLX_RED_SIZE, 1,
@@ -1901,30 +3958,23 @@ glx_output_surface_create(
     glClear(GL_COLOR_BUFFER_BIT);
     gl_set_current_context(&old_cs, NULL);
 
+    /* GL resources are shared with the parent context */
+    if (share_output) {
+        obj_output->gl_pool   = gl_resource_pool_ref(share_output->gl_pool);
+        obj_output->gl_shared = 1;
+        share_output->gl_shared = 1;
+    }
+    else
+        obj_output->gl_pool = gl_resource_pool_new(get_gl_pool_size());
+
     if (use_putsurface_fast()) {
-        RenderThreadArgs *args = NULL;
-
-        obj_output->render_comm = async_queue_new();
-        if (!obj_output->render_comm)
-            goto render_thread_init_end;
-
-        args = malloc(sizeof(*args));
-        if (!args)
-            goto render_thread_init_end;
-        args->driver_data = driver_data;
-        args->obj_output  = obj_output;
-        obj_output->render_thread_ok = !pthread_create(
-            &obj_output->render_thread,
-            NULL,
-            render_thread,
-            args
-        );
-    render_thread_init_end:
-        if (!obj_output->render_thread_ok)
-            free(args);
+        obj_output->use_mailbox = use_putsurface_mailbox();
+        render_thread_attach(driver_data, obj_output);
     }
-    obj_output->render_ticks = 0;
-    obj_output->render_start = get_ticks_usec();
+    obj_output->render_ticks     = 0;
+    obj_output->render_presented = 0;
+    obj_output->render_dropped   = 0;
+    obj_output->render_start     = get_ticks_usec();
     return obj_output;
 
 error:
@@ -1937,7 +3987,7 @@ static inline GLContextState *
 glx_output_surface_get_context(object_glx_output_p obj_output)
 {
     if (obj_output->render_thread_ok &&
-        obj_output->render_thread == pthread_self())
+        obj_output->render_thread->thread == pthread_self())
         return obj_output->render_context;
     return obj_output->gl_context;
 }
@@ -2004,28 +4054,11 @@ glx_output_surface_ensure_size(
         }
     }
 
-    /* Make sure the VA/GLX surface is created */
-    if (size_changed) {
-        destroy_glx_surface(driver_data, glx_output->gl_surface);
-        glx_output->gl_surface = NULL;
-    }
-    if (!glx_output->gl_surface) {
-        glx_output->gl_surface = create_glx_surface(
-            driver_data,
-            width,
-            height
-        );
-        if (!glx_output->gl_surface)
-            return -1;
-        glx_output->gl_surface->gl_context = glx_output->gl_context;
-
-        /* Make sure the FBO is created */
-        if (!fbo_ensure(glx_output->gl_surface))
-            return -1;
-        gl_bind_framebuffer_object(glx_output->gl_surface->fbo);
-        glClear(GL_COLOR_BUFFER_BIT);
-        gl_unbind_framebuffer_object(glx_output->gl_surface->fbo);
-    }
+    /* Make sure the VA/GLX surfaces are created */
+    if (size_changed)
+        glx_output_surface_destroy_buffers(driver_data, glx_output);
+    if (glx_output_surface_ensure_buffers(driver_data, glx_output, width, height) < 0)
+        return -1;
     return 0;
 }
 
@@ -2043,43 +4076,146 @@ ensure_bounds(VARectangle *r, unsigned int width, unsigned int height)
         r->height = height - r->y;
 }
 
-// Query GLX surface status
-int
-query_surface_status_glx(
+// Records that surface is displayed by the put of SEQNO to the output
+static inline void
+glx_output_surface_set_seqno(
+    object_glx_output_p obj_output,
+    object_surface_p    obj_surface,
+    unsigned int        seqno
+)
+{
+    obj_surface->glx_output = obj_output;
+    obj_surface->glx_seqno  = seqno;
+}
+
+// Check whether the surface was flipped to the output, waiting at most
+// timeout usec for the flip to complete
+static int
+glx_output_surface_sync(
     xvba_driver_data_t *driver_data,
-    object_surface_p    obj_surface
+    object_glx_output_p obj_output,
+    object_surface_p    obj_surface,
+    unsigned int        timeout
+)
+{
+    const uint64_t end_time = get_ticks_usec() + timeout;
+    GLSync *gl_sync = NULL;
+    int status = 1;
+
+    glx_output_surface_lock(obj_output);
+
+    /* Only the last put of the surface to this output matters. If the
+       surface was put to another output since, that put is not known,
+       so wait for whatever was queued here */
+    const unsigned int seqno = (obj_surface->glx_output == obj_output ?
+                                obj_surface->glx_seqno :
+                                obj_output->put_seqno);
+
+    /* Puts are only pending with a render thread, which signals flips */
+    if (obj_output->render_thread_ok &&
+        (int)(obj_output->flip_seqno - seqno) < 0 && timeout > 0) {
+        struct timespec ts;
+        ts.tv_sec  = end_time / 1000000;
+        ts.tv_nsec = 1000 * (end_time % 1000000);
+        while ((int)(obj_output->flip_seqno - seqno) < 0) {
+            if (pthread_cond_timedwait(&obj_output->flip_cond,
+                                       &obj_output->lock, &ts) != 0)
+                break;
+        }
+    }
+
+    /* The render thread did not flip the surface yet */
+    if ((int)(obj_output->flip_seqno - seqno) < 0) {
+        glx_output_surface_unlock(obj_output);
+        return 0;
+    }
+
+    /* The render thread needs the lock for every put and flip, so the
+       fence is waited on without it. Flips meanwhile replace the fence,
+       hence the reference */
+    gl_sync = gl_ref_sync(obj_output->gl_sync);
+    glx_output_surface_unlock(obj_output);
+
+    /* Time spent waiting for the flip counts against the timeout */
+    const uint64_t now = get_ticks_usec();
+    const unsigned int remaining = now < end_time ? end_time - now : 0;
+
+    if (!gl_sync && timeout == 0) {
+        /* Queries shall not drain the GL pipeline */
+        status = 0;
+    }
+    else if (gl_push_context(obj_output->gl_context)) {
+        /* GL_NV_fence fences set by the render thread can't be checked
+           from here, assume the flip completed in that case */
+        if (gl_sync)
+            status = gl_wait_sync(gl_sync, remaining) != 0;
+        else
+            glFinish();
+        gl_destroy_sync(gl_sync);
+        gl_pop_context();
+    }
+    else
+        gl_destroy_sync(gl_sync);
+
+    /* Other surfaces may still be queued to the output */
+    if (status) {
+        glx_output_surface_lock(obj_output);
+        if ((int)(obj_output->flip_seqno - obj_output->put_seqno) >= 0)
+            obj_output->va_surface_status = VASurfaceReady;
+        glx_output_surface_unlock(obj_output);
+    }
+    return status;
+}
+
+// Query or wait for GLX surface status
+static int
+glx_surface_sync(
+    xvba_driver_data_t *driver_data,
+    object_surface_p    obj_surface,
+    unsigned int        timeout
 )
 {
     unsigned int i;
+    int status = XVBA_COMPLETED;
+
     for (i = 0; i < obj_surface->output_surfaces_count; i++) {
         object_glx_output_p obj_output = obj_surface->output_surfaces[i]->glx;
         if (!obj_output)
             continue;
         if (obj_output->va_surface_status != VASurfaceDisplaying)
             continue;
-        obj_output->va_surface_status = VASurfaceReady;
-
-        /* Make sure all pending OpenGL commands have completed */
-        GLContextState old_cs;
-        if (gl_set_current_context(obj_output->gl_context, &old_cs)) {
-            glFinish();
-            gl_swap_buffers(obj_output->gl_context);
-            gl_set_current_context(&old_cs, NULL);
-        }
+        if (!glx_output_surface_sync(driver_data, obj_output, obj_surface,
+                                     timeout))
+            status = XVBA_STILL_PENDING;
     }
-    return XVBA_COMPLETED;
+    return status;
 }
 
-// Queue surface for display
-VAStatus
-flip_surface(
-    xvba_driver_data_t  *driver_data,
-    object_glx_output_p  obj_output
+// Query GLX surface status
+int
+query_surface_status_glx(
+    xvba_driver_data_t *driver_data,
+    object_surface_p    obj_surface
 )
 {
-    object_glx_surface_p const obj_glx_surface = obj_output->gl_surface;
+    return glx_surface_sync(driver_data, obj_surface, 0);
+}
 
-    /* Draw GL surface to screen */
+// Wait for GLX surface to be displayed, at most timeout usec
+int
+sync_surface_glx(
+    xvba_driver_data_t *driver_data,
+    object_surface_p    obj_surface,
+    unsigned int        timeout
+)
+{
+    return glx_surface_sync(driver_data, obj_surface, timeout);
+}
+
+// Draw GL surface to the current draw buffer
+static void
+draw_glx_surface(object_glx_surface_p obj_glx_surface)
+{
     glBindTexture(obj_glx_surface->target, obj_glx_surface->texture);
     glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
     glBegin(GL_QUADS);
@@ -2111,9 +4247,81 @@ flip_surface(
     }
     glEnd();
     glBindTexture(obj_glx_surface->target, 0);
+}
+
+// Compare two rectangles
+static inline int
+rect_equal(const VARectangle *a, const VARectangle *b)
+{
+    return (a->x == b->x && a->y == b->y &&
+            a->width == b->width && a->height == b->height);
+}
+
+// Record which buffers still match the picture being flipped, outside
+// of the area it was put to
+static void
+glx_output_surface_track_buffers(object_glx_output_p obj_output)
+{
+    const GLXOutputDamage * const d = &obj_output->damage;
+    const unsigned int index = obj_output->gl_surface_index;
+    unsigned int i, valid = 0;
+
+    /* Other buffers were composed the same way if the picture is made
+       of a single put to the same area, which leaves the rest alone */
+    if (obj_output->gl_surface_puts == 1 && d->num_cliprects == 0) {
+        if (!(d->flags & VA_CLEAR_DRAWABLE)) {
+            for (i = 0; i < obj_output->gl_surfaces_count; i++) {
+                if ((obj_output->gl_surfaces_valid & (1U << i)) &&
+                    rect_equal(&obj_output->gl_surfaces_rect[i], &d->dst_rect))
+                    valid |= 1U << i;
+            }
+        }
+        obj_output->gl_surfaces_rect[index] = d->dst_rect;
+        valid |= 1U << index;
+    }
+    obj_output->gl_surfaces_valid = valid;
+}
+
+// Check whether the back buffer already matches the last picture
+// flipped, outside of the area the next put goes to
+static inline int
+glx_output_surface_is_seeded(
+    object_glx_output_p obj_output,
+    const VARectangle  *dst_rect
+)
+{
+    const unsigned int index = obj_output->gl_surface_index;
+
+    return ((obj_output->gl_surfaces_valid & (1U << index)) &&
+            rect_equal(&obj_output->gl_surfaces_rect[index], dst_rect));
+}
+
+// Queue surface for display
+VAStatus
+flip_surface(
+    xvba_driver_data_t  *driver_data,
+    object_glx_output_p  obj_output
+)
+{
+    /* Draw GL surface to screen */
+    draw_glx_surface(obj_output->gl_surface);
 
     gl_swap_buffers(glx_output_surface_get_context(obj_output));
     obj_output->render_ticks++;
+
+    /* Track completion of the flip with a fence, rather than draining
+       the GL pipeline when the surface status is queried */
+    gl_destroy_sync(obj_output->gl_sync);
+    obj_output->gl_sync    = gl_create_sync();
+    obj_output->flip_seqno = obj_output->render_seqno;
+
+    /* The flipped picture can only be presented again as is if it was
+       made of a single surface */
+    glx_output_surface_track_buffers(obj_output);
+    obj_output->damage.is_valid = obj_output->gl_surface_puts == 1;
+    obj_output->gl_surface_puts = 0;
+
+    glx_output_surface_swap_buffers(obj_output);
     return VA_STATUS_SUCCESS;
 }
 
@@ -2130,15 +4338,160 @@ queue_surface(
 
     if (obj_output->render_thread_ok)
         return VA_STATUS_SUCCESS;
+    obj_output->render_seqno = ++obj_output->put_seqno;
+    glx_output_surface_set_seqno(obj_output, obj_surface,
+                                 obj_output->render_seqno);
     return flip_surface(driver_data, obj_output);
 }
 
-// Render video surface (and subpictures) into the specified drawable
+// Get the last time any display attribute was changed
+static uint64_t get_display_attrs_mtime(xvba_driver_data_t *driver_data)
+{
+    uint64_t mtime = 0;
+    unsigned int i;
+
+    for (i = 0; i < driver_data->va_display_attrs_count; i++) {
+        if (mtime < driver_data->va_display_attrs_mtime[i])
+            mtime = driver_data->va_display_attrs_mtime[i];
+    }
+    return mtime;
+}
+
+// Record the picture composed into the output surface
+static void
+glx_output_surface_damage(
+    xvba_driver_data_t  *driver_data,
+    object_glx_output_p  obj_output,
+    object_surface_p     obj_surface,
+    const VARectangle   *src_rect,
+    const VARectangle   *dst_rect,
+    const VARectangle   *cliprects,
+    unsigned int         num_cliprects,
+    unsigned int         flags
+)
+{
+    GLXOutputDamage * const d = &obj_output->damage;
+
+    d->obj_surface   = obj_surface;
+    d->surface_mtime = obj_surface->mtime;
+    d->attrs_mtime   = get_display_attrs_mtime(driver_data);
+    d->src_rect      = *src_rect;
+    d->dst_rect      = *dst_rect;
+    d->num_cliprects = MIN(num_cliprects, XVBA_MAX_CLIPRECTS);
+    if (d->num_cliprects > 0)
+        memcpy(d->cliprects, cliprects, d->num_cliprects * sizeof(*cliprects));
+    d->flags         = flags;
+    obj_output->gl_surface_puts++;
+}
+
+// Present the last picture flipped again, if it is the very same
+static int
+glx_output_surface_reuse_front(
+    xvba_driver_data_t  *driver_data,
+    object_glx_output_p  obj_output,
+    object_surface_p     obj_surface,
+    const VARectangle   *src_rect,
+    const VARectangle   *dst_rect,
+    const VARectangle   *cliprects,
+    unsigned int         num_cliprects,
+    unsigned int         flags
+)
+{
+    const GLXOutputDamage * const d = &obj_output->damage;
+    const unsigned int n = obj_output->gl_surfaces_count;
+    unsigned int i;
+
+    if (!d->is_valid || obj_output->gl_surface_puts > 0)
+        return 0;
+
+    /* Subpictures may have changed without us knowing about */
+    if (obj_surface->assocs_count > 0)
+        return 0;
+
+    if (d->obj_surface != obj_surface ||
+        d->surface_mtime != obj_surface->mtime ||
+        d->attrs_mtime != get_display_attrs_mtime(driver_data) ||
+        d->flags != flags ||
+        !rect_equal(&d->src_rect, src_rect) ||
+        !rect_equal(&d->dst_rect, dst_rect) ||
+        d->num_cliprects != num_cliprects)
+        return 0;
+    for (i = 0; i < num_cliprects; i++) {
+        if (!rect_equal(&d->cliprects[i], &cliprects[i]))
+            return 0;
+    }
+
+    /* Flip the front buffer again */
+    obj_output->gl_surface_index = (obj_output->gl_surface_index + n - 1) % n;
+    obj_output->gl_surface       = obj_output->gl_surfaces[obj_output->gl_surface_index];
+    obj_output->gl_surface_stale = 0;
+    obj_output->gl_surface_puts  = 1;
+    return 1;
+}
+
+// Clip the clip rects to the output window bounds
+static unsigned int
+get_clip_rects(
+    object_glx_output_p  obj_output,
+    const VARectangle   *cliprects,
+    unsigned int         num_cliprects,
+    VARectangle         *clip_rects
+)
+{
+    unsigned int i, n = 0;
+
+    /* No clip rects means the whole drawable is visible */
+    if (num_cliprects == 0) {
+        clip_rects[0].x      = 0;
+        clip_rects[0].y      = 0;
+        clip_rects[0].width  = obj_output->window.width;
+        clip_rects[0].height = obj_output->window.height;
+        return 1;
+    }
+
+    for (i = 0; i < num_cliprects && i < XVBA_MAX_CLIPRECTS; i++) {
+        VARectangle r = cliprects[i];
+        if (r.x < 0) {
+            r.width = MAX((int)r.width + r.x, 0);
+            r.x     = 0;
+        }
+        if (r.y < 0) {
+            r.height = MAX((int)r.height + r.y, 0);
+            r.y      = 0;
+        }
+        if (r.x >= (int)obj_output->window.width ||
+            r.y >= (int)obj_output->window.height)
+            continue;
+        ensure_bounds(&r, obj_output->window.width, obj_output->window.height);
+        if (r.width == 0 || r.height == 0)
+            continue;
+        clip_rects[n++] = r;
+    }
+    return n;
+}
+
+// Restrict rendering to the specified clip rect
+static inline void
+set_clip_rect(object_glx_output_p obj_output, const VARectangle *r)
+{
+    /* The output surface is rendered upside down, see gl_resize() */
+    glEnable(GL_SCISSOR_TEST);
+    glScissor(
+        r->x,
+        obj_output->window.height - (r->y + r->height),
+        r->width,
+        r->height
+    );
+}
+
+// Render video surface (and subpictures) into the output surface, with
+// the VA/GLX surface locked
 static VAStatus
-do_put_surface_glx(
+do_render_surface_glx(
     xvba_driver_data_t  *driver_data,
     object_glx_output_p  obj_output,
     object_surface_p     obj_surface,
+    object_glx_surface_p obj_glx_surface,
     const VARectangle   *src_rect,
     const VARectangle   *dst_rect,
     const VARectangle   *cliprects,
@@ -2146,12 +4499,6 @@ do_put_surface_glx(
     unsigned int         flags
 )
 {
-    /* Ensure VA/GLX surface exists with the specified dimensions */
-    object_glx_surface_p obj_glx_surface;
-    obj_glx_surface = glx_surface_ensure(driver_data, obj_surface, obj_output);
-    if (!obj_glx_surface)
-        return VA_STATUS_ERROR_ALLOCATION_FAILED;
-
     if (glx_output_surface_ensure_size(driver_data, obj_output) < 0)
         return VA_STATUS_ERROR_OPERATION_FAILED;
 
@@ -2162,10 +4509,21 @@ do_put_surface_glx(
     /* Reset GLX viewport for active context */
     gl_resize(obj_output->window.width, obj_output->window.height);
 
+    /* Present the last picture again if nothing changed since */
+    if (glx_output_surface_reuse_front(
+            driver_data,
+            obj_output,
+            obj_surface,
+            src_rect, dst_rect,
+            cliprects, num_cliprects,
+            flags))
+        return VA_STATUS_SUCCESS;
+
     /* Transfer surface to texture */
     VAStatus status;
     if (!is_empty_surface(obj_surface)) {
-        status = transfer_surface(driver_data, obj_glx_surface, obj_surface, flags);
+        status = transfer_surface(driver_data, obj_glx_surface, obj_surface,
+                                  flags, 1);
         if (status != VA_STATUS_SUCCESS)
             return status;
     }
@@ -2180,101 +4538,502 @@ do_put_surface_glx(
     if (status != VA_STATUS_SUCCESS)
         return status;
 
+    /* Sample the TX texture directly, if the picture was left there */
+    GLenum target = obj_glx_surface->target;
+    GLuint texture = obj_glx_surface->texture;
+    unsigned int texture_width = obj_glx_surface->width;
+    unsigned int texture_height = obj_glx_surface->height;
+    float texture_scale_x = 1.0f, texture_scale_y = 1.0f;
+    unsigned int n_evergreen_params = 0;
+
+    if (obj_glx_surface->use_tx_texture) {
+        target             = GL_TEXTURE_2D;
+        texture            = obj_glx_surface->tx_texture;
+        texture_width      = obj_glx_surface->tx_width;
+        texture_height     = obj_glx_surface->tx_height;
+        texture_scale_x    = obj_surface->width / (float)texture_width;
+        texture_scale_y    = obj_surface->height / (float)texture_height;
+        n_evergreen_params = obj_glx_surface->evergreen_params_count;
+    }
+
+    /* Select fragment program: ProcAmp, HQ scaler and Evergreen fix-up
+       can be combined */
+    unsigned int features = (SHADER_SOURCE_RGBA |
+                             get_shader_target(target) |
+                             SHADER_FEATURE_EVERGREEN(n_evergreen_params));
+    if (obj_glx_surface->use_procamp_shader)
+        features |= SHADER_FEATURE_PROCAMP;
+    if (obj_glx_surface->va_scale == VA_FILTER_SCALING_HQ) {
+        features |= SHADER_FEATURE_BICUBIC;
+        if (obj_glx_surface->hqscaler_texture)
+            features |= SHADER_FEATURE_BICUBIC_LUT;
+    }
+
     /* Render picture */
     GLVTable * const gl_vtable = gl_get_vtable();
-    float params[4];
-    unsigned int i;
+    GLShaderObject *shader;
 
     gl_bind_framebuffer_object(obj_output->gl_surface->fbo);
-    gl_vtable->gl_active_texture(GL_TEXTURE0);
-    glBindTexture(obj_glx_surface->target, obj_glx_surface->texture);
-    if (obj_glx_surface->hqscaler) {
-        gl_bind_shader_object(obj_glx_surface->hqscaler);
-        params[0] = (float)obj_glx_surface->width;
-        params[1] = (float)obj_glx_surface->height;
-        params[2] = 1.0f / obj_glx_surface->width;
-        params[3] = 1.0f / obj_glx_surface->height;
-        gl_vtable->gl_program_local_parameter_4fv(
-            GL_FRAGMENT_PROGRAM,
-            0,
-            params
-        );
-        if (obj_glx_surface->hqscaler_texture) {
-            gl_vtable->gl_active_texture(GL_TEXTURE1);
-            glBindTexture(GL_TEXTURE_1D, obj_glx_surface->hqscaler_texture);
-        }
+    if (obj_output->gl_surface_stale) {
+        /* Start from the last picture flipped, unless this one covers
+           it entirely or the buffer already holds the rest of it */
+        if (num_cliprects > 0 ||
+            (!(flags & VA_CLEAR_DRAWABLE) &&
+             (vis_rect.x > 0 || vis_rect.y > 0 ||
+              vis_rect.width  < obj_output->window.width ||
+              vis_rect.height < obj_output->window.height) &&
+             !glx_output_surface_is_seeded(obj_output, dst_rect)))
+            draw_glx_surface(glx_output_surface_get_front(obj_output));
+        obj_output->gl_surface_stale = 0;
     }
-    if (obj_glx_surface->use_procamp_shader) {
-        gl_bind_shader_object(obj_glx_surface->procamp_shader);
-        for (i = 0; i < 4; i++)
-            gl_vtable->gl_program_local_parameter_4fv(
-                GL_FRAGMENT_PROGRAM, i,
-                driver_data->cm_composite[i]
-            );
+    if (features & SHADER_FEATURE_BICUBIC_LUT) {
+        gl_vtable->gl_active_texture(GL_TEXTURE0 + SHADER_TEXUNIT_BICUBIC_LUT);
+        glBindTexture(GL_TEXTURE_1D, obj_glx_surface->hqscaler_texture);
     }
+    gl_vtable->gl_active_texture(GL_TEXTURE0);
+    glBindTexture(target, texture);
+    status = bind_shader(
+        driver_data,
+        obj_glx_surface,
+        features,
+        texture_width,
+        texture_height,
+        &shader
+    );
+    if (status != VA_STATUS_SUCCESS)
+        goto end;
     if (flags & VA_CLEAR_DRAWABLE) {
         if (driver_data->va_background_color &&
             driver_data->va_background_color->value != obj_output->bgcolor) {
             obj_output->bgcolor = driver_data->va_background_color->value;
             gl_set_bgcolor(obj_output->bgcolor);
         }
-        glClear(GL_COLOR_BUFFER_BIT);
     }
-    glPushMatrix();
-    glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
-    glTranslatef((float)vis_rect.x, (float)vis_rect.y, 0.0f);
+
+    /* Only render the visible regions of the drawable */
+    VARectangle clip_rects[XVBA_MAX_CLIPRECTS];
+    unsigned int i, num_clip_rects;
+    num_clip_rects = get_clip_rects(
+        obj_output,
+        cliprects, num_cliprects,
+        clip_rects
+    );
+
+    float tx1 = 0.0f, ty1 = 0.0f, tx2 = 0.0f, ty2 = 0.0f;
     if (!is_empty_surface(obj_surface)) {
         const float surface_width  = obj_surface->xvba_surface_width;
         const float surface_height = obj_surface->xvba_surface_height;
-        float tx1 = src_rect->x / surface_width;
-        float ty1 = src_rect->y / surface_height;
-        float tx2 = tx1 + src_rect->width / surface_width;
-        float ty2 = ty1 + src_rect->height / surface_height;
-        const int w = vis_rect.width;
-        const int h = vis_rect.height;
+        tx1 = src_rect->x / surface_width;
+        ty1 = src_rect->y / surface_height;
+        tx2 = tx1 + src_rect->width / surface_width;
+        ty2 = ty1 + src_rect->height / surface_height;
 
-        switch (obj_glx_surface->target) {
+        switch (target) {
+        case GL_TEXTURE_2D:
+            /* Skip the TX texture padding */
+            tx1 *= texture_scale_x;
+            tx2 *= texture_scale_x;
+            ty1 *= texture_scale_y;
+            ty2 *= texture_scale_y;
+            break;
         case GL_TEXTURE_RECTANGLE_ARB:
-            tx1 *= obj_glx_surface->width;
-            tx2 *= obj_glx_surface->width;
-            ty1 *= obj_glx_surface->height;
-            ty2 *= obj_glx_surface->height;
+            tx1 *= texture_width;
+            tx2 *= texture_width;
+            ty1 *= texture_height;
+            ty2 *= texture_height;
             break;
         }
+    }
 
-        glBegin(GL_QUADS);
-        glTexCoord2f(tx1, ty1); glVertex2i(0, 0);
-        glTexCoord2f(tx1, ty2); glVertex2i(0, h);
-        glTexCoord2f(tx2, ty2); glVertex2i(w, h);
-        glTexCoord2f(tx2, ty1); glVertex2i(w, 0);
-        glEnd();
+    glPushMatrix();
+    glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+    glTranslatef((float)vis_rect.x, (float)vis_rect.y, 0.0f);
+    for (i = 0; i < num_clip_rects; i++) {
+        if (num_cliprects > 0)
+            set_clip_rect(obj_output, &clip_rects[i]);
+        if (flags & VA_CLEAR_DRAWABLE)
+            glClear(GL_COLOR_BUFFER_BIT);
+        if (!is_empty_surface(obj_surface)) {
+            const int w = vis_rect.width;
+            const int h = vis_rect.height;
+
+            glBegin(GL_QUADS);
+            glTexCoord2f(tx1, ty1); glVertex2i(0, 0);
+            glTexCoord2f(tx1, ty2); glVertex2i(0, h);
+            glTexCoord2f(tx2, ty2); glVertex2i(w, h);
+            glTexCoord2f(tx2, ty1); glVertex2i(w, 0);
+            glEnd();
+        }
+    }
+    if (shader)
+        gl_unbind_shader_object(shader);
+    glBindTexture(target, 0);
+    if (features & SHADER_FEATURE_BICUBIC_LUT) {
+        gl_vtable->gl_active_texture(GL_TEXTURE0 + SHADER_TEXUNIT_BICUBIC_LUT);
+        glBindTexture(GL_TEXTURE_1D, 0);
+        gl_vtable->gl_active_texture(GL_TEXTURE0);
     }
-    gl_vtable->gl_active_texture(GL_TEXTURE0);
-    glBindTexture(obj_glx_surface->target, 0);
 
-    /* Render subpictures */
+    /* Render subpictures, through the fixed pipeline */
     glScalef(
         (float)dst_rect->width / (float)obj_surface->width,
         (float)dst_rect->height / (float)obj_surface->height,
         1.0f
     );
-    status = render_subpictures(driver_data, obj_surface, src_rect);
+    for (i = 0; i < num_clip_rects; i++) {
+        if (num_cliprects > 0)
+            set_clip_rect(obj_output, &clip_rects[i]);
+        status = render_subpictures(driver_data, obj_surface, src_rect);
+        if (status != VA_STATUS_SUCCESS)
+            break;
+    }
+    if (num_cliprects > 0)
+        glDisable(GL_SCISSOR_TEST);
     glPopMatrix();
-    if (obj_glx_surface->use_procamp_shader)
-        gl_unbind_shader_object(obj_glx_surface->procamp_shader);
-    if (obj_glx_surface->hqscaler) {
-        if (obj_glx_surface->hqscaler_texture) {
-            gl_vtable->gl_active_texture(GL_TEXTURE1);
-            glBindTexture(GL_TEXTURE_1D, 0);
-        }
-        gl_unbind_shader_object(obj_glx_surface->hqscaler);
+    gl_unbind_framebuffer_object(obj_output->gl_surface->fbo);
+
+    /* Record what the output surface now holds */
+    glx_output_surface_damage(
+        driver_data,
+        obj_output,
+        obj_surface,
+        src_rect, dst_rect,
+        cliprects, num_cliprects,
+        flags
+    );
+    return VA_STATUS_SUCCESS;
+
+end:
+    glBindTexture(target, 0);
+    if (features & SHADER_FEATURE_BICUBIC_LUT) {
+        gl_vtable->gl_active_texture(GL_TEXTURE0 + SHADER_TEXUNIT_BICUBIC_LUT);
+        glBindTexture(GL_TEXTURE_1D, 0);
+        gl_vtable->gl_active_texture(GL_TEXTURE0);
     }
     gl_unbind_framebuffer_object(obj_output->gl_surface->fbo);
+    return status;
+}
+
+// Render video surface (and subpictures) into the output surface
+static VAStatus
+render_surface_glx(
+    xvba_driver_data_t  *driver_data,
+    object_glx_output_p  obj_output,
+    object_surface_p     obj_surface,
+    const VARectangle   *src_rect,
+    const VARectangle   *dst_rect,
+    const VARectangle   *cliprects,
+    unsigned int         num_cliprects,
+    unsigned int         flags
+)
+{
+    object_glx_surface_p obj_glx_surface;
+    VAStatus status;
+
+    /* Ensure VA/GLX surface exists with the specified dimensions */
+    obj_glx_surface = glx_surface_ensure(driver_data, obj_surface, obj_output);
+    if (!obj_glx_surface)
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+
+    /* Another output may transfer a different picture into the same
+       VA/GLX surface from its own thread. Keep it until this output is
+       done sampling it, and submit the commands before the next one
+       gets it so that the shared texture is updated in order */
+    pthread_mutex_lock(&obj_glx_surface->lock);
+    status = do_render_surface_glx(
+        driver_data,
+        obj_output,
+        obj_surface,
+        obj_glx_surface,
+        src_rect, dst_rect,
+        cliprects, num_cliprects,
+        flags
+    );
+    if (obj_output->gl_shared)
+        glFlush();
+    pthread_mutex_unlock(&obj_glx_surface->lock);
+    return status;
+}
+
+// Render video surface (and subpictures) into the specified drawable
+static VAStatus
+do_put_surface_glx(
+    xvba_driver_data_t  *driver_data,
+    object_glx_output_p  obj_output,
+    object_surface_p     obj_surface,
+    const VARectangle   *src_rect,
+    const VARectangle   *dst_rect,
+    const VARectangle   *cliprects,
+    unsigned int         num_cliprects,
+    unsigned int         flags
+)
+{
+    VAStatus status;
+
+    status = render_surface_glx(
+        driver_data,
+        obj_output,
+        obj_surface,
+        src_rect, dst_rect,
+        cliprects, num_cliprects,
+        flags
+    );
+    if (status != VA_STATUS_SUCCESS)
+        return status;
 
     /* Queue surface for display */
     return queue_surface(driver_data, obj_output, obj_surface);
 }
 
+// Render all the tiles of the drawable mosaic, and queue them for
+// display at once
+static VAStatus
+do_put_mosaic_glx(
+    xvba_driver_data_t  *driver_data,
+    object_glx_output_p  obj_output
+)
+{
+    GLXOutputMosaic * const mosaic = &obj_output->mosaic;
+    VAStatus status = VA_STATUS_SUCCESS;
+    unsigned int i, flags;
+
+    if (mosaic->tiles_count == 0)
+        return VA_STATUS_SUCCESS;
+
+    /* The last picture flipped can't be reused for a part of it */
+    if (mosaic->tiles_count > 1)
+        obj_output->damage.is_valid = 0;
+
+    for (i = 0; i < mosaic->tiles_count; i++) {
+        GLXMosaicTile * const tile = &mosaic->tiles[i];
+
+        /* Tiles don't necessarily cover the whole drawable, so start
+           from the background color rather than from the last flip */
+        flags = tile->flags & ~VA_CLEAR_DRAWABLE;
+        if (i == 0)
+            flags |= VA_CLEAR_DRAWABLE;
+
+        status = render_surface_glx(
+            driver_data,
+            obj_output,
+            tile->obj_surface,
+            &tile->src_rect, &tile->dst_rect,
+            mosaic->cliprects, mosaic->num_cliprects,
+            flags
+        );
+        if (status != VA_STATUS_SUCCESS)
+            break;
+        tile->obj_surface->va_surface_status = VASurfaceDisplaying;
+        tile->is_fresh = 0;
+    }
+    for (; i < mosaic->tiles_count; i++)
+        mosaic->tiles[i].is_fresh = 0;
+    mosaic->fresh_count = 0;
+    if (status != VA_STATUS_SUCCESS)
+        return status;
+
+    return queue_surface(driver_data, obj_output, mosaic->tiles[0].obj_surface);
+}
+
+// Drops the references the output keeps to surface, i.e. its tiles of
+// the mosaic and the puts queued to the render thread
+void
+glx_output_surface_forget(
+    xvba_driver_data_t *driver_data,
+    object_glx_output_p obj_output,
+    object_surface_p    obj_surface
+)
+{
+    GLXOutputMosaic * const mosaic = &obj_output->mosaic;
+    unsigned int i;
+
+    glx_output_surface_lock(obj_output);
+    for (i = 0; i < mosaic->tiles_count; ) {
+        GLXMosaicTile * const tile = &mosaic->tiles[i];
+        if (tile->obj_surface != obj_surface) {
+            i++;
+            continue;
+        }
+        if (tile->is_fresh)
+            mosaic->fresh_count--;
+        memmove(tile, tile + 1,
+                (--mosaic->tiles_count - i) * sizeof(*tile));
+    }
+    glx_output_surface_unlock(obj_output);
+
+    render_thread_forget_surface(obj_output, obj_surface);
+}
+
+// Gets the tile of the drawable mosaic at the specified location
+static GLXMosaicTile *
+glx_output_surface_get_tile(
+    object_glx_output_p  obj_output,
+    const VARectangle   *dst_rect
+)
+{
+    GLXOutputMosaic * const mosaic = &obj_output->mosaic;
+    GLXMosaicTile *tile;
+    unsigned int i;
+
+    for (i = 0; i < mosaic->tiles_count; i++) {
+        if (rect_equal(&mosaic->tiles[i].dst_rect, dst_rect))
+            return &mosaic->tiles[i];
+    }
+
+    tile = realloc_buffer(
+        (void **)&mosaic->tiles,
+        &mosaic->tiles_count_max,
+        1 + mosaic->tiles_count,
+        sizeof(*tile)
+    );
+    if (!tile)
+        return NULL;
+
+    tile = &mosaic->tiles[mosaic->tiles_count++];
+    memset(tile, 0, sizeof(*tile));
+    tile->dst_rect = *dst_rect;
+    return tile;
+}
+
+// Refreshes the drawable mosaic, from the calling thread
+static VAStatus
+glx_output_surface_refresh_mosaic(
+    xvba_driver_data_t *driver_data,
+    object_glx_output_p obj_output
+)
+{
+    VAStatus status;
+
+    if (!gl_push_context(obj_output->gl_context))
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+    status = do_put_mosaic_glx(driver_data, obj_output);
+    gl_pop_context();
+    return status;
+}
+
+// Queue video surface as a tile of the drawable mosaic. The mosaic is
+// refreshed once all tiles were updated
+static VAStatus
+put_mosaic_glx(
+    xvba_driver_data_t  *driver_data,
+    object_glx_output_p  obj_output,
+    object_surface_p     obj_surface,
+    const VARectangle   *src_rect,
+    const VARectangle   *dst_rect,
+    const VARectangle   *cliprects,
+    unsigned int         num_cliprects,
+    unsigned int         flags
+)
+{
+    GLXOutputMosaic * const mosaic = &obj_output->mosaic;
+    VAStatus status = VA_STATUS_SUCCESS;
+    GLXMosaicTile *tile;
+    int needs_refresh;
+
+    glx_output_surface_lock(obj_output);
+    tile = glx_output_surface_get_tile(obj_output, dst_rect);
+    if (!tile) {
+        glx_output_surface_unlock(obj_output);
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
+
+    /* A tile updated twice means the others won't catch up for this
+       refresh, e.g. a stalled camera. So, present the tiles received
+       so far first */
+    needs_refresh = tile->is_fresh;
+    if (needs_refresh && !obj_output->render_thread_ok) {
+        status = glx_output_surface_refresh_mosaic(driver_data, obj_output);
+        needs_refresh = 0;
+    }
+
+    tile->obj_surface = obj_surface;
+    tile->src_rect    = *src_rect;
+    tile->flags       = flags & ~XVBA_PUTSURFACE_MOSAIC;
+
+    /* Tiles are displayed by the next refresh of the mosaic */
+    glx_output_surface_set_seqno(obj_output, obj_surface,
+                                 obj_output->put_seqno + 1);
+    if (!tile->is_fresh) {
+        tile->is_fresh = 1;
+        mosaic->fresh_count++;
+    }
+
+    /* Clip rects apply to the drawable, i.e. to the whole mosaic */
+    mosaic->num_cliprects = num_cliprects;
+    if (num_cliprects > 0)
+        memcpy(mosaic->cliprects, cliprects,
+               num_cliprects * sizeof(*cliprects));
+
+    if (mosaic->fresh_count == mosaic->tiles_count)
+        needs_refresh = 1;
+    if (needs_refresh && mosaic->refresh_pending)
+        needs_refresh = 0;
+    if (needs_refresh && obj_output->render_thread_ok)
+        mosaic->refresh_pending = 1;
+    glx_output_surface_unlock(obj_output);
+
+    /* Render the tiles in a single pass */
+    if (needs_refresh) {
+        if (obj_output->render_thread_ok) {
+            PutSurfaceMsg msg;
+
+            memset(&msg, 0, sizeof(msg));
+            msg.type       = MSG_TYPE_PUT_MOSAIC;
+            msg.obj_output = obj_output;
+            render_thread_send_msg(obj_output->render_thread, &msg);
+        }
+        else if (status == VA_STATUS_SUCCESS)
+            status = glx_output_surface_refresh_mosaic(driver_data, obj_output);
+    }
+
+    obj_surface->va_surface_status = VASurfaceDisplaying;
+    obj_output->va_surface_status  = VASurfaceDisplaying;
+    return status;
+}
+
+// Drops the drawable mosaic, once surfaces are put to it as a whole
+static void
+glx_output_surface_reset_mosaic(object_glx_output_p obj_output)
+{
+    GLXOutputMosaic * const mosaic = &obj_output->mosaic;
+
+    glx_output_surface_lock(obj_output);
+    mosaic->tiles_count = 0;
+    mosaic->fresh_count = 0;
+    glx_output_surface_unlock(obj_output);
+}
+
+// Merge clip rects so that they fit into XVBA_MAX_CLIPRECTS
+static void
+merge_clip_rects(
+    VARectangle        *clip_rects,
+    const VARectangle  *cliprects,
+    unsigned int        num_cliprects
+)
+{
+    const unsigned int n = XVBA_MAX_CLIPRECTS - 1;
+    int x1, y1, x2, y2;
+    unsigned int i;
+
+    memcpy(clip_rects, cliprects, n * sizeof(*cliprects));
+
+    x1 = cliprects[n].x;
+    y1 = cliprects[n].y;
+    x2 = x1 + cliprects[n].width;
+    y2 = y1 + cliprects[n].height;
+    for (i = n + 1; i < num_cliprects; i++) {
+        const VARectangle * const r = &cliprects[i];
+        x1 = MIN(x1, r->x);
+        y1 = MIN(y1, r->y);
+        x2 = MAX(x2, r->x + (int)r->width);
+        y2 = MAX(y2, r->y + (int)r->height);
+    }
+    clip_rects[n].x      = x1;
+    clip_rects[n].y      = y1;
+    clip_rects[n].width  = x2 - x1;
+    clip_rects[n].height = y2 - y1;
+}
+
 VAStatus
 put_surface_glx(
     xvba_driver_data_t *driver_data,
@@ -2287,9 +5046,15 @@ put_surface_glx(
     unsigned int        flags
 )
 {
-    /* XXX: no clip rects supported */
-    if (cliprects || num_cliprects > 0)
-        return VA_STATUS_ERROR_INVALID_PARAMETER;
+    /* Clip rects in excess are merged into the last one */
+    VARectangle clip_rects[XVBA_MAX_CLIPRECTS];
+    if (!cliprects)
+        num_cliprects = 0;
+    if (num_cliprects > XVBA_MAX_CLIPRECTS) {
+        merge_clip_rects(clip_rects, cliprects, num_cliprects);
+        cliprects     = clip_rects;
+        num_cliprects = XVBA_MAX_CLIPRECTS;
+    }
 
     /* Ensure output surface (child window) is set up */
     object_glx_output_p obj_output;
@@ -2305,32 +5070,45 @@ put_surface_glx(
     VARectangle src_rect = *source_rect;
     ensure_bounds(&src_rect, obj_surface->width, obj_surface->height);
 
+    /* Compose the surface with the other tiles of the mosaic */
+    if (flags & XVBA_PUTSURFACE_MOSAIC)
+        return put_mosaic_glx(
+            driver_data,
+            obj_output,
+            obj_surface,
+            &src_rect,
+            target_rect,
+            cliprects, num_cliprects,
+            flags
+        );
+    if (obj_output->mosaic.tiles_count > 0)
+        glx_output_surface_reset_mosaic(obj_output);
+
     /* Send args to render thread */
     if (obj_output->render_thread_ok) {
-        uint64_t now = get_ticks_usec();
-        PutSurfaceMsg *msg;
-
-        if (now >= obj_output->render_timestamp + VIDEO_REFRESH) {
-            if (!async_queue_push(obj_output->render_comm, MSG2PTR(MSG_TYPE_FLIP)))
-                return VA_STATUS_ERROR_OPERATION_FAILED;
-            obj_output->render_timestamp = now;
-        }
-
-        msg = malloc(sizeof(*msg));
-        if (!msg)
-            return VA_STATUS_ERROR_ALLOCATION_FAILED;
-
-        msg->obj_surface = obj_surface;
-        msg->src_rect    = src_rect;
-        msg->dst_rect    = *target_rect;
-        msg->flags       = flags;
-        if (!async_queue_push(obj_output->render_comm, msg))
-            return VA_STATUS_ERROR_OPERATION_FAILED;
+        PutSurfaceMsg msg;
+
+        msg.type          = MSG_TYPE_PUT_SURFACE;
+        msg.obj_output    = obj_output;
+        msg.obj_surface   = obj_surface;
+        msg.src_rect      = src_rect;
+        msg.dst_rect      = *target_rect;
+        msg.flags         = flags;
+        msg.seqno         = 0;
+        msg.num_cliprects = num_cliprects;
+        if (num_cliprects > 0)
+            memcpy(msg.cliprects, cliprects,
+                   num_cliprects * sizeof(*cliprects));
+        render_thread_send_msg(obj_output->render_thread, &msg);
+
+        /* The surface is displaying as soon as it is queued, so that it
+           is not reported ready before the render thread gets it */
+        obj_surface->va_surface_status = VASurfaceDisplaying;
+        obj_output->va_surface_status  = VASurfaceDisplaying;
         return VA_STATUS_SUCCESS;
     }
 
-    GLContextState old_cs;
-    if (!gl_set_current_context(obj_output->gl_context, &old_cs))
+    if (!gl_push_context(obj_output->gl_context))
         return VA_STATUS_ERROR_OPERATION_FAILED;
 
     VAStatus status;
@@ -2344,6 +5122,6 @@ put_surface_glx(
         flags
     );
 
-    gl_set_current_context(&old_cs, NULL);
+    gl_pop_context();
     return status;
 }
@@ -29,13 +29,62 @@
 #include "object_heap.h"
 #include "xvba_video_x11.h"
 #include "utils_glx.h"
-#include "uasyncqueue.h"
+#include "xvba_shaders.h"
 
-#define XVBA_MAX_EVERGREEN_PARAMS 4
+#define XVBA_MAX_EVERGREEN_PARAMS SHADER_MAX_EVERGREEN_PARAMS
+#define XVBA_MAX_OUTPUT_BUFFERS   3
+#define XVBA_MAX_CLIPRECTS        16
+#define XVBA_MAX_IMAGE_PBOS       3
+
+/* Driver-specific vaPutSurface() flag: the surface is a tile of the
+   drawable mosaic, composed with the other tiles into a single flip */
+#define XVBA_PUTSURFACE_MOSAIC    0x10000000
+
+/* Driver-specific vaCopySurfaceGLX() flags: pack the picture as YUV
+   bytes into the RGBA texture, e.g. for upload to an encoder. A w x h
+   texture then holds a (4 * w) x (2 * h / 3) picture */
+#define XVBA_COPYSURFACE_NV12     0x20000000
+#define XVBA_COPYSURFACE_I420     0x40000000
+#define XVBA_COPYSURFACE_PACKING  (XVBA_COPYSURFACE_NV12|XVBA_COPYSURFACE_I420)
 
 typedef struct object_glx_output   object_glx_output_t;
 typedef struct object_glx_surface  object_glx_surface_t;
 typedef struct object_glx_surface *object_glx_surface_p;
+typedef struct glx_render_thread   GLXRenderThread;
+typedef struct glx_readback        GLXReadback;
+
+/* Last picture flipped, so that presenting it again needs no redraw */
+typedef struct {
+    object_surface_p     obj_surface;
+    uint64_t             surface_mtime;
+    uint64_t             attrs_mtime;
+    VARectangle          src_rect;
+    VARectangle          dst_rect;
+    VARectangle          cliprects[XVBA_MAX_CLIPRECTS];
+    unsigned int         num_cliprects;
+    unsigned int         flags;
+    unsigned int         is_valid;
+} GLXOutputDamage;
+
+/* Surface displayed at a fixed location of a mosaic */
+typedef struct {
+    object_surface_p     obj_surface;
+    VARectangle          src_rect;
+    VARectangle          dst_rect;
+    unsigned int         flags;
+    unsigned int         is_fresh;      // updated since the last refresh
+} GLXMosaicTile;
+
+/* Layout of the surfaces composed together into the drawable */
+typedef struct {
+    GLXMosaicTile       *tiles;
+    unsigned int         tiles_count;
+    unsigned int         tiles_count_max;
+    unsigned int         fresh_count;
+    unsigned int         refresh_pending; // render thread has yet to draw it
+    VARectangle          cliprects[XVBA_MAX_CLIPRECTS];
+    unsigned int         num_cliprects;
+} GLXOutputMosaic;
 
 struct object_image_glx {
     GLenum               target;
@@ -44,7 +93,18 @@ struct object_image_glx {
     unsigned int         num_textures;
     unsigned int         width;
     unsigned int         height;
-    GLShaderObject      *shader;
+    GLuint               pbos[XVBA_MAX_IMAGE_PBOS];
+    unsigned int         num_pbos;
+    unsigned int         pbo_index;     // next PBO to upload from
+    unsigned int         atlas_x;       // region in the subpicture atlas
+    unsigned int         atlas_y;
+    unsigned int         atlas_serial;  // damage serial last uploaded there
+    unsigned int         atlas_pass;    // last pass it was drawn in
+    unsigned int         in_atlas;
+    unsigned int         palette_features; // shader features, if indexed
+    GLuint               palette_texture;
+    unsigned int         palette_serial;   // palette last uploaded there
+    GLShaderObject      *palette_shader;
 };
 
 struct object_glx_output {
@@ -63,13 +123,34 @@ struct object_glx_output {
         Colormap         cmap;
     }                    gl_window;
     GLContextState      *gl_context;
-    object_glx_surface_p gl_surface;
-    UAsyncQueue         *render_comm;
-    pthread_t            render_thread;
+    GLResourcePool      *gl_pool;
+    unsigned int         gl_shared;     // GL objects are used by other outputs
+    object_glx_surface_p gl_surface;    // buffer being composed
+    object_glx_surface_p gl_surfaces[XVBA_MAX_OUTPUT_BUFFERS];
+    unsigned int         gl_surfaces_count;
+    unsigned int         gl_surface_index;
+    unsigned int         gl_surface_stale; // doesn't hold the last flip
+    unsigned int         gl_surface_puts;  // pictures composed since flip
+    VARectangle          gl_surfaces_rect[XVBA_MAX_OUTPUT_BUFFERS];
+    unsigned int         gl_surfaces_valid; // buffers matching the front
+                                            // outside of gl_surfaces_rect
+    GLXOutputDamage      damage;
+    GLXOutputMosaic      mosaic;
+    GLSync              *gl_sync;       // fence set after the last flip
+    unsigned int         put_seqno;     // last surface queued for display
+    unsigned int         flip_seqno;    // last surface flipped to screen
+    pthread_cond_t       flip_cond;     // signaled on flips by the render thread
+    GLXRenderThread     *render_thread;
     unsigned int         render_thread_ok;
-    GLContextState      *render_context;
-    uint64_t             render_timestamp;
+    GLContextState      *render_context; // render thread context, on the output window
+    unsigned int         render_seqno;  // last surface rendered
+    struct put_surface_msg *render_pending;
+    unsigned int         render_num_pending;
+    unsigned int         render_num_surfaces;
+    unsigned int         use_mailbox;
     uint64_t             render_ticks;
+    uint64_t             render_presented;
+    uint64_t             render_dropped;
     uint64_t             render_start;
     pthread_mutex_t      lock;
 };
@@ -77,27 +158,33 @@ struct object_glx_output {
 struct object_glx_surface {
     unsigned int         refcount;
     GLContextState      *gl_context;
+    GLResourcePool      *pool;
     GLenum               target;
     GLenum               format;
     GLuint               texture;
+    unsigned int         own_texture;
     unsigned int         width;
     unsigned int         height;
     unsigned int         va_scale;
     XVBASurface         *xvba_surface;
     GLFramebufferObject *fbo;
+    ShaderCache         *shaders;
     unsigned int         use_procamp_shader;
-    GLShaderObject      *procamp_shader;
     uint64_t             procamp_mtime;
     GLuint               tx_texture; // temporary used for transfer_surface()
     XVBASurface         *tx_xvba_surface;
+    unsigned int         tx_width;
+    unsigned int         tx_height;
+    unsigned int         use_tx_texture; // picture is still in tx_texture
     int                  evergreen_workaround;
-    GLuint               evergreen_texture;
-    GLFramebufferObject *evergreen_fbo;
-    GLShaderObject      *evergreen_shader;
-    float                evergreen_params[1 + XVBA_MAX_EVERGREEN_PARAMS][4];
+    float                evergreen_params[XVBA_MAX_EVERGREEN_PARAMS][4];
     unsigned int         evergreen_params_count;
-    GLShaderObject      *hqscaler;
     GLuint               hqscaler_texture;
+    object_surface_p     content_surface; // VA surface last transferred
+    uint64_t             content_mtime;   // generation of that VA surface
+    unsigned int         content_flags;   // fields that were transferred
+    object_glx_surface_p copy_surface;    // source of vaCopySurfaceGLX() passes
+    pthread_mutex_t      lock;            // held from transfer to sampling
 };
 
 // Destroys GLX output surface
@@ -107,6 +194,15 @@ glx_output_surface_destroy(
     object_glx_output_p obj_output
 ) attribute_hidden;
 
+// Drops the references the output keeps to surface, i.e. its tiles of
+// the mosaic and the puts queued to the render thread
+void
+glx_output_surface_forget(
+    xvba_driver_data_t *driver_data,
+    object_glx_output_p obj_output,
+    object_surface_p    obj_surface
+) attribute_hidden;
+
 // Unreferences GLX surface
 void
 glx_surface_unref(
@@ -121,6 +217,13 @@ glx_surface_ref(
     object_glx_surface_p obj_glx_surface
 ) attribute_hidden;
 
+// Releases the GLX surface of a VA surface
+void
+glx_surface_release(
+    xvba_driver_data_t *driver_data,
+    object_surface_p    obj_surface
+) attribute_hidden;
+
 // Query GLX surface status
 int
 query_surface_status_glx(
@@ -128,6 +231,14 @@ query_surface_status_glx(
     object_surface_p    obj_surface
 ) attribute_hidden;
 
+// Wait for GLX surface to be displayed, at most timeout usec
+int
+sync_surface_glx(
+    xvba_driver_data_t *driver_data,
+    object_surface_p    obj_surface,
+    unsigned int        timeout
+) attribute_hidden;
+
 // Render video surface (and subpictures) into the specified drawable
 VAStatus
 put_surface_glx(
@@ -141,6 +252,20 @@ put_surface_glx(
     unsigned int        flags
 ) attribute_hidden;
 
+// Reads RECT of the surface back into the image, scaled to the image size
+VAStatus
+get_image_glx(
+    xvba_driver_data_t *driver_data,
+    object_surface_p    obj_surface,
+    object_image_p      obj_image,
+    const VARectangle  *rect
+) attribute_hidden;
+
+// Destroys the GL resources of scaled vaGetImage() readbacks
+void
+glx_readback_destroy(xvba_driver_data_t *driver_data)
+    attribute_hidden;
+
 // vaCreateSurfaceGLX
 VAStatus xvba_CreateSurfaceGLX(
     VADriverContextP    ctx,